@@ -1,19 +1,32 @@
+#include "cgroup.h"
+#include "client.h"
 #include "common.h"
+#include "exec.h"
+#include "fanout.h"
+#include "forward.h"
+#include "gateway.h"
 #include "global.h"
+#include "handoff.h"
+#include "history.h"
+#include "loadgen.h"
+#include "mux.h"
+#include "profile.h"
+#include "ratelimit.h"
+#include "server.h"
 #include "socks.h"
+#include "launch.h"
+#include "tls.h"
+#include "trigger.h"
 #include <err.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 enum conn_mode { CM_NONE, CM_TCP, CM_TCP6, CM_UDS, CM_VSOCK, CM_VSOCKMULT };
 
-int start_server(int svrfd, const char *launchreq);
-
-int start_client(int fd);
-
 static bool read_cookie(const char *cookiefile);
 
 int main(int argc, char **argv) {
@@ -24,9 +37,29 @@ int main(int argc, char **argv) {
   char *port = NULL;
   char *launchreq = NULL;
   char *cookiefile = NULL;
+  int nthreads = -1;
+  bool muxmode = false;
+  bool gatewaymode = false;
+  bool udp = false;
+  char *tlsfile = NULL;
+  char *loadspec = NULL;
+  char *fanspec = NULL;
+  char *benchspec = NULL;
+  char *mapfile = NULL;
+  char *triggerfile = NULL;
+  char *handoffpath = NULL;
+  char *histdir = NULL;
+  char *histquery = NULL;
+  char *acctspec = NULL;
+  uint64_t sessionrate = 0;
+  uint64_t globalrate = 0;
+  int weight = 1;
+
+  // client side forwards are set up during option parsing
+  fwd_init(false);
 
   char c;
-  while ((c = getopt(argc, argv, "s:c:h:u:v:p:")) != EOF) {
+  while ((c = getopt(argc, argv, "s:c:h:6:u:v:p:L:R:T:j:Mm:b:B:W:eEUt:xl:F:Gg:P:w:H:S:C:Q:A:")) != EOF) {
     switch (c) {
     case 's':
       servermode = true;
@@ -68,6 +101,91 @@ int main(int argc, char **argv) {
     case 'c':
       cookiefile = optarg;
       break;
+    case 'T':
+      ticketpath = optarg;
+      break;
+    case 'e':
+      predict_echo = true;
+      break;
+    case 'x':
+      trace_latency = true;
+      break;
+    case 'E':
+      exec_session = true;
+      break;
+    case 'l':
+      loadspec = optarg;
+      break;
+    case 'F':
+      fanspec = optarg;
+      break;
+    case 'S':
+      benchspec = optarg;
+      break;
+    case 'U':
+      udp = true;
+      break;
+    case 't':
+      tlsfile = optarg;
+      break;
+    case 'M':
+      muxmode = true;
+      break;
+    case 'G':
+      gatewaymode = true;
+      break;
+    case 'P':
+      if (!profile_init(optarg))
+        goto usage;
+      break;
+    case 'g':
+      if (strlen(optarg) > CAP_TARGET_MAX)
+        goto usage;
+      gateway_target = optarg;
+      break;
+    case 'm':
+      mapfile = optarg;
+      break;
+    case 'w':
+      triggerfile = optarg;
+      break;
+    case 'H':
+      handoffpath = optarg;
+      break;
+    case 'C':
+      histdir = optarg;
+      break;
+    case 'Q':
+      histquery = optarg;
+      break;
+    case 'A':
+      acctspec = optarg;
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      if (nthreads < 0)
+        goto usage;
+      break;
+    case 'b':
+      if (!(sessionrate = rl_parse_rate(optarg)))
+        goto usage;
+      break;
+    case 'B':
+      if (!(globalrate = rl_parse_rate(optarg)))
+        goto usage;
+      break;
+    case 'W':
+      if ((weight = atoi(optarg)) <= 0)
+        goto usage;
+      break;
+    case 'L':
+      if (!fwd_add_local(optarg))
+        return 1;
+      break;
+    case 'R':
+      if (!fwd_add_remote(optarg))
+        return 1;
+      break;
     default:
       goto usage;
     }
@@ -83,33 +201,142 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (servermode) {
-    int svrfd;
-    switch (connmode) {
-    case CM_TCP:
-    case CM_TCP6:
-      svrfd = create_tcp_server(connmode == CM_TCP6, targetaddr, port);
-      break;
-    case CM_UDS:
-      svrfd = create_uds_server(targetaddr);
-      break;
+  if (muxmode) {
+    if (servermode || connmode != CM_UDS)
+      goto usage;
+    int svrfd = create_uds_server(targetaddr);
+    if (svrfd < 0)
+      err(1, "Error creating socket server");
+    return start_vsock_mux(svrfd, mapfile);
+  }
+
+  if ((udp || tlsfile) && connmode != CM_TCP && connmode != CM_TCP6)
+    goto usage;
+  if (tlsfile && !tls_init(servermode, tlsfile))
+    return 1;
+
+  if (loadspec) {
+    // sessions are opened from plain sockets
+    if (servermode || udp || tlsfile)
+      goto usage;
+    // the endpoint as a spec, and as the options of a server listening on it (for shards=)
+    char spec[256];
+    const char *srvargs[7] = {0};
+    if (connmode == CM_UDS) {
+      snprintf(spec, sizeof(spec), "unix:%s", targetaddr);
+      srvargs[0] = "-u";
+      srvargs[1] = targetaddr;
+    } else if (connmode == CM_TCP || connmode == CM_TCP6) {
+      snprintf(spec, sizeof(spec), "%s:%s:%s", connmode == CM_TCP6 ? "tcp6" : "tcp", targetaddr, port);
+      srvargs[0] = connmode == CM_TCP6 ? "-6" : "-h";
+      srvargs[1] = targetaddr;
+    } else if (connmode == CM_VSOCK) {
+      snprintf(spec, sizeof(spec), "vsock:%s:%s", cid, port);
+      srvargs[0] = "-v";
+      srvargs[1] = cid;
+    } else {
+      goto usage;
+    }
+    int nsrvargs = 2;
+    if (connmode != CM_UDS) {
+      srvargs[nsrvargs++] = "-p";
+      srvargs[nsrvargs++] = port;
+    }
+    if (cookiefile) {
+      srvargs[nsrvargs++] = "-c";
+      srvargs[nsrvargs++] = cookiefile;
+    }
+    return start_loadgen(loadspec, spec, srvargs);
+  }
+
+  if (histquery) {
+    // searches the history on disk, without a server
+    if (!histdir || servermode || connmode != CM_NONE)
+      goto usage;
+    return history_query(histdir, histquery);
+  }
+
+  if (benchspec) {
+    // runs on its own
+    if (servermode || connmode != CM_NONE || loadspec || fanspec)
+      goto usage;
+    return start_launch_bench(benchspec);
+  }
+
+  if (fanspec) {
+    // the targets come from the file, each in an exec session of its own
+    if (servermode || connmode != CM_NONE || udp || tlsfile || ticketpath || predict_echo || trace_latency ||
+        gateway_target)
+      goto usage;
+    exec_session = true;
+    return start_fanout(fanspec);
+  }
+
+  if ((triggerfile || histdir || acctspec) && !servermode)
+    goto usage;
+  // the UDP relay runs in the server process
+  if (handoffpath && (!servermode || udp))
+    goto usage;
+  // there is no terminal on the other side
+  if (exec_session && (servermode || predict_echo || trace_latency))
+    goto usage;
+
+  if (servermode || gatewaymode) {
+    if (gatewaymode && (servermode || udp || !mapfile))
+      goto usage;
+    int svrfd = -1;
+    // the server we take over from, if any, gives us its listening socket
+    if (handoffpath && !handoff_takeover(handoffpath, nthreads >= 0, &svrfd))
+      return 1;
+    if (svrfd < 0) {
+      switch (connmode) {
+      case CM_TCP:
+      case CM_TCP6:
 #ifdef __linux__
-    case CM_VSOCK:
-      svrfd = create_vsock_server(cid, port);
-      break;
+        if (udp) {
+          svrfd = create_udp_server(connmode == CM_TCP6, targetaddr, port);
+          break;
+        }
+#else
+        if (udp)
+          goto usage;
 #endif
-    default:
-      goto usage;
+        svrfd = create_tcp_server(connmode == CM_TCP6, targetaddr, port);
+        break;
+      case CM_UDS:
+        svrfd = create_uds_server(targetaddr);
+        break;
+#ifdef __linux__
+      case CM_VSOCK:
+        svrfd = create_vsock_server(cid, port);
+        break;
+#endif
+      default:
+        goto usage;
+      }
     }
     if (svrfd < 0)
       err(1, "Error creating socket server");
-    return start_server(svrfd, launchreq);
+    if (gatewaymode)
+      return start_gateway(svrfd, mapfile);
+    if (!rl_init(sessionrate, globalrate, weight))
+      err(1, "Error setting up rate limiting");
+    if (triggerfile && !trigger_load(triggerfile))
+      return 1;
+    if (histdir && !history_init(histdir))
+      return 1;
+    if (acctspec && !cg_init(acctspec))
+      return 1;
+    return start_server(svrfd, launchreq, nthreads);
   } else {
     int commfd;
     switch (connmode) {
     case CM_TCP:
     case CM_TCP6:
-      commfd = create_tcp_client(connmode == CM_TCP6, targetaddr, port);
+      if (udp)
+        commfd = create_udp_client(connmode == CM_TCP6, targetaddr, port);
+      else
+        commfd = create_tcp_client(connmode == CM_TCP6, targetaddr, port);
       break;
     case CM_UDS:
       commfd = create_uds_client(targetaddr);
@@ -127,7 +354,10 @@ int main(int argc, char **argv) {
     }
     if (commfd < 0)
       err(1, "Error connecting to server");
-    return start_client(commfd);
+    if (tlsfile && (commfd = tls_wrap(commfd, targetaddr, false)) < 0)
+      return 1;
+    profile_pin();
+    return exec_session ? start_exec_client(commfd) : start_client(commfd);
   }
 
 usage:
@@ -141,6 +371,14 @@ usage:
   puts("  Requires '-p' to be present.");
   puts(" -6 <host>");
   puts("  Same as `-h`, but specify TCP on IPv6 mode instead of IPv4.");
+  puts(" -U");
+  puts("  Use UDP instead of TCP with '-h' or '-6', for lossy links. The session survives");
+  puts("  packet loss without stalling, and the client changing its address.");
+  puts("  UDP servers are supported only on Linux.");
+  puts(" -t <pemfile>");
+  puts("  Use TLS 1.3 with '-h' or '-6'. On the server, <pemfile> has the certificate chain");
+  puts("  and the private key. On the client, it has the certificates to verify the server");
+  puts("  against, and the server's certificate must also match the host name or address.");
   puts(" -u <path>");
   puts("  Specify Unix socket mode as well as the socket path to connect/listen.");
   puts(" -v <cid>");
@@ -153,6 +391,116 @@ usage:
   puts("  Enables authentication and specify a cookie file for authentication.");
   printf("  Cookie file must be within %u and %u bytes in size.\n", COOKIE_MIN_SIZE,
     COOKIE_MAX_SIZE);
+  puts(" -T <ticketfile>");
+  puts("  (client only) Cache the session ticket from the server in <ticketfile>. With a");
+  puts("  cached ticket, authentication completes without waiting for the server's nonce.");
+  puts(" -e");
+  puts("  (client only) Predictive local echo: show typed characters (underlined) before");
+  puts("  the server echoes them back. Only kicks in on slow links, and turns itself off");
+  puts("  when the predictions turn out wrong, e.g. at password prompts.");
+  puts(" -x");
+  puts("  (client only) Trace the latency of each frame of output, broken down into the");
+  puts("  keystroke's trip to the server, the app, the server relay, the network and the");
+  puts("  terminal. The histogram is printed on exit and on SIGUSR1.");
+  puts(" -E");
+  puts("  (client only) Exec session: run <app_to_run> on pipes instead of a PTY, for");
+  puts("  scripts and binary data. Its stdout and stderr come out on ours, and we exit");
+  puts("  with its exit status (255 if the session ends without one). Not with '-e' or");
+  puts("  '-x', and not through a gateway or the threaded server.");
+  puts(" -l <loadspec>");
+  puts("  (client only, Linux only) Load generator: open many sessions over '-u', '-h',");
+  puts("  '-6' or '-v' in steps, and print throughput, echo latency, setup rate and (with");
+  puts("  server=<pid>) the server's CPU and memory after each step. <loadspec> is a comma");
+  puts("  separated list of n=<sessions>, step=<sessions>, hold=<seconds>, idle=<%>,");
+  puts("  interactive=<%>, bulk=<%>, think=<ms>, procs=<n> and server=<pid>. Bulk sessions");
+  puts("  run the command in PTYFWD_LOAD_BULK (default \"yes\"), so <app_to_run> should be");
+  puts("  a shell. With shards=<n>[:<n>...], a threaded server ('-j <n>') running /bin/sh is");
+  puts("  started on the endpoint for each shard count in turn, and the throughput of each");
+  puts("  is compared at the end.");
+  puts(" -F <fanspec>");
+  puts("  (client only, Linux only) Fan-out: run the same command on many servers at");
+  puts("  once. Our stdin is read to the end, and given to an exec session (see '-E') on");
+  puts("  each target, so their <app_to_run> should be a shell. <fanspec> is a comma");
+  puts("  separated list of targets=<file> (required), par=<n> (targets in progress at");
+  puts("  once, default 32), timeout=<seconds> and prefix. The target file has one target");
+  puts("  per line in the format [<name>=]<target_spec>. Each target's output is printed");
+  puts("  when it is done, or line by line prefixed with its name with 'prefix'. Exit");
+  puts("  status and timing of each target are printed at the end. Not with the other");
+  puts("  connection options.");
+  puts(" -S <benchspec>");
+  puts("  (Linux only) Spawn benchmark: time launching a session's app, PTY included,");
+  puts("  with fork and with posix_spawn, as our own memory grows. <benchspec> is a comma");
+  puts("  separated list of n=<spawns> (per method and size, default 200), rss=<MiB>[:<MiB>");
+  puts("  ...] (memory to allocate and touch first, default 0:256:1024) and app=<path>");
+  puts("  (default /bin/true). Not with the other options.");
+  puts(" -M");
+  puts("  Run as a VSOCK multiplexer on the Unix socket given with '-u', for clients");
+  puts("  that use '-u' together with '-v'. Streams are routed to VSOCK (Linux only),");
+  puts("  or to the targets in the map file given with '-m'.");
+  puts(" -m <mapfile>");
+  puts("  (multiplexer only) Route streams by CID and port. One entry per line in the");
+  puts("  format <cid>:<port>=<target_spec>, where <cid> and <port> can be '*'.");
+  puts("  (gateway only) The backends. One entry per line in the format");
+  puts("  <name>=<target_spec>[ <pool_size>], <pool_size> being the number of");
+  puts("  authenticated connections kept ready (default 1).");
+  puts(" -G");
+  puts("  (Linux only) Run as a session gateway on '-u', '-h', '-6' or '-v', for clients");
+  puts("  that use '-g'. Clients authenticate to the gateway, which relays their session");
+  puts("  to the named backend over a connection from its pool. The same cookie is used");
+  puts("  for the backends. Requires '-m'. Forwarding is not available through it.");
+  puts(" -g <name>");
+  puts("  (client only) Connect through a gateway, to the backend named <name>.");
+  puts(" -j <threads>");
+  puts("  (server only, Linux only) Serve all sessions from <threads> event loop threads");
+  puts("  instead of a process per session. 0 means one thread per online CPU.");
+  puts("  Port forwarding is not available in this mode. SIGUSR1 dumps statistics.");
+  puts(" -b <rate>");
+  puts("  (server only) Limit the output of each session to <rate> bytes per second.");
+  puts("  <rate> can have a K, M or G suffix.");
+  puts(" -B <rate>");
+  puts("  (server only) Limit the total output of all sessions to <rate> bytes per second,");
+  puts("  shared fairly between the sessions that are busy. SIGUSR1 dumps statistics.");
+  puts(" -W <weight>");
+  puts("  (server only) With '-B', how much more of the total interactive sessions get than");
+  puts("  sessions without a PTY (-E) when both are busy. Defaults to 1.");
+  puts(" -w <triggerfile>");
+  puts("  (server only) Watch the app's output for patterns, one per line in the format");
+  puts("  <pattern> log, <pattern> reply <text> or <pattern> exec <command>. 'reply' types");
+  puts("  <text> into the session. 'exec' runs <command> with PTYFWD_TRIGGER and");
+  puts("  PTYFWD_SESSION set, at most once per second. Patterns and replies can use \\s, \\t,");
+  puts("  \\r, \\n, \\e, \\\\ and \\xHH. Lines starting with '#' are ignored.");
+  puts(" -C <dir>");
+  puts("  (server only) Keep the output of every session in <dir>, compressed and indexed");
+  puts("  for '-Q'. Files are named after the app's pid and the session's start time.");
+  puts("  Output is written out within 5 seconds, and left out if the disk can't keep up.");
+  puts(" -Q <pattern>");
+  puts("  Search the history in the directory given with '-C' for <pattern> (up to 256");
+  puts("  bytes, matched exactly), and print the session, time, offset in the session's");
+  puts("  output and line of every match. Exits with 0 if there are matches, 1 otherwise.");
+  puts(" -A <cgroup>[,cpu=<percent>][,mem=<size>][,interval=<seconds>]");
+  puts("  (server only, Linux) Account the resources of every session in a cgroup v2 of its");
+  puts("  own, session-<app pid>, under <cgroup> ('self' for the server's own), optionally");
+  puts("  limited to <percent> of one CPU and <size> of memory (K, M, G or T suffix). Usage is");
+  puts("  sampled every <seconds> (5) and dumped on SIGUSR1, and each session's totals are");
+  puts("  logged when all of its processes are gone. <cgroup> must be delegated to us.");
+  puts(" -H <path>");
+  puts("  (server only) Live handoff, for upgrades: wait for a successor on the Unix socket");
+  puts("  <path>. A server started with the same '-H' takes over the listening socket, and");
+  puts("  with '-j' on both sides, the running sessions too. The old server exits once it");
+  puts("  has no sessions left. Not with '-U'.");
+  puts(" -P <profile>");
+  puts("  Transport profile: socket tuning for the session's connections. One of");
+  puts("  'default', 'latency' (e.g. TCP_NOTSENT_LOWAT, busy polling, larger VSOCK buffers)");
+  puts("  or 'bulk' (Nagle on, larger Unix and VSOCK buffers). Append ',cpu=<n>' to pin the");
+  puts("  relay (client, session process of the forking server, gateway or multiplexer) to");
+  puts("  CPU <n>. Tuning beyond TCP_NODELAY is Linux only.");
+  puts(" -L <listen_spec>=<target_spec>");
+  puts("  (client only) Listen locally and forward each connection to <target_spec>,");
+  puts("  connected from the server side. Can be specified multiple times.");
+  puts("  Spec format is one of: tcp:<host>:<port>, tcp6:<host>:<port>, unix:<path>,");
+  puts("  or vsock:<cid>:<port>.");
+  puts(" -R <listen_spec>=<target_spec>");
+  puts("  (client only) Same as `-L`, but the server listens and the client connects.");
   return 0;
 }
 
@@ -0,0 +1,176 @@
+#include "auth.h"
+#include "utils.h"
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#define TICKET_CACHE_SLOTS 4096
+#define TICKET_CACHE_PROBE 16
+
+static const char auth_label[] = "ptyfwd v3 auth";
+static const char ticket_label[] = "ptyfwd v3 ticket";
+
+// used ticket IDs, shared between all worker processes
+struct ticket_cache {
+  pthread_mutex_t lock;
+  struct {
+    uint8_t id[TICKET_ID_SIZE];
+    uint64_t expiry;
+  } slots[TICKET_CACHE_SLOTS];
+};
+
+static uint8_t ticket_key[32];
+static struct ticket_cache *tcache = NULL;
+
+static bool hmac_sha256(const void *key, size_t keylen, const void *label, size_t labellen, const void *data,
+    size_t datalen, uint8_t *out) {
+  uint8_t msg[128];
+  if (labellen + datalen > sizeof(msg))
+    return false;
+  memcpy(msg, label, labellen);
+  memcpy(msg + labellen, data, datalen);
+  unsigned int outlen = 0;
+  return HMAC(EVP_sha256(), key, keylen, msg, labellen + datalen, out, &outlen) && outlen == 32;
+}
+
+bool auth_answer_v2(const struct cookie *c, const uint8_t *nonce, uint8_t *answer) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  if (!ctx)
+    return false;
+  int result = 1;
+  result &= EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+  result &= EVP_DigestUpdate(ctx, nonce, NONCE_SIZE);
+  result &= EVP_DigestUpdate(ctx, c->data, c->size);
+  result &= EVP_DigestFinal_ex(ctx, answer, NULL);
+  EVP_MD_CTX_free(ctx);
+  return result;
+}
+
+bool auth_answer_v3(const struct cookie *c, const uint8_t *nonce, uint8_t *answer) {
+  return hmac_sha256(c->data, c->size, auth_label, sizeof(auth_label), nonce, NONCE_SIZE, answer);
+}
+
+bool auth_equal(const void *a, const void *b, size_t len) { return !CRYPTO_memcmp(a, b, len); }
+
+bool auth_ticket_init() {
+  random_fill(ticket_key, sizeof(ticket_key));
+
+  tcache = mmap(NULL, sizeof(*tcache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (tcache == MAP_FAILED) {
+    tcache = NULL;
+    return false;
+  }
+  if (!shared_mutex_init(&tcache->lock)) {
+    munmap(tcache, sizeof(*tcache));
+    tcache = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool auth_ticket_issue(uint8_t *ticket) {
+  if (!tcache)
+    return false;
+  uint64_t expiry = time(NULL) + TICKET_LIFETIME;
+  random_fill(ticket, TICKET_ID_SIZE);
+  memcpy(ticket + TICKET_ID_SIZE, &expiry, sizeof(expiry));
+  return hmac_sha256(ticket_key, sizeof(ticket_key), "", 0, ticket, TICKET_ID_SIZE + sizeof(expiry),
+      ticket + TICKET_ID_SIZE + sizeof(expiry));
+}
+
+// returns false if the ticket has been used before, or if we have no room to remember it
+static bool ticket_mark_used(const uint8_t *id, uint64_t expiry, uint64_t now) {
+  uint32_t start;
+  memcpy(&start, id, sizeof(start));
+
+  bool ok = false;
+  int freeslot = -1;
+  // a worker that died in here wrote at most one slot, and its ticket is either remembered or
+  // not. either way the cache is fine as it is.
+  shared_mutex_lock(&tcache->lock);
+  for (int i = 0; i < TICKET_CACHE_PROBE; ++i) {
+    int idx = (start + i) % TICKET_CACHE_SLOTS;
+    if (tcache->slots[idx].expiry <= now) {
+      if (freeslot < 0)
+        freeslot = idx;
+    } else if (!memcmp(tcache->slots[idx].id, id, TICKET_ID_SIZE)) {
+      goto end;
+    }
+  }
+  if (freeslot >= 0) {
+    memcpy(tcache->slots[freeslot].id, id, TICKET_ID_SIZE);
+    tcache->slots[freeslot].expiry = expiry;
+    ok = true;
+  }
+end:
+  pthread_mutex_unlock(&tcache->lock);
+  return ok;
+}
+
+bool auth_ticket_check(const struct cookie *c, const uint8_t *data, size_t len) {
+  if (!tcache || len != TICKET_SIZE + TICKET_PROOF_SIZE)
+    return false;
+
+  uint8_t ref[32];
+  uint64_t expiry;
+  memcpy(&expiry, data + TICKET_ID_SIZE, sizeof(expiry));
+  if (!hmac_sha256(ticket_key, sizeof(ticket_key), "", 0, data, TICKET_ID_SIZE + sizeof(expiry), ref) ||
+      !auth_equal(ref, data + TICKET_ID_SIZE + sizeof(expiry), sizeof(ref)))
+    return false;
+
+  uint64_t now = time(NULL);
+  if (expiry <= now)
+    return false;
+
+  if (!auth_ticket_proof(c, data, ref) || !auth_equal(ref, data + TICKET_SIZE, TICKET_PROOF_SIZE))
+    return false;
+
+  return ticket_mark_used(data, expiry, now);
+}
+
+bool auth_ticket_proof(const struct cookie *c, const uint8_t *ticket, uint8_t *proof) {
+  return hmac_sha256(c->data, c->size, ticket_label, sizeof(ticket_label), ticket, TICKET_SIZE, proof);
+}
+
+bool auth_ticket_load(const char *path, uint8_t *ticket) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  // a ticket file must contain exactly one ticket
+  uint8_t buff[TICKET_SIZE + 1];
+  int rd = read(fd, buff, sizeof(buff));
+  close(fd);
+  if (rd != TICKET_SIZE)
+    return false;
+  memcpy(ticket, buff, TICKET_SIZE);
+  return true;
+}
+
+void auth_ticket_save(const char *path, const uint8_t *ticket) {
+  // write to a temporary file first, so that a concurrent client never sees a partial ticket
+  char tmppath[PATH_MAX];
+  if (snprintf(tmppath, sizeof(tmppath), "%s.%d", path, getpid()) >= sizeof(tmppath))
+    return;
+  int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    warn("Error saving session ticket");
+    return;
+  }
+  bool ok = write_all(fd, ticket, TICKET_SIZE);
+  close(fd);
+  if (!ok || rename(tmppath, path) < 0) {
+    warn("Error saving session ticket");
+    unlink(tmppath);
+  }
+}
+
+void auth_ticket_forget(const char *path) { unlink(path); }
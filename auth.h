@@ -0,0 +1,51 @@
+#pragma once
+
+#include "common.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// the shared secret. passed explicitly, so that every connection can have its own.
+struct cookie {
+  uint16_t size;
+  uint8_t data[COOKIE_MAX_SIZE];
+};
+
+// v2 handshake: answer = SHA1(nonce + cookie)
+bool auth_answer_v2(const struct cookie *c, const uint8_t *nonce, uint8_t *answer);
+
+// v3 handshake: answer = HMAC-SHA256(cookie, label + nonce)
+bool auth_answer_v3(const struct cookie *c, const uint8_t *nonce, uint8_t *answer);
+
+// constant time comparison. returns true if both are equal.
+bool auth_equal(const void *a, const void *b, size_t len);
+
+// session tickets
+// a ticket is issued by the server after a successful authentication. the ticket is
+// bound to the server's process lifetime, expires after TICKET_LIFETIME seconds, and
+// can only be used once. a client presents it together with a proof that it knows the
+// cookie, without having to wait for the server's nonce.
+
+// ticket: id + expiry + MAC(server ticket key, id + expiry)
+#define TICKET_ID_SIZE 16
+#define TICKET_SIZE (TICKET_ID_SIZE + 8 + 32)
+#define TICKET_PROOF_SIZE 32
+#define TICKET_LIFETIME (12 * 60 * 60)
+
+// server side. must be called before forking workers, as they share the replay cache.
+bool auth_ticket_init();
+
+bool auth_ticket_issue(uint8_t *ticket);
+
+// `data` is ticket + proof. returns true if the ticket is valid and has not been used before.
+bool auth_ticket_check(const struct cookie *c, const uint8_t *data, size_t len);
+
+// client side
+// proof = HMAC-SHA256(cookie, label + ticket)
+bool auth_ticket_proof(const struct cookie *c, const uint8_t *ticket, uint8_t *proof);
+
+bool auth_ticket_load(const char *path, uint8_t *ticket);
+
+void auth_ticket_save(const char *path, const uint8_t *ticket);
+
+void auth_ticket_forget(const char *path);
@@ -0,0 +1,638 @@
+#include "auth.h"
+#include "bufpool.h"
+#include "common.h"
+#include "forward.h"
+#include "global.h"
+#include "libptyfwd.h"
+#include "protocol.h"
+#include "server.h"
+#include "socks.h"
+#include "trigger.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/vm_sockets.h>
+#endif
+
+// microbenchmarks. `make bench` builds them with optimizations, whatever CFLAGS says.
+//  - the frame codec: ns per frame to encode (proto_encode) and decode (proto_reader_next) for
+//    a few frame size distributions. decoding runs on a buffer that is already filled, as after
+//    proto_reader_fill(), so no syscalls are measured.
+//  - forwarding: a stream sent through a forwarding channel (forward.c, with a relay loop on
+//    each side of the connection) against the same stream sent over the connection itself.
+//    the connection is VSOCK loopback where the kernel has it, a Unix socketpair otherwise.
+//  - handshakes: how long a client takes to get through the handshake with server_negotiate(),
+//    over a link that delays everything by LINK_DELAY_MS each way, in round trips of that link.
+//  - output triggers: GB/s of trigger_scan() with typical patterns over text that keeps
+//    hitting their first bytes but never matches, with each candidate scan the CPU has.
+// ./bench [<MiB per run>] (64)
+
+#define BENCH_RUNS 5
+// writes of the forwarding benchmark's source
+#define STREAM_CHUNK 65536
+// one-way delay of the handshakes' link, and how many reads it can hold in flight
+#define LINK_DELAY_MS 20
+#define LINK_CHUNKS 64
+// mPTY reads the trigger scan is given
+#define SCAN_CHUNK 4096
+
+struct dist {
+  const char *name;
+  // sizes are picked uniformly from one of the ranges, the first one with `pct` percent
+  // probability
+  int pct;
+  uint16_t lo1, hi1;
+  uint16_t lo2, hi2;
+};
+
+static const struct dist dists[] = {
+  {"keystrokes", 100, 1, 8, 0, 0},
+  {"interactive", 80, 1, 64, 256, 4096},
+  {"4k", 100, 4096, 4096, 0, 0},
+  {"bulk", 90, 16384, 65535, 1, 1024},
+  {"max", 100, 65535, 65535, 0, 0},
+};
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd() {
+  rnd_state = rnd_state * 1103515245 + 12345;
+  return rnd_state >> 8;
+}
+
+static uint16_t pick(const struct dist *d) {
+  bool first = (int)(rnd() % 100) < d->pct;
+  uint16_t lo = first ? d->lo1 : d->lo2, hi = first ? d->hi1 : d->hi2;
+  return lo + rnd() % (hi - lo + 1);
+}
+
+static void run(const struct dist *d, size_t total) {
+  // the sizes are picked up front, so that picking them is not measured
+  size_t maxframes = total / ((d->lo1 < d->lo2 || !d->lo2 ? d->lo1 : d->lo2) + PROTO_HDR_MAX) + 1;
+  uint16_t *sizes = malloc(maxframes * sizeof(*sizes));
+  uint8_t *payload = malloc(65535);
+  if (!sizes || !payload) {
+    perror("malloc");
+    exit(1);
+  }
+  memset(payload, 'x', 65535);
+  size_t nframes = 0, bytes = 0;
+  while (bytes < total && nframes < maxframes) {
+    sizes[nframes] = pick(d);
+    bytes += sizes[nframes++];
+  }
+  uint8_t *wire = malloc(bytes + nframes * PROTO_HDR_MAX);
+  if (!wire) {
+    perror("malloc");
+    exit(1);
+  }
+
+  uint64_t best_enc = UINT64_MAX, best_dec = UINT64_MAX;
+  size_t wirelen = 0;
+  for (int run = 0; run < BENCH_RUNS; ++run) {
+    uint64_t start = mono_ns();
+    wirelen = 0;
+    for (size_t i = 0; i < nframes; ++i)
+      wirelen += proto_encode(wire + wirelen, sizes[i], DT_REGULAR, payload);
+    uint64_t enc = mono_ns() - start;
+
+    struct proto_reader r = {.buff = wire, .end = wirelen, .cap = wirelen};
+    uint16_t len;
+    enum data_type type;
+    const uint8_t *data;
+    size_t decoded = 0, sum = 0;
+    start = mono_ns();
+    while (proto_reader_next(&r, &len, &type, &data)) {
+      sum += len + data[0];
+      ++decoded;
+    }
+    uint64_t dec = mono_ns() - start;
+    if (decoded != nframes || sum != bytes + 'x' * nframes) {
+      fprintf(stderr, "%s: decoded %zu of %zu frames\n", d->name, decoded, nframes);
+      exit(1);
+    }
+    best_enc = enc < best_enc ? enc : best_enc;
+    best_dec = dec < best_dec ? dec : best_dec;
+  }
+
+  printf("%-12s %10zu %9.1f %12.2f %12.2f %10.2f %10.2f\n", d->name, nframes, (double)bytes / nframes,
+    (double)best_enc / nframes, (double)best_dec / nframes, (double)wirelen / best_enc, (double)wirelen / best_dec);
+  free(sizes);
+  free(payload);
+  free(wire);
+}
+
+// a connected pair over VSOCK loopback, or a Unix socketpair. returns the transport's name.
+static const char *connect_pair(int sp[2]) {
+#if defined(__linux__) && defined(VMADDR_CID_LOCAL)
+  struct sockaddr_vm addr = {.svm_family = AF_VSOCK, .svm_cid = VMADDR_CID_LOCAL, .svm_port = VMADDR_PORT_ANY};
+  socklen_t addrlen = sizeof(addr);
+  int l = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (l >= 0 && !bind(l, (struct sockaddr *)&addr, sizeof(addr)) && !listen(l, 1) &&
+      !getsockname(l, (struct sockaddr *)&addr, &addrlen)) {
+    addr.svm_cid = VMADDR_CID_LOCAL;
+    sp[0] = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sp[0] >= 0 && !connect(sp[0], (struct sockaddr *)&addr, sizeof(addr)) &&
+        (sp[1] = accept4(l, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+      close(l);
+      return "vsock loopback";
+    }
+    if (sp[0] >= 0)
+      close(sp[0]);
+  }
+  if (l >= 0)
+    close(l);
+#endif
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) < 0) {
+    perror("socketpair");
+    exit(1);
+  }
+  return "unix socketpair";
+}
+
+struct stream {
+  // the sink accepts its connection on `listenfd` if it is >= 0
+  int fd;
+  int listenfd;
+  size_t total;
+  uint64_t end_ns;
+  atomic_bool done;
+};
+
+static void *source_main(void *arg) {
+  struct stream *st = arg;
+  static uint8_t chunk[STREAM_CHUNK];
+  memset(chunk, 'x', sizeof(chunk));
+  for (size_t sent = 0; sent < st->total;) {
+    size_t len = st->total - sent < sizeof(chunk) ? st->total - sent : sizeof(chunk);
+    if (!write_all(st->fd, chunk, len)) {
+      perror("source write");
+      exit(1);
+    }
+    sent += len;
+  }
+  close(st->fd);
+  return NULL;
+}
+
+static void *sink_main(void *arg) {
+  struct stream *st = arg;
+  if (st->listenfd >= 0 && (st->fd = accept(st->listenfd, NULL, NULL)) < 0) {
+    perror("sink accept");
+    exit(1);
+  }
+  uint8_t buff[STREAM_CHUNK];
+  size_t got = 0;
+  while (got < st->total) {
+    ssize_t rd = read(st->fd, buff, sizeof(buff));
+    if (rd <= 0) {
+      if (rd < 0 && errno == EINTR)
+        continue;
+      fprintf(stderr, "sink: got %zu of %zu bytes\n", got, st->total);
+      exit(1);
+    }
+    got += rd;
+  }
+  st->end_ns = mono_ns();
+  atomic_store(&st->done, true);
+  close(st->fd);
+  return NULL;
+}
+
+// what the client and the server do for forwarding in their relay loops, on the connection
+// `fd`, until `done` is set (if given) or the connection is gone
+static void fwd_relay(int fd, atomic_bool *done) {
+  struct proto_writer w;
+  proto_writer_init(&w, fd);
+  struct proto_reader r;
+  proto_reader_init(&r);
+  set_fd_flags(fd, true, O_NONBLOCK);
+  struct pollfd pfds[1 + FWD_MAX_POLLFDS];
+  while (!done || !atomic_load(done)) {
+    bool congested = proto_pending(&w) >= PROTO_OUTQ_HIGH;
+    pfds[0] = (struct pollfd){.fd = fd, .events = POLLIN | (proto_pending(&w) ? POLLOUT : 0)};
+    int nfwd = fwd_fill_pollfds(pfds + 1, !congested);
+    if (poll(pfds, 1 + nfwd, 100) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if ((pfds[0].revents & POLLOUT) && !proto_flush(&w, false))
+      break;
+    if (pfds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+      if (!proto_reader_fill(&r, fd))
+        break;
+      uint16_t len;
+      enum data_type type;
+      const uint8_t *data;
+      bool ok = true;
+      while (ok && proto_reader_next(&r, &len, &type, &data))
+        ok = fwd_handle_frame(&w, type, data, len);
+      if (!ok)
+        break;
+    }
+    if (!fwd_handle_pollfds(&w, pfds + 1, nfwd))
+      break;
+  }
+  fwd_close_all();
+  proto_reader_release(&r);
+  proto_writer_release(&w);
+}
+
+// MB/s of `total` bytes from a source to a sink: straight over the connection, or through a
+// local forward (-L) whose server side runs in a child process
+static double run_stream(size_t total, bool forward, const char **transport) {
+  int conn[2];
+  *transport = connect_pair(conn);
+  struct stream src = {.fd = conn[0], .listenfd = -1, .total = total};
+  struct stream dst = {.fd = conn[1], .listenfd = -1, .total = total};
+  char dir[] = "/tmp/ptyfwd-bench.XXXXXX", lspec[64], tspec[64], fspec[128];
+  pid_t child = -1;
+
+  if (forward) {
+    if (!mkdtemp(dir)) {
+      perror("mkdtemp");
+      exit(1);
+    }
+    snprintf(lspec, sizeof(lspec), "unix:%s/l", dir);
+    snprintf(tspec, sizeof(tspec), "unix:%s/t", dir);
+    snprintf(fspec, sizeof(fspec), "%s=%s", lspec, tspec);
+    if ((dst.listenfd = create_spec_server(tspec)) < 0) {
+      perror("Error listening for the forward's target");
+      exit(1);
+    }
+    if ((child = fork()) < 0) {
+      perror("fork");
+      exit(1);
+    }
+    if (!child) {
+      close(dst.listenfd);
+      close(conn[0]);
+      fwd_init(true);
+      fwd_half_close(true);
+      fwd_relay(conn[1], NULL);
+      _exit(0);
+    }
+    close(conn[1]);
+    fwd_init(false);
+    fwd_half_close(true);
+    if (!fwd_add_local(fspec) || (src.fd = create_spec_client(lspec)) < 0) {
+      perror("Error connecting to the forward");
+      exit(1);
+    }
+  }
+
+  uint64_t start = mono_ns();
+  pthread_t srct, dstt;
+  if (pthread_create(&dstt, NULL, sink_main, &dst) || pthread_create(&srct, NULL, source_main, &src)) {
+    perror("pthread_create");
+    exit(1);
+  }
+  if (forward)
+    fwd_relay(conn[0], &dst.done);
+  pthread_join(srct, NULL);
+  pthread_join(dstt, NULL);
+
+  if (forward) {
+    close(conn[0]);
+    waitpid(child, NULL, 0);
+    close(dst.listenfd);
+    unlink(lspec + 5);
+    unlink(tspec + 5);
+    rmdir(dir);
+  }
+  return total / ((dst.end_ns - start) / 1e3);
+}
+
+static void run_streams(size_t total) {
+  const char *transport;
+  double best[2] = {0};
+  for (int run = 0; run < BENCH_RUNS; ++run) {
+    for (int fwd = 0; fwd < 2; ++fwd) {
+      double mbps = run_stream(total, fwd, &transport);
+      best[fwd] = mbps > best[fwd] ? mbps : best[fwd];
+    }
+  }
+  printf("\n# forwarding, over %s\n", transport);
+  printf("%-12s %10s %9s\n", "path", "MB/s", "relative");
+  printf("%-12s %10.1f %8.2fx\n", "direct", best[0], 1.0);
+  printf("%-12s %10.1f %8.2fx\n", "channel", best[1], best[1] / best[0]);
+}
+
+struct link_chunk {
+  uint64_t due_ns;
+  int to;
+  size_t len;
+  uint8_t data[HANDSHAKE_BUFF_SIZE];
+};
+
+// relays between fds[0] and fds[1], each read LINK_DELAY_MS after it was made, until either side
+// is closed. both are shut down then, so that nobody waits for the link any longer.
+static void *link_main(void *arg) {
+  const int *fds = arg;
+  struct link_chunk q[LINK_CHUNKS];
+  int n = 0;
+  for (;;) {
+    // chunks are queued in the order they are due
+    uint64_t now = mono_ns();
+    int kept = 0;
+    for (int i = 0; i < n; ++i) {
+      if (q[i].due_ns > now)
+        q[kept++] = q[i];
+      else if (!write_all(q[i].to, q[i].data, q[i].len))
+        goto out;
+    }
+    n = kept;
+
+    struct pollfd pfds[2] = {{.fd = fds[0], .events = POLLIN}, {.fd = fds[1], .events = POLLIN}};
+    struct timespec ts, *timeout = NULL;
+    if (n) {
+      uint64_t wait = q[0].due_ns - now;
+      ts = (struct timespec){.tv_sec = wait / 1000000000, .tv_nsec = wait % 1000000000};
+      timeout = &ts;
+    }
+    if (ppoll(pfds, 2, timeout, NULL) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("ppoll");
+      exit(1);
+    }
+    for (int i = 0; i < 2; ++i) {
+      if (!pfds[i].revents || n == LINK_CHUNKS)
+        continue;
+      ssize_t rd = read(fds[i], q[n].data, sizeof(q[n].data));
+      if (rd <= 0)
+        goto out;
+      q[n].due_ns = mono_ns() + LINK_DELAY_MS * 1000000ull;
+      q[n].to = fds[!i];
+      q[n++].len = rd;
+    }
+  }
+out:
+  shutdown(fds[0], SHUT_RDWR);
+  shutdown(fds[1], SHUT_RDWR);
+  return NULL;
+}
+
+struct hs_case {
+  const char *name;
+  // a v2 client, which echoes the preamble and answers the SHA1 challenge
+  bool legacy_client;
+  // the server as it was before its flights were pipelined: it sent the challenge only once the
+  // preamble had been echoed
+  bool legacy_server;
+  // resume with the ticket of the previous handshake
+  bool ticket;
+};
+
+static const struct hs_case hs_cases[] = {
+  {"v2, unpipelined", true, true, false},
+  {"v2", true, false, false},
+  {"v3", false, false, false},
+  {"v3, ticket", false, false, true},
+};
+
+struct hs_server {
+  int fd;
+  bool legacy;
+  bool ok;
+};
+
+static bool legacy_server(int fd) {
+  uint8_t frame[PROTO_HDR_MAX + NONCE_SIZE], buff[HANDSHAKE_BUFF_SIZE], nonce[NONCE_SIZE], answer[ANSWER_SIZE];
+  uint16_t len;
+  enum data_type type;
+  random_fill(nonce, sizeof(nonce));
+  return write_all(fd, frame, proto_encode(frame, sizeof(preamble), DT_PREAMBLE, preamble)) &&
+         proto_read(fd, &len, &type, buff, sizeof(buff)) &&
+         write_all(fd, frame, proto_encode(frame, NONCE_SIZE, DT_AUTH, nonce)) &&
+         proto_read(fd, &len, &type, buff, sizeof(buff)) && len == ANSWER_SIZE &&
+         auth_answer_v2(&cookie, nonce, answer) && auth_equal(answer, buff, ANSWER_SIZE) &&
+         write_all(fd, frame, proto_encode(frame, 0, DT_NONE, NULL));
+}
+
+static void *hs_server_main(void *arg) {
+  struct hs_server *srv = arg;
+  struct session_setup setup;
+  srv->ok = srv->legacy ? legacy_server(srv->fd) : server_negotiate(srv->fd, 0, &setup);
+  return NULL;
+}
+
+static bool legacy_client(int fd) {
+  uint8_t frame[PROTO_HDR_MAX + ANSWER_SIZE], buff[HANDSHAKE_BUFF_SIZE], answer[ANSWER_SIZE];
+  uint16_t len;
+  enum data_type type;
+  return proto_read(fd, &len, &type, buff, sizeof(buff)) && type == DT_PREAMBLE &&
+         write_all(fd, frame, proto_encode(frame, sizeof(preamble), DT_PREAMBLE, preamble)) &&
+         proto_read(fd, &len, &type, buff, sizeof(buff)) && type == DT_AUTH && len == NONCE_SIZE &&
+         auth_answer_v2(&cookie, buff, answer) &&
+         write_all(fd, frame, proto_encode(frame, ANSWER_SIZE, DT_AUTH, answer)) &&
+         proto_read(fd, &len, &type, buff, sizeof(buff)) && type == DT_NONE;
+}
+
+// the handshake of the ptyfwd client (client.c). `ticket` is replaced by the one the server
+// hands out.
+static bool lib_client(int fd, uint8_t *ticket, bool resume) {
+  struct ptyfwd_client_config cfg = {
+    .cookie = cookie.data,
+    .cookielen = cookie.size,
+    .ticket = resume ? ticket : NULL,
+    .rows = 24,
+    .cols = 80,
+  };
+  struct ptyfwd_conn *conn = ptyfwd_client_new(&cfg);
+  uint8_t buff[HANDSHAKE_BUFF_SIZE];
+  bool done = !conn, ok = false;
+  while (!done) {
+    struct ptyfwd_event ev;
+    while (!done && ptyfwd_next_event(conn, &ev)) {
+      if (ev.type == PTYFWD_EV_TICKET && ev.data)
+        memcpy(ticket, ev.data, PTYFWD_TICKET_SIZE);
+      ok = ev.type == PTYFWD_EV_READY;
+      done = ok || ev.type == PTYFWD_EV_CLOSED || ev.type == PTYFWD_EV_ERROR;
+    }
+    const uint8_t *out;
+    size_t outlen = ptyfwd_output(conn, &out);
+    if (outlen && !write_all(fd, out, outlen))
+      ok = false;
+    ptyfwd_output_consume(conn, outlen);
+    size_t want = ptyfwd_want(conn);
+    if (want > sizeof(buff))
+      want = sizeof(buff);
+    if (!done && (!want || !read_all(fd, buff, want) || !ptyfwd_feed(conn, buff, want)))
+      done = true;
+  }
+  ptyfwd_free(conn);
+  return ok;
+}
+
+// ms until the client is through the handshake, from when the server starts it
+static double run_handshake(const struct hs_case *hc, uint8_t *ticket) {
+  int cl[2], sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, cl) < 0 ||
+      socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+    perror("socketpair");
+    exit(1);
+  }
+  int linkfds[2] = {cl[1], sv[1]};
+  struct hs_server srv = {.fd = sv[0], .legacy = hc->legacy_server};
+  pthread_t linkt, srvt;
+  if (pthread_create(&linkt, NULL, link_main, linkfds)) {
+    perror("pthread_create");
+    exit(1);
+  }
+  uint64_t start = mono_ns();
+  if (pthread_create(&srvt, NULL, hs_server_main, &srv)) {
+    perror("pthread_create");
+    exit(1);
+  }
+  bool ok = hc->legacy_client ? legacy_client(cl[0]) : lib_client(cl[0], ticket, hc->ticket);
+  uint64_t end = mono_ns();
+  close(cl[0]);
+  pthread_join(linkt, NULL);
+  pthread_join(srvt, NULL);
+  close(cl[1]);
+  close(sv[0]);
+  close(sv[1]);
+  if (!(ok && srv.ok)) {
+    fprintf(stderr, "The %s handshake failed\n", hc->name);
+    exit(1);
+  }
+  return (end - start) / 1e6;
+}
+
+static void run_handshakes() {
+  cookie.size = 32;
+  random_fill(cookie.data, cookie.size);
+  if (!auth_ticket_init()) {
+    perror("auth_ticket_init");
+    exit(1);
+  }
+  double best[sizeof(hs_cases) / sizeof(*hs_cases)];
+  const size_t ncases = sizeof(best) / sizeof(*best);
+  uint8_t ticket[PTYFWD_TICKET_SIZE];
+  for (int run = 0; run < BENCH_RUNS; ++run) {
+    for (size_t i = 0; i < ncases; ++i) {
+      double ms = run_handshake(&hs_cases[i], ticket);
+      best[i] = !run || ms < best[i] ? ms : best[i];
+    }
+  }
+  printf("\n# handshakes, with %d ms each way\n", LINK_DELAY_MS);
+  printf("%-16s %10s %12s\n", "handshake", "ms", "round trips");
+  for (size_t i = 0; i < ncases; ++i)
+    printf("%-16s %10.1f %12.2f\n", hs_cases[i].name, best[i], best[i] / (2 * LINK_DELAY_MS));
+}
+
+static const char *const trigger_pats[] = {
+  "panic:", "Out\\sof\\smemory", "Segmentation\\sfault", "error:", "FATAL", "Traceback", "password:", "[sudo]",
+};
+
+// like source code and logs: the first bytes of the patterns show up now and then (pass, parse,
+// errno, ...), the patterns themselves never
+static const char *const trigger_words[] = {
+  "the", "of", "to", "and", "a", "in", "is", "it", "for", "on", "with", "as", "at", "by", "from", "be", "this", "that",
+  "return", "int", "static", "const", "char", "void", "struct", "size_t", "uint8_t", "if", "else", "while", "break",
+  "buff", "len", "data", "fd", "0", "1", "NULL", "true", "false", "read", "write", "session", "client", "server",
+  "pass", "parse", "errno", "output", "Trace", "FAIL", "sudo",
+};
+static const char *const trigger_seps[] = {" ", " ", " ", "\n", "(", ")", ";", ", ", "\t"};
+
+// GB/s of trigger_scan() over `total` bytes of `text`
+static double run_scan(const uint8_t *text, size_t textlen, size_t total) {
+  struct trigger_session t;
+  trigger_session_init(&t, 0, NULL, NULL);
+  uint64_t start = mono_ns();
+  for (size_t done = 0; done < total;) {
+    for (size_t off = 0; off + SCAN_CHUNK <= textlen && done < total; off += SCAN_CHUNK, done += SCAN_CHUNK)
+      trigger_scan(&t, text + off, SCAN_CHUNK);
+  }
+  double gbps = total / ((mono_ns() - start) * 1.0);
+  trigger_session_free(&t);
+  return gbps;
+}
+
+static void run_triggers(size_t total) {
+  char path[] = "/tmp/ptyfwd-bench.XXXXXX";
+  int fd = mkstemp(path);
+  FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (!f) {
+    perror("Error writing the trigger file");
+    exit(1);
+  }
+  for (size_t i = 0; i < sizeof(trigger_pats) / sizeof(*trigger_pats); ++i)
+    fprintf(f, "%s log\n", trigger_pats[i]);
+  fclose(f);
+  bool loaded = trigger_load(path);
+  unlink(path);
+  if (!loaded)
+    exit(1);
+
+  size_t textlen = 1 << 20;
+  uint8_t *text = malloc(textlen);
+  if (!text) {
+    perror("malloc");
+    exit(1);
+  }
+  for (size_t n = 0; n < textlen;) {
+    const char *w = trigger_words[rnd() % (sizeof(trigger_words) / sizeof(*trigger_words))];
+    const char *sep = trigger_seps[rnd() % (sizeof(trigger_seps) / sizeof(*trigger_seps))];
+    for (const char *c = w; *c && n < textlen; ++c)
+      text[n++] = *c;
+    for (const char *c = sep; *c && n < textlen; ++c)
+      text[n++] = *c;
+  }
+
+  static const char *const scans[] = {"avx2", "ssse3", "scalar"};
+  const size_t nscans = sizeof(scans) / sizeof(*scans);
+  double best[sizeof(scans) / sizeof(*scans)] = {0};
+  for (int run = 0; run < BENCH_RUNS; ++run) {
+    for (size_t i = 0; i < nscans; ++i) {
+      if (!trigger_use_scan(scans[i]))
+        continue;
+      double gbps = run_scan(text, textlen, total);
+      best[i] = gbps > best[i] ? gbps : best[i];
+    }
+  }
+  free(text);
+
+  size_t npats = sizeof(trigger_pats) / sizeof(*trigger_pats);
+  printf("\n# output triggers, %zu patterns over text, %d byte reads\n", npats, SCAN_CHUNK);
+  printf("%-12s %10s %9s\n", "scan", "GB/s", "relative");
+  for (size_t i = 0; i < nscans; ++i) {
+    if (best[i])
+      printf("%-12s %10.2f %8.2fx\n", scans[i], best[i], best[i] / best[nscans - 1]);
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t mib = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+  if (!mib) {
+    fprintf(stderr, "Usage: %s [<MiB per run>]\n", argv[0]);
+    return 1;
+  }
+  bufpool_init(0);
+  printf("%-12s %10s %9s %12s %12s %10s %10s\n", "sizes", "frames", "avg(B)", "enc(ns/fr)", "dec(ns/fr)",
+    "enc(GB/s)", "dec(GB/s)");
+  for (size_t i = 0; i < sizeof(dists) / sizeof(*dists); ++i)
+    run(&dists[i], mib << 20);
+  fflush(stdout);
+  // the source may still write when the forward is torn down
+  signal(SIGPIPE, SIG_IGN);
+  run_streams(mib << 20);
+  fflush(stdout);
+  run_handshakes();
+  fflush(stdout);
+  run_triggers(mib << 20);
+  return 0;
+}
@@ -0,0 +1,130 @@
+#include "bufpool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <malloc.h>
+#endif
+
+// reads this much shorter than the buffer count as short reads
+#define SHORT_READ_RATIO 4
+// this many short reads in a row shrink the buffer
+#define SHORT_READS_TO_SHRINK 8
+
+// released buffers are linked through their first bytes
+struct freebuf {
+  struct freebuf *next;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  size_t cached_max;
+  struct freebuf *free[BUFPOOL_NCLASSES];
+  size_t nfree[BUFPOOL_NCLASSES];
+  size_t inuse;
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static int size_class(size_t size, size_t *cap) {
+  size_t c = BUFPOOL_MIN_SIZE;
+  int i = 0;
+  while (c < size && i < BUFPOOL_NCLASSES - 1) {
+    c *= 4;
+    ++i;
+  }
+  *cap = c;
+  return i;
+}
+
+void bufpool_init(size_t cached) {
+  pool.cached_max = cached;
+#ifdef M_MMAP_THRESHOLD
+  // big buffers get their own mapping, so that freeing them actually returns the memory.
+  // this also stops glibc from raising the threshold as buffers come and go.
+  mallopt(M_MMAP_THRESHOLD, BUFPOOL_MAX_SIZE / 4);
+#endif
+}
+
+void *bufpool_get(size_t size, size_t *cap) {
+  int cls = size_class(size, cap);
+  pthread_mutex_lock(&pool.lock);
+  struct freebuf *fb = pool.free[cls];
+  if (fb) {
+    pool.free[cls] = fb->next;
+    --pool.nfree[cls];
+  }
+  pool.inuse += *cap;
+  pthread_mutex_unlock(&pool.lock);
+
+  if (!fb && !(fb = malloc(*cap))) {
+    pthread_mutex_lock(&pool.lock);
+    pool.inuse -= *cap;
+    pthread_mutex_unlock(&pool.lock);
+  }
+  return fb;
+}
+
+void bufpool_put(void *buff, size_t cap) {
+  if (!buff)
+    return;
+  int cls = size_class(cap, &cap);
+  struct freebuf *fb = buff;
+  pthread_mutex_lock(&pool.lock);
+  pool.inuse -= cap;
+  if ((pool.nfree[cls] + 1) * cap <= pool.cached_max) {
+    fb->next = pool.free[cls];
+    pool.free[cls] = fb;
+    ++pool.nfree[cls];
+    fb = NULL;
+  }
+  pthread_mutex_unlock(&pool.lock);
+  free(fb);
+}
+
+void bufpool_get_stats(struct bufpool_stats *st) {
+  pthread_mutex_lock(&pool.lock);
+  st->inuse = pool.inuse;
+  st->cached = 0;
+  for (int i = 0, c = BUFPOOL_MIN_SIZE; i < BUFPOOL_NCLASSES; ++i, c *= 4)
+    st->cached += pool.nfree[i] * c;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+void readsize_init(struct readsize *rs) {
+  rs->size = BUFPOOL_MIN_SIZE;
+  rs->nshort = 0;
+}
+
+void readsize_update(struct readsize *rs, size_t got, size_t room) {
+  if (got >= room) {
+    // there is probably more where this came from
+    if (rs->size < BUFPOOL_MAX_SIZE)
+      rs->size *= 4;
+    rs->nshort = 0;
+  } else if (got < room / SHORT_READ_RATIO) {
+    if (++rs->nshort >= SHORT_READS_TO_SHRINK) {
+      if (rs->size > BUFPOOL_MIN_SIZE)
+        rs->size /= 4;
+      rs->nshort = 0;
+    }
+  } else {
+    rs->nshort = 0;
+  }
+}
+
+void relaybuf_init(struct relaybuf *rb) {
+  rb->buff = NULL;
+  rb->cap = 0;
+  readsize_init(&rb->rs);
+}
+
+uint8_t *relaybuf_acquire(struct relaybuf *rb) {
+  if (rb->buff && rb->cap == rb->rs.size)
+    return rb->buff;
+  bufpool_put(rb->buff, rb->cap);
+  rb->buff = bufpool_get(rb->rs.size, &rb->cap);
+  return rb->buff;
+}
+
+void relaybuf_release(struct relaybuf *rb) {
+  bufpool_put(rb->buff, rb->cap);
+  relaybuf_init(rb);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// size classed pool for relay buffers, shared by all threads of the process.
+// sessions only hold buffers while data is in flight, and give them back once they
+// have been quiet for BUFPOOL_IDLE_MS, so that idle sessions hold no buffers at all.
+
+// size classes are powers of 4 from BUFPOOL_MIN_SIZE to BUFPOOL_MAX_SIZE
+#define BUFPOOL_MIN_SIZE 2048
+#define BUFPOOL_MAX_SIZE (128 * 1024)
+#define BUFPOOL_NCLASSES 4
+
+#define BUFPOOL_IDLE_MS 1000
+
+// keep up to `cached` bytes of released buffers per size class for reuse.
+// everything else goes back to the OS.
+void bufpool_init(size_t cached);
+
+// returns a buffer of at least `size` (capped to BUFPOOL_MAX_SIZE) bytes, or NULL.
+// `*cap` is set to the actual size of the buffer.
+void *bufpool_get(size_t size, size_t *cap);
+
+void bufpool_put(void *buff, size_t cap);
+
+struct bufpool_stats {
+  size_t inuse;
+  size_t cached;
+};
+
+void bufpool_get_stats(struct bufpool_stats *st);
+
+// buffer size that follows the observed throughput: it starts small, grows while reads
+// fill the whole buffer, and shrinks back after a run of short reads.
+struct readsize {
+  uint32_t size;
+  uint8_t nshort;
+};
+
+void readsize_init(struct readsize *rs);
+
+// `got` bytes were read into a buffer of `room` bytes
+void readsize_update(struct readsize *rs, size_t got, size_t room);
+
+// read buffer that comes from the pool when needed and follows a readsize
+struct relaybuf {
+  uint8_t *buff;
+  size_t cap;
+  struct readsize rs;
+};
+
+void relaybuf_init(struct relaybuf *rb);
+
+// get a buffer matching the current read size. returns NULL if out of memory.
+uint8_t *relaybuf_acquire(struct relaybuf *rb);
+
+// give the buffer back to the pool. the read size starts over.
+void relaybuf_release(struct relaybuf *rb);
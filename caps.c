@@ -0,0 +1,108 @@
+#include "caps.h"
+#include "common.h"
+#include <string.h>
+
+void caps_legacy(struct caps *c) {
+  memset(c, 0, sizeof(*c));
+  c->max_frame = 0xFFFF;
+  c->buff_size = BUFF_SIZE;
+}
+
+void caps_local(struct caps *c) {
+  caps_legacy(c);
+  c->features = CF_FORWARD | CF_TRACE | CF_EXEC | CF_CHAN_EOF;
+}
+
+static size_t put_tlv(uint8_t *out, size_t outsize, size_t pos, enum cap_type type, const void *val, uint8_t len) {
+  if (pos + 2 + len > outsize)
+    return 0;
+  out[pos] = type;
+  out[pos + 1] = len;
+  memcpy(out + pos + 2, val, len);
+  return pos + 2 + len;
+}
+
+size_t caps_encode(const struct caps *c, uint8_t *out, size_t outsize) {
+  size_t pos = 0;
+  if (!(pos = put_tlv(out, outsize, pos, CAP_MAX_FRAME, &c->max_frame, sizeof(c->max_frame))) ||
+      !(pos = put_tlv(out, outsize, pos, CAP_BUFF_SIZE, &c->buff_size, sizeof(c->buff_size))) ||
+      !(pos = put_tlv(out, outsize, pos, CAP_CODECS, &c->codecs, sizeof(c->codecs))) ||
+      !(pos = put_tlv(out, outsize, pos, CAP_FEATURES, &c->features, sizeof(c->features))) ||
+      !(pos = put_tlv(out, outsize, pos, CAP_HEARTBEAT, &c->heartbeat, sizeof(c->heartbeat))))
+    return 0;
+  if (*c->target && !(pos = put_tlv(out, outsize, pos, CAP_TARGET, c->target, strlen(c->target))))
+    return 0;
+  return pos;
+}
+
+bool caps_decode(const uint8_t *data, size_t len, struct caps *c) {
+  caps_legacy(c);
+  size_t pos = 0;
+  while (pos < len) {
+    if (pos + 2 > len || pos + 2 + data[pos + 1] > len)
+      return false;
+    uint8_t type = data[pos];
+    uint8_t vlen = data[pos + 1];
+    const uint8_t *val = data + pos + 2;
+    pos += 2 + vlen;
+
+    void *dst = NULL;
+    uint8_t dstlen = 0;
+    switch (type) {
+    case CAP_MAX_FRAME:
+      dst = &c->max_frame;
+      dstlen = sizeof(c->max_frame);
+      break;
+    case CAP_BUFF_SIZE:
+      dst = &c->buff_size;
+      dstlen = sizeof(c->buff_size);
+      break;
+    case CAP_CODECS:
+      dst = &c->codecs;
+      dstlen = sizeof(c->codecs);
+      break;
+    case CAP_FEATURES:
+      dst = &c->features;
+      dstlen = sizeof(c->features);
+      break;
+    case CAP_HEARTBEAT:
+      dst = &c->heartbeat;
+      dstlen = sizeof(c->heartbeat);
+      break;
+    case CAP_TARGET:
+      // the only variable length value
+      if (vlen > CAP_TARGET_MAX || memchr(val, 0, vlen))
+        return false;
+      memcpy(c->target, val, vlen);
+      c->target[vlen] = 0;
+      continue;
+    default:
+      // from a newer peer
+      continue;
+    }
+    if (vlen != dstlen)
+      return false;
+    memcpy(dst, val, vlen);
+  }
+  return true;
+}
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+void caps_merge(const struct caps *a, const struct caps *b, struct caps *out) {
+  out->max_frame = MIN(a->max_frame, b->max_frame);
+  out->buff_size = MIN(a->buff_size, b->buff_size);
+  out->codecs = a->codecs & b->codecs;
+  out->features = a->features & b->features;
+  // heartbeats only if both sides do them, at the pace of the slower side
+  out->heartbeat = (a->heartbeat && b->heartbeat) ? MAX(a->heartbeat, b->heartbeat) : 0;
+  // only clients name a target
+  memcpy(out->target, *a->target ? a->target : b->target, sizeof(out->target));
+}
+
+uint32_t caps_read_size(const struct caps *c) {
+  uint32_t sz = MIN(c->buff_size, c->max_frame);
+  sz = MIN(sz, 0xFFFF);
+  return sz ? sz : 1;
+}
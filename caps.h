@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// capabilities are exchanged in the v3 preamble, right after the handshake version, as a
+// list of TLVs:
+//  - 1 byte type
+//  - 1 byte length
+//  - value of len `length` (host byte order, like the rest of the protocol)
+// each side advertises what it supports, and both sides merge the two lists with the same
+// rules, so they end up with the same result without another round trip. unknown types are
+// skipped, and a missing type means the peer does not know about it.
+
+enum cap_type {
+  CAP_MAX_FRAME = 1, // u32: largest frame payload the peer accepts
+  CAP_BUFF_SIZE,     // u32: preferred relay read size
+  CAP_CODECS,        // u32: bitmask of supported compression codecs
+  CAP_FEATURES,      // u32: bitmask of optional features (enum cap_feature)
+  CAP_HEARTBEAT,     // u16: heartbeat interval in seconds, 0 if not supported
+  CAP_TARGET,        // string: client only, the backend to reach through a gateway (gateway.h)
+};
+
+enum cap_feature {
+  CF_FORWARD = 1 << 0,  // forwarding channels (forward.h)
+  CF_TRACE = 1 << 1,    // latency tracing stamps (trace.h)
+  CF_EXEC = 1 << 2,     // run the app on pipes instead of a PTY (exec.h)
+  CF_CHAN_EOF = 1 << 3, // forwarding channels can be half closed (forward.h)
+};
+
+// longest CAP_TARGET
+#define CAP_TARGET_MAX 63
+
+// largest TLV list we produce
+#define CAPS_MAX_ENCODED (64 + CAP_TARGET_MAX)
+
+struct caps {
+  uint32_t max_frame;
+  uint32_t buff_size;
+  uint32_t codecs;
+  uint32_t features;
+  uint16_t heartbeat;
+  // empty if not given
+  char target[CAP_TARGET_MAX + 1];
+};
+
+// what a peer that does not send capabilities (e.g. a legacy peer) supports
+void caps_legacy(struct caps *c);
+
+// what we support
+void caps_local(struct caps *c);
+
+// returns the number of bytes written, or 0 if `out` is too small
+size_t caps_encode(const struct caps *c, uint8_t *out, size_t outsize);
+
+// returns false on malformed input
+bool caps_decode(const uint8_t *data, size_t len, struct caps *c);
+
+void caps_merge(const struct caps *a, const struct caps *b, struct caps *out);
+
+// read size for relaying data with the negotiated capabilities
+uint32_t caps_read_size(const struct caps *c);
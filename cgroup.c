@@ -0,0 +1,457 @@
+#include "cgroup.h"
+#include <err.h>
+#include <stdio.h>
+
+#ifdef __linux__
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <mntent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+
+#define CG_PREFIX "session-"
+#define CG_NAME_MAX 64
+#define CG_FILE_MAX 4096
+// leaves that have never been populated are left alone for this long, as their app may be
+// about to join
+#define CG_GRACE_MS 10000
+
+struct cg_stat {
+  char name[CG_NAME_MAX];
+  uint64_t first_ms;
+  // ever populated
+  bool populated;
+  // still there, as of the last scan
+  bool seen;
+  uint64_t cpu_usec;
+  uint64_t prev_cpu_usec;
+  uint64_t prev_ms;
+  double cpu_pct;
+  uint64_t mem;
+  uint64_t peak;
+  uint64_t rbytes;
+  uint64_t wbytes;
+};
+
+static int basefd = -1;
+static unsigned cpu_pct_max;
+static uint64_t mem_max;
+// what goes in cpu.max and memory.max, formatted up front for cg_attach_self()
+static char cpu_max_value[32];
+static char mem_max_value[32];
+static unsigned interval_s = 5;
+static bool has_memory;
+static bool has_io;
+static uint64_t next_ms;
+static struct cg_stat *stats;
+static int nstats;
+static int capstats;
+
+static bool read_file(int dirfd, const char *name, char *buff, size_t size) {
+  int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  ssize_t len = read(fd, buff, size - 1);
+  close(fd);
+  if (len < 0)
+    return false;
+  buff[len] = 0;
+  return true;
+}
+
+static bool write_file(int dirfd, const char *name, const char *data) {
+  int fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  size_t len = strlen(data);
+  bool ok = write(fd, data, len) == (ssize_t)len;
+  int saved = errno;
+  close(fd);
+  errno = saved;
+  return ok;
+}
+
+// the value of `key` in a "key value" per line file such as cpu.stat
+static uint64_t key_value(const char *text, const char *key) {
+  size_t len = strlen(key);
+  for (const char *p = text; p; p = strchr(p, '\n')) {
+    if (*p == '\n')
+      ++p;
+    if (!strncmp(p, key, len) && p[len] == ' ')
+      return strtoull(p + len + 1, NULL, 10);
+  }
+  return 0;
+}
+
+// the sum of `key`=value over all devices in io.stat
+static uint64_t io_sum(const char *text, const char *key) {
+  size_t len = strlen(key);
+  uint64_t sum = 0;
+  for (const char *p = strstr(text, key); p; p = strstr(p + len, key)) {
+    if (p[len] == '=' && (p == text || p[-1] == ' '))
+      sum += strtoull(p + len + 1, NULL, 10);
+  }
+  return sum;
+}
+
+// the directory of the cgroup we are in
+static bool own_cgroup(char *path, size_t size) {
+  char buff[CG_FILE_MAX];
+  if (!read_file(AT_FDCWD, "/proc/self/cgroup", buff, sizeof(buff)))
+    return false;
+  char *rel = strstr(buff, "0::");
+  if (!rel || (rel != buff && rel[-1] != '\n'))
+    return false;
+  rel += 3;
+  rel[strcspn(rel, "\n")] = 0;
+
+  FILE *f = setmntent("/proc/self/mounts", "r");
+  if (!f)
+    return false;
+  bool found = false;
+  struct mntent *m;
+  while (!found && (m = getmntent(f))) {
+    if (!strcmp(m->mnt_type, "cgroup2"))
+      found = snprintf(path, size, "%s%s", m->mnt_dir, strcmp(rel, "/") ? rel : "") < (int)size;
+  }
+  endmntent(f);
+  return found;
+}
+
+// controllers with limits can't be enabled for the children of a cgroup that has processes of
+// its own, so if it is ours, move to a leaf of our own first
+static bool leave_base() {
+  char path[PATH_MAX];
+  struct stat ours, base;
+  if (!own_cgroup(path, sizeof(path)) || stat(path, &ours) < 0 || fstat(basefd, &base) < 0)
+    return true;
+  if (ours.st_dev != base.st_dev || ours.st_ino != base.st_ino)
+    return true;
+  if (mkdirat(basefd, "server", 0755) < 0 && errno != EEXIST) {
+    warn("Error creating the server's cgroup");
+    return false;
+  }
+  int fd = openat(basefd, "server", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  char pid[16];
+  snprintf(pid, sizeof(pid), "%d", getpid());
+  if (fd < 0 || !write_file(fd, "cgroup.procs", pid)) {
+    warn("Error moving to the server's cgroup");
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+// best effort: enable `name` for the leaves if it is available
+static bool enable_controller(const char *controllers, const char *name) {
+  char buff[CG_FILE_MAX];
+  snprintf(buff, sizeof(buff), "%s", controllers);
+  char *save;
+  for (char *tok = strtok_r(buff, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save)) {
+    if (!strcmp(tok, name)) {
+      char req[32];
+      snprintf(req, sizeof(req), "+%s", name);
+      return write_file(basefd, "cgroup.subtree_control", req);
+    }
+  }
+  return false;
+}
+
+// a size in bytes, like "512M" or "2GiB". returns 0 if invalid or too large.
+static uint64_t parse_size(const char *s) {
+  if (*s < '0' || *s > '9')
+    return 0;
+  char *end;
+  errno = 0;
+  unsigned long long v = strtoull(s, &end, 10);
+  int shift = 0;
+  switch (*end) {
+  case 'T':
+  case 't':
+    shift += 10;
+    // fallthrough
+  case 'G':
+  case 'g':
+    shift += 10;
+    // fallthrough
+  case 'M':
+  case 'm':
+    shift += 10;
+    // fallthrough
+  case 'K':
+  case 'k':
+    shift += 10;
+    if (*++end == 'i')
+      ++end;
+    break;
+  }
+  if (*end == 'B')
+    ++end;
+  if (errno || *end || v > UINT64_MAX >> shift)
+    return 0;
+  return (uint64_t)v << shift;
+}
+
+bool cg_init(const char *spec) {
+  char buff[PATH_MAX + 64];
+  if (snprintf(buff, sizeof(buff), "%s", spec) >= (int)sizeof(buff)) {
+    warnx("Invalid accounting spec.");
+    return false;
+  }
+  char *save;
+  char *dir = strtok_r(buff, ",", &save);
+  for (char *tok = strtok_r(NULL, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    if (sscanf(tok, "cpu=%u", &cpu_pct_max) == 1 || sscanf(tok, "interval=%u", &interval_s) == 1)
+      continue;
+    if (!strncmp(tok, "mem=", 4) && (mem_max = parse_size(tok + 4)))
+      continue;
+    warnx("Unknown accounting option '%s'", tok);
+    return false;
+  }
+  if (!dir || !interval_s) {
+    warnx("Invalid accounting spec.");
+    return false;
+  }
+
+  char path[PATH_MAX];
+  if (!strcmp(dir, "self")) {
+    if (!own_cgroup(path, sizeof(path))) {
+      warnx("Can't find our cgroup v2.");
+      return false;
+    }
+    dir = path;
+  }
+  struct statfs fs;
+  basefd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (basefd < 0 || fstatfs(basefd, &fs) < 0) {
+    warn("Error opening cgroup %s", dir);
+    return false;
+  }
+  if (fs.f_type != CGROUP2_SUPER_MAGIC) {
+    warnx("%s is not a cgroup v2.", dir);
+    return false;
+  }
+  if (!leave_base())
+    return false;
+
+  char controllers[CG_FILE_MAX];
+  if (!read_file(basefd, "cgroup.controllers", controllers, sizeof(controllers)))
+    controllers[0] = 0;
+  bool has_cpu = enable_controller(controllers, "cpu");
+  has_memory = enable_controller(controllers, "memory");
+  has_io = enable_controller(controllers, "io");
+  if (cpu_pct_max && !has_cpu) {
+    warnx("CPU limits need the cpu controller, which can't be enabled in %s.", dir);
+    return false;
+  }
+  if (mem_max && !has_memory) {
+    warnx("Memory limits need the memory controller, which can't be enabled in %s.", dir);
+    return false;
+  }
+  if (cpu_pct_max)
+    snprintf(cpu_max_value, sizeof(cpu_max_value), "%u 100000", cpu_pct_max * 1000);
+  if (mem_max)
+    snprintf(mem_max_value, sizeof(mem_max_value), "%llu", (unsigned long long)mem_max);
+  return true;
+}
+
+bool cg_enabled() {
+  return basefd >= 0;
+}
+
+static bool set_limits(int fd) {
+  return (!cpu_pct_max || write_file(fd, "cpu.max", cpu_max_value)) &&
+         (!mem_max || write_file(fd, "memory.max", mem_max_value));
+}
+
+bool cg_attach_self() {
+  char name[CG_NAME_MAX] = CG_PREFIX;
+  size_t len = strlen(name);
+  name[len + format_uint(name + len, getpid())] = 0;
+  // a leftover of an earlier app with the same pid is shared
+  if (mkdirat(basefd, name, 0755) < 0 && errno != EEXIST) {
+    warn_raw("Error creating the session's cgroup");
+    return false;
+  }
+  int fd = openat(basefd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  // "0" is whoever writes it
+  if (fd >= 0 && set_limits(fd) && write_file(fd, "cgroup.procs", "0")) {
+    close(fd);
+    return true;
+  }
+  warn_raw("Error moving the app to the session's cgroup");
+  if (fd >= 0)
+    close(fd);
+  unlinkat(basefd, name, AT_REMOVEDIR);
+  return false;
+}
+
+static struct cg_stat *find_stat(const char *name, uint64_t now) {
+  for (int i = 0; i < nstats; ++i) {
+    if (!strcmp(stats[i].name, name))
+      return &stats[i];
+  }
+  if (nstats == capstats) {
+    int cap = capstats ? capstats * 2 : 16;
+    struct cg_stat *grown = realloc(stats, cap * sizeof(*stats));
+    if (!grown)
+      return NULL;
+    stats = grown;
+    capstats = cap;
+  }
+  struct cg_stat *st = &stats[nstats++];
+  *st = (struct cg_stat){.first_ms = now};
+  snprintf(st->name, sizeof(st->name), "%s", name);
+  return st;
+}
+
+static void log_totals(const struct cg_stat *st) {
+  char mem[64] = "", io[96] = "";
+  if (has_memory)
+    snprintf(mem, sizeof(mem), ", up to %llu KiB of memory", (unsigned long long)(st->peak >> 10));
+  if (has_io)
+    snprintf(io, sizeof(io), ", read %llu KiB and wrote %llu KiB", (unsigned long long)(st->rbytes >> 10),
+      (unsigned long long)(st->wbytes >> 10));
+  warnx("%s is over: %.3f s of CPU%s%s.", st->name, st->cpu_usec / 1e6, mem, io);
+}
+
+// returns false if the leaf is done with and has been removed
+static bool sample(struct cg_stat *st, uint64_t now) {
+  int fd = openat(basefd, st->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  char buff[CG_FILE_MAX];
+  bool populated = read_file(fd, "cgroup.events", buff, sizeof(buff)) && key_value(buff, "populated");
+  if (read_file(fd, "cpu.stat", buff, sizeof(buff)))
+    st->cpu_usec = key_value(buff, "usage_usec");
+  if (st->prev_ms && now > st->prev_ms)
+    st->cpu_pct = (st->cpu_usec - st->prev_cpu_usec) / 10.0 / (now - st->prev_ms);
+  st->prev_cpu_usec = st->cpu_usec;
+  st->prev_ms = now;
+  if (has_memory && read_file(fd, "memory.current", buff, sizeof(buff))) {
+    st->mem = strtoull(buff, NULL, 10);
+    // memory.peak is newer than the controller
+    if (read_file(fd, "memory.peak", buff, sizeof(buff)))
+      st->peak = strtoull(buff, NULL, 10);
+    if (st->mem > st->peak)
+      st->peak = st->mem;
+  }
+  if (has_io && read_file(fd, "io.stat", buff, sizeof(buff))) {
+    st->rbytes = io_sum(buff, "rbytes");
+    st->wbytes = io_sum(buff, "wbytes");
+  }
+  close(fd);
+
+  // short lived apps can come and go between samples
+  if (populated || st->cpu_usec)
+    st->populated = true;
+  if (populated)
+    return true;
+  if (!st->populated && now - st->first_ms < CG_GRACE_MS)
+    return true;
+  if (st->populated)
+    log_totals(st);
+  if (unlinkat(basefd, st->name, AT_REMOVEDIR) < 0 && errno != ENOENT) {
+    warn("Error removing cgroup %s", st->name);
+    return true;
+  }
+  return false;
+}
+
+static void sample_all(uint64_t now) {
+  int fd = dup(basefd);
+  DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+  if (!dir) {
+    if (fd >= 0)
+      close(fd);
+    warn("Error reading cgroup");
+    return;
+  }
+  // the offset is shared with `basefd`
+  rewinddir(dir);
+  for (int i = 0; i < nstats; ++i)
+    stats[i].seen = false;
+  struct dirent *de;
+  while ((de = readdir(dir))) {
+    if (strncmp(de->d_name, CG_PREFIX, strlen(CG_PREFIX)) || (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN))
+      continue;
+    struct cg_stat *st = find_stat(de->d_name, now);
+    if (st)
+      st->seen = sample(st, now);
+  }
+  closedir(dir);
+
+  int kept = 0;
+  for (int i = 0; i < nstats; ++i) {
+    if (stats[i].seen)
+      stats[kept++] = stats[i];
+  }
+  nstats = kept;
+}
+
+int cg_tick() {
+  if (basefd < 0)
+    return -1;
+  uint64_t now = mono_ns() / 1000000;
+  if (now < next_ms)
+    return next_ms - now;
+  sample_all(now);
+  next_ms = now + interval_s * 1000;
+  return interval_s * 1000;
+}
+
+void cg_dump_stats() {
+  if (basefd < 0)
+    return;
+  fprintf(stderr, "%-24s %7s %10s %10s %10s %10s %10s\n", "session", "cpu(%)", "cpu(s)", "mem(KiB)", "peak(KiB)",
+    "read(KiB)", "write(KiB)");
+  for (int i = 0; i < nstats; ++i) {
+    const struct cg_stat *st = &stats[i];
+    fprintf(stderr, "%-24s %7.1f %10.2f", st->name, st->cpu_pct, st->cpu_usec / 1e6);
+    if (has_memory)
+      fprintf(stderr, " %10llu %10llu", (unsigned long long)(st->mem >> 10), (unsigned long long)(st->peak >> 10));
+    else
+      fprintf(stderr, " %10s %10s", "-", "-");
+    if (has_io)
+      fprintf(
+        stderr, " %10llu %10llu\n", (unsigned long long)(st->rbytes >> 10), (unsigned long long)(st->wbytes >> 10));
+    else
+      fprintf(stderr, " %10s %10s\n", "-", "-");
+  }
+}
+
+#else
+
+bool cg_init(const char *spec) {
+  warnx("Resource accounting is supported only on Linux.");
+  return false;
+}
+
+bool cg_enabled() {
+  return false;
+}
+
+bool cg_attach_self() {
+  return false;
+}
+
+int cg_tick() {
+  return -1;
+}
+
+void cg_dump_stats() {
+}
+
+#endif
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// per-session resource accounting (-A): the app of every session (and whatever it starts) is
+// put in a cgroup v2 leaf of its own, session-<app pid>, under a cgroup delegated to us.
+//  - apps are launched with fork and exec then (see launch.h), and join their leaf before the
+//    exec, so that nothing they run escapes it. posix_spawn would need the leaf before the pid
+//    it is named after is known (POSIX_SPAWN_SETCGROUP), and cgroup v2 can't rename.
+//  - the cpu, memory and io controllers are enabled for the leaves where available, for the
+//    optional limits and for memory and io accounting. CPU time is always accounted.
+//  - if we are in the cgroup ourselves, we move to its `server` leaf first, since cgroups
+//    with controllers enabled for their children can't have processes of their own.
+//  - the server samples cpu.stat, memory.current and io.stat of all leaves on a timer. SIGUSR1
+//    prints them along with the other statistics, and when a session's processes are all gone,
+//    its totals are logged and its leaf is removed.
+// Linux only.
+//
+// `spec` is <cgroup>[,cpu=<percent>][,mem=<size>][,interval=<seconds>]:
+//  - <cgroup>: the cgroup's directory, or `self` for the one we are in
+//  - cpu: limit each session to <percent> of one CPU (cpu.max)
+//  - mem: limit each session's memory to <size> bytes, with an optional K, M, G or T suffix
+//    such as 512M or 2GiB (memory.max)
+//  - interval: how often to sample (5)
+bool cg_init(const char *spec);
+
+bool cg_enabled();
+
+// put the calling process in a leaf of its own, with the limits set. called by the app's
+// process between fork and exec, so it makes raw syscalls only. returns false on error, after
+// printing why.
+bool cg_attach_self();
+
+// server side: sample if it is time to. returns how long until the next sample in ms, or -1
+// if there is no accounting.
+int cg_tick();
+
+void cg_dump_stats();
@@ -1,135 +1,298 @@
+#include "auth.h"
+#include "caps.h"
+#include "client.h"
+#include "forward.h"
+#include "predict.h"
+#include "profile.h"
 #include "protocol.h"
+#include "trace.h"
 #include "utils.h"
 #include "global.h"
+#include "libptyfwd_priv.h"
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdio.h>
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <unistd.h>
 #include <string.h>
-#include <openssl/sha.h>
-
-static char rbuff[BUFF_SIZE];
 
 static bool set_tty_raw(bool set);
 
-static void install_signal_handlers();
+static bool write_stdout(const uint8_t *data, size_t len);
 
-static void sighandler(int sig);
+static void send_window_size(struct proto_writer *comm);
 
-static void send_window_size(int commfd);
+static bool negotiate(int fd, const struct ptyfwd_client_config *cfg, const char *ticketfile, struct caps *caps,
+                      bool *winch);
 
-static bool negotiate(int fd);
+static bool negotiate_session(int fd, struct caps *caps, bool *winch);
 
-static struct {
-  bool winch;
-  bool sighalt;
-} operparams = {0};
+// minimum time between two DT_WINCH
+#define WINCH_MIN_INTERVAL_NS (50 * 1000000ull)
+
+// terminal output that could not be written without blocking
+static struct bytequeue stdoutq;
 
 int start_client(int fd) {
   // nonblocking for stdio (we don't use stderr at the moment)
   for (int i = 0; i <= 1; ++i) {
     set_fd_flags(i, true, O_NONBLOCK);
   }
+  set_fd_flags(fd, true, O_NONBLOCK);
 
-  if (!negotiate(fd)) {
+  struct caps caps;
+  // whether the initial window size already went out with the handshake
+  bool winch_sent;
+  if (!negotiate_session(fd, &caps, &winch_sent)) {
     warnx("Server negotiation failed.");
     return 1;
   }
 
-  install_signal_handlers();
+  if (!(caps.features & CF_FORWARD) && fwd_close_all())
+    warnx("Server does not support forwarding. Forwards are disabled.");
+  fwd_half_close(caps.features & CF_CHAN_EOF);
+  bool tracing = caps.features & CF_TRACE;
+  if (trace_latency && !tracing)
+    warnx("Server does not support latency tracing.");
+  if (tracing)
+    trace_init();
+
+  // with tracing, SIGUSR1 dumps the latency breakdown
+  int sig_to_handle[] = {SIGINT, SIGTERM, SIGWINCH, SIGHUP, SIGUSR1};
+  int sigfd = signal_fd(sig_to_handle, sizeof(sig_to_handle) / sizeof(int) - !tracing);
+  if (sigfd < 0)
+    err(1, "Error installing signal handlers");
 
   if (!set_tty_raw(true))
     err(1, "Error setting terminal to raw mode");
 
-  // send current window size (if exists)
-  send_window_size(fd);
+  struct proto_writer comm;
+  proto_writer_init(&comm, fd);
 
-  struct pollfd pfds[2];
-  pfds[0].fd = fd;
-  pfds[1].fd = 0; // stdin
-  pfds[0].events = pfds[1].events = POLLIN;
+  // send current window size (if exists)
+  if (!winch_sent)
+    send_window_size(&comm);
+  uint64_t last_winch = mono_ns();
+  bool winch_pending = false;
+
+  if (!fwd_start(&comm))
+    err(1, "Error requesting remote forwards");
+
+  struct proto_reader reader;
+  proto_reader_init(&reader);
+  char rbuff[BUFF_SIZE];
+  if (predict_echo)
+    predict_init(write_stdout);
+
+  enum { PFD_COMM, PFD_STDIN, PFD_STDOUT, PFD_SIG, PFD_FWD };
+  struct pollfd pfds[PFD_FWD + FWD_MAX_POLLFDS];
+  pfds[PFD_COMM].fd = fd;
+  pfds[PFD_STDIN].fd = 0;
+  pfds[PFD_STDOUT].fd = 1;
+  pfds[PFD_SIG].fd = sigfd;
+  pfds[PFD_SIG].events = POLLIN;
 
   const char *errmsg = NULL;
   bool stop = false;
   while (!(errmsg || stop)) {
-    if (operparams.sighalt) {
-      warnx("Requested graceful stop");
-      stop = true;
-      break;
+    // resizes are coalesced: only the latest size is sent, and at a bounded rate
+    int timeout = -1;
+    if (winch_pending) {
+      uint64_t elapsed = mono_ns() - last_winch;
+      if (elapsed >= WINCH_MIN_INTERVAL_NS) {
+        winch_pending = false;
+        last_winch = mono_ns();
+        send_window_size(&comm);
+      } else {
+        timeout = (WINCH_MIN_INTERVAL_NS - elapsed) / 1000000 + 1;
+      }
+    }
+    if (predict_echo) {
+      int predtimeout = predict_timeout();
+      if (predtimeout >= 0 && (timeout < 0 || predtimeout < timeout))
+        timeout = predtimeout;
     }
-    if (operparams.winch) {
-      operparams.winch = false;
-      send_window_size(fd);
+    if (tracing) {
+      int tracetimeout = trace_timeout();
+      if (timeout < 0 || tracetimeout < timeout)
+        timeout = tracetimeout;
     }
 
-    if (poll(pfds, 2, -1) < 0) {
+    // stop reading new data while the peer is not keeping up with us,
+    // and don't take more from the server than the terminal can swallow.
+    bool congested = proto_pending(&comm) >= PROTO_OUTQ_HIGH;
+    pfds[PFD_COMM].events = (stdoutq.len >= PROTO_OUTQ_HIGH ? 0 : POLLIN) | (proto_pending(&comm) ? POLLOUT : 0);
+    pfds[PFD_STDIN].events = congested ? 0 : POLLIN;
+    pfds[PFD_STDOUT].events = stdoutq.len ? POLLOUT : 0;
+    int nfwd = fwd_fill_pollfds(pfds + PFD_FWD, !congested);
+    if (poll(pfds, PFD_FWD + nfwd, timeout) < 0) {
       if (errno == EINTR)
         continue;
       errmsg = "Wait error";
+      break;
+    }
+    if (predict_echo && !predict_tick()) {
+      errmsg = "stdout write error";
+      break;
+    }
+    if (tracing) {
+      uint8_t ping[TRACE_PAYLOAD_MAX];
+      size_t pinglen = trace_ping(ping);
+      if (pinglen && !proto_write(&comm, pinglen, DT_TRACE, ping)) {
+        errmsg = "Socket write error";
+        break;
+      }
     }
 
-    for (int i = 0; i < 2; ++i) {
-      if (!(pfds[i].revents & (POLLIN | POLLERR | POLLHUP)))
-        continue;
-      int srcfd = pfds[i].fd;
-      if (srcfd == fd) {
-        uint16_t rdlen;
-        enum data_type pdatatype;
-        if (!proto_read(fd, &rdlen, &pdatatype, rbuff)) {
-          errmsg = "Socket read error";
-          break;
+    if (pfds[PFD_SIG].revents & POLLIN) {
+      int sig;
+      while ((sig = signal_fd_next(sigfd))) {
+        if (sig == SIGWINCH) {
+          winch_pending = true;
+        } else if (sig == SIGUSR1) {
+          trace_dump();
+        } else {
+          warnx("Requested graceful stop");
+          stop = true;
         }
+      }
+      if (stop)
+        break;
+    }
 
+    if ((pfds[PFD_COMM].revents & POLLOUT) && !proto_flush(&comm, false)) {
+      errmsg = "Socket write error";
+      break;
+    }
+    if ((pfds[PFD_STDOUT].revents & (POLLOUT | POLLERR | POLLHUP)) && !bq_flush(&stdoutq, 1)) {
+      errmsg = "stdout write error";
+      break;
+    }
+    if (tracing && !stdoutq.len)
+      trace_output_drained();
+
+    if ((pfds[PFD_COMM].events & POLLIN) && (pfds[PFD_COMM].revents & (POLLIN | POLLERR | POLLHUP))) {
+      if (!proto_reader_fill(&reader, fd)) {
+        errmsg = "Socket read error";
+        break;
+      }
+      profile_rearm(fd);
+      uint64_t readns = tracing ? mono_ns() : 0;
+
+      uint16_t rdlen;
+      enum data_type pdatatype;
+      const uint8_t *data;
+      while (!(errmsg || stop) && proto_reader_next(&reader, &rdlen, &pdatatype, &data)) {
         switch (pdatatype) {
         case DT_REGULAR:
-          if (!write_all(1, rbuff, rdlen))
+          if (!(predict_echo ? predict_output(data, rdlen) : write_stdout(data, rdlen)))
             errmsg = "stdout write error";
+          if (tracing)
+            trace_output(readns, rdlen, stdoutq.len);
+          break;
+        case DT_TRACE:
+          if (tracing)
+            trace_frame(data, rdlen, readns);
           break;
         case DT_CLOSE:
           stop = true;
           break;
         case DT_NONE:
           break;
+        case DT_CHAN_OPEN:
+        case DT_CHAN_DATA:
+        case DT_CHAN_CREDIT:
+        case DT_CHAN_CLOSE:
+        case DT_CHAN_EOF:
+          if (!fwd_handle_frame(&comm, pdatatype, data, rdlen))
+            errmsg = "Socket write error";
+          break;
         default:
           warnx("Unrecognized data type %d", pdatatype);
-          continue;
-        }
-      } else if (srcfd == 0) {
-        int rd = read(0, rbuff, BUFF_SIZE);
-        if (rd <= 0) {
-          if (rd < 0)
-            errmsg = "stdin read error";
-          stop = true;
           break;
         }
+      }
+      if (errmsg || stop)
+        break;
+    }
 
-        if (!proto_write(fd, rd, DT_REGULAR, rbuff)) {
-          errmsg = "Socket write error";
-          break;
-        }
-      } else {
-        errno = EINVAL;
-        errmsg = "unknown src fd";
+    if ((pfds[PFD_STDIN].events & POLLIN) && (pfds[PFD_STDIN].revents & (POLLIN | POLLERR | POLLHUP))) {
+      int rd = read(0, rbuff, caps_read_size(&caps));
+      uint8_t stamp[TRACE_PAYLOAD_MAX];
+      if (rd < 0 && (errno == EINTR || errno == EAGAIN)) {
+        // try again later
+      } else if (rd <= 0) {
+        if (rd < 0)
+          errmsg = "stdin read error";
+        stop = true;
+        break;
+      } else if (tracing && !proto_write(&comm, trace_input(stamp), DT_TRACE, stamp)) {
+        errmsg = "Socket write error";
+        break;
+      } else if (!proto_write(&comm, rd, DT_REGULAR, rbuff)) {
+        errmsg = "Socket write error";
+        break;
+      } else if (predict_echo && !predict_input((uint8_t *)rbuff, rd)) {
+        errmsg = "stdout write error";
+        break;
       }
     }
+
+    if (!fwd_handle_pollfds(&comm, pfds + PFD_FWD, nfwd))
+      errmsg = "Socket write error";
   }
 
   if (errmsg)
     warn("%s", errmsg);
 
   // don't forget to let server know if we're stopping
-  proto_write(fd, 0, DT_CLOSE, NULL);
+  proto_write(&comm, 0, DT_CLOSE, NULL);
+  proto_flush(&comm, true);
+  proto_writer_release(&comm);
+  proto_reader_release(&reader);
+
+  // whatever the terminal has not taken yet
+  while (stdoutq.len && bq_flush(&stdoutq, 1) && stdoutq.len) {
+    struct pollfd pfd = {.fd = 1, .events = POLLOUT};
+    poll(&pfd, 1, -1);
+  }
+  bq_free(&stdoutq);
 
+  fwd_close_all();
   // fd = comm socket
   close(fd);
+  close(sigfd);
   set_tty_raw(false);
+  if (predict_echo)
+    predict_dump_stats();
+  if (tracing)
+    trace_dump();
   return errmsg ? 1 : 0;
 }
 
+// write to stdout without blocking. whatever the terminal cannot take right now is queued.
+static bool write_stdout(const uint8_t *data, size_t len) {
+  if (!stdoutq.len) {
+    while (len) {
+      ssize_t wr = write(1, data, len);
+      if (wr < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        return false;
+      }
+      data += wr;
+      len -= wr;
+    }
+  }
+  return !len || bq_append(&stdoutq, data, len);
+}
+
 static bool set_tty_raw(bool set) {
   int err;
   static bool is_raw = false;
@@ -210,111 +373,110 @@ static bool set_tty_raw(bool set) {
   return true;
 }
 
-static void install_signal_handlers() {
-  struct sigaction act = {0};
-  sigfillset(&act.sa_mask);
-  act.sa_handler = sighandler;
-
-  int sig_to_handle[] = {SIGINT, SIGTERM, SIGWINCH, SIGHUP};
-  for (int i = 0; i < sizeof(sig_to_handle) / sizeof(int); ++i) {
-    if (sigaction(sig_to_handle[i], &act, NULL) < 0)
-      err(1, "Error installing handler for signal %d", sig_to_handle[i]);
+static void send_window_size(struct proto_writer *comm) {
+  struct winsize winsz;
+  if (ioctl(0, TIOCGWINSZ, &winsz) >= 0) {
+    struct winch_data wd = {.rows = winsz.ws_row, .cols = winsz.ws_col};
+    proto_write(comm, sizeof(wd), DT_WINCH, &wd);
   }
 }
 
-static void sighandler(int sig) {
-  switch (sig) {
-  case SIGINT:
-  case SIGTERM:
-  case SIGHUP:
-    operparams.sighalt = true;
-    break;
-  case SIGWINCH:
-    operparams.winch = true;
-    break;
-  }
+bool client_negotiate(int fd, struct caps *caps) {
+  bool winch;
+  return negotiate_session(fd, caps, &winch);
 }
 
-static void send_window_size(int commfd) {
+// the handshake with the command line's settings. `winch`: whether it carried the window size.
+static bool negotiate_session(int fd, struct caps *caps, bool *winch) {
+  struct ptyfwd_client_config cfg = {
+    .cookie = cookie.data,
+    .cookielen = cookie.size,
+    .features = CF_FORWARD | CF_CHAN_EOF | (trace_latency ? CF_TRACE : 0) | (exec_session ? CF_EXEC : 0),
+    .target = gateway_target,
+  };
+  uint8_t ticket[TICKET_SIZE];
+  if (cookie.size && ticketpath && auth_ticket_load(ticketpath, ticket))
+    cfg.ticket = ticket;
   struct winsize winsz;
   if (ioctl(0, TIOCGWINSZ, &winsz) >= 0) {
-    struct winch_data wd = {.rows = winsz.ws_row, .cols = winsz.ws_col};
-    proto_write(commfd, sizeof(wd), DT_WINCH, &wd);
+    cfg.rows = winsz.ws_row;
+    cfg.cols = winsz.ws_col;
   }
+  return negotiate(fd, &cfg, ticketpath, caps, winch);
 }
 
-static bool negotiate(int fd) {
-  uint16_t recv_len;
-  enum data_type recv_type;
-
-  if (!proto_read(fd, &recv_len, &recv_type, rbuff)) {
-    warn("Error receiving server preamble");
-    return false;
-  }
-  if (recv_len != sizeof(preamble) && recv_type != DT_PREAMBLE) {
-    warnx("Got unknown preamble from server.");
-    return false;
-  }
-
-  if (memcmp(rbuff, preamble, sizeof(preamble))) {
-    warnx("Invalid server version!");
-    return false;
-  }
-
-  // OK, send preamble back
-  proto_write(fd, sizeof(preamble), DT_PREAMBLE, preamble);
+bool client_negotiate_features(int fd, uint32_t features, struct caps *caps) {
+  struct ptyfwd_client_config cfg = {
+    .cookie = cookie.data,
+    .cookielen = cookie.size,
+    .features = features,
+  };
+  bool winch;
+  return negotiate(fd, &cfg, NULL, caps, &winch);
+}
 
-  // authentication phase
-  if (!proto_read(fd, &recv_len, &recv_type, rbuff)) {
-    warn("Error receiving authentication request.");
+static bool negotiate(int fd, const struct ptyfwd_client_config *cfg, const char *ticketfile, struct caps *caps,
+                      bool *winch) {
+  struct ptyfwd_conn *conn = ptyfwd_client_new(cfg);
+  if (!conn) {
+    warn("Error starting handshake");
     return false;
   }
 
-  if (recv_type == DT_NONE) {
-    // server does not require authentication
-    if (cookie.size) {
-      warnx("Warning: server does not require authentication.");
-    }
-    return true;
-  } else if (recv_type == DT_AUTH) {
-    if (!cookie.size) {
-      warnx("Server requires authentication. Please supply cookie file.");
-      return false;
+  // the handshake reads no more than its own frames, so that whatever follows is left for the
+  // session's reader
+  uint8_t hsbuff[HANDSHAKE_BUFF_SIZE];
+  bool done = false, ok = false;
+  while (!done) {
+    struct ptyfwd_event ev;
+    while (!done && ptyfwd_next_event(conn, &ev)) {
+      switch (ev.type) {
+      case PTYFWD_EV_WARNING:
+        warnx("%s", ev.message);
+        break;
+      case PTYFWD_EV_TICKET:
+        if (ticketfile && ev.data)
+          auth_ticket_save(ticketfile, ev.data);
+        else if (ticketfile)
+          auth_ticket_forget(ticketfile);
+        break;
+      case PTYFWD_EV_READY:
+        done = ok = true;
+        break;
+      case PTYFWD_EV_ERROR:
+        warnx("%s", ev.message);
+        done = true;
+        break;
+      default:
+        break;
+      }
     }
 
-    if (recv_len != NONCE_SIZE) {
-      warnx("Invalid nonce size.");
-      return false;
+    // whatever the handshake has for the server goes out before we wait for the server
+    const uint8_t *out;
+    size_t outlen = ptyfwd_output(conn, &out);
+    if (outlen && !write_all(fd, out, outlen)) {
+      warn("Error sending handshake");
+      ok = false;
+      break;
     }
+    ptyfwd_output_consume(conn, outlen);
+    if (done)
+      break;
 
-    // generate answer
-    uint8_t answer[ANSWER_SIZE];
-    SHA_CTX shactx;
-    int sharesult = 1;
-    sharesult &= SHA1_Init(&shactx);
-    sharesult &= SHA1_Update(&shactx, rbuff, NONCE_SIZE);
-    sharesult &= SHA1_Update(&shactx, cookie.data, cookie.size);
-    sharesult &= SHA1_Final(answer, &shactx);
-
-    proto_write(fd, ANSWER_SIZE, DT_AUTH, answer);
-
-    if (!proto_read(fd, &recv_len, &recv_type, rbuff)) {
-      warnx("Error reading authentication result.");
-      return false;
-    }
-    switch (recv_type) {
-      case DT_CLOSE:
-        warnx("Access denied!");
-        return false;
-      case DT_NONE:
-        // access granted!
-        return true;
-      default:
-        warnx("Invalid server response.");
-        return false;
+    size_t want = ptyfwd_want(conn);
+    if (want > sizeof(hsbuff))
+      want = sizeof(hsbuff);
+    if (!read_all(fd, hsbuff, want) || !ptyfwd_feed(conn, hsbuff, want)) {
+      warn("Error receiving handshake from server");
+      break;
     }
-  } else {
-    warnx("Server sent unknown response.");
-    return false;
   }
-}
\ No newline at end of file
+
+  if (ok) {
+    ptyfwd_caps(conn, caps);
+    *winch = ptyfwd_winch_sent(conn);
+  }
+  ptyfwd_free(conn);
+  return ok;
+}
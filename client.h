@@ -0,0 +1,17 @@
+#pragma once
+
+#include "caps.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// run an interactive session over the connected `fd` until either side ends it.
+// returns the exit code for the app.
+int start_client(int fd);
+
+// the client side of the handshake, including authentication. `caps` gets what both sides
+// support.
+bool client_negotiate(int fd, struct caps *caps);
+
+// the same for connections that are not the user's own session, e.g. the gateway's to its
+// backends: only `features` is asked for, and no ticket, gateway target or window size is used.
+bool client_negotiate_features(int fd, uint32_t features, struct caps *caps);
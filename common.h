@@ -6,9 +6,16 @@ _Static_assert(BUFF_SIZE >= 65536, "Buffer size needs to be able to fit 16 bit l
 #define COOKIE_MIN_SIZE 64
 #define COOKIE_MAX_SIZE 1024
 
+// handshake frames are small. anything bigger is rejected.
+#define HANDSHAKE_BUFF_SIZE 1024
+
 #define NONCE_SIZE 16
 #define ANSWER_SIZE 20 // output of SHA1
+#define ANSWER_V3_SIZE 32 // output of HMAC-SHA256
 
+// version in the base preamble. every peer understands this.
 #define PROTOCOL_VERSION 2
+// highest handshake version we speak, advertised after the base preamble
+#define HANDSHAKE_VERSION 3
 
 typedef unsigned int UINT;
@@ -0,0 +1,469 @@
+#include "exec.h"
+#include "bufpool.h"
+#include "caps.h"
+#include "client.h"
+#include "common.h"
+#include "forward.h"
+#include "profile.h"
+#include "protocol.h"
+#include "ratelimit.h"
+#include "launch.h"
+#include "utils.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// the app's output pipes. the default (64 KiB) is a single frame, so the app would stall
+// every time we go for the socket.
+#define PIPE_SIZE (1024 * 1024)
+
+// status for when the app's exit status is unknown
+#define EXIT_UNKNOWN 255
+
+// write to `fd` after whatever is queued in `q`, queueing what cannot be written now
+static bool queued_write(struct bytequeue *q, int fd, const void *data, size_t len) {
+  if (!q->len) {
+    while (len) {
+      ssize_t wr = write(fd, data, len);
+      if (wr < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN)
+          break;
+        return false;
+      }
+      data = (const uint8_t *)data + wr;
+      len -= wr;
+    }
+  }
+  return !len || bq_append(q, data, len);
+}
+
+// launch `launchreq` with pipes for stdio. `appfds` gets our (nonblocking) ends of the app's
+// stdin, stdout and stderr.
+static pid_t spawn_exec_child(const char *launchreq, int closefd, int appfds[3]) {
+  int pipes[3][2] = {{-1, -1}, {-1, -1}, {-1, -1}};
+  for (int i = 0; i < 3; ++i) {
+    if (pipe(pipes[i]) < 0) {
+      warn("Error creating pipes");
+      goto error;
+    }
+    // the app only gets its ends, as its stdio
+    fcntl(pipes[i][0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipes[i][1], F_SETFD, FD_CLOEXEC);
+  }
+
+  // stdin is the read end of its pipe, stdout and stderr the write ends
+  struct launch_io io = {.stdio = {pipes[0][0], pipes[1][1], pipes[2][1]}, .closefd = closefd, .cgroup = true};
+  pid_t childpid = launch_app(launchreq, &io);
+  if (childpid < 0) {
+    warn("Error launching %s", launchreq);
+    goto error;
+  }
+
+  for (int i = 0; i < 3; ++i) {
+    close(pipes[i][i ? 1 : 0]);
+    appfds[i] = pipes[i][i ? 0 : 1];
+    set_fd_flags(appfds[i], true, O_NONBLOCK);
+#ifdef __linux__
+    // best effort, as it is capped by fs.pipe-max-size
+    if (i)
+      fcntl(appfds[i], F_SETPIPE_SZ, PIPE_SIZE);
+#endif
+  }
+  return childpid;
+
+error:
+  for (int i = 0; i < 3; ++i) {
+    if (pipes[i][0] >= 0) {
+      close(pipes[i][0]);
+      close(pipes[i][1]);
+    }
+  }
+  return -1;
+}
+
+static void close_app_fd(int *fd) {
+  if (*fd >= 0)
+    close(*fd);
+  *fd = -1;
+}
+
+void exec_worker_loop(int commfd, const char *launchreq, const struct session_setup *setup) {
+  enum { APP_IN, APP_OUT, APP_ERR };
+  int appfds[3];
+  struct proto_writer comm;
+  proto_writer_init(&comm, commfd);
+  pid_t pid = spawn_exec_child(launchreq, commfd, appfds);
+  if (pid < 0) {
+    // what a shell does for a command it cannot run
+    char msg[256];
+    int len = snprintf(msg, sizeof(msg), "ptyfwd: Error launching %s: %s\n", launchreq, strerror(errno));
+    int32_t status = 127;
+    proto_write(&comm, len, DT_STDERR, msg);
+    proto_write(&comm, sizeof(status), DT_EXIT, &status);
+    proto_write(&comm, 0, DT_CLOSE, NULL);
+    proto_flush(&comm, true);
+    exit(1);
+  }
+  profile_pin();
+  // the app may close its stdin while we still have data for it
+  signal(SIGPIPE, SIG_IGN);
+  const struct caps *caps = &setup->caps;
+
+  fwd_init(true);
+  fwd_half_close(caps->features & CF_CHAN_EOF);
+  bufpool_init(0);
+  struct proto_reader reader;
+  proto_reader_init(&reader);
+  uint8_t buff[BUFF_SIZE];
+  struct rl_session rls;
+  rl_session_init(&rls, true);
+  // client data not yet written to the app's stdin
+  struct bytequeue toapp = {0};
+  bool input_eof = false;
+
+  enum { PFD_COMM, PFD_IN, PFD_OUT, PFD_ERR, PFD_FWD };
+  struct pollfd pfds[PFD_FWD + FWD_MAX_POLLFDS];
+  pfds[PFD_COMM].fd = commfd;
+  const char *errmsg = NULL;
+  bool stop = false;
+  // the session lasts until the app is done with its output
+  while (!(errmsg || stop) && (appfds[APP_OUT] >= 0 || appfds[APP_ERR] >= 0)) {
+    if (input_eof && !toapp.len)
+      close_app_fd(&appfds[APP_IN]);
+
+    // same flow control as PTY sessions, with the app's stdin in place of mPTY
+    bool congested = proto_pending(&comm) >= PROTO_OUTQ_HIGH;
+    size_t allowed = 0;
+    int throttle_ms = -1;
+    if (congested)
+      rl_pause(&rls);
+    else
+      allowed = rl_allow(&rls, caps_read_size(caps), &throttle_ms);
+    pfds[PFD_COMM].events = (toapp.len < PROTO_OUTQ_HIGH ? POLLIN : 0) | (proto_pending(&comm) ? POLLOUT : 0);
+    pfds[PFD_IN].fd = toapp.len ? appfds[APP_IN] : -1;
+    pfds[PFD_IN].events = POLLOUT;
+    for (int i = APP_OUT; i <= APP_ERR; ++i) {
+      pfds[PFD_IN + i].fd = allowed ? appfds[i] : -1;
+      pfds[PFD_IN + i].events = POLLIN;
+    }
+    int nfwd = fwd_fill_pollfds(pfds + PFD_FWD, !congested);
+    if (poll(pfds, PFD_FWD + nfwd, throttle_ms) < 0) {
+      if (errno == EINTR)
+        continue;
+      errmsg = "Wait error";
+      break;
+    }
+
+    if ((pfds[PFD_COMM].revents & POLLOUT) && !proto_flush(&comm, false)) {
+      errmsg = "Socket write error";
+      break;
+    }
+
+    if ((pfds[PFD_IN].revents & (POLLOUT | POLLERR | POLLHUP)) && !bq_flush(&toapp, appfds[APP_IN])) {
+      // the app is not reading its stdin anymore. neither are we, then.
+      if (errno != EPIPE) {
+        errmsg = "App stdin write error";
+        break;
+      }
+      bq_free(&toapp);
+      close_app_fd(&appfds[APP_IN]);
+    }
+
+    if ((pfds[PFD_COMM].events & POLLIN) && (pfds[PFD_COMM].revents & (POLLIN | POLLERR | POLLHUP))) {
+      if (!proto_reader_fill(&reader, commfd)) {
+        errmsg = "Socket read error";
+        break;
+      }
+      profile_rearm(commfd);
+      uint16_t rdlen;
+      enum data_type pdatatype;
+      const uint8_t *data;
+      while (!(errmsg || stop) && proto_reader_next(&reader, &rdlen, &pdatatype, &data)) {
+        switch (pdatatype) {
+        case DT_REGULAR:
+          // input after the app closed its stdin goes nowhere
+          if (appfds[APP_IN] < 0 || input_eof)
+            break;
+          if (!queued_write(&toapp, appfds[APP_IN], data, rdlen)) {
+            if (errno != EPIPE)
+              errmsg = "App stdin write error";
+            bq_free(&toapp);
+            close_app_fd(&appfds[APP_IN]);
+          }
+          break;
+        case DT_EOF:
+          input_eof = true;
+          break;
+        case DT_CLOSE:
+          stop = true;
+          break;
+        case DT_NONE:
+        case DT_WINCH:
+          break;
+        case DT_CHAN_LISTEN:
+        case DT_CHAN_OPEN:
+        case DT_CHAN_DATA:
+        case DT_CHAN_CREDIT:
+        case DT_CHAN_CLOSE:
+        case DT_CHAN_EOF:
+          if (!fwd_handle_frame(&comm, pdatatype, data, rdlen))
+            errmsg = "Socket write error";
+          break;
+        default:
+          warnx("Unrecognized data type %d", pdatatype);
+          break;
+        }
+      }
+      if (errmsg || stop)
+        break;
+    }
+
+    for (int i = APP_OUT; i <= APP_ERR && !errmsg; ++i) {
+      if (!(pfds[PFD_IN + i].revents & (POLLIN | POLLERR | POLLHUP)))
+        continue;
+      size_t room = allowed;
+      if (room > sizeof(buff))
+        room = sizeof(buff);
+      if (!room)
+        break;
+      ssize_t rd = read(appfds[i], buff, room);
+      if (rd < 0 && (errno == EAGAIN || errno == EINTR))
+        continue;
+      if (rd <= 0) {
+        if (rd < 0)
+          warn("App output read error");
+        close_app_fd(&appfds[i]);
+        continue;
+      }
+      allowed -= rd;
+      rl_consume(&rls, rd);
+      if (!proto_write(&comm, rd, i == APP_OUT ? DT_REGULAR : DT_STDERR, buff))
+        errmsg = "Socket write error";
+    }
+
+    if (!(errmsg || stop) && !fwd_handle_pollfds(&comm, pfds + PFD_FWD, nfwd))
+      errmsg = "Socket write error";
+  }
+
+  if (errmsg)
+    warn("%s", errmsg);
+
+  int32_t status = -1;
+  if (!(errmsg || stop)) {
+    // the app is done with its output. its exit status is the last thing it has for us.
+    int wstatus;
+    if (waitpid(pid, &wstatus, 0) == pid) {
+      status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+      proto_write(&comm, sizeof(status), DT_EXIT, &status);
+    }
+  } else {
+    // what closing mPTY would do
+    kill(-pid, SIGHUP);
+  }
+
+  proto_write(&comm, 0, DT_CLOSE, NULL);
+  proto_flush(&comm, true);
+  proto_writer_release(&comm);
+  proto_reader_release(&reader);
+
+  fwd_close_all();
+  close(commfd);
+  for (int i = 0; i < 3; ++i)
+    close_app_fd(&appfds[i]);
+  bq_free(&toapp);
+
+  rl_pause(&rls);
+  if (status >= 0)
+    warnx("Client disconnected. App exited with status %d.", status);
+  else
+    warnx("Client disconnected.");
+  exit(errmsg ? 1 : 0);
+}
+
+int start_exec_client(int fd) {
+  // nonblocking for stdio
+  for (int i = 0; i <= 2; ++i)
+    set_fd_flags(i, true, O_NONBLOCK);
+  set_fd_flags(fd, true, O_NONBLOCK);
+
+  struct caps caps;
+  if (!client_negotiate(fd, &caps)) {
+    warnx("Server negotiation failed.");
+    return EXIT_UNKNOWN;
+  }
+  struct proto_writer comm;
+  proto_writer_init(&comm, fd);
+  if (!(caps.features & CF_EXEC)) {
+    // it has launched the app on a PTY already
+    warnx("Server does not support exec sessions.");
+    proto_write(&comm, 0, DT_CLOSE, NULL);
+    proto_flush(&comm, true);
+    proto_writer_release(&comm);
+    close(fd);
+    return EXIT_UNKNOWN;
+  }
+  if (!(caps.features & CF_FORWARD) && fwd_close_all())
+    warnx("Server does not support forwarding. Forwards are disabled.");
+  fwd_half_close(caps.features & CF_CHAN_EOF);
+
+  int sig_to_handle[] = {SIGINT, SIGTERM, SIGHUP};
+  int sigfd = signal_fd(sig_to_handle, sizeof(sig_to_handle) / sizeof(int));
+  if (sigfd < 0)
+    err(1, "Error installing signal handlers");
+  if (!fwd_start(&comm))
+    err(1, "Error requesting remote forwards");
+  struct proto_reader reader;
+  proto_reader_init(&reader);
+  uint8_t buff[BUFF_SIZE];
+
+  // the app's output that could not be written without blocking, by our fd
+  struct bytequeue outq[3] = {{0}};
+  int32_t status = EXIT_UNKNOWN;
+  bool input_eof = false;
+
+  enum { PFD_COMM, PFD_STDIN, PFD_STDOUT, PFD_STDERR, PFD_SIG, PFD_FWD };
+  struct pollfd pfds[PFD_FWD + FWD_MAX_POLLFDS];
+  pfds[PFD_COMM].fd = fd;
+  pfds[PFD_STDOUT].fd = 1;
+  pfds[PFD_STDERR].fd = 2;
+  pfds[PFD_SIG].fd = sigfd;
+  pfds[PFD_SIG].events = POLLIN;
+
+  const char *errmsg = NULL;
+  bool stop = false;
+  // the server is gone after its DT_CLOSE, and writing to it would get us SIGPIPE
+  bool server_closed = false;
+  while (!(errmsg || stop)) {
+    bool congested = proto_pending(&comm) >= PROTO_OUTQ_HIGH;
+    bool backlog = outq[1].len >= PROTO_OUTQ_HIGH || outq[2].len >= PROTO_OUTQ_HIGH;
+    pfds[PFD_COMM].events = (backlog ? 0 : POLLIN) | (proto_pending(&comm) ? POLLOUT : 0);
+    pfds[PFD_STDIN].fd = input_eof ? -1 : 0;
+    pfds[PFD_STDIN].events = congested ? 0 : POLLIN;
+    pfds[PFD_STDOUT].events = outq[1].len ? POLLOUT : 0;
+    pfds[PFD_STDERR].events = outq[2].len ? POLLOUT : 0;
+    int nfwd = fwd_fill_pollfds(pfds + PFD_FWD, !congested);
+    if (poll(pfds, PFD_FWD + nfwd, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      errmsg = "Wait error";
+      break;
+    }
+
+    if (pfds[PFD_SIG].revents & POLLIN) {
+      while (signal_fd_next(sigfd))
+        stop = true;
+      if (stop) {
+        warnx("Requested graceful stop");
+        break;
+      }
+    }
+
+    if ((pfds[PFD_COMM].revents & POLLOUT) && !proto_flush(&comm, false)) {
+      errmsg = "Socket write error";
+      break;
+    }
+    for (int i = 1; i <= 2; ++i) {
+      if ((pfds[PFD_STDIN + i].revents & (POLLOUT | POLLERR | POLLHUP)) && !bq_flush(&outq[i], i))
+        errmsg = i == 1 ? "stdout write error" : "stderr write error";
+    }
+    if (errmsg)
+      break;
+
+    if ((pfds[PFD_COMM].events & POLLIN) && (pfds[PFD_COMM].revents & (POLLIN | POLLERR | POLLHUP))) {
+      if (!proto_reader_fill(&reader, fd)) {
+        errmsg = "Socket read error";
+        break;
+      }
+      profile_rearm(fd);
+      uint16_t rdlen;
+      enum data_type pdatatype;
+      const uint8_t *data;
+      while (!(errmsg || stop) && proto_reader_next(&reader, &rdlen, &pdatatype, &data)) {
+        switch (pdatatype) {
+        case DT_REGULAR:
+          if (!queued_write(&outq[1], 1, data, rdlen))
+            errmsg = "stdout write error";
+          break;
+        case DT_STDERR:
+          if (!queued_write(&outq[2], 2, data, rdlen))
+            errmsg = "stderr write error";
+          break;
+        case DT_EXIT:
+          if (rdlen == sizeof(status))
+            memcpy(&status, data, sizeof(status));
+          break;
+        case DT_CLOSE:
+          stop = server_closed = true;
+          break;
+        case DT_NONE:
+          break;
+        case DT_CHAN_OPEN:
+        case DT_CHAN_DATA:
+        case DT_CHAN_CREDIT:
+        case DT_CHAN_CLOSE:
+        case DT_CHAN_EOF:
+          if (!fwd_handle_frame(&comm, pdatatype, data, rdlen))
+            errmsg = "Socket write error";
+          break;
+        default:
+          warnx("Unrecognized data type %d", pdatatype);
+          break;
+        }
+      }
+      if (errmsg || stop)
+        break;
+    }
+
+    if ((pfds[PFD_STDIN].events & POLLIN) && (pfds[PFD_STDIN].revents & (POLLIN | POLLERR | POLLHUP))) {
+      ssize_t rd = read(0, buff, caps_read_size(&caps));
+      if (rd < 0 && (errno == EINTR || errno == EAGAIN)) {
+        // try again later
+      } else if (rd < 0) {
+        errmsg = "stdin read error";
+        break;
+      } else if (!proto_write(&comm, rd, rd ? DT_REGULAR : DT_EOF, buff)) {
+        errmsg = "Socket write error";
+        break;
+      } else if (!rd) {
+        input_eof = true;
+      }
+    }
+
+    if (!fwd_handle_pollfds(&comm, pfds + PFD_FWD, nfwd))
+      errmsg = "Socket write error";
+  }
+
+  if (errmsg)
+    warn("%s", errmsg);
+
+  // don't forget to let server know if we're stopping
+  if (!server_closed) {
+    proto_write(&comm, 0, DT_CLOSE, NULL);
+    proto_flush(&comm, true);
+  }
+  proto_writer_release(&comm);
+  proto_reader_release(&reader);
+
+  // whatever our stdout and stderr have not taken yet
+  for (int i = 1; i <= 2; ++i) {
+    while (outq[i].len && bq_flush(&outq[i], i) && outq[i].len) {
+      struct pollfd pfd = {.fd = i, .events = POLLOUT};
+      poll(&pfd, 1, -1);
+    }
+    bq_free(&outq[i]);
+  }
+
+  fwd_close_all();
+  close(fd);
+  close(sigfd);
+  return errmsg ? EXIT_UNKNOWN : status;
+}
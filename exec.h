@@ -0,0 +1,20 @@
+#pragma once
+
+#include "server.h"
+
+// exec sessions (-E): for automation, the app runs on pipes instead of a PTY, so its output
+// reaches the client byte for byte, without the line discipline's CRLF conversion, echo or
+// canonical mode limits in between.
+//  - the app's stdout goes out as DT_REGULAR and its stderr as DT_STDERR, in frames as large as
+//    the connection allows, and the client writes them to its own stdout and stderr.
+//  - the client's stdin goes to the app's stdin as DT_REGULAR. DT_EOF closes it.
+//  - once the app has closed its stdout and stderr, the server sends its exit status as DT_EXIT
+//    (the exit code, or 128 + the signal that killed it), and the client exits with it.
+// the session is offered by the forking server only, as CF_EXEC. if the client leaves first,
+// the app gets SIGHUP, like it would from a PTY.
+
+// server side, in the session process. never returns.
+void exec_worker_loop(int commfd, const char *launchreq, const struct session_setup *setup);
+
+// client side. returns the app's exit status, or 255 if the session ended without one.
+int start_exec_client(int fd);
@@ -0,0 +1,721 @@
+#include "fanout.h"
+#include <err.h>
+#include <errno.h>
+
+#ifdef __linux__
+
+#include "bufpool.h"
+#include "caps.h"
+#include "client.h"
+#include "forward.h"
+#include "protocol.h"
+#include "socks.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+#define MAX_HANDSHAKERS 16
+#define DEFAULT_PAR 32
+// a connect and handshake that takes longer than this is aborted
+#define HANDSHAKE_TIMEOUT_MS 10000
+// between attempts to connect to a Unix socket with a full backlog
+#define BACKLOG_RETRY_MS 10
+// how often stuck handshakes and timed out targets are looked for
+#define CHECK_INTERVAL_MS 200
+// our stdin is read to the end before the first target starts. it had better be a command.
+#define INPUT_MAX (16 * 1024 * 1024)
+// the output of a target beyond this is dropped
+#define OUTPUT_MAX (64 * 1024 * 1024)
+// output of all targets kept in memory at once. beyond this, it goes to temporary files.
+#define OUTPUT_MEM_MAX (256 * 1024 * 1024)
+// in prefix mode, a line longer than this is broken up
+#define LINE_MAX_LEN 65536
+// input goes out in frames of this size
+#define INPUT_CHUNK 16384
+
+struct fo_config {
+  char *targets;
+  unsigned par;
+  unsigned timeout_s;
+  bool prefix;
+};
+
+// as the main thread sees it. a target is queued until its handshake is over.
+enum fo_state { FS_QUEUED, FS_RUNNING, FS_DONE };
+
+struct fo_target {
+  char *name;
+  char *spec;
+  // set by the handshake thread, before it hands the target over
+  int fd;
+  const char *error;
+  int errnum;
+  uint64_t start_ns;
+  uint64_t connected_ns;
+  // the rest belongs to the main thread
+  enum fo_state state;
+  struct proto_reader reader;
+  // how much of the input has been sent, and the frames the socket has not taken yet
+  size_t inoff;
+  bool eof_sent;
+  struct bytequeue toserver;
+  // stdout and stderr: all of it, or only the partial line in prefix mode
+  struct bytequeue out[2];
+  // the rest of stdout and stderr, once they no longer fit in memory
+  FILE *spill[2];
+  size_t outlen;
+  bool truncated;
+  bool has_status;
+  int32_t status;
+  uint64_t end_ns;
+};
+
+// the target a handshake thread is working on, so that it can be aborted
+struct fo_handshaker {
+  pthread_t thread;
+  int fd;
+  uint64_t deadline;
+};
+
+static struct fo_config cfg;
+static struct fo_target *targets;
+static int ntargets;
+static struct bytequeue input;
+// output buffered by all targets
+static size_t outmem;
+
+static int epfd;
+// handshake threads -> main thread: indices of the targets that are ready (or failed)
+static int donefds[2];
+static int done_marker, signal_marker;
+static int ndone;
+
+// protects the rest
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_cond = PTHREAD_COND_INITIALIZER;
+static struct fo_handshaker handshakers[MAX_HANDSHAKERS];
+static int nhandshakers;
+// the next target to start
+static int next;
+// targets started and not done yet
+static unsigned inflight;
+// set by stop_all(). the handshake threads give up on their targets.
+static bool aborted;
+
+static bool parse_spec(const char *spec) {
+  cfg = (struct fo_config){.par = DEFAULT_PAR};
+  char *buff = strdup(spec);
+  if (!buff)
+    return false;
+  bool ok = true;
+  char *save;
+  for (char *tok = strtok_r(buff, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    if (sscanf(tok, "par=%u", &cfg.par) == 1 || sscanf(tok, "timeout=%u", &cfg.timeout_s) == 1)
+      continue;
+    if (!strncmp(tok, "targets=", 8)) {
+      free(cfg.targets);
+      cfg.targets = strdup(tok + 8);
+      continue;
+    }
+    if (!strcmp(tok, "prefix")) {
+      cfg.prefix = true;
+      continue;
+    }
+    warnx("Unknown fan-out option '%s'", tok);
+    ok = false;
+  }
+  free(buff);
+  if (ok && (!cfg.targets || !*cfg.targets || !cfg.par)) {
+    warnx("Invalid fan-out options. A target file is required.");
+    ok = false;
+  }
+  return ok;
+}
+
+static bool load_targets(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    warn("Cannot open target file");
+    return false;
+  }
+
+  char line[512];
+  int lineno = 0;
+  int cap = 0;
+  bool success = false;
+  while (fgets(line, sizeof(line), f)) {
+    ++lineno;
+    line[strcspn(line, "\r\n")] = 0;
+    if (!*line || *line == '#')
+      continue;
+
+    // the name is optional, and endpoint specs have no '='
+    char *spec = strchr(line, '=');
+    char *name = line;
+    if (spec)
+      *spec++ = 0;
+    else
+      spec = line;
+    if (!*name || !*spec) {
+      warnx("%s:%d: expected [<name>=]<target spec>", path, lineno);
+      goto end;
+    }
+
+    if (ntargets == cap && !(targets = realloc(targets, (cap += 256) * sizeof(*targets)))) {
+      warn("Error loading target file");
+      goto end;
+    }
+    struct fo_target *t = targets + ntargets;
+    memset(t, 0, sizeof(*t));
+    t->fd = -1;
+    if (!(t->name = strdup(name)) || !(t->spec = strdup(spec))) {
+      warn("Error loading target file");
+      goto end;
+    }
+    ++ntargets;
+  }
+  success = true;
+
+end:
+  fclose(f);
+  return success;
+}
+
+static bool read_input() {
+  uint8_t buff[BUFF_SIZE];
+  for (;;) {
+    ssize_t rd = read(0, buff, sizeof(buff));
+    if (rd < 0 && errno == EINTR)
+      continue;
+    if (rd < 0) {
+      warn("stdin read error");
+      return false;
+    }
+    if (!rd)
+      return true;
+    if (input.len + rd > INPUT_MAX) {
+      warnx("Input is too large for fan-out.");
+      return false;
+    }
+    if (!bq_append(&input, buff, rd)) {
+      warn("Error reading input");
+      return false;
+    }
+  }
+}
+
+static void target_fail(struct fo_target *t, const char *error, int errnum) {
+  t->error = error;
+  t->errnum = errnum;
+}
+
+static bool is_aborted() {
+  pthread_mutex_lock(&lock);
+  bool ret = aborted;
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
+
+// handshake thread: connect to the target and set up an exec session. `t->fd` is the connected
+// socket, or -1 with `t->error` set.
+static void target_connect(struct fo_handshaker *hs, struct fo_target *t) {
+  t->start_ns = mono_ns();
+  int fd = -1;
+  // a Unix socket whose backlog is full does not wait for room
+  while (!is_aborted() && (fd = create_spec_client_async(t->spec)) < 0 && errno == EAGAIN &&
+         mono_ns() - t->start_ns < HANDSHAKE_TIMEOUT_MS * 1000000ull)
+    usleep(BACKLOG_RETRY_MS * 1000);
+  if (fd < 0 && is_aborted()) {
+    target_fail(t, "interrupted", 0);
+    return;
+  }
+  if (fd < 0) {
+    target_fail(t, "connect", errno);
+    return;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  // the main thread shuts the socket down if we take too long. stop_all() may have aborted the
+  // handshakes in the meantime, and must not find our socket afterwards.
+  pthread_mutex_lock(&lock);
+  bool stopped = aborted;
+  if (!stopped) {
+    hs->fd = fd;
+    hs->deadline = t->start_ns + HANDSHAKE_TIMEOUT_MS * 1000000ull;
+  }
+  pthread_mutex_unlock(&lock);
+  if (stopped) {
+    target_fail(t, "interrupted", 0);
+    close(fd);
+    return;
+  }
+
+  struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+  int soerr = 0;
+  socklen_t soerrlen = sizeof(soerr);
+  int ready = poll(&pfd, 1, HANDSHAKE_TIMEOUT_MS);
+  bool connected = false;
+  struct caps caps;
+  if (ready <= 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &soerrlen) < 0 || soerr) {
+    target_fail(t, "connect", soerr ? soerr : ready ? errno : ETIMEDOUT);
+  } else {
+    connected = true;
+    set_fd_flags(fd, false, O_NONBLOCK);
+    if (is_aborted())
+      target_fail(t, "interrupted", 0);
+    else if (!client_negotiate(fd, &caps))
+      target_fail(t, "handshake failed", 0);
+    else if (!(caps.features & CF_EXEC))
+      target_fail(t, "server does not support exec sessions", 0);
+  }
+
+  pthread_mutex_lock(&lock);
+  // the handshake failed because we shut it down
+  if (connected && t->error && aborted)
+    target_fail(t, "interrupted", 0);
+  else if (connected && t->error && mono_ns() >= hs->deadline)
+    target_fail(t, "handshake timed out", 0);
+  hs->fd = -1;
+  pthread_mutex_unlock(&lock);
+
+  if (t->error) {
+    if (connected) {
+      // the server may have launched the app already
+      uint8_t frame[PROTO_HDR_MAX];
+      write(fd, frame, proto_encode(frame, 0, DT_CLOSE, NULL));
+    }
+    close(fd);
+    return;
+  }
+  t->connected_ns = mono_ns();
+  t->fd = fd;
+}
+
+static void *handshaker_main(void *arg) {
+  struct fo_handshaker *hs = arg;
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (next < ntargets && inflight >= cfg.par)
+      pthread_cond_wait(&slot_cond, &lock);
+    if (next >= ntargets)
+      break;
+    struct fo_target *t = targets + next++;
+    ++inflight;
+    pthread_mutex_unlock(&lock);
+
+    target_connect(hs, t);
+    uint32_t idx = t - targets;
+    // a pipe write this small is atomic
+    if (write(donefds[1], &idx, sizeof(idx)) != sizeof(idx))
+      err(1, "Error handing over target");
+
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// abort the handshakes that take too long. the blocked thread fails right away.
+static void check_handshakes(uint64_t now) {
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < nhandshakers; ++i) {
+    if (handshakers[i].fd >= 0 && now >= handshakers[i].deadline)
+      shutdown(handshakers[i].fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void print_line(struct fo_target *t, int stream, const void *data, size_t len, bool newline) {
+  struct bytequeue *q = t->out + stream;
+  struct iovec iov[] = {
+    {.iov_base = t->name, .iov_len = strlen(t->name)},
+    {.iov_base = ": ", .iov_len = 2},
+    {.iov_base = q->buff + q->off, .iov_len = q->len},
+    {.iov_base = (void *)data, .iov_len = len},
+    {.iov_base = "\n", .iov_len = newline},
+  };
+  writev_all(stream + 1, iov, sizeof(iov) / sizeof(*iov));
+  q->off = q->len = 0;
+}
+
+// output of the target's app on `stream` (0 for stdout, 1 for stderr)
+static void target_output(struct fo_target *t, int stream, const uint8_t *data, size_t len) {
+  struct bytequeue *q = t->out + stream;
+  if (!cfg.prefix) {
+    if (t->outlen + len > OUTPUT_MAX) {
+      t->truncated = true;
+      return;
+    }
+    t->outlen += len;
+    // once a stream spills, the rest of it follows, to keep it in order
+    FILE **spill = t->spill + stream;
+    if (!*spill && outmem + len > OUTPUT_MEM_MAX && !(*spill = tmpfile())) {
+      if (!t->truncated)
+        warn("%s: error creating a temporary file for the output", t->name);
+      t->truncated = true;
+      return;
+    }
+    if (*spill) {
+      if (fwrite(data, 1, len, *spill) != len)
+        t->truncated = true;
+    } else if (bq_append(q, data, len)) {
+      outmem += len;
+    } else {
+      t->truncated = true;
+    }
+    return;
+  }
+
+  while (len) {
+    const uint8_t *nl = memchr(data, '\n', len);
+    size_t linelen = nl ? nl + 1 - data : len;
+    if (nl) {
+      print_line(t, stream, data, linelen, false);
+    } else if (q->len + len >= LINE_MAX_LEN) {
+      print_line(t, stream, data, len, true);
+    } else if (!bq_append(q, data, len)) {
+      print_line(t, stream, data, len, true);
+    }
+    data += linelen;
+    len -= linelen;
+  }
+}
+
+// copies what was spilled to `fd`. returns whether it ended with a newline.
+static bool print_spill(FILE *fp, int fd, bool newline) {
+  uint8_t buff[65536];
+  size_t rd;
+  rewind(fp);
+  while ((rd = fread(buff, 1, sizeof(buff), fp))) {
+    write_all(fd, buff, rd);
+    newline = buff[rd - 1] == '\n';
+  }
+  fclose(fp);
+  return newline;
+}
+
+// what is left of the target's output, now that it is done
+static void target_print(struct fo_target *t) {
+  bool header = !cfg.prefix && (t->out[0].len || t->out[1].len || t->spill[0] || t->spill[1]);
+  if (header) {
+    // stdout and stderr of a target go out together, under its name
+    char hdr[512];
+    int len = snprintf(hdr, sizeof(hdr), "==> %s <==\n", t->name);
+    write_all(1, hdr, len < sizeof(hdr) ? len : sizeof(hdr) - 1);
+  }
+  for (int i = 0; i < 2; ++i) {
+    struct bytequeue *q = t->out + i;
+    if (cfg.prefix) {
+      if (q->len)
+        print_line(t, i, NULL, 0, true);
+    } else {
+      bool newline = true;
+      if (q->len) {
+        write_all(i + 1, q->buff + q->off, q->len);
+        newline = q->buff[q->off + q->len - 1] == '\n';
+        outmem -= q->len;
+      }
+      if (t->spill[i])
+        newline = print_spill(t->spill[i], i + 1, newline);
+      t->spill[i] = NULL;
+      if (!newline)
+        write_all(i + 1, "\n", 1);
+    }
+    bq_free(q);
+  }
+  if (t->truncated)
+    warnx("%s: output truncated", t->name);
+}
+
+static void target_done(struct fo_target *t, bool send_close) {
+  if (t->fd >= 0) {
+    if (send_close) {
+      uint8_t frame[PROTO_HDR_MAX];
+      write(t->fd, frame, proto_encode(frame, 0, DT_CLOSE, NULL));
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, t->fd, NULL);
+    close(t->fd);
+    t->fd = -1;
+  }
+  bufpool_put(t->reader.buff, t->reader.cap);
+  proto_reader_init(&t->reader);
+  bq_free(&t->toserver);
+  t->end_ns = mono_ns();
+  if (t->state != FS_QUEUED) {
+    pthread_mutex_lock(&lock);
+    --inflight;
+    pthread_cond_signal(&slot_cond);
+    pthread_mutex_unlock(&lock);
+  }
+  t->state = FS_DONE;
+  ++ndone;
+  target_print(t);
+}
+
+// send as much of the input as the socket takes, then EOF
+static bool target_send(struct fo_target *t) {
+  for (;;) {
+    if (t->toserver.len) {
+      if (!bq_flush(&t->toserver, t->fd))
+        return false;
+      if (t->toserver.len)
+        break;
+    }
+    if (t->eof_sent)
+      break;
+    size_t len = input.len - t->inoff;
+    if (len > INPUT_CHUNK)
+      len = INPUT_CHUNK;
+    uint8_t frame[PROTO_HDR_MAX + INPUT_CHUNK];
+    size_t flen = proto_encode(frame, len, len ? DT_REGULAR : DT_EOF, input.buff + input.off + t->inoff);
+    t->inoff += len;
+    t->eof_sent = !len;
+    if (!bq_append(&t->toserver, frame, flen))
+      return false;
+  }
+  struct epoll_event ev = {.events = EPOLLIN | (t->eof_sent && !t->toserver.len ? 0 : EPOLLOUT), .data.ptr = t};
+  return !epoll_ctl(epfd, EPOLL_CTL_MOD, t->fd, &ev);
+}
+
+// the handshake thread is done with the target
+static void target_start(struct fo_target *t, bool stopping) {
+  t->state = FS_RUNNING;
+  if (stopping)
+    target_fail(t, "interrupted", 0);
+  if (t->fd < 0 || stopping) {
+    target_done(t, true);
+    return;
+  }
+  set_fd_flags(t->fd, true, O_NONBLOCK);
+  proto_reader_init(&t->reader);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = t};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, t->fd, &ev) < 0 || !target_send(t)) {
+    target_fail(t, "write", errno);
+    target_done(t, true);
+  }
+}
+
+static void target_read(struct fo_target *t) {
+  if (!proto_reader_fill(&t->reader, t->fd)) {
+    target_fail(t, "connection lost", errno);
+    target_done(t, false);
+    return;
+  }
+  uint16_t len;
+  enum data_type type;
+  const uint8_t *data;
+  while (proto_reader_next(&t->reader, &len, &type, &data)) {
+    switch (type) {
+    case DT_REGULAR:
+      target_output(t, 0, data, len);
+      break;
+    case DT_STDERR:
+      target_output(t, 1, data, len);
+      break;
+    case DT_EXIT:
+      if (len == sizeof(t->status)) {
+        memcpy(&t->status, data, sizeof(t->status));
+        t->has_status = true;
+      }
+      break;
+    case DT_CLOSE:
+      if (!t->has_status)
+        target_fail(t, "session ended without exit status", 0);
+      target_done(t, false);
+      return;
+    default:
+      break;
+    }
+  }
+  proto_reader_release(&t->reader);
+}
+
+// targets not started yet won't be, and running ones are ended
+static void stop_all() {
+  pthread_mutex_lock(&lock);
+  int first = next;
+  next = ntargets;
+  // handshakes in progress are aborted
+  aborted = true;
+  for (int i = 0; i < nhandshakers; ++i)
+    handshakers[i].deadline = 0;
+  pthread_mutex_unlock(&lock);
+  check_handshakes(0);
+
+  for (int i = first; i < ntargets; ++i) {
+    target_fail(targets + i, "not started", 0);
+    target_done(targets + i, false);
+  }
+  for (int i = 0; i < ntargets; ++i) {
+    if (targets[i].state == FS_RUNNING) {
+      target_fail(targets + i, "interrupted", 0);
+      target_done(targets + i, true);
+    }
+  }
+}
+
+static void check_timeouts(uint64_t now) {
+  uint64_t timeout_ns = cfg.timeout_s * 1000000000ull;
+  for (int i = 0; i < ntargets; ++i) {
+    struct fo_target *t = targets + i;
+    if (t->state == FS_RUNNING && now - t->connected_ns >= timeout_ns) {
+      target_fail(t, "timed out", 0);
+      target_done(t, true);
+    }
+  }
+}
+
+// a line per target, and the totals
+static int print_summary(uint64_t elapsed_ns) {
+  int width = 6;
+  for (int i = 0; i < ntargets; ++i) {
+    int len = strlen(targets[i].name);
+    if (len > width)
+      width = len > 40 ? 40 : len;
+  }
+  int ok = 0, nonzero = 0, failed = 0;
+  fprintf(stderr, "%-*s %6s %12s %12s\n", width, "target", "status", "connect(ms)", "total(ms)");
+  for (int i = 0; i < ntargets; ++i) {
+    struct fo_target *t = targets + i;
+    double total_ms = t->start_ns ? (t->end_ns - t->start_ns) / 1e6 : 0;
+    bool success = t->has_status && !t->error;
+    char status[16] = "-";
+    char connect_ms[32] = "-";
+    if (success)
+      snprintf(status, sizeof(status), "%d", t->status);
+    if (t->connected_ns)
+      snprintf(connect_ms, sizeof(connect_ms), "%.1f", (t->connected_ns - t->start_ns) / 1e6);
+    fprintf(stderr, "%-*s %6s %12s %12.1f\n", width, t->name, status, connect_ms, total_ms);
+    if (success) {
+      ++*(t->status ? &nonzero : &ok);
+      continue;
+    }
+    ++failed;
+    if (t->errnum)
+      fprintf(stderr, "  %s: %s\n", t->error, strerror(t->errnum));
+    else
+      fprintf(stderr, "  %s\n", t->error ? t->error : "no exit status");
+  }
+  fprintf(stderr, "%d targets in %.1f s: %d exited with 0, %d with another status, %d failed\n", ntargets,
+    elapsed_ns / 1e9, ok, nonzero, failed);
+  return ok == ntargets ? 0 : 1;
+}
+
+int start_fanout(const char *spec) {
+  if (!parse_spec(spec) || !load_targets(cfg.targets))
+    return 1;
+  if (!ntargets) {
+    warnx("No targets in the target file.");
+    return 1;
+  }
+  if (fwd_close_all())
+    warnx("Forwards are not available in fan-out mode.");
+  if (!read_input())
+    return 1;
+
+  // a socket per target in progress
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  bufpool_init(0);
+
+  // signals are only received through the fd. block them before creating threads
+  // so that every thread inherits the mask.
+  int sigs[] = {SIGINT, SIGTERM, SIGHUP};
+  int sigfd = signal_fd(sigs, sizeof(sigs) / sizeof(*sigs));
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (sigfd < 0 || epfd < 0 || pipe2(donefds, O_CLOEXEC) < 0) {
+    warn("Error setting up event loop");
+    return 1;
+  }
+  set_fd_flags(donefds[0], true, O_NONBLOCK);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &done_marker};
+  struct epoll_event sigev = {.events = EPOLLIN, .data.ptr = &signal_marker};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, donefds[0], &ev) < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &sigev) < 0) {
+    warn("Error setting up event loop");
+    return 1;
+  }
+
+  uint64_t start_ns = mono_ns();
+  nhandshakers = cfg.par < MAX_HANDSHAKERS ? cfg.par : MAX_HANDSHAKERS;
+  if (nhandshakers > ntargets)
+    nhandshakers = ntargets;
+  for (int i = 0; i < nhandshakers; ++i) {
+    handshakers[i].fd = -1;
+    if ((errno = pthread_create(&handshakers[i].thread, NULL, handshaker_main, handshakers + i)))
+      err(1, "Error starting handshake thread");
+  }
+
+  bool stopping = false;
+  uint64_t next_check = 0;
+  struct epoll_event events[MAX_EVENTS];
+  while (ndone < ntargets) {
+    int nev = epoll_wait(epfd, events, MAX_EVENTS, CHECK_INTERVAL_MS);
+    if (nev < 0 && errno != EINTR)
+      err(1, "Wait error");
+    for (int i = 0; i < nev; ++i) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == &done_marker) {
+        uint32_t idx;
+        while (read(donefds[0], &idx, sizeof(idx)) == sizeof(idx))
+          target_start(targets + idx, stopping);
+      } else if (ptr == &signal_marker) {
+        while (signal_fd_next(sigfd))
+          stopping = true;
+        if (stopping) {
+          warnx("Requested graceful stop");
+          stop_all();
+        }
+      } else {
+        struct fo_target *t = ptr;
+        // it may have been done with by an earlier event
+        if (t->state != FS_RUNNING)
+          continue;
+        if ((events[i].events & EPOLLOUT) && !target_send(t)) {
+          target_fail(t, "write", errno);
+          target_done(t, false);
+          continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+          target_read(t);
+      }
+    }
+
+    uint64_t now = mono_ns();
+    if (now >= next_check) {
+      check_handshakes(now);
+      if (cfg.timeout_s)
+        check_timeouts(now);
+      next_check = now + CHECK_INTERVAL_MS * 1000000ull;
+    }
+  }
+
+  for (int i = 0; i < nhandshakers; ++i)
+    pthread_join(handshakers[i].thread, NULL);
+  return print_summary(mono_ns() - start_ns);
+}
+
+#else
+
+int start_fanout(const char *spec) {
+  errno = ENOTSUP;
+  warn("Fan-out");
+  return 1;
+}
+
+#endif
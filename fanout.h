@@ -0,0 +1,21 @@
+#pragma once
+
+// fan-out (-F): run the same command on many servers at once, from a single event loop.
+// every target gets an exec session (see exec.h), so their app should be a shell: our stdin is
+// read to the end first, and then given to each target's app as its stdin, followed by EOF.
+// sessions are set up by a few handshake threads, while the main thread relays all of the
+// running ones. each target's output is kept in buffers of its own, so the output of different
+// targets never interleaves mid-line. past 256 MiB for all targets, the buffers go on in
+// temporary files.
+//
+// `spec` is a comma separated list of:
+//  - targets=<file>: the targets, one per line as [<name>=]<target_spec>, where <target_spec>
+//    is an endpoint spec (see socks.h). lines starting with '#' are ignored. (required)
+//  - par=<n>: how many targets can be in progress at once (32)
+//  - timeout=<seconds>: end the session of a target that has not finished after this long,
+//    counting from when it was connected (no limit)
+//  - prefix: print each line of output as it comes, prefixed with the target's name, instead
+//    of all of a target's output at once when it is done
+// a line for each target, with its exit status and timing, is printed on stderr at the end.
+// returns 0 if the app exited with 0 on every target, 1 otherwise. supported only on Linux.
+int start_fanout(const char *spec);
@@ -0,0 +1,505 @@
+#include "forward.h"
+#include "socks.h"
+#include "utils.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SPEC_MAX 256
+
+// server allocated channel IDs have this bit set, so that both sides can open channels
+// without having to agree on the ID first.
+#define CHAN_ID_SERVER 0x80000000u
+
+// the maximum channel data in a single frame
+#define CHAN_FRAME_DATA (0xFFFF - sizeof(uint32_t))
+
+struct fwd_listener {
+  int fd; // -1 for client side remote forwards (the listener is at the server)
+  uint32_t id;
+  char listen[SPEC_MAX];
+  char target[SPEC_MAX]; // empty for server side listeners
+};
+
+struct fwd_chan {
+  int fd; // -1 if slot is unused
+  uint32_t id;
+  // bytes we may still send to the peer
+  uint32_t credit;
+  // bytes written to our local socket but not yet credited back to the peer
+  uint32_t consumed;
+  // data from peer that cannot be written to the local socket yet
+  uint8_t *pend;
+  uint32_t pend_off;
+  uint32_t pend_len;
+  // peer has closed the channel: close the local socket once `pend` is drained
+  bool closing;
+  // half close (CF_CHAN_EOF). we read EOF from the local socket and told the peer.
+  bool local_eof;
+  // the peer sent DT_CHAN_EOF: shut down the local socket's write side once `pend` is drained
+  bool peer_eof;
+  // our connection to the target is still in progress (see handle_open)
+  bool connecting;
+};
+
+enum pollent_kind { PK_LISTENER, PK_CHAN };
+
+static struct {
+  bool server;
+  // the peer takes DT_CHAN_EOF
+  bool half_close;
+  uint32_t next_chan_id;
+  uint32_t next_listener_id;
+  int nlisteners;
+  struct fwd_listener listeners[FWD_MAX_LISTENERS];
+  struct fwd_chan chans[FWD_MAX_CHANNELS];
+  // maps pollfds filled in `fwd_fill_pollfds` back to the listener/channel
+  struct {
+    enum pollent_kind kind;
+    int idx;
+  } pollmap[FWD_MAX_POLLFDS];
+} fwd = {.next_chan_id = 1, .next_listener_id = 1};
+
+static uint8_t cbuff[CHAN_FRAME_DATA];
+
+static bool split_spec(const char *spec, struct fwd_listener *l) {
+  const char *eq = strchr(spec, '=');
+  if (!eq || eq == spec || !eq[1] || eq - spec >= SPEC_MAX || strlen(eq + 1) >= SPEC_MAX) {
+    warnx("Invalid forward spec '%s'. Expected '<listen spec>=<target spec>'.", spec);
+    return false;
+  }
+  memcpy(l->listen, spec, eq - spec);
+  l->listen[eq - spec] = 0;
+  strcpy(l->target, eq + 1);
+  return true;
+}
+
+static struct fwd_listener *new_listener() {
+  if (fwd.nlisteners >= FWD_MAX_LISTENERS) {
+    warnx("Too many forward listeners");
+    return NULL;
+  }
+  struct fwd_listener *l = &fwd.listeners[fwd.nlisteners];
+  memset(l, 0, sizeof(*l));
+  l->fd = -1;
+  return l;
+}
+
+void fwd_init(bool server) {
+  fwd.server = server;
+  for (int i = 0; i < FWD_MAX_CHANNELS; ++i)
+    fwd.chans[i].fd = -1;
+}
+
+void fwd_half_close(bool enabled) { fwd.half_close = enabled; }
+
+bool fwd_add_local(const char *spec) {
+  struct fwd_listener *l = new_listener();
+  if (!l || !split_spec(spec, l))
+    return false;
+  l->fd = create_spec_server(l->listen);
+  if (l->fd < 0) {
+    warn("Error listening on %s", l->listen);
+    return false;
+  }
+  set_fd_flags(l->fd, true, O_NONBLOCK);
+  l->id = fwd.next_listener_id++;
+  ++fwd.nlisteners;
+  return true;
+}
+
+bool fwd_add_remote(const char *spec) {
+  struct fwd_listener *l = new_listener();
+  if (!l || !split_spec(spec, l))
+    return false;
+  l->id = fwd.next_listener_id++;
+  ++fwd.nlisteners;
+  return true;
+}
+
+bool fwd_start(struct proto_writer *comm) {
+  for (int i = 0; i < fwd.nlisteners; ++i) {
+    struct fwd_listener *l = &fwd.listeners[i];
+    if (l->fd >= 0)
+      continue;
+    struct iovec iov[2] = {{&l->id, sizeof(l->id)}, {l->listen, strlen(l->listen)}};
+    if (!proto_writev(comm, DT_CHAN_LISTEN, iov, 2))
+      return false;
+  }
+  return true;
+}
+
+static struct fwd_chan *find_chan(uint32_t id) {
+  for (int i = 0; i < FWD_MAX_CHANNELS; ++i) {
+    if (fwd.chans[i].fd >= 0 && fwd.chans[i].id == id)
+      return &fwd.chans[i];
+  }
+  return NULL;
+}
+
+static struct fwd_chan *new_chan(int fd, uint32_t id) {
+  for (int i = 0; i < FWD_MAX_CHANNELS; ++i) {
+    struct fwd_chan *ch = &fwd.chans[i];
+    if (ch->fd < 0) {
+      memset(ch, 0, sizeof(*ch));
+      ch->fd = fd;
+      ch->id = id;
+      ch->credit = CHAN_WINDOW;
+      set_fd_flags(fd, true, O_NONBLOCK);
+      return ch;
+    }
+  }
+  warnx("Too many forwarding channels");
+  return NULL;
+}
+
+static void free_chan(struct fwd_chan *ch) {
+  close(ch->fd);
+  ch->fd = -1;
+  free(ch->pend);
+  ch->pend = NULL;
+}
+
+// close our side of the channel and let the peer know
+static bool close_chan(struct proto_writer *comm, struct fwd_chan *ch) {
+  uint32_t id = ch->id;
+  free_chan(ch);
+  return proto_write(comm, sizeof(id), DT_CHAN_CLOSE, &id);
+}
+
+// everything the peer sent has been written to the local socket
+static void chan_drained(struct fwd_chan *ch) {
+  if (ch->closing) {
+    free_chan(ch);
+    return;
+  }
+  if (!ch->peer_eof)
+    return;
+  shutdown(ch->fd, SHUT_WR);
+  // both directions are done, and the peer knows as much as we do
+  if (ch->local_eof)
+    free_chan(ch);
+}
+
+static bool give_credit(struct proto_writer *comm, struct fwd_chan *ch, bool force) {
+  // batch up credits so that we don't send a frame for every small write
+  if (!ch->consumed || (!force && ch->consumed < CHAN_WINDOW / 4))
+    return true;
+  uint32_t msg[2] = {ch->id, ch->consumed};
+  ch->consumed = 0;
+  return proto_write(comm, sizeof(msg), DT_CHAN_CREDIT, msg);
+}
+
+// write as much as possible to the local socket without blocking.
+// returns the number of bytes written, or -1 if the local socket is dead.
+static int chan_send_local(struct fwd_chan *ch, const uint8_t *data, uint32_t len) {
+  uint32_t done = 0;
+  while (done < len) {
+    ssize_t wr = send(ch->fd, data + done, len - done, MSG_NOSIGNAL);
+    if (wr < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return -1;
+    }
+    done += wr;
+  }
+  return done;
+}
+
+static bool chan_recv_peer(struct proto_writer *comm, struct fwd_chan *ch, const uint8_t *data, uint32_t len) {
+  if (ch->closing || ch->peer_eof)
+    return true;
+
+  uint32_t done = 0;
+  if (!ch->pend_len && !ch->connecting) {
+    // fast path: straight from the frame buffer to the local socket
+    int wr = chan_send_local(ch, data, len);
+    if (wr < 0)
+      return close_chan(comm, ch);
+    done = wr;
+    ch->consumed += done;
+  }
+
+  if (done < len) {
+    uint32_t rem = len - done;
+    if (ch->pend_len + rem > CHAN_WINDOW) {
+      warnx("Peer overran the window of channel %u", ch->id);
+      return close_chan(comm, ch);
+    }
+    if (!ch->pend) {
+      ch->pend = malloc(CHAN_WINDOW);
+      if (!ch->pend)
+        return close_chan(comm, ch);
+    }
+    if (ch->pend_off + ch->pend_len + rem > CHAN_WINDOW) {
+      memmove(ch->pend, ch->pend + ch->pend_off, ch->pend_len);
+      ch->pend_off = 0;
+    }
+    memcpy(ch->pend + ch->pend_off + ch->pend_len, data + done, rem);
+    ch->pend_len += rem;
+  }
+
+  return give_credit(comm, ch, false);
+}
+
+static bool chan_flush_pend(struct proto_writer *comm, struct fwd_chan *ch) {
+  int wr = chan_send_local(ch, ch->pend + ch->pend_off, ch->pend_len);
+  if (wr < 0)
+    return close_chan(comm, ch);
+  ch->pend_off += wr;
+  ch->pend_len -= wr;
+  ch->consumed += wr;
+  if (!ch->pend_len) {
+    ch->pend_off = 0;
+    chan_drained(ch);
+    if (ch->fd < 0)
+      return true;
+  }
+  return give_credit(comm, ch, !ch->pend_len);
+}
+
+// whatever the peer sent in the meantime was queued
+static bool chan_connected(struct proto_writer *comm, struct fwd_chan *ch) {
+  int soerr = 0;
+  socklen_t soerrlen = sizeof(soerr);
+  if (getsockopt(ch->fd, SOL_SOCKET, SO_ERROR, &soerr, &soerrlen) < 0 || soerr) {
+    errno = soerr ? soerr : errno;
+    warn("Error connecting forwarded channel %u", ch->id);
+    return close_chan(comm, ch);
+  }
+  ch->connecting = false;
+  return chan_flush_pend(comm, ch);
+}
+
+static bool chan_read_local(struct proto_writer *comm, struct fwd_chan *ch) {
+  uint32_t toread = ch->credit < sizeof(cbuff) ? ch->credit : sizeof(cbuff);
+  ssize_t rd = read(ch->fd, cbuff, toread);
+  if (rd < 0) {
+    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+      return true;
+    return close_chan(comm, ch);
+  } else if (rd == 0) {
+    if (!fwd.half_close)
+      return close_chan(comm, ch);
+    // the other direction may still have data
+    ch->local_eof = true;
+    uint32_t id = ch->id;
+    if (ch->peer_eof && !ch->pend_len)
+      free_chan(ch);
+    return proto_write(comm, sizeof(id), DT_CHAN_EOF, &id);
+  }
+
+  ch->credit -= rd;
+  struct iovec iov[2] = {{&ch->id, sizeof(ch->id)}, {cbuff, rd}};
+  return proto_writev(comm, DT_CHAN_DATA, iov, 2);
+}
+
+static bool open_chan(struct proto_writer *comm, int fd, struct fwd_listener *l) {
+  uint32_t id = fwd.next_chan_id++ | (fwd.server ? CHAN_ID_SERVER : 0);
+  if (!new_chan(fd, id)) {
+    close(fd);
+    return true;
+  }
+  uint32_t hdr[2] = {id, fwd.server ? l->id : 0};
+  struct iovec iov[2] = {{hdr, sizeof(hdr)}, {l->target, strlen(l->target)}};
+  return proto_writev(comm, DT_CHAN_OPEN, iov, 2);
+}
+
+static void accept_listener(struct proto_writer *comm, struct fwd_listener *l, bool *ok) {
+  int fd = accept(l->fd, NULL, NULL);
+  if (fd < 0) {
+    if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+      warn("Error accepting forwarded connection on %s", l->listen);
+    return;
+  }
+  *ok = open_chan(comm, fd, l);
+}
+
+int fwd_fill_pollfds(struct pollfd *pfds, bool can_read) {
+  int n = 0;
+  for (int i = 0; i < fwd.nlisteners; ++i) {
+    if (fwd.listeners[i].fd < 0)
+      continue;
+    pfds[n].fd = fwd.listeners[i].fd;
+    pfds[n].events = POLLIN;
+    fwd.pollmap[n].kind = PK_LISTENER;
+    fwd.pollmap[n].idx = i;
+    ++n;
+  }
+  for (int i = 0; i < FWD_MAX_CHANNELS; ++i) {
+    struct fwd_chan *ch = &fwd.chans[i];
+    if (ch->fd < 0)
+      continue;
+    short events = 0;
+    if (ch->connecting)
+      events = POLLOUT;
+    else if (can_read && ch->credit && !ch->closing && !ch->local_eof)
+      events |= POLLIN;
+    if (ch->pend_len)
+      events |= POLLOUT;
+    if (!events)
+      continue;
+    pfds[n].fd = ch->fd;
+    pfds[n].events = events;
+    fwd.pollmap[n].kind = PK_CHAN;
+    fwd.pollmap[n].idx = i;
+    ++n;
+  }
+  return n;
+}
+
+bool fwd_handle_pollfds(struct proto_writer *comm, const struct pollfd *pfds, int npfds) {
+  bool ok = true;
+  for (int i = 0; ok && i < npfds; ++i) {
+    short revents = pfds[i].revents;
+    if (!revents)
+      continue;
+    int idx = fwd.pollmap[i].idx;
+    if (fwd.pollmap[i].kind == PK_LISTENER) {
+      accept_listener(comm, &fwd.listeners[idx], &ok);
+      continue;
+    }
+    struct fwd_chan *ch = &fwd.chans[idx];
+    if (ch->fd != pfds[i].fd)
+      continue; // closed while handling an earlier entry
+    if (ch->connecting) {
+      ok = chan_connected(comm, ch);
+      continue;
+    }
+    if (revents & POLLOUT)
+      ok = chan_flush_pend(comm, ch);
+    if (ok && ch->fd >= 0 && !ch->local_eof && (revents & (POLLIN | POLLERR | POLLHUP)))
+      ok = chan_read_local(comm, ch);
+  }
+  return ok;
+}
+
+static void copy_spec(char *dst, const uint8_t *data, uint16_t len) {
+  len = len < SPEC_MAX ? len : SPEC_MAX - 1;
+  memcpy(dst, data, len);
+  dst[len] = 0;
+}
+
+static bool handle_listen(struct proto_writer *comm, const uint8_t *data, uint16_t len) {
+  if (!fwd.server || len < sizeof(uint32_t))
+    return true;
+  struct fwd_listener *l = new_listener();
+  if (!l)
+    return true;
+  memcpy(&l->id, data, sizeof(l->id));
+  copy_spec(l->listen, data + sizeof(uint32_t), len - sizeof(uint32_t));
+  l->fd = create_spec_server(l->listen);
+  if (l->fd < 0) {
+    warn("Error listening on %s for remote forward", l->listen);
+    return true;
+  }
+  set_fd_flags(l->fd, true, O_NONBLOCK);
+  ++fwd.nlisteners;
+  return true;
+}
+
+static bool handle_open(struct proto_writer *comm, const uint8_t *data, uint16_t len) {
+  uint32_t hdr[2];
+  if (len < sizeof(hdr))
+    return true;
+  memcpy(hdr, data, sizeof(hdr));
+
+  char target[SPEC_MAX];
+  if (fwd.server) {
+    // local forward: client tells us where to connect to
+    copy_spec(target, data + sizeof(hdr), len - sizeof(hdr));
+  } else {
+    // remote forward: look up the target from our listener ID
+    struct fwd_listener *l = NULL;
+    for (int i = 0; i < fwd.nlisteners; ++i) {
+      if (fwd.listeners[i].fd < 0 && fwd.listeners[i].id == hdr[1])
+        l = &fwd.listeners[i];
+    }
+    if (!l) {
+      warnx("Server opened a channel for unknown listener %u", hdr[1]);
+      return proto_write(comm, sizeof(hdr[0]), DT_CHAN_CLOSE, &hdr[0]);
+    }
+    strcpy(target, l->target);
+  }
+
+  // the session goes on while we connect. the peer may send data right away, which is queued
+  // within the usual window.
+  int fd = create_spec_client_async(target);
+  if (fd < 0) {
+    warn("Error connecting forwarded channel to %s", target);
+    return proto_write(comm, sizeof(hdr[0]), DT_CHAN_CLOSE, &hdr[0]);
+  }
+  struct fwd_chan *ch = new_chan(fd, hdr[0]);
+  if (!ch) {
+    close(fd);
+    return proto_write(comm, sizeof(hdr[0]), DT_CHAN_CLOSE, &hdr[0]);
+  }
+  ch->connecting = true;
+  return true;
+}
+
+bool fwd_handle_frame(struct proto_writer *comm, enum data_type type, const uint8_t *data, uint16_t len) {
+  if (type == DT_CHAN_LISTEN)
+    return handle_listen(comm, data, len);
+  if (type == DT_CHAN_OPEN)
+    return handle_open(comm, data, len);
+
+  uint32_t id;
+  if (len < sizeof(id))
+    return true;
+  memcpy(&id, data, sizeof(id));
+  // frames for channels we already closed are still in flight. simply ignore them.
+  struct fwd_chan *ch = find_chan(id);
+  if (!ch)
+    return true;
+
+  switch (type) {
+  case DT_CHAN_DATA:
+    return chan_recv_peer(comm, ch, data + sizeof(id), len - sizeof(id));
+  case DT_CHAN_CREDIT:
+    if (len >= 2 * sizeof(uint32_t)) {
+      uint32_t credit;
+      memcpy(&credit, data + sizeof(id), sizeof(credit));
+      // the peer can only hand back what we sent it
+      if (credit > CHAN_WINDOW - ch->credit) {
+        warnx("Peer granted too much credit on channel %u", ch->id);
+        return close_chan(comm, ch);
+      }
+      ch->credit += credit;
+    }
+    return true;
+  case DT_CHAN_CLOSE:
+    if (ch->pend_len)
+      ch->closing = true;
+    else
+      free_chan(ch);
+    return true;
+  case DT_CHAN_EOF:
+    ch->peer_eof = true;
+    if (!ch->pend_len && !ch->connecting)
+      chan_drained(ch);
+    return true;
+  default:
+    return true;
+  }
+}
+
+bool fwd_close_all() {
+  bool any = fwd.nlisteners > 0;
+  for (int i = 0; i < FWD_MAX_CHANNELS; ++i) {
+    if (fwd.chans[i].fd >= 0)
+      free_chan(&fwd.chans[i]);
+  }
+  for (int i = 0; i < fwd.nlisteners; ++i) {
+    if (fwd.listeners[i].fd >= 0)
+      close(fwd.listeners[i].fd);
+  }
+  fwd.nlisteners = 0;
+  return any;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "protocol.h"
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// stream forwarding channels, multiplexed over the session's comm socket.
+//  - local forward (-L): client listens, server connects to the target.
+//  - remote forward (-R): client asks the server to listen, client connects to the target.
+// listen/target endpoints are in the spec format of `create_spec_server`.
+//
+// each direction of a channel is flow controlled with credits: a sender may only have
+// CHAN_WINDOW bytes in flight. the receiver hands credits back with DT_CHAN_CREDIT as it
+// writes the data to its local socket, so a slow local peer never stalls the session.
+//
+// when both sides support it (CF_CHAN_EOF), a channel is half closed: EOF on one local socket
+// is passed on with DT_CHAN_EOF, which shuts down the write side of the other, and the channel
+// is closed once both directions are done. otherwise EOF on either side closes the channel.
+
+#define FWD_MAX_LISTENERS 16
+#define FWD_MAX_CHANNELS 64
+#define FWD_MAX_POLLFDS (FWD_MAX_LISTENERS + FWD_MAX_CHANNELS)
+
+#define CHAN_WINDOW (256 * 1024)
+
+void fwd_init(bool server);
+
+// whether the peer takes DT_CHAN_EOF (CF_CHAN_EOF)
+void fwd_half_close(bool enabled);
+
+// client only. `spec` is in "<listen spec>=<target spec>" format.
+// local forwards start listening immediately.
+bool fwd_add_local(const char *spec);
+
+bool fwd_add_remote(const char *spec);
+
+// client only. request the server to start listening for remote forwards.
+bool fwd_start(struct proto_writer *comm);
+
+// fill `pfds` (at most FWD_MAX_POLLFDS entries) with the fds we want to be polled.
+// channels are not read from unless `can_read` is set. returns the number of entries filled.
+int fwd_fill_pollfds(struct pollfd *pfds, bool can_read);
+
+// handle the pollfds returned by `fwd_fill_pollfds`. frames for the peer go out through `comm`.
+// returns false on comm socket error.
+bool fwd_handle_pollfds(struct proto_writer *comm, const struct pollfd *pfds, int npfds);
+
+// handle a DT_CHAN_* frame. returns false on comm socket error.
+bool fwd_handle_frame(struct proto_writer *comm, enum data_type type, const uint8_t *data, uint16_t len);
+
+// returns true if there was anything to close
+bool fwd_close_all();
@@ -0,0 +1,160 @@
+#include "bufpool.h"
+#include "caps.h"
+#include "client.h"
+#include "common.h"
+#include "global.h"
+#include "protocol.h"
+#include "server.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// fuzzing harness for everything that parses what comes off the wire: the frame decoders and
+// both sides of the handshake. the input is sent by a peer over a socketpair, so the code under
+// test reads it the way it reads a real connection, short reads and EOF included.
+//  - libFuzzer: `make fuzz` (needs clang), then ./fuzz <corpus dir>
+//  - AFL, or to replay a crash: `make fuzz-replay [CC=afl-clang-fast]`, then
+//    ./fuzz-replay < input, or ./fuzz-replay <files...>
+// the first byte of the input picks the target, and the rest is what the peer sends.
+
+enum fuzz_target {
+  FT_PROTO_READ,    // proto_read() until it fails
+  FT_READER,        // proto_reader_fill() and proto_reader_next() until EOF
+  FT_SERVER,        // server_negotiate() without a cookie
+  FT_SERVER_COOKIE, // server_negotiate() with one
+  FT_CLIENT,        // client_negotiate() without a cookie
+  FT_CLIENT_COOKIE, // client_negotiate() with one
+  FT_COUNT
+};
+
+struct feed {
+  int fd;
+  const uint8_t *data;
+  size_t len;
+};
+
+// the peer: sends the input, then takes whatever comes back until the other side is done
+static void *feed_main(void *arg) {
+  struct feed *f = arg;
+  for (size_t off = 0; off < f->len;) {
+    ssize_t wr = send(f->fd, f->data + off, f->len - off, MSG_NOSIGNAL);
+    if (wr <= 0)
+      break;
+    off += wr;
+  }
+  shutdown(f->fd, SHUT_WR);
+  uint8_t sink[4096];
+  while (read(f->fd, sink, sizeof(sink)) > 0) {
+  }
+  return NULL;
+}
+
+static void run_target(enum fuzz_target target, int fd) {
+  uint8_t buff[HANDSHAKE_BUFF_SIZE];
+  uint16_t len;
+  enum data_type type;
+  switch (target) {
+  case FT_PROTO_READ:
+    while (proto_read(fd, &len, &type, buff, sizeof(buff))) {
+    }
+    break;
+  case FT_READER: {
+    struct proto_reader r;
+    proto_reader_init(&r);
+    const uint8_t *data;
+    while (proto_reader_fill(&r, fd)) {
+      while (proto_reader_next(&r, &len, &type, &data)) {
+      }
+    }
+    proto_reader_release(&r);
+    break;
+  }
+  case FT_SERVER:
+  case FT_SERVER_COOKIE: {
+    struct session_setup setup;
+    server_negotiate(fd, CF_FORWARD | CF_TRACE | CF_EXEC | CF_CHAN_EOF, &setup);
+    break;
+  }
+  case FT_CLIENT:
+  case FT_CLIENT_COOKIE: {
+    struct caps caps;
+    client_negotiate(fd, &caps);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  bufpool_init(0);
+  auth_ticket_init();
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (!size)
+    return 0;
+  enum fuzz_target target = data[0] % FT_COUNT;
+  cookie.size = 0;
+  if (target == FT_SERVER_COOKIE || target == FT_CLIENT_COOKIE) {
+    cookie.size = 64;
+    memset(cookie.data, 'c', cookie.size);
+  }
+
+  int sp[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) < 0) {
+    perror("socketpair");
+    abort();
+  }
+  struct feed f = {.fd = sp[1], .data = data + 1, .len = size - 1};
+  pthread_t feeder;
+  if (pthread_create(&feeder, NULL, feed_main, &f)) {
+    perror("pthread_create");
+    abort();
+  }
+  run_target(target, sp[0]);
+  close(sp[0]);
+  pthread_join(feeder, NULL);
+  close(sp[1]);
+  return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+static bool run_file(FILE *fp) {
+  uint8_t *data = NULL;
+  size_t len = 0, cap = 0;
+  for (;;) {
+    if (len == cap && !(data = realloc(data, cap = cap ? 2 * cap : 65536)))
+      return false;
+    size_t rd = fread(data + len, 1, cap - len, fp);
+    if (!rd)
+      break;
+    len += rd;
+  }
+  LLVMFuzzerTestOneInput(data, len);
+  free(data);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  LLVMFuzzerInitialize(&argc, &argv);
+  if (argc < 2)
+    return !run_file(stdin);
+  for (int i = 1; i < argc; ++i) {
+    FILE *fp = fopen(argv[i], "rb");
+    if (!fp || !run_file(fp)) {
+      perror(argv[i]);
+      return 1;
+    }
+    fclose(fp);
+  }
+  return 0;
+}
+
+#endif
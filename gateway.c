@@ -0,0 +1,758 @@
+#include "gateway.h"
+#include <err.h>
+#include <errno.h>
+
+#ifdef __linux__
+
+#include "auth.h"
+#include "bufpool.h"
+#include "caps.h"
+#include "client.h"
+#include "global.h"
+#include "profile.h"
+#include "protocol.h"
+#include "pump.h"
+#include "server.h"
+#include "socks.h"
+#include "tls.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define GW_MAX_TARGETS 1024
+#define GW_DEFAULT_POOL 1
+#define MAX_EVENTS 256
+
+// a client waits this long for a backend connection
+#define BACKEND_WAIT_MS 10000
+// a backend connect or handshake that takes longer than this is aborted
+#define BACKEND_TIMEOUT_MS 10000
+// after a failed backend connection, the pool waits this long before trying again, doubling
+// up to the max. clients that are waiting don't wait for this.
+#define RETRY_MIN_MS 100
+#define RETRY_MAX_MS 10000
+// idle connections are checked for hangups this often
+#define POOL_CHECK_MS 1000
+
+struct gw_idle {
+  int fd;
+  struct gw_idle *next;
+};
+
+struct gw_target {
+  char *name;
+  char *spec;
+  int poolsize;
+  // the rest is protected by `pool_lock`
+  // idle backend connections, oldest first
+  struct gw_idle *idle;
+  struct gw_idle *idletail;
+  int nidle;
+  // clients waiting for a connection, that have not seen a failed one yet
+  int waiting;
+  // bumped on every failed connection, so waiting clients can give up
+  uint64_t failures;
+  int backoff_ms;
+  uint64_t retry_at;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+static struct gw_target targets[GW_MAX_TARGETS];
+static int ntargets;
+
+// the pool is filled by a single thread, one backend at a time
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+// clients waiting for a connection
+static pthread_cond_t pool_cond;
+// the filler waiting for work
+static pthread_cond_t filler_cond;
+// the handshake in progress. the main thread aborts it if it takes too long.
+static int filler_fd = -1;
+static uint64_t filler_deadline;
+
+struct stream;
+
+// what an epoll event points to
+struct gw_end {
+  struct stream *st;
+  int fd;
+  // currently registered epoll events, 0 if not registered
+  uint32_t events;
+};
+
+struct stream {
+  struct gw_end client;
+  struct gw_end backend;
+  // client to backend
+  struct pump up;
+  // backend to client
+  struct pump down;
+  struct stream *prev;
+  struct stream *next;
+};
+
+static int epfd;
+static int evfd;
+
+static struct stream *streams;
+// paired by the handshake threads, for the main thread to pick up
+static pthread_mutex_t incoming_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stream *incoming;
+
+static struct {
+  atomic_uint_fast64_t accepted;
+  atomic_uint_fast64_t rejected;
+  atomic_uint_fast64_t handshakes;
+  atomic_uint_fast64_t backend_failed;
+  uint64_t active;
+  uint64_t bytes_up;
+  uint64_t bytes_down;
+} stats;
+
+static struct gw_end listener_end;
+static struct gw_end signal_end;
+static struct gw_end wakeup_end;
+
+static bool load_targets(const char *mapfile);
+
+static void *filler_main(void *arg);
+
+static void *handshake_main(void *arg);
+
+static void accept_incoming();
+
+static void handle_stream(struct gw_end *end);
+
+static void stream_close(struct stream *st);
+
+static void check_filler(uint64_t now);
+
+static void dump_stats();
+
+int start_gateway(int svrfd, const char *mapfile) {
+  if (!load_targets(mapfile))
+    return 1;
+  if (!ntargets) {
+    warnx("No backends in the map file.");
+    return 1;
+  }
+
+  // a client connection, a backend connection and two pipes per session
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  bufpool_init(0);
+  if (cookie.size && !auth_ticket_init())
+    return 1;
+
+  // make sure random_fill is set up before there are multiple threads
+  uint8_t dummy;
+  random_fill(&dummy, sizeof(dummy));
+
+  if (listen(svrfd, SOMAXCONN) < 0) {
+    warn("Listen error");
+    return 1;
+  }
+  set_fd_flags(svrfd, true, O_NONBLOCK);
+  fcntl(svrfd, F_SETFD, FD_CLOEXEC);
+
+  // signals are only received through the fd. block them before creating threads
+  // so that every thread inherits the mask.
+  int sigs[] = {SIGUSR1};
+  int sigfd = signal_fd(sigs, sizeof(sigs) / sizeof(*sigs));
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (sigfd < 0 || epfd < 0 || evfd < 0) {
+    warn("Error setting up event loop");
+    return 1;
+  }
+  listener_end.fd = svrfd;
+  signal_end.fd = sigfd;
+  wakeup_end.fd = evfd;
+  struct gw_end *ends[] = {&listener_end, &signal_end, &wakeup_end};
+  for (int i = 0; i < 3; ++i) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = ends[i]};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ends[i]->fd, &ev) < 0) {
+      warn("Error setting up event loop");
+      return 1;
+    }
+  }
+
+  // timed waits are in the same clock as everything else
+  pthread_condattr_t condattr;
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&pool_cond, &condattr);
+  pthread_cond_init(&filler_cond, &condattr);
+  pthread_condattr_destroy(&condattr);
+
+  pthread_attr_t thattr;
+  pthread_attr_init(&thattr);
+  pthread_attr_setdetachstate(&thattr, PTHREAD_CREATE_DETACHED);
+  pthread_t filler;
+  if ((errno = pthread_create(&filler, &thattr, filler_main, NULL))) {
+    warn("Error starting pool thread");
+    return 1;
+  }
+  warnx("Gateway started with %d backend(s).", ntargets);
+  profile_pin();
+
+  struct epoll_event events[MAX_EVENTS];
+  uint64_t next_check = mono_ns() + 1000000000ull;
+  for (;;) {
+    int timeout = handshake_sweep();
+    if (timeout < 0 || timeout > 1000)
+      timeout = 1000;
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno != EINTR)
+        warn("epoll_wait error");
+      continue;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      struct gw_end *end = events[i].data.ptr;
+      if (!end) {
+        // belongs to a stream closed earlier in this batch
+        continue;
+      } else if (end == &listener_end) {
+        // handshakes run on short-lived threads with blocking sockets, like in the threaded
+        // server, so a slow client never stalls the relay
+        for (;;) {
+          int commfd = accept4(svrfd, NULL, NULL, SOCK_CLOEXEC);
+          if (commfd < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+              warn("Error accepting connection");
+            break;
+          }
+          ++stats.accepted;
+          profile_tune(commfd);
+          int slot = handshake_begin(commfd);
+          if (slot < 0) {
+            ++stats.rejected;
+            close(commfd);
+            continue;
+          }
+          pthread_t hsthread;
+          if ((errno = pthread_create(&hsthread, &thattr, handshake_main, (void *)(intptr_t)slot))) {
+            warn("Error starting handshake thread");
+            handshake_end(slot);
+            close(commfd);
+          }
+        }
+      } else if (end == &signal_end) {
+        int sig;
+        while ((sig = signal_fd_next(sigfd))) {
+          if (sig == SIGUSR1)
+            dump_stats();
+        }
+      } else if (end == &wakeup_end) {
+        uint64_t val;
+        read(evfd, &val, sizeof(val));
+        accept_incoming();
+      } else {
+        struct stream *st = end->st;
+        handle_stream(end);
+        if (st->client.fd < 0) {
+          // closed. the other end may still be in this batch.
+          for (int j = i + 1; j < n; ++j) {
+            struct gw_end *other = events[j].data.ptr;
+            if (other == &st->client || other == &st->backend)
+              events[j].data.ptr = NULL;
+          }
+          free(st);
+        }
+      }
+    }
+
+    uint64_t now = mono_ns();
+    if (now >= next_check) {
+      check_filler(now);
+      next_check = now + 1000000000ull;
+    }
+  }
+
+  return 0;
+}
+
+static bool load_targets(const char *mapfile) {
+  FILE *f = fopen(mapfile, "r");
+  if (!f) {
+    warn("Cannot open map file");
+    return false;
+  }
+
+  char line[512];
+  int lineno = 0;
+  bool success = false;
+  while (fgets(line, sizeof(line), f)) {
+    ++lineno;
+    line[strcspn(line, "\r\n")] = 0;
+    if (!*line || *line == '#')
+      continue;
+
+    char *spec = strchr(line, '=');
+    if (!spec || spec == line || spec - line > CAP_TARGET_MAX) {
+      warnx("%s:%d: expected <name>=<target spec>[ <pool size>]", mapfile, lineno);
+      goto end;
+    }
+    *spec++ = 0;
+    int poolsize = GW_DEFAULT_POOL;
+    char *pool = strchr(spec, ' ');
+    if (pool) {
+      *pool++ = 0;
+      char *endp;
+      poolsize = strtol(pool, &endp, 10);
+      if (!*pool || *endp || poolsize < 0) {
+        warnx("%s:%d: invalid pool size", mapfile, lineno);
+        goto end;
+      }
+    }
+
+    if (ntargets == GW_MAX_TARGETS) {
+      warnx("%s:%d: too many backends", mapfile, lineno);
+      goto end;
+    }
+    struct gw_target *t = targets + ntargets;
+    if (!(t->name = strdup(line)) || !(t->spec = strdup(spec))) {
+      warn("Error loading map file");
+      goto end;
+    }
+    t->poolsize = poolsize;
+    t->backoff_ms = RETRY_MIN_MS;
+    ++ntargets;
+  }
+  success = true;
+
+end:
+  fclose(f);
+  return success;
+}
+
+static struct gw_target *find_target(const char *name) {
+  if (!*name)
+    name = "*";
+  for (int i = 0; i < ntargets; ++i) {
+    if (!strcmp(targets[i].name, name))
+      return targets + i;
+  }
+  return NULL;
+}
+
+static struct timespec mono_timespec(uint64_t ns) {
+  struct timespec ts = {.tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull};
+  return ts;
+}
+
+static bool fd_hung_up(int fd) {
+  struct pollfd pfd = {.fd = fd, .events = POLLRDHUP};
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+// connect to the backend and do the handshake. returns the connected (blocking) socket or -1.
+static int backend_connect(struct gw_target *t) {
+  int fd = create_spec_client_async(t->spec);
+  if (fd < 0) {
+    warn("Error connecting to backend %s (%s)", t->name, t->spec);
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+  int soerr = 0;
+  socklen_t soerrlen = sizeof(soerr);
+  int ready = poll(&pfd, 1, BACKEND_TIMEOUT_MS);
+  if (ready <= 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &soerrlen) < 0 || soerr) {
+    errno = soerr ? soerr : ready ? errno : ETIMEDOUT;
+    warn("Error connecting to backend %s (%s)", t->name, t->spec);
+    close(fd);
+    return -1;
+  }
+  set_fd_flags(fd, false, O_NONBLOCK);
+
+  pthread_mutex_lock(&pool_lock);
+  filler_fd = fd;
+  filler_deadline = mono_ns() + BACKEND_TIMEOUT_MS * 1000000ull;
+  pthread_mutex_unlock(&pool_lock);
+  struct caps caps;
+  // the same as what the gateway offers its clients
+  bool ok = client_negotiate_features(fd, 0, &caps);
+  pthread_mutex_lock(&pool_lock);
+  filler_fd = -1;
+  pthread_mutex_unlock(&pool_lock);
+
+  ++stats.handshakes;
+  if (!ok) {
+    warnx("Backend %s (%s) negotiation failed.", t->name, t->spec);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// called by the main thread every now and then
+static void check_filler(uint64_t now) {
+  pthread_mutex_lock(&pool_lock);
+  if (filler_fd >= 0 && now >= filler_deadline) {
+    // the blocked handshake fails right away
+    warnx("Backend handshake timed out.");
+    shutdown(filler_fd, SHUT_RDWR);
+    filler_fd = -1;
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// close idle connections whose backend went away. called with `pool_lock` held.
+static void pool_check() {
+  for (int i = 0; i < ntargets; ++i) {
+    struct gw_target *t = targets + i;
+    for (struct gw_idle **p = &t->idle; *p;) {
+      struct gw_idle *c = *p;
+      if (!fd_hung_up(c->fd)) {
+        t->idletail = c;
+        p = &c->next;
+        continue;
+      }
+      *p = c->next;
+      close(c->fd);
+      free(c);
+      --t->nidle;
+    }
+    if (!t->idle)
+      t->idletail = NULL;
+  }
+}
+
+// the next target that needs a connection, or NULL. `*wake` is lowered to the time the next
+// backoff ends. called with `pool_lock` held.
+static struct gw_target *pool_next(uint64_t now, uint64_t *wake) {
+  // round robin, with waiting clients first
+  static int cursor;
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int k = 0; k < ntargets; ++k) {
+      int i = (cursor + k) % ntargets;
+      struct gw_target *t = targets + i;
+      if (t->nidle >= t->poolsize + t->waiting)
+        continue;
+      if (!pass && !t->waiting)
+        continue;
+      if (pass && now < t->retry_at) {
+        if (t->retry_at < *wake)
+          *wake = t->retry_at;
+        continue;
+      }
+      cursor = i + 1;
+      return t;
+    }
+  }
+  return NULL;
+}
+
+static void *filler_main(void *arg) {
+  pthread_mutex_lock(&pool_lock);
+  uint64_t next_check = 0;
+  for (;;) {
+    uint64_t now = mono_ns();
+    if (now >= next_check) {
+      pool_check();
+      next_check = now + POOL_CHECK_MS * 1000000ull;
+    }
+    uint64_t wake = next_check;
+    struct gw_target *t = pool_next(now, &wake);
+    if (!t) {
+      struct timespec ts = mono_timespec(wake);
+      pthread_cond_timedwait(&filler_cond, &pool_lock, &ts);
+      continue;
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+    int fd = backend_connect(t);
+    struct gw_idle *c = NULL;
+    if (fd >= 0 && !(c = malloc(sizeof(*c)))) {
+      close(fd);
+      fd = -1;
+    }
+    pthread_mutex_lock(&pool_lock);
+
+    if (c) {
+      c->fd = fd;
+      c->next = NULL;
+      if (t->idletail)
+        t->idletail->next = c;
+      else
+        t->idle = c;
+      t->idletail = c;
+      ++t->nidle;
+      t->backoff_ms = RETRY_MIN_MS;
+      t->retry_at = 0;
+    } else {
+      ++stats.backend_failed;
+      // the waiting clients give up
+      ++t->failures;
+      t->waiting = 0;
+      t->retry_at = mono_ns() + t->backoff_ms * 1000000ull;
+      t->backoff_ms = t->backoff_ms * 2 > RETRY_MAX_MS ? RETRY_MAX_MS : t->backoff_ms * 2;
+    }
+    pthread_cond_broadcast(&pool_cond);
+  }
+  return NULL;
+}
+
+// take a connection from the pool, waiting for one if there is none. returns -1 if the backend
+// can't be reached.
+static int pool_take(struct gw_target *t) {
+  struct timespec deadline = mono_timespec(mono_ns() + BACKEND_WAIT_MS * 1000000ull);
+  int fd = -1;
+  bool waited = false;
+  pthread_mutex_lock(&pool_lock);
+  uint64_t failures = t->failures;
+  for (;;) {
+    if (t->idle) {
+      struct gw_idle *c = t->idle;
+      if (!(t->idle = c->next))
+        t->idletail = NULL;
+      --t->nidle;
+      fd = c->fd;
+      free(c);
+      if (!fd_hung_up(fd))
+        break;
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    if (t->failures != failures)
+      break;
+    if (!waited) {
+      ++t->waiting;
+      waited = true;
+      pthread_cond_signal(&filler_cond);
+    }
+    if (pthread_cond_timedwait(&pool_cond, &pool_lock, &deadline) == ETIMEDOUT)
+      break;
+  }
+  if (waited && t->failures == failures)
+    --t->waiting;
+  if (fd >= 0) {
+    ++*(waited ? &t->misses : &t->hits);
+    // refill
+    pthread_cond_signal(&filler_cond);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return fd;
+}
+
+// tell the client why, on its terminal, and end the session
+static void reject(int fd, const char *fmt, ...) {
+  char msg[256];
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(msg, sizeof(msg), fmt, args);
+  va_end(args);
+  if (len < 0)
+    len = 0;
+  else if (len >= sizeof(msg))
+    len = sizeof(msg) - 1;
+  warnx("Client rejected: %s", msg);
+
+  char text[sizeof(msg) + 16];
+  int textlen = snprintf(text, sizeof(text), "ptyfwd gateway: %s\r\n", msg);
+  uint8_t frames[2 * PROTO_HDR_MAX + sizeof(text)];
+  size_t framelen = proto_encode(frames, textlen, DT_REGULAR, text);
+  framelen += proto_encode(frames + framelen, 0, DT_CLOSE, NULL);
+  write_all(fd, frames, framelen);
+  ++stats.rejected;
+}
+
+static void *handshake_main(void *arg) {
+  int slot = (intptr_t)arg;
+  int commfd = handshake_fd(slot);
+  struct session_setup setup;
+  // if it runs out of time, the listener shuts the socket down, which fails it
+  bool ok = !tls_enabled() || (commfd = tls_wrap(commfd, NULL, true)) >= 0;
+  // anything that needs the gateway to look into the frames is off
+  ok = ok && server_negotiate(commfd, 0, &setup);
+  handshake_end(slot);
+  if (!ok) {
+    warnx("Client negotiation failed.");
+    ++stats.rejected;
+    if (commfd >= 0)
+      close(commfd);
+    return NULL;
+  }
+
+  struct gw_target *t = find_target(setup.caps.target);
+  if (!t) {
+    if (*setup.caps.target)
+      reject(commfd, "unknown backend '%s'", setup.caps.target);
+    else
+      reject(commfd, "no backend given");
+    close(commfd);
+    return NULL;
+  }
+  int backendfd = pool_take(t);
+  if (backendfd < 0) {
+    reject(commfd, "backend '%s' is not reachable", t->name);
+    close(commfd);
+    return NULL;
+  }
+
+  // the backend's PTY was opened before the client came along. the window size that the
+  // client sent with its handshake goes ahead of everything else.
+  if (setup.has_winch) {
+    uint8_t frame[PROTO_HDR_MAX + sizeof(setup.winch)];
+    if (!write_all(backendfd, frame, proto_encode(frame, sizeof(setup.winch), DT_WINCH, &setup.winch))) {
+      reject(commfd, "backend '%s' is not reachable", t->name);
+      goto error;
+    }
+  }
+
+  struct stream *st = calloc(1, sizeof(*st));
+  if (!st) {
+    warn("Error allocating stream");
+    goto error;
+  }
+  st->client.st = st->backend.st = st;
+  st->client.fd = commfd;
+  st->backend.fd = backendfd;
+  pump_clear(&st->up);
+  pump_clear(&st->down);
+  set_fd_flags(commfd, true, O_NONBLOCK);
+  set_fd_flags(backendfd, true, O_NONBLOCK);
+
+  pthread_mutex_lock(&incoming_lock);
+  st->next = incoming;
+  incoming = st;
+  pthread_mutex_unlock(&incoming_lock);
+  uint64_t one = 1;
+  write(evfd, &one, sizeof(one));
+  return NULL;
+
+error:
+  close(backendfd);
+  close(commfd);
+  return NULL;
+}
+
+// register, update or unregister `end` so that epoll only reports `events`.
+// fds without any events wanted are unregistered, since hangups are always reported.
+static bool end_watch(struct gw_end *end, uint32_t events) {
+  if (events == end->events)
+    return true;
+  struct epoll_event ev = {.events = events, .data.ptr = end};
+  int op = !events ? EPOLL_CTL_DEL : end->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(epfd, op, end->fd, &ev) < 0) {
+    warn("epoll_ctl error");
+    return false;
+  }
+  end->events = events;
+  return true;
+}
+
+// sources are only read from once everything read before is written
+static bool stream_watch(struct stream *st) {
+  uint32_t cev = (!st->up.eof && !st->up.pending ? EPOLLIN : 0) | (st->down.pending ? EPOLLOUT : 0);
+  uint32_t bev = (!st->down.eof && !st->down.pending ? EPOLLIN : 0) | (st->up.pending ? EPOLLOUT : 0);
+  return end_watch(&st->client, cev) && end_watch(&st->backend, bev);
+}
+
+static void accept_incoming() {
+  pthread_mutex_lock(&incoming_lock);
+  struct stream *list = incoming;
+  incoming = NULL;
+  pthread_mutex_unlock(&incoming_lock);
+
+  for (struct stream *st = list, *next; st; st = next) {
+    next = st->next;
+    st->prev = NULL;
+    st->next = streams;
+    if (streams)
+      streams->prev = st;
+    streams = st;
+    ++stats.active;
+    warnx("New client connected.");
+    // whatever the backend sent while in the pool (e.g. a shell prompt) goes out right away
+    if (!pump_init(&st->up) || !pump_init(&st->down) || !stream_watch(st)) {
+      stream_close(st);
+      free(st);
+      continue;
+    }
+    handle_stream(&st->backend);
+    if (st->client.fd < 0)
+      free(st);
+  }
+}
+
+static void handle_stream(struct gw_end *end) {
+  struct stream *st = end->st;
+  uint64_t up = st->up.total, down = st->down.total;
+  bool ok = pump_run(&st->up, st->client.fd, st->backend.fd) && pump_run(&st->down, st->backend.fd, st->client.fd);
+  stats.bytes_up += st->up.total - up;
+  stats.bytes_down += st->down.total - down;
+  if (!ok || (st->up.done && st->down.done) || !stream_watch(st))
+    stream_close(st);
+}
+
+// the stream itself is freed by the caller. `client.fd` is set to -1.
+static void stream_close(struct stream *st) {
+  end_watch(&st->client, 0);
+  end_watch(&st->backend, 0);
+  close(st->client.fd);
+  close(st->backend.fd);
+  st->client.fd = -1;
+  pump_free(&st->up);
+  pump_free(&st->down);
+
+  if (st->prev)
+    st->prev->next = st->next;
+  else
+    streams = st->next;
+  if (st->next)
+    st->next->prev = st->prev;
+  --stats.active;
+  warnx("Client disconnected.");
+}
+
+static void dump_stats() {
+  fprintf(stderr,
+    "accepted %llu, rejected %llu, active %llu, backend handshakes %llu, failed %llu, bytes up %llu, down %llu\n",
+    (unsigned long long)stats.accepted, (unsigned long long)stats.rejected, (unsigned long long)stats.active,
+    (unsigned long long)stats.handshakes, (unsigned long long)stats.backend_failed,
+    (unsigned long long)stats.bytes_up, (unsigned long long)stats.bytes_down);
+  fprintf(stderr, "%-24s  %4s  %4s  %8s  %8s\n", "backend", "idle", "pool", "hits", "misses");
+  pthread_mutex_lock(&pool_lock);
+  for (int i = 0; i < ntargets; ++i) {
+    struct gw_target *t = targets + i;
+    fprintf(stderr, "%-24s  %4d  %4d  %8llu  %8llu\n", t->name, t->nidle, t->poolsize, (unsigned long long)t->hits,
+      (unsigned long long)t->misses);
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+#else
+
+int start_gateway(int svrfd, const char *mapfile) {
+  errno = ENOTSUP;
+  warn("Gateway");
+  return 1;
+}
+
+#endif
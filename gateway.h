@@ -0,0 +1,25 @@
+#pragma once
+
+// session gateway (-G): one address for clients to reach many backend servers (e.g. one per VM,
+// on VSOCK) by name, without knowing where they are.
+//  - clients authenticate to the gateway with the usual handshake, and name the backend they
+//    want in CAP_TARGET (the client's '-g').
+//  - for every backend, the gateway keeps a pool of connections that have already finished
+//    their handshake (with the gateway's cookie), so a new session does not wait for a backend
+//    connect and handshake. the pool is topped up in the background. note that every pooled
+//    connection is a session on the backend, with its app already running.
+//  - once paired, the bytes are relayed as they are in both directions (see pump.h). both
+//    handshakes end up with the same frame format, so frames never need to be re-encoded.
+//
+// backends are read from the map file, with one entry per line in the format
+//   <name>=<target spec>[ <pool size>]
+// where <target spec> is in the format of `create_spec_client`, and <pool size> is the number
+// of idle connections to keep (1 by default, 0 connects only when a client asks).
+// lines starting with '#' are ignored. clients that do not name a backend get the one named
+// `*`, if there is one.
+//
+// forwarding and latency tracing are not offered through the gateway.
+// SIGUSR1 dumps statistics to stderr.
+
+// `svrfd` is a bound (but not listening) server socket. Linux only.
+int start_gateway(int svrfd, const char *mapfile);
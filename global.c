@@ -1,5 +1,14 @@
 #include "global.h"
+#include <stddef.h>
 
 struct cookie cookie = {};
 
-const uint8_t preamble[8] = {'p', 't', 'y', 'f', 'w', 'd', PROTOCOL_VERSION & 0xFF, (PROTOCOL_VERSION >> 8) & 0xFF};
+const char *ticketpath = NULL;
+
+bool predict_echo = false;
+
+bool trace_latency = false;
+
+bool exec_session = false;
+
+const char *gateway_target = NULL;
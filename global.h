@@ -2,14 +2,24 @@
 
 // store all global app config here
 
+#include <stdbool.h>
 #include <stdint.h>
+#include "auth.h"
 #include "common.h"
 
-struct cookie {
-  uint16_t size;
-  uint8_t data[COOKIE_MAX_SIZE];
-};
-
 extern struct cookie cookie;
 
-extern const uint8_t preamble[8];
+// client: where the session ticket is cached (NULL if disabled)
+extern const char *ticketpath;
+
+// client: predictive local echo (-e)
+extern bool predict_echo;
+
+// client: latency tracing (-x)
+extern bool trace_latency;
+
+// client: run the app without a PTY (-E)
+extern bool exec_session;
+
+// client: the backend to reach through a gateway (-g), NULL if not given
+extern const char *gateway_target;
@@ -0,0 +1,367 @@
+#include "handoff.h"
+#include "utils.h"
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef SOCK_CLOEXEC
+#define SOCK_CLOEXEC 0
+#endif
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+// both binaries must agree on this
+#define HANDOFF_VERSION 1
+// the accept loop waits at most this long for a successor's hello
+#define HANDOFF_HELLO_TIMEOUT_MS 5000
+
+enum handoff_msg { HM_LISTENER = 1, HM_SESSION, HM_END };
+
+// successor to old server, right after connecting
+struct handoff_hello {
+  uint32_t version;
+  uint32_t adopt;
+};
+
+// every message from the old server. the fds come with it.
+struct handoff_hdr {
+  uint32_t type;
+  uint32_t len;
+};
+
+// HM_SESSION, followed by the capabilities (caps_encode) and the relay's data
+struct handoff_rec {
+  int32_t pid;
+  uint32_t capslen;
+  uint32_t toclientlen;
+  uint32_t toptylen;
+  uint32_t partiallen;
+};
+
+static const char *sockpath;
+// waiting for a successor
+static int listenfd = -1;
+// to the other server, while a handoff is in progress
+static int peerfd = -1;
+// shards send their sessions concurrently
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool fill_addr(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+static void close_fds(const int *fds, int nfds) {
+  for (int i = 0; i < nfds; ++i)
+    close(fds[i]);
+}
+
+// send a message with `nfds` fds attached, in a single sendmsg unless the socket buffer is full
+static bool send_msg(int fd, struct iovec *iov, int iovcnt, const int *fds, int nfds) {
+  union {
+    struct cmsghdr hdr;
+    char buff[CMSG_SPACE(2 * sizeof(int))];
+  } ctl;
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+  if (nfds) {
+    msg.msg_control = ctl.buff;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  }
+  ssize_t wr;
+  while ((wr = sendmsg(fd, &msg, 0)) < 0) {
+    if (errno != EINTR)
+      return false;
+  }
+  // the fds went with the first byte. the rest goes as it is.
+  for (; iovcnt && (size_t)wr >= iov->iov_len; ++iov, --iovcnt)
+    wr -= iov->iov_len;
+  if (!iovcnt)
+    return true;
+  iov->iov_base = (uint8_t *)iov->iov_base + wr;
+  iov->iov_len -= wr;
+  return writev_all(fd, iov, iovcnt);
+}
+
+// receive the header of a message, and the fds that came with it (at most 2)
+static bool recv_hdr(int fd, struct handoff_hdr *hdr, int *fds, int *nfds) {
+  union {
+    struct cmsghdr hdr;
+    char buff[CMSG_SPACE(2 * sizeof(int))];
+  } ctl;
+  struct iovec iov = {.iov_base = hdr, .iov_len = sizeof(*hdr)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buff, .msg_controllen = sizeof(ctl)};
+  ssize_t rd;
+  while ((rd = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) < 0) {
+    if (errno != EINTR)
+      return false;
+  }
+  *nfds = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < n && *nfds < 2; ++i)
+      memcpy(fds + (*nfds)++, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+  }
+  if (rd != sizeof(*hdr) || (msg.msg_flags & MSG_CTRUNC)) {
+    close_fds(fds, *nfds);
+    errno = rd < 0 ? errno : EPROTO;
+    return false;
+  }
+  return true;
+}
+
+bool handoff_takeover(const char *path, bool adopt, int *svrfd) {
+  sockpath = path;
+  *svrfd = -1;
+  struct sockaddr_un addr;
+  if (!fill_addr(path, &addr)) {
+    warn("Invalid handoff socket path");
+    return false;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    warn("Error creating handoff socket");
+    return false;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    // nobody to take over from
+    if (errno == ENOENT || errno == ECONNREFUSED)
+      return true;
+    warn("Error connecting to the old server");
+    return false;
+  }
+
+  struct handoff_hello hello = {.version = HANDOFF_VERSION, .adopt = adopt};
+  struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+  struct handoff_hdr hdr;
+  int fds[2], nfds;
+  if (!writev_all(fd, &iov, 1) || !recv_hdr(fd, &hdr, fds, &nfds)) {
+    warn("The old server did not hand over its listening socket");
+    close(fd);
+    return false;
+  }
+  if (hdr.type != HM_LISTENER || hdr.len || nfds != 1) {
+    warnx("The old server did not hand over its listening socket.");
+    close_fds(fds, nfds);
+    close(fd);
+    return false;
+  }
+  *svrfd = fds[0];
+  peerfd = fd;
+  warnx("Taking over from the old server.");
+  return true;
+}
+
+static bool recv_session(uint32_t len, const int *fds, handoff_adopt_fn adopt) {
+  struct handoff_rec rec = {0};
+  uint8_t *data = NULL;
+  if (len < sizeof(rec) || !read_all(peerfd, &rec, sizeof(rec)))
+    return false;
+  len -= sizeof(rec);
+  if ((uint64_t)rec.capslen + rec.toclientlen + rec.toptylen + rec.partiallen != len)
+    return false;
+  if (len && (!(data = malloc(len)) || !read_all(peerfd, data, len))) {
+    free(data);
+    return false;
+  }
+
+  struct handoff_session s = {.commfd = fds[0], .ptyfd = fds[1], .pid = rec.pid};
+  if (!caps_decode(data, rec.capslen, &s.caps)) {
+    free(data);
+    return false;
+  }
+  s.toclient = data + rec.capslen;
+  s.toclientlen = rec.toclientlen;
+  s.topty = s.toclient + s.toclientlen;
+  s.toptylen = rec.toptylen;
+  s.partial = s.topty + s.toptylen;
+  s.partiallen = rec.partiallen;
+  adopt(&s);
+  free(data);
+  return true;
+}
+
+bool handoff_start(handoff_adopt_fn adopt) {
+  if (!sockpath)
+    return true;
+
+  if (peerfd >= 0) {
+    int nsessions = 0;
+    for (;;) {
+      struct handoff_hdr hdr;
+      int fds[2], nfds;
+      if (!recv_hdr(peerfd, &hdr, fds, &nfds)) {
+        warn("Error receiving sessions from the old server");
+        return false;
+      }
+      if (hdr.type == HM_END && !hdr.len && !nfds)
+        break;
+      if (hdr.type != HM_SESSION || nfds != 2 || !adopt || !recv_session(hdr.len, fds, adopt)) {
+        warnx("Got an invalid session from the old server.");
+        close_fds(fds, nfds);
+        return false;
+      }
+      ++nsessions;
+    }
+    close(peerfd);
+    peerfd = -1;
+    warnx("Took over %d sessions from the old server.", nsessions);
+  }
+
+  struct sockaddr_un addr;
+  if (!fill_addr(sockpath, &addr) || (listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    warn("Error creating handoff socket");
+    return false;
+  }
+  // the old server's socket, if any, is ours now
+  unlink(sockpath);
+  if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || chmod(sockpath, 0600) < 0 ||
+      listen(listenfd, 1) < 0) {
+    warn("Error listening for a successor");
+    close(listenfd);
+    listenfd = -1;
+    return false;
+  }
+  return true;
+}
+
+int handoff_fd() { return listenfd; }
+
+// read_all(), but gives up with ETIMEDOUT at the deadline. read_all() would block the
+// accept loop for as long as the peer stays silent.
+static bool read_timeout(int fd, void *buff, size_t len, int timeout_ms) {
+  uint64_t deadline = mono_ns() + (uint64_t)timeout_ms * 1000000;
+  for (size_t done = 0; done < len;) {
+    uint64_t now = mono_ns();
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int ready = now < deadline ? poll(&pfd, 1, (deadline - now + 999999) / 1000000) : 0;
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0) {
+      if (!ready)
+        errno = ETIMEDOUT;
+      return false;
+    }
+    ssize_t rd = read(fd, (uint8_t *)buff + done, len - done);
+    if (rd < 0 && errno == EINTR)
+      continue;
+    if (rd <= 0) {
+      if (!rd)
+        errno = EIO;
+      return false;
+    }
+    done += rd;
+  }
+  return true;
+}
+
+// the successor must be one of us
+static bool same_user(int fd) {
+#ifdef __linux__
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+    return false;
+  return cred.uid == geteuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  return !getpeereid(fd, &uid, &gid) && uid == geteuid();
+#endif
+}
+
+bool handoff_accept(int svrfd, bool *adopt) {
+  int fd = accept(listenfd, NULL, NULL);
+  if (fd < 0)
+    return false;
+  struct handoff_hello hello;
+  if (!same_user(fd)) {
+    warnx("Refusing handoff to a server of another user.");
+    goto refuse;
+  }
+  if (!read_timeout(fd, &hello, sizeof(hello), HANDOFF_HELLO_TIMEOUT_MS)) {
+    warn("Error receiving handoff request");
+    goto refuse;
+  }
+  if (hello.version != HANDOFF_VERSION) {
+    warnx("Refusing handoff to a server with handoff version %u.", hello.version);
+    goto refuse;
+  }
+
+  struct handoff_hdr hdr = {.type = HM_LISTENER};
+  struct iovec iov = {.iov_base = &hdr, .iov_len = sizeof(hdr)};
+  if (!send_msg(fd, &iov, 1, &svrfd, 1)) {
+    warn("Error handing over the listening socket");
+    goto refuse;
+  }
+  // it's the successor that waits for the next one
+  close(listenfd);
+  listenfd = -1;
+  close(svrfd);
+  peerfd = fd;
+  *adopt = hello.adopt;
+  warnx("Handing over to the new server.");
+  return true;
+
+refuse:
+  close(fd);
+  return false;
+}
+
+bool handoff_send_session(const struct handoff_session *s) {
+  uint8_t caps[CAPS_MAX_ENCODED];
+  struct handoff_rec rec = {
+    .pid = s->pid,
+    .capslen = caps_encode(&s->caps, caps, sizeof(caps)),
+    .toclientlen = s->toclientlen,
+    .toptylen = s->toptylen,
+    .partiallen = s->partiallen,
+  };
+  struct handoff_hdr hdr = {
+    .type = HM_SESSION,
+    .len = sizeof(rec) + rec.capslen + rec.toclientlen + rec.toptylen + rec.partiallen,
+  };
+  struct iovec iov[] = {
+    {.iov_base = &hdr, .iov_len = sizeof(hdr)},
+    {.iov_base = &rec, .iov_len = sizeof(rec)},
+    {.iov_base = caps, .iov_len = rec.capslen},
+    {.iov_base = (void *)s->toclient, .iov_len = s->toclientlen},
+    {.iov_base = (void *)s->topty, .iov_len = s->toptylen},
+    {.iov_base = (void *)s->partial, .iov_len = s->partiallen},
+  };
+  int fds[2] = {s->commfd, s->ptyfd};
+  pthread_mutex_lock(&send_lock);
+  bool ok = peerfd >= 0 && send_msg(peerfd, iov, sizeof(iov) / sizeof(*iov), fds, 2);
+  pthread_mutex_unlock(&send_lock);
+  return ok;
+}
+
+void handoff_finish() {
+  struct handoff_hdr hdr = {.type = HM_END};
+  struct iovec iov = {.iov_base = &hdr, .iov_len = sizeof(hdr)};
+  if (!send_msg(peerfd, &iov, 1, NULL, 0))
+    warn("Error finishing the handoff");
+  close(peerfd);
+  peerfd = -1;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "caps.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// live handoff (-H <path>): upgrade the server binary without dropping the listening socket
+// or any session.
+//  - a server started with -H waits for its successor on the Unix socket <path>.
+//  - a server started with -H while another one is waiting there takes over from it, instead
+//    of creating its own listening socket. the old server passes the listening socket over
+//    with SCM_RIGHTS and stops accepting, so connections waiting in the backlog are not lost.
+//  - the threaded server (shard.h) also passes every session to a threaded successor: the comm
+//    socket and mPTY, the launched app's pid and the capabilities, along with whatever the relay
+//    still holds (output not yet written to the client, input not yet written to mPTY, and a
+//    partially received frame). each shard sends its own sessions, one sendmsg per session.
+//  - sessions that can't move keep running in the old server, which exits once they are over:
+//    TLS sessions without kTLS (their record layer runs in a relay thread), and all sessions if
+//    the successor is a forking server. sessions of the forking server are processes of their
+//    own, and are not affected by the handoff at all.
+// only a successor running as the same user is accepted. UDP servers can't hand off, as their
+// UDP relay runs in the server process.
+
+// a session of the threaded server, as it is handed over
+struct handoff_session {
+  int commfd;
+  int ptyfd;
+  pid_t pid;
+  struct caps caps;
+  // output not yet written to the client
+  const uint8_t *toclient;
+  size_t toclientlen;
+  // input not yet written to mPTY
+  const uint8_t *topty;
+  size_t toptylen;
+  // the start of a frame from the client that has not fully arrived yet
+  const uint8_t *partial;
+  size_t partiallen;
+};
+
+typedef void (*handoff_adopt_fn)(const struct handoff_session *s);
+
+// new server. if a server is waiting for its successor on `path`, take over its listening socket
+// into `*svrfd`, otherwise `*svrfd` is -1. `adopt` tells whether we can take over sessions.
+// returns false on error.
+bool handoff_takeover(const char *path, bool adopt, int *svrfd);
+
+// new server: receive the old server's sessions (if any), calling `adopt` for each, then start
+// waiting for a successor ourselves. returns false on error.
+bool handoff_start(handoff_adopt_fn adopt);
+
+// the fd to poll for a successor, -1 if there is none
+int handoff_fd();
+
+// old server: a successor connected to `handoff_fd`. hand `svrfd` over and close it.
+// `*adopt` tells whether the successor takes sessions. returns false if the handoff did not
+// happen, in which case we go on as before.
+bool handoff_accept(int svrfd, bool *adopt);
+
+// old server, thread safe: hand one session over. our copies of its fds can be closed then.
+bool handoff_send_session(const struct handoff_session *s);
+
+// old server: all sessions that can move have been sent
+void handoff_finish();
@@ -0,0 +1,582 @@
+#include "history.h"
+#include "utils.h"
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// output per chunk
+#define HIST_CHUNK_SIZE (64 * 1024)
+// a chunk is written out once its first byte is this old, so that queries see recent output
+#define HIST_FLUSH_MS 5000
+// output the writer has yet to take, per session. past this, output is left out.
+#define HIST_PENDING_MAX (8 * 1024 * 1024)
+// the writer's queue of a session is given back to the OS after a burst
+#define HIST_WORK_KEEP (256 * 1024)
+// time marks: one per read, at most every HIST_MARK_MS and HIST_MARKS_MAX per chunk
+#define HIST_MARK_MS 10
+#define HIST_MARKS_MAX 1024
+// the trigram filter of a chunk has 2^n bits, more for larger chunks. the writer fills the
+// largest one, and folds it down to size when the chunk is written out.
+#define HIST_BLOOM_MIN_BITS 256
+#define HIST_BLOOM_MAX_BITS 32768
+#define HIST_LEAD_MAX (HISTORY_QUERY_MAX - 1)
+// for the lines printed by queries
+#define HIST_CONTEXT 60
+
+#define HIST_MAGIC "PTYFHIST"
+#define HIST_VERSION 1
+
+// start of the .idx file
+struct hist_file_hdr {
+  char magic[8];
+  uint32_t version;
+  int32_t pid;
+  uint64_t start_ms;
+};
+
+// an entry of the .idx file, followed by the chunk's filter (`bloombits` / 8 bytes)
+struct hist_chunk_hdr {
+  // of the compressed chunk in the .dat file
+  uint64_t datoff;
+  // of the chunk's output in the session's output
+  uint64_t rawoff;
+  // wall clock when its first byte was read
+  uint64_t start_ms;
+  uint32_t zlen;
+  uint32_t rawlen;
+  uint16_t leadlen;
+  uint16_t nmarks;
+  uint32_t bloombits;
+};
+
+// uncompressed, a chunk is its marks, then the lead-in, then its output. a mark is when the
+// output at `off` was read, in ms after the chunk's start_ms.
+struct hist_mark {
+  uint32_t off;
+  uint32_t ms;
+};
+
+// what the relay queues for the writer, each followed by `len` bytes of output
+struct hist_rec {
+  uint64_t ms;
+  uint32_t len;
+};
+
+struct history_session {
+  // shared with the relay, under `lock`
+  struct bytequeue pending;
+  uint64_t dropped;
+  bool closing;
+  struct history_session *next;
+
+  // everything below is the writer's
+  struct bytequeue work;
+  // `closing` as of when `work` was taken
+  bool last;
+  bool failed;
+  bool warned;
+  pid_t pid;
+  int datfd;
+  int idxfd;
+  uint64_t datoff;
+  uint64_t rawoff;
+  // the chunk being filled. NULL between chunks.
+  uint8_t *chunk;
+  size_t chunklen;
+  uint64_t chunk_ms;
+  struct hist_mark marks[HIST_MARKS_MAX];
+  int nmarks;
+  uint64_t mark_ms;
+  // the output right before the chunk
+  uint8_t lead[HIST_LEAD_MAX];
+  size_t leadlen;
+  // the last three bytes, and how many of them there are
+  uint32_t tri;
+  int trilen;
+  uint8_t bloom[HIST_BLOOM_MAX_BITS / 8];
+};
+
+static const char *histdir;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct history_session *sessions;
+static pthread_t writer;
+static bool writer_running;
+static bool stopping;
+
+static uint64_t wall_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static uint32_t trigram_bit(uint32_t tri, uint32_t bits) { return ((tri * 2654435761u) >> 17) & (bits - 1); }
+
+static bool bloom_test(const uint8_t *bloom, uint32_t bits, uint32_t tri) {
+  uint32_t bit = trigram_bit(tri, bits);
+  return bloom[bit / 8] & (1 << (bit % 8));
+}
+
+bool history_init(const char *dir) {
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    warn("Error creating history directory");
+    return false;
+  }
+  if (access(dir, W_OK | X_OK) < 0) {
+    warn("Error accessing history directory");
+    return false;
+  }
+  histdir = dir;
+  return true;
+}
+
+// the writer's side
+
+static void bloom_add(struct history_session *h, uint8_t b) {
+  h->tri = (h->tri << 8 | b) & 0xffffff;
+  if (h->trilen < 3)
+    ++h->trilen;
+  if (h->trilen == 3) {
+    uint32_t bit = trigram_bit(h->tri, HIST_BLOOM_MAX_BITS);
+    h->bloom[bit / 8] |= 1 << (bit % 8);
+  }
+}
+
+static bool chunk_start(struct history_session *h, uint64_t ms) {
+  if (!(h->chunk = malloc(HIST_CHUNK_SIZE)))
+    return false;
+  h->chunklen = 0;
+  h->chunk_ms = ms;
+  h->nmarks = 0;
+  memset(h->bloom, 0, sizeof(h->bloom));
+  // matches that end in this chunk may start in the lead-in
+  h->trilen = 0;
+  for (size_t i = 0; i < h->leadlen; ++i)
+    bloom_add(h, h->lead[i]);
+  return true;
+}
+
+static bool chunk_write(struct history_session *h) {
+  uint32_t bits = HIST_BLOOM_MIN_BITS;
+  while (bits < (h->leadlen + h->chunklen) / 2 && bits < HIST_BLOOM_MAX_BITS)
+    bits *= 2;
+  for (uint32_t b = HIST_BLOOM_MAX_BITS; b > bits; b /= 2) {
+    for (uint32_t i = 0; i < b / 16; ++i)
+      h->bloom[i] |= h->bloom[i + b / 16];
+  }
+
+  size_t markslen = h->nmarks * sizeof(struct hist_mark);
+  uLong plainlen = markslen + h->leadlen + h->chunklen;
+  uLongf zlen = compressBound(plainlen);
+  uint8_t *plain = malloc(plainlen);
+  uint8_t *z = malloc(zlen);
+  bool ok = plain && z;
+  if (ok) {
+    memcpy(plain, h->marks, markslen);
+    memcpy(plain + markslen, h->lead, h->leadlen);
+    memcpy(plain + markslen + h->leadlen, h->chunk, h->chunklen);
+    ok = compress2(z, &zlen, plain, plainlen, Z_BEST_SPEED) == Z_OK;
+  }
+  if (ok) {
+    struct hist_chunk_hdr hdr = {
+      .datoff = h->datoff,
+      .rawoff = h->rawoff,
+      .start_ms = h->chunk_ms,
+      .zlen = zlen,
+      .rawlen = h->chunklen,
+      .leadlen = h->leadlen,
+      .nmarks = h->nmarks,
+      .bloombits = bits,
+    };
+    struct iovec iov[] = {{.iov_base = &hdr, .iov_len = sizeof(hdr)}, {.iov_base = h->bloom, .iov_len = bits / 8}};
+    // the data first, so that an entry in the index always has its chunk
+    ok = write_all(h->datfd, z, zlen) && writev_all(h->idxfd, iov, 2);
+    h->datoff += zlen;
+  }
+  free(plain);
+  free(z);
+  return ok;
+}
+
+static void chunk_end(struct history_session *h) {
+  if (!h->failed && !chunk_write(h)) {
+    warn("Error writing history of session %d", (int)h->pid);
+    h->failed = true;
+  }
+  h->rawoff += h->chunklen;
+  // the next lead-in
+  size_t keep = h->chunklen < HIST_LEAD_MAX ? h->chunklen : HIST_LEAD_MAX;
+  size_t fromlead = h->leadlen < HIST_LEAD_MAX - keep ? h->leadlen : HIST_LEAD_MAX - keep;
+  memmove(h->lead, h->lead + h->leadlen - fromlead, fromlead);
+  memcpy(h->lead + fromlead, h->chunk + h->chunklen - keep, keep);
+  h->leadlen = fromlead + keep;
+  free(h->chunk);
+  h->chunk = NULL;
+}
+
+static void add_output(struct history_session *h, uint64_t ms, const uint8_t *data, size_t len) {
+  while (len) {
+    if (!h->chunk && !chunk_start(h, ms)) {
+      warn("Error allocating history chunk");
+      return;
+    }
+    if (!h->nmarks || (ms >= h->mark_ms + HIST_MARK_MS && h->nmarks < HIST_MARKS_MAX)) {
+      uint64_t delta = ms > h->chunk_ms ? ms - h->chunk_ms : 0;
+      h->marks[h->nmarks++] = (struct hist_mark){.off = h->chunklen, .ms = delta < UINT32_MAX ? delta : UINT32_MAX};
+      h->mark_ms = ms;
+    }
+    size_t n = HIST_CHUNK_SIZE - h->chunklen;
+    if (n > len)
+      n = len;
+    for (size_t i = 0; i < n; ++i)
+      bloom_add(h, data[i]);
+    memcpy(h->chunk + h->chunklen, data, n);
+    h->chunklen += n;
+    data += n;
+    len -= n;
+    if (h->chunklen == HIST_CHUNK_SIZE)
+      chunk_end(h);
+  }
+}
+
+static void take_work(struct history_session *h) {
+  size_t off = 0;
+  while (off + sizeof(struct hist_rec) <= h->work.len) {
+    struct hist_rec rec;
+    memcpy(&rec, h->work.buff + h->work.off + off, sizeof(rec));
+    off += sizeof(rec);
+    add_output(h, rec.ms, h->work.buff + h->work.off + off, rec.len);
+    off += rec.len;
+  }
+  h->work.off = h->work.len = 0;
+  if (h->work.cap > HIST_WORK_KEEP)
+    bq_free(&h->work);
+}
+
+static void session_free(struct history_session *h) {
+  close(h->datfd);
+  close(h->idxfd);
+  bq_free(&h->pending);
+  bq_free(&h->work);
+  free(h->chunk);
+  free(h);
+}
+
+static void *writer_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    for (struct history_session *h = sessions; h; h = h->next) {
+      // the relay goes on with the writer's empty queue
+      struct bytequeue q = h->work;
+      h->work = h->pending;
+      h->pending = q;
+      h->last = h->closing;
+      if (h->dropped && !h->warned) {
+        warnx("History of session %d is falling behind. Some output is left out.", (int)h->pid);
+        h->warned = true;
+      }
+    }
+    // sessions are only added in front, and only removed by us
+    struct history_session *head = sessions;
+    pthread_mutex_unlock(&lock);
+
+    uint64_t now = wall_ms();
+    for (struct history_session *h = head; h; h = h->next) {
+      take_work(h);
+      if (h->chunk && (h->last || now - h->chunk_ms >= HIST_FLUSH_MS))
+        chunk_end(h);
+    }
+
+    pthread_mutex_lock(&lock);
+    bool more = false;
+    for (struct history_session **pp = &sessions; *pp;) {
+      struct history_session *h = *pp;
+      if (h->last) {
+        *pp = h->next;
+        session_free(h);
+        continue;
+      }
+      more |= h->pending.len || h->closing;
+      pp = &h->next;
+    }
+    if (stopping && !sessions)
+      break;
+    if (!more) {
+      // sessions are gone over at least every second, for the chunks to write out
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += 1;
+      pthread_cond_timedwait(&cond, &lock, &ts);
+    }
+  }
+  writer_running = false;
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// the relay's side
+
+static int open_file(uint64_t ms, pid_t pid, const char *ext) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%d-%llu.%s", histdir, (int)pid, (unsigned long long)ms, ext);
+  return open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+}
+
+struct history_session *history_open(pid_t pid) {
+  if (!histdir)
+    return NULL;
+  struct history_session *h = calloc(1, sizeof(*h));
+  if (!h) {
+    warn("Error allocating history");
+    return NULL;
+  }
+  h->pid = pid;
+  h->datfd = h->idxfd = -1;
+  uint64_t ms = wall_ms();
+  struct hist_file_hdr hdr = {.magic = HIST_MAGIC, .version = HIST_VERSION, .pid = pid, .start_ms = ms};
+  if ((h->datfd = open_file(ms, pid, "dat")) < 0 || (h->idxfd = open_file(ms, pid, "idx")) < 0 ||
+      !write_all(h->idxfd, &hdr, sizeof(hdr))) {
+    warn("Error creating history of session %d", (int)pid);
+    goto error;
+  }
+
+  pthread_mutex_lock(&lock);
+  if (!writer_running) {
+    if ((errno = pthread_create(&writer, NULL, writer_main, NULL))) {
+      pthread_mutex_unlock(&lock);
+      warn("Error starting history writer");
+      goto error;
+    }
+    writer_running = true;
+    stopping = false;
+  }
+  h->next = sessions;
+  sessions = h;
+  pthread_mutex_unlock(&lock);
+  return h;
+
+error:
+  if (h->datfd >= 0)
+    close(h->datfd);
+  if (h->idxfd >= 0)
+    close(h->idxfd);
+  free(h);
+  return NULL;
+}
+
+void history_append(struct history_session *h, const uint8_t *data, size_t len) {
+  if (!h || !len)
+    return;
+  struct hist_rec rec = {.ms = wall_ms(), .len = len};
+  pthread_mutex_lock(&lock);
+  bool wake = !h->pending.len;
+  if (h->pending.len + sizeof(rec) + len > HIST_PENDING_MAX || !bq_append(&h->pending, &rec, sizeof(rec)))
+    h->dropped += len;
+  else if (!bq_append(&h->pending, data, len)) {
+    h->pending.len -= sizeof(rec);
+    h->dropped += len;
+  }
+  if (wake)
+    pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+}
+
+void history_close(struct history_session *h) {
+  if (!h)
+    return;
+  pthread_mutex_lock(&lock);
+  h->closing = true;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+}
+
+void history_finish() {
+  pthread_mutex_lock(&lock);
+  bool running = writer_running;
+  stopping = true;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+  if (running)
+    pthread_join(writer, NULL);
+}
+
+// queries
+
+static uint64_t name_ms(const char *name) {
+  const char *dash = strchr(name, '-');
+  return dash ? strtoull(dash + 1, NULL, 10) : 0;
+}
+
+static int is_index(const struct dirent *de) {
+  size_t len = strlen(de->d_name);
+  return len > 4 && !strcmp(de->d_name + len - 4, ".idx");
+}
+
+// oldest session first
+static int by_start(const struct dirent **a, const struct dirent **b) {
+  uint64_t x = name_ms((*a)->d_name), y = name_ms((*b)->d_name);
+  return x < y ? -1 : x > y ? 1 : strcmp((*a)->d_name, (*b)->d_name);
+}
+
+// the line around a match, without escape sequences and control characters
+static void print_context(const uint8_t *win, size_t winlen, size_t start, size_t end) {
+  size_t from = start > HIST_CONTEXT ? start - HIST_CONTEXT : 0;
+  size_t to = end + HIST_CONTEXT < winlen ? end + HIST_CONTEXT : winlen;
+  for (size_t i = start; i > from; --i) {
+    if (win[i - 1] == '\n' || win[i - 1] == '\r') {
+      from = i;
+      break;
+    }
+  }
+  for (size_t i = end; i < to; ++i) {
+    if (win[i] == '\n' || win[i] == '\r') {
+      to = i;
+      break;
+    }
+  }
+  for (size_t i = from; i < to; ++i) {
+    if (win[i] == 0x1b && i + 1 < to && win[i + 1] == '[') {
+      // CSI: parameters and intermediates, up to the final byte
+      for (i += 2; i < to && (win[i] < 0x40 || win[i] > 0x7e); ++i)
+        ;
+      continue;
+    }
+    putchar(win[i] < 0x20 || win[i] == 0x7f ? '.' : win[i]);
+  }
+  putchar('\n');
+}
+
+static void print_match(const char *name, const struct hist_chunk_hdr *ch, const struct hist_mark *marks,
+                        const uint8_t *win, size_t start, size_t end) {
+  // the time its last byte was read
+  size_t last = end - 1 - ch->leadlen;
+  uint64_t ms = ch->start_ms;
+  for (int i = 0; i < ch->nmarks && marks[i].off <= last; ++i)
+    ms = ch->start_ms + marks[i].ms;
+  time_t secs = ms / 1000;
+  struct tm tm;
+  char when[32];
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&secs, &tm));
+  printf("%s  %s.%03u  %llu  ", name, when, (unsigned)(ms % 1000),
+         (unsigned long long)(ch->rawoff - ch->leadlen + start));
+  print_context(win, ch->leadlen + ch->rawlen, start, end);
+}
+
+// returns the number of matches, or -1 if the files are unusable
+static int query_session(const char *dir, const char *idxname, const char *pattern, const uint32_t *tris, int ntris) {
+  char path[PATH_MAX], name[NAME_MAX];
+  snprintf(name, sizeof(name), "%.*s", (int)(strlen(idxname) - 4), idxname);
+  snprintf(path, sizeof(path), "%s/%s", dir, idxname);
+  FILE *idx = fopen(path, "rb");
+  snprintf(path, sizeof(path), "%s/%s.dat", dir, name);
+  int datfd = open(path, O_RDONLY | O_CLOEXEC);
+  struct hist_file_hdr hdr;
+  if (!idx || datfd < 0 || fread(&hdr, sizeof(hdr), 1, idx) != 1 || memcmp(hdr.magic, HIST_MAGIC, 8) ||
+      hdr.version != HIST_VERSION) {
+    warnx("%s: not a usable session history", name);
+    if (idx)
+      fclose(idx);
+    if (datfd >= 0)
+      close(datfd);
+    return -1;
+  }
+
+  size_t plen = strlen(pattern);
+  int nmatches = 0;
+  uint8_t bloom[HIST_BLOOM_MAX_BITS / 8];
+  uint8_t *z = NULL, *plain = NULL;
+  struct hist_chunk_hdr ch;
+  // the last entry may still be being written
+  while (fread(&ch, sizeof(ch), 1, idx) == 1) {
+    if (ch.bloombits < HIST_BLOOM_MIN_BITS || ch.bloombits > HIST_BLOOM_MAX_BITS ||
+        (ch.bloombits & (ch.bloombits - 1)) || ch.rawlen > HIST_CHUNK_SIZE || ch.leadlen > HIST_LEAD_MAX ||
+        ch.nmarks > HIST_MARKS_MAX) {
+      warnx("%s: corrupt index", name);
+      break;
+    }
+    if (fread(bloom, ch.bloombits / 8, 1, idx) != 1)
+      break;
+    bool candidate = true;
+    for (int i = 0; i < ntris && candidate; ++i)
+      candidate = bloom_test(bloom, ch.bloombits, tris[i]);
+    if (!candidate)
+      continue;
+
+    size_t markslen = ch.nmarks * sizeof(struct hist_mark);
+    uLongf plainlen = markslen + ch.leadlen + ch.rawlen, gotlen = plainlen;
+    free(z);
+    free(plain);
+    z = malloc(ch.zlen ? ch.zlen : 1);
+    plain = malloc(plainlen ? plainlen : 1);
+    if (!z || !plain) {
+      warn("Error allocating buffers");
+      break;
+    }
+    if (pread(datfd, z, ch.zlen, ch.datoff) != (ssize_t)ch.zlen || uncompress(plain, &gotlen, z, ch.zlen) != Z_OK ||
+        gotlen != plainlen) {
+      warnx("%s: corrupt chunk at %llu", name, (unsigned long long)ch.datoff);
+      continue;
+    }
+    struct hist_mark *marks = (struct hist_mark *)plain;
+    const uint8_t *win = plain + markslen;
+    size_t winlen = ch.leadlen + ch.rawlen;
+    for (const uint8_t *p = win; (p = memmem(p, win + winlen - p, pattern, plen)); ++p) {
+      size_t start = p - win;
+      // those that end in the lead-in are in the chunk before
+      if (start + plen <= ch.leadlen)
+        continue;
+      print_match(name, &ch, marks, win, start, start + plen);
+      ++nmatches;
+    }
+  }
+  free(z);
+  free(plain);
+  fclose(idx);
+  close(datfd);
+  return nmatches;
+}
+
+int history_query(const char *dir, const char *pattern) {
+  size_t plen = strlen(pattern);
+  if (!plen || plen > HISTORY_QUERY_MAX) {
+    warnx("The pattern must be 1 to %d bytes long.", HISTORY_QUERY_MAX);
+    return 2;
+  }
+  // shorter patterns have no trigrams, and every chunk is a candidate
+  uint32_t tris[HISTORY_QUERY_MAX];
+  int ntris = 0;
+  for (size_t i = 0; i + 3 <= plen; ++i)
+    tris[ntris++] = (uint8_t)pattern[i] << 16 | (uint8_t)pattern[i + 1] << 8 | (uint8_t)pattern[i + 2];
+
+  struct dirent **names;
+  int n = scandir(dir, &names, is_index, by_start);
+  if (n < 0) {
+    warn("Error reading history directory");
+    return 2;
+  }
+  int nmatches = 0;
+  bool failed = false;
+  for (int i = 0; i < n; ++i) {
+    int found = query_session(dir, names[i]->d_name, pattern, tris, ntris);
+    if (found < 0)
+      failed = true;
+    else
+      nmatches += found;
+    free(names[i]);
+  }
+  free(names);
+  // like grep
+  return nmatches ? 0 : failed ? 2 : 1;
+}
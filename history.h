@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// session history (-C <dir>): the server keeps everything each session's app prints, so that
+// it can be searched later (-Q) instead of scrolled through.
+//  - a session's output is stored in chunks of up to 64 KiB, compressed with zlib, in
+//    <dir>/<pid>-<start ms>.dat. a chunk is written out when it is full, when it is 5 s old,
+//    and when the session ends.
+//  - each chunk has an entry in <dir>/<pid>-<start ms>.idx, with its offsets, times (10 ms
+//    resolution) and a bloom filter of the trigrams in it. a query only decompresses the chunks
+//    whose filter has all of the pattern's trigrams.
+//  - each chunk also has the last HISTORY_QUERY_MAX - 1 bytes of output before it, so that
+//    matches that span chunks are found in the chunk they end in.
+// the relay only copies its output into a queue. compression, indexing and disk writes are
+// done by a thread of their own, and if it falls too far behind, output is left out of the
+// history rather than waited for.
+
+#define HISTORY_QUERY_MAX 256
+
+// server side. returns false if `dir` can't be used.
+bool history_init(const char *dir);
+
+struct history_session;
+
+// `pid` is the launched app. returns NULL if there is no history or on error.
+struct history_session *history_open(pid_t pid);
+
+// `data` has just been read from mPTY. `h` can be NULL.
+void history_append(struct history_session *h, const uint8_t *data, size_t len);
+
+// the session is over. what is left of it is written out in the background. `h` can be NULL.
+void history_close(struct history_session *h);
+
+// wait for everything to be written out, e.g. before the session process exits
+void history_finish();
+
+// -Q: print where `pattern` appears in the sessions in `dir`: session, time, offset in the
+// session's output and the line around it. returns the exit code for the app.
+int history_query(const char *dir, const char *pattern);
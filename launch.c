@@ -0,0 +1,280 @@
+#include "launch.h"
+#include "cgroup.h"
+#include "server.h"
+#include "utils.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+// opening a tty after setsid makes it the controlling terminal on Linux only. elsewhere, that
+// takes TIOCSCTTY, which posix_spawn cannot do.
+#if defined(__linux__) && defined(POSIX_SPAWN_SETSID)
+#define HAVE_SPAWN_SETSID
+#endif
+
+#define BENCH_MAX_SIZES 16
+
+extern char **environ;
+
+// the benchmark compares the two
+static bool use_fork;
+
+static _Noreturn void child_fail(int status, const char *msg) {
+  warn_raw(msg);
+  _exit(status);
+}
+
+static pid_t spawn_fork(const char *launchreq, const struct launch_io *io) {
+  pid_t pid = fork();
+  if (pid)
+    return pid;
+
+  // child. only raw syscalls from here on, since the server may have other threads (see
+  // warn_raw).
+  if (io->closefd >= 0)
+    close(io->closefd);
+  // before anything can escape it
+  if (io->cgroup && cg_enabled() && !cg_attach_self())
+    _exit(1);
+
+  // don't let the launched app inherit the server's signal setup
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigprocmask(SIG_SETMASK, &sigs, NULL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+
+  // this must be done in this exact order to make this process
+  // as both session leader and controlling terminal
+  if (setsid() < 0)
+    child_fail(1, "Error setting session leader");
+  if (io->pts) {
+    int ptys = open(io->pts, O_RDWR);
+    if (ptys < 0)
+      child_fail(1, "Error opening sPTY");
+    if (ioctl(ptys, TIOCSCTTY, 0) < 0)
+      child_fail(1, "Error setting controlling terminal");
+    if (tcsetpgrp(ptys, getpid()) < 0)
+      child_fail(1, "Error setting foreground process group");
+    // make sPTY our stdio!
+    for (int i = 0; i <= 2; ++i) {
+      if (dup2(ptys, i) != i)
+        child_fail(1, "Error dup2 sPTY to stdio");
+    }
+    if (ptys > 2)
+      close(ptys);
+  } else {
+    for (int i = 0; i <= 2; ++i) {
+      if (dup2(io->stdio[i], i) != i)
+        child_fail(1, "Error dup2 to stdio");
+    }
+  }
+
+  char *args[2] = {(char *)launchreq, NULL};
+  execvp(launchreq, args);
+  // the app's stdio is ours, so this is where the client sees it
+  child_fail(127, "exec error");
+}
+
+#ifdef HAVE_SPAWN_SETSID
+static pid_t spawn_posix(const char *launchreq, const struct launch_io *io) {
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  int rc = posix_spawn_file_actions_init(&fa);
+  if (rc) {
+    errno = rc;
+    return -1;
+  }
+  if ((rc = posix_spawnattr_init(&attr))) {
+    posix_spawn_file_actions_destroy(&fa);
+    errno = rc;
+    return -1;
+  }
+
+  sigset_t mask, defaults;
+  sigemptyset(&mask);
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGCHLD);
+  sigaddset(&defaults, SIGPIPE);
+  rc = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  if (!rc)
+    rc = posix_spawnattr_setsigmask(&attr, &mask);
+  if (!rc)
+    rc = posix_spawnattr_setsigdefault(&attr, &defaults);
+  if (!rc && io->closefd >= 0)
+    rc = posix_spawn_file_actions_addclose(&fa, io->closefd);
+  if (io->pts) {
+    // file actions come after setsid, so this makes sPTY our controlling terminal, with our
+    // process group in the foreground
+    if (!rc)
+      rc = posix_spawn_file_actions_addopen(&fa, 0, io->pts, O_RDWR, 0);
+    for (int i = 1; i <= 2 && !rc; ++i)
+      rc = posix_spawn_file_actions_adddup2(&fa, 0, i);
+  } else {
+    for (int i = 0; i <= 2 && !rc; ++i)
+      rc = posix_spawn_file_actions_adddup2(&fa, io->stdio[i], i);
+  }
+
+  pid_t pid = -1;
+  char *args[2] = {(char *)launchreq, NULL};
+  if (!rc)
+    rc = posix_spawnp(&pid, launchreq, &fa, &attr, args, environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  if (rc) {
+    errno = rc;
+    return -1;
+  }
+  return pid;
+}
+#endif
+
+pid_t launch_app(const char *launchreq, const struct launch_io *io) {
+#ifdef HAVE_SPAWN_SETSID
+  // see cgroup.h
+  if (!use_fork && !(io->cgroup && cg_enabled()))
+    return spawn_posix(launchreq, io);
+#endif
+  return spawn_fork(launchreq, io);
+}
+
+struct bench_config {
+  unsigned n;
+  unsigned sizes[BENCH_MAX_SIZES];
+  int nsizes;
+  const char *app;
+};
+
+static struct bench_config cfg;
+
+static bool parse_spec(char *buff) {
+  cfg = (struct bench_config){.n = 200, .sizes = {0, 256, 1024}, .nsizes = 3, .app = "/bin/true"};
+  char *save;
+  for (char *tok = strtok_r(buff, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    if (sscanf(tok, "n=%u", &cfg.n) == 1)
+      continue;
+    if (!strncmp(tok, "app=", 4) && tok[4]) {
+      cfg.app = tok + 4;
+      continue;
+    }
+    if (!strncmp(tok, "rss=", 4)) {
+      cfg.nsizes = 0;
+      char *save2;
+      for (char *s = strtok_r(tok + 4, ":", &save2); s; s = strtok_r(NULL, ":", &save2)) {
+        if (cfg.nsizes == BENCH_MAX_SIZES || sscanf(s, "%u", &cfg.sizes[cfg.nsizes]) != 1) {
+          warnx("Invalid spawn benchmark sizes.");
+          return false;
+        }
+        ++cfg.nsizes;
+      }
+      continue;
+    }
+    warnx("Unknown spawn benchmark option '%s'", tok);
+    return false;
+  }
+  if (!cfg.n || !cfg.nsizes) {
+    warnx("Invalid spawn benchmark options.");
+    return false;
+  }
+  return true;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static unsigned long rss_mib() {
+  unsigned long size, resident;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return 0;
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+  fclose(f);
+  return resident * sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+// time `cfg.n` launches of a session's app, PTY included, from the parent's point of view
+static bool bench_spawns(uint64_t *samples) {
+  struct session_setup setup = {0};
+  for (unsigned i = 0; i < cfg.n; ++i) {
+    int ptym;
+    uint64_t start = mono_ns();
+    pid_t pid = spawn_pty_child(cfg.app, &setup, -1, &ptym);
+    samples[i] = mono_ns() - start;
+    if (pid < 0)
+      return false;
+    close(ptym);
+    waitpid(pid, NULL, 0);
+  }
+  qsort(samples, cfg.n, sizeof(*samples), cmp_u64);
+  return true;
+}
+
+int start_launch_bench(const char *spec) {
+#ifndef __linux__
+  (void)spec;
+  warnx("The spawn benchmark is supported only on Linux.");
+  return 1;
+#else
+  char *buff = strdup(spec);
+  uint64_t *samples = NULL;
+  uint8_t *ballast = NULL;
+  int ret = 1;
+  if (!buff || !parse_spec(buff))
+    goto out;
+  if (!(samples = malloc(cfg.n * sizeof(*samples)))) {
+    warn("Error allocating samples");
+    goto out;
+  }
+
+#ifdef HAVE_SPAWN_SETSID
+  static const bool methods[] = {true, false};
+#else
+  static const bool methods[] = {true};
+#endif
+  printf("%8s %12s %10s %10s %10s %10s\n", "rss(MiB)", "method", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+  for (int s = 0; s < cfg.nsizes; ++s) {
+    free(ballast);
+    ballast = NULL;
+    size_t size = (size_t)cfg.sizes[s] * 1024 * 1024;
+    // touched, so that its pages are mapped like a busy server's
+    if (size && !(ballast = malloc(size))) {
+      warn("Error allocating %u MiB", cfg.sizes[s]);
+      goto out;
+    }
+    if (size)
+      memset(ballast, 1, size);
+    for (int m = 0; m < sizeof(methods) / sizeof(*methods); ++m) {
+      use_fork = methods[m];
+      // spawn_pty_child has said why
+      if (!bench_spawns(samples))
+        goto out;
+      printf("%8lu %12s", rss_mib(), use_fork ? "fork" : "posix_spawn");
+      static const int pcts[] = {50, 90, 99, 100};
+      for (int p = 0; p < sizeof(pcts) / sizeof(*pcts); ++p)
+        printf(" %10.1f", samples[(cfg.n - 1) * pcts[p] / 100] / 1000.0);
+      putchar('\n');
+      fflush(stdout);
+    }
+  }
+  ret = 0;
+
+out:
+  use_fork = false;
+  free(ballast);
+  free(samples);
+  free(buff);
+  return ret;
+#endif
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// launching the apps of sessions. fork() copies the page tables of the server only for the
+// child to exec right away, which gets slow as the server grows: relay buffers, recordings, or
+// thousands of sessions in the threaded server. on Linux, the app is launched with posix_spawn
+// instead (a vfork-style clone in glibc and musl), and its setup is done by posix_spawn itself:
+// setsid, then opening the sPTY, which makes it the controlling terminal, then dup2 to stdio.
+// elsewhere, it is fork and exec.
+
+// how the app's stdio is set up
+struct launch_io {
+  // the sPTY to open as stdio and controlling terminal, or NULL
+  const char *pts;
+  // without `pts`: the fds that become stdin, stdout and stderr
+  int stdio[3];
+  // closed in the app if >= 0. the fds above are not, and all others must be close-on-exec.
+  int closefd;
+  // start the app in a cgroup of its own, if there is per-session accounting (see cgroup.h).
+  // the app is launched with fork and exec then.
+  bool cgroup;
+};
+
+// launch `launchreq` as the leader of a session of its own, with an empty signal mask and
+// default SIGCHLD and SIGPIPE. returns its pid, or -1 with errno set. whether an app that
+// cannot be executed is an error here, or exits with 127 after printing why on its stderr,
+// depends on the platform.
+pid_t launch_app(const char *launchreq, const struct launch_io *io);
+
+// spawn benchmark (-S): the latency of launching a session's app (PTY included), with fork
+// and with posix_spawn, as the memory of the launching process grows.
+// `spec` is a comma separated list of:
+//  - n=<spawns>: spawns per method and size (200)
+//  - rss=<MiB>[:<MiB>...]: the sizes, as memory allocated and touched beforehand (0:256:1024)
+//  - app=<path>: what to launch (/bin/true)
+// returns the exit code for the app. supported only on Linux.
+int start_launch_bench(const char *spec);
@@ -0,0 +1,407 @@
+#include "libptyfwd_priv.h"
+#include "auth.h"
+#include "caps.h"
+#include "common.h"
+#include "protocol.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert(PTYFWD_TICKET_SIZE == TICKET_SIZE, "Ticket size must match auth.h");
+_Static_assert(PTYFWD_FEATURE_FORWARD == CF_FORWARD && PTYFWD_FEATURE_TRACE == CF_TRACE &&
+        PTYFWD_FEATURE_EXEC == CF_EXEC && PTYFWD_FEATURE_CHAN_EOF == CF_CHAN_EOF,
+    "Feature bits must match caps.h");
+
+enum conn_state {
+  CS_PREAMBLE,  // waiting for the server's preamble
+  CS_V2_AUTH,   // legacy server: waiting for its challenge
+  CS_V2_RESULT, // legacy server: waiting for the verdict
+  CS_V3_AUTH,   // waiting for the challenge that follows the preamble
+  CS_V3_RESULT, // waiting for the verdict, and maybe a ticket
+  CS_READY,
+  CS_CLOSED, // by either side, or failed
+};
+
+struct ptyfwd_conn {
+  enum conn_state state;
+  struct cookie cookie;
+  // what we ask for, and what both sides support
+  struct caps local;
+  struct caps caps;
+  uint8_t ticket[TICKET_SIZE];
+  bool sent_ticket;
+  uint8_t nonce[NONCE_SIZE];
+  struct winch_data winch;
+  bool has_winch;
+  bool winch_sent;
+  // some frames make two events. the second one waits here.
+  struct ptyfwd_event pending;
+  bool has_pending;
+  // from the server, not parsed yet
+  struct bytequeue in;
+  // for the server, not written yet
+  struct bytequeue out;
+};
+
+static bool queue_frame(struct ptyfwd_conn *c, enum data_type type, const void *data, uint16_t len) {
+  uint8_t hdr[PROTO_HDR_MAX];
+  size_t hlen = proto_encode_header(hdr, len, type);
+  return bq_append(&c->out, hdr, hlen) && (!len || bq_append(&c->out, data, len));
+}
+
+// our first (and usually only) flight: preamble + handshake version, then either a session
+// ticket or the answer to the server's nonce, then the initial window size.
+static bool queue_v3_flight(struct ptyfwd_conn *c, enum data_type authtype, const uint8_t *nonce) {
+  uint8_t data[sizeof(preamble) + sizeof(uint16_t) + CAPS_MAX_ENCODED + TICKET_SIZE + TICKET_PROOF_SIZE];
+  uint16_t version = HANDSHAKE_VERSION;
+  memcpy(data, preamble, sizeof(preamble));
+  memcpy(data + sizeof(preamble), &version, sizeof(version));
+  size_t datalen = sizeof(preamble) + sizeof(version);
+  datalen += caps_encode(&c->local, data + datalen, sizeof(data) - datalen);
+  if (!queue_frame(c, DT_PREAMBLE, data, datalen))
+    return false;
+
+  if (authtype == DT_TICKET) {
+    memcpy(data, c->ticket, TICKET_SIZE);
+    if (!auth_ticket_proof(&c->cookie, c->ticket, data + TICKET_SIZE) ||
+        !queue_frame(c, DT_TICKET, data, TICKET_SIZE + TICKET_PROOF_SIZE))
+      return false;
+  } else if (authtype == DT_AUTH) {
+    if (!auth_answer_v3(&c->cookie, nonce, data) || !queue_frame(c, DT_AUTH, data, ANSWER_V3_SIZE))
+      return false;
+  }
+
+  c->winch_sent = true;
+  return !c->has_winch || queue_frame(c, DT_WINCH, &c->winch, sizeof(c->winch));
+}
+
+struct ptyfwd_conn *ptyfwd_client_new(const struct ptyfwd_client_config *cfg) {
+  if (cfg->cookielen > COOKIE_MAX_SIZE || (cfg->target && strlen(cfg->target) > CAP_TARGET_MAX)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  struct ptyfwd_conn *c = calloc(1, sizeof(*c));
+  if (!c)
+    return NULL;
+  c->cookie.size = cfg->cookielen;
+  if (cfg->cookielen)
+    memcpy(c->cookie.data, cfg->cookie, cfg->cookielen);
+  caps_local(&c->local);
+  c->local.features &= cfg->features;
+  if (cfg->target)
+    strcpy(c->local.target, cfg->target);
+  c->winch = (struct winch_data){.rows = cfg->rows, .cols = cfg->cols};
+  c->has_winch = cfg->rows || cfg->cols;
+
+  // a client holding a session ticket does not wait for the server's preamble: it sends its
+  // whole first flight right away, and the handshake is done in a single round trip.
+  if (c->cookie.size && cfg->ticket) {
+    memcpy(c->ticket, cfg->ticket, TICKET_SIZE);
+    if (!queue_v3_flight(c, DT_TICKET, NULL)) {
+      ptyfwd_free(c);
+      return NULL;
+    }
+    c->sent_ticket = true;
+  }
+  return c;
+}
+
+void ptyfwd_free(struct ptyfwd_conn *c) {
+  if (!c)
+    return;
+  bq_free(&c->in);
+  bq_free(&c->out);
+  // the cookie does not outlive the connection
+  memset(&c->cookie, 0, sizeof(c->cookie));
+  free(c);
+}
+
+bool ptyfwd_feed(struct ptyfwd_conn *c, const void *data, size_t len) {
+  return c->state == CS_CLOSED || !len || bq_append(&c->in, data, len);
+}
+
+size_t ptyfwd_want(const struct ptyfwd_conn *c) {
+  size_t avail = c->in.len;
+  const uint8_t *p = c->in.buff + c->in.off;
+  if (c->has_pending)
+    return 0;
+  // the shortest frame is a type and a 1 byte length
+  if (avail < 2)
+    return 2 - avail;
+  size_t hlen = (p[0] & 0x80) ? 3 : 2;
+  if (avail < hlen)
+    return hlen - avail;
+  uint16_t len = 0;
+  memcpy(&len, p + 1, hlen - 1);
+  return avail < hlen + len ? hlen + len - avail : 0;
+}
+
+// take the next complete frame off the input
+static bool next_frame(struct ptyfwd_conn *c, uint16_t *len, enum data_type *type, const uint8_t **data) {
+  if (ptyfwd_want(c) || !c->in.len)
+    return false;
+  const uint8_t *p = c->in.buff + c->in.off;
+  size_t hlen = (p[0] & 0x80) ? 3 : 2;
+  *len = 0;
+  memcpy(len, p + 1, hlen - 1);
+  *type = p[0] & 0x7F;
+  *data = p + hlen;
+  c->in.off += hlen + *len;
+  c->in.len -= hlen + *len;
+  return true;
+}
+
+static bool fail(struct ptyfwd_conn *c, struct ptyfwd_event *ev, const char *message) {
+  c->state = CS_CLOSED;
+  ev->type = PTYFWD_EV_ERROR;
+  ev->message = message;
+  return true;
+}
+
+// the handshake is done. tell about `warning` first, if any.
+static bool ready(struct ptyfwd_conn *c, struct ptyfwd_event *ev, const char *warning) {
+  c->state = CS_READY;
+  ev->type = PTYFWD_EV_READY;
+  if (!warning)
+    return true;
+  c->pending = *ev;
+  c->has_pending = true;
+  ev->type = PTYFWD_EV_WARNING;
+  ev->message = warning;
+  return true;
+}
+
+static bool handle_preamble(struct ptyfwd_conn *c, enum data_type type, const uint8_t *data, uint16_t len,
+    struct ptyfwd_event *ev) {
+  if (len < sizeof(preamble) || type != DT_PREAMBLE)
+    return fail(c, ev, "Got unknown preamble from server.");
+  if (memcmp(data, preamble, sizeof(preamble)))
+    return fail(c, ev, "Invalid server version!");
+
+  // newer servers append the highest handshake version they support, and their capabilities
+  uint16_t version = PROTOCOL_VERSION;
+  if (len >= sizeof(preamble) + sizeof(version))
+    memcpy(&version, data + sizeof(preamble), sizeof(version));
+
+  if (version >= HANDSHAKE_VERSION) {
+    struct caps server_caps;
+    size_t capsoff = sizeof(preamble) + sizeof(version);
+    if (!caps_decode(data + capsoff, len - capsoff, &server_caps))
+      return fail(c, ev, "Got malformed capabilities from server.");
+    caps_merge(&c->local, &server_caps, &c->caps);
+    c->state = CS_V3_AUTH;
+    return false;
+  }
+
+  caps_legacy(&c->caps);
+  if (c->sent_ticket) {
+    // the server has been downgraded since it gave us the ticket
+    c->pending = (struct ptyfwd_event){.type = PTYFWD_EV_ERROR,
+        .message = "Server does not support session tickets. Please reconnect."};
+    c->has_pending = true;
+    c->state = CS_CLOSED;
+    ev->type = PTYFWD_EV_TICKET;
+    return true;
+  }
+  // legacy servers want the preamble back
+  if (!queue_frame(c, DT_PREAMBLE, preamble, sizeof(preamble)))
+    return fail(c, ev, "Out of memory.");
+  c->state = CS_V2_AUTH;
+  return false;
+}
+
+static bool handle_v2(struct ptyfwd_conn *c, enum data_type type, const uint8_t *data, uint16_t len,
+    struct ptyfwd_event *ev) {
+  if (c->state == CS_V2_RESULT) {
+    switch (type) {
+    case DT_CLOSE:
+      return fail(c, ev, "Access denied!");
+    case DT_NONE:
+      return ready(c, ev, NULL);
+    default:
+      return fail(c, ev, "Invalid server response.");
+    }
+  }
+
+  if (type == DT_NONE)
+    return ready(c, ev, c->cookie.size ? "Warning: server does not require authentication." : NULL);
+  if (type != DT_AUTH)
+    return fail(c, ev, "Server sent unknown response.");
+  if (!c->cookie.size)
+    return fail(c, ev, "Server requires authentication. Please supply cookie file.");
+  if (len != NONCE_SIZE)
+    return fail(c, ev, "Invalid nonce size.");
+  uint8_t answer[ANSWER_SIZE];
+  if (!auth_answer_v2(&c->cookie, data, answer) || !queue_frame(c, DT_AUTH, answer, ANSWER_SIZE))
+    return fail(c, ev, "Error computing authentication answer.");
+  c->state = CS_V2_RESULT;
+  return false;
+}
+
+static bool handle_v3(struct ptyfwd_conn *c, enum data_type type, const uint8_t *data, uint16_t len,
+    struct ptyfwd_event *ev) {
+  if (c->state == CS_V3_AUTH) {
+    // the server's challenge arrives together with its preamble
+    if (type == DT_NONE) {
+      if (!c->sent_ticket && !queue_v3_flight(c, DT_NONE, NULL))
+        return fail(c, ev, "Out of memory.");
+      return ready(c, ev, c->cookie.size ? "Warning: server does not require authentication." : NULL);
+    }
+    if (type != DT_AUTH)
+      return fail(c, ev, "Server sent unknown response.");
+    if (!c->cookie.size)
+      return fail(c, ev, "Server requires authentication. Please supply cookie file.");
+    if (len != NONCE_SIZE)
+      return fail(c, ev, "Invalid nonce size.");
+    // kept in case the server does not take our ticket
+    memcpy(c->nonce, data, NONCE_SIZE);
+    if (!c->sent_ticket && !queue_v3_flight(c, DT_AUTH, data))
+      return fail(c, ev, "Error computing authentication answer.");
+    c->state = CS_V3_RESULT;
+    return false;
+  }
+
+  switch (type) {
+  case DT_AUTH: {
+    // server did not accept our ticket. answer the nonce instead.
+    uint8_t answer[ANSWER_V3_SIZE];
+    if (!c->sent_ticket || len)
+      return fail(c, ev, "Invalid server response.");
+    c->sent_ticket = false;
+    if (!auth_answer_v3(&c->cookie, c->nonce, answer) || !queue_frame(c, DT_AUTH, answer, ANSWER_V3_SIZE))
+      return fail(c, ev, "Error computing authentication answer.");
+    return false;
+  }
+  case DT_TICKET:
+    if (len != TICKET_SIZE)
+      return false;
+    ev->type = PTYFWD_EV_TICKET;
+    ev->data = data;
+    ev->len = len;
+    return true;
+  case DT_CLOSE:
+    return fail(c, ev, "Access denied!");
+  case DT_NONE:
+    return ready(c, ev, NULL);
+  default:
+    return fail(c, ev, "Invalid server response.");
+  }
+}
+
+static bool handle_session(struct ptyfwd_conn *c, enum data_type type, const uint8_t *data, uint16_t len,
+    struct ptyfwd_event *ev) {
+  ev->data = data;
+  ev->len = len;
+  switch (type) {
+  case DT_REGULAR:
+    ev->type = PTYFWD_EV_OUTPUT;
+    return true;
+  case DT_STDERR:
+    ev->type = PTYFWD_EV_STDERR;
+    return true;
+  case DT_EXIT:
+    if (len != sizeof(ev->status))
+      return false;
+    ev->type = PTYFWD_EV_EXIT;
+    memcpy(&ev->status, data, sizeof(ev->status));
+    return true;
+  case DT_CLOSE:
+    c->state = CS_CLOSED;
+    ev->type = PTYFWD_EV_CLOSED;
+    return true;
+  default:
+    ev->type = PTYFWD_EV_FRAME;
+    ev->frame_type = type;
+    return true;
+  }
+}
+
+bool ptyfwd_next_event(struct ptyfwd_conn *c, struct ptyfwd_event *ev) {
+  if (c->has_pending) {
+    *ev = c->pending;
+    c->has_pending = false;
+    return true;
+  }
+  uint16_t len;
+  enum data_type type;
+  const uint8_t *data;
+  while (c->state != CS_CLOSED && next_frame(c, &len, &type, &data)) {
+    *ev = (struct ptyfwd_event){0};
+    bool got;
+    switch (c->state) {
+    case CS_PREAMBLE:
+      got = handle_preamble(c, type, data, len, ev);
+      break;
+    case CS_V2_AUTH:
+    case CS_V2_RESULT:
+      got = handle_v2(c, type, data, len, ev);
+      break;
+    case CS_V3_AUTH:
+    case CS_V3_RESULT:
+      got = handle_v3(c, type, data, len, ev);
+      break;
+    default:
+      got = handle_session(c, type, data, len, ev);
+      break;
+    }
+    if (got)
+      return true;
+  }
+  return false;
+}
+
+size_t ptyfwd_output(const struct ptyfwd_conn *c, const uint8_t **data) {
+  *data = c->out.buff + c->out.off;
+  return c->out.len;
+}
+
+void ptyfwd_output_consume(struct ptyfwd_conn *c, size_t len) {
+  if (len > c->out.len)
+    len = c->out.len;
+  c->out.off += len;
+  c->out.len -= len;
+  if (!c->out.len)
+    c->out.off = 0;
+}
+
+bool ptyfwd_ready(const struct ptyfwd_conn *c) { return c->state == CS_READY; }
+
+uint32_t ptyfwd_features(const struct ptyfwd_conn *c) { return c->caps.features; }
+
+bool ptyfwd_send_frame(struct ptyfwd_conn *c, int type, const void *data, uint16_t len) {
+  if (c->state != CS_READY || type < 0 || type > 0x7F) {
+    errno = c->state == CS_READY ? EINVAL : ENOTCONN;
+    return false;
+  }
+  return queue_frame(c, type, data, len);
+}
+
+bool ptyfwd_send_input(struct ptyfwd_conn *c, const void *data, size_t len) {
+  // in frames the server reads in one go
+  size_t chunk = caps_read_size(&c->caps);
+  for (size_t off = 0; off < len; off += chunk) {
+    size_t n = len - off < chunk ? len - off : chunk;
+    if (!ptyfwd_send_frame(c, DT_REGULAR, (const uint8_t *)data + off, n))
+      return false;
+  }
+  return true;
+}
+
+bool ptyfwd_send_eof(struct ptyfwd_conn *c) { return ptyfwd_send_frame(c, DT_EOF, NULL, 0); }
+
+bool ptyfwd_resize(struct ptyfwd_conn *c, uint16_t rows, uint16_t cols) {
+  struct winch_data wd = {.rows = rows, .cols = cols};
+  return ptyfwd_send_frame(c, DT_WINCH, &wd, sizeof(wd));
+}
+
+bool ptyfwd_close(struct ptyfwd_conn *c) {
+  if (!ptyfwd_send_frame(c, DT_CLOSE, NULL, 0))
+    return false;
+  c->state = CS_CLOSED;
+  return true;
+}
+
+void ptyfwd_caps(const struct ptyfwd_conn *c, struct caps *out) { *out = c->caps; }
+
+bool ptyfwd_winch_sent(const struct ptyfwd_conn *c) { return c->winch_sent; }
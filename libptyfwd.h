@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// libptyfwd (libptyfwd.a, libptyfwd.so): the client side of the protocol, for programs that
+// drive many sessions from an event loop of their own, instead of running a ptyfwd client per
+// session. a connection does no I/O: the program connects the socket, feeds in whatever it
+// reads from it, and writes out what the connection has for the server. all of the state is in
+// the connection, so any number of them can be used at once, from any thread, as long as each
+// one is used by one thread at a time.
+//
+// a session goes like this:
+//  1. ptyfwd_client_new(): the handshake starts.
+//  2. write out ptyfwd_output(), feed in what the server sends, and handle the events, until
+//     PTYFWD_EV_READY.
+//  3. the same, along with ptyfwd_send_input(), ptyfwd_resize() etc., until PTYFWD_EV_CLOSED or
+//     PTYFWD_EV_ERROR.
+// the ptyfwd client does its handshake through this, too. the library stops there: it has no
+// relay loop. the ones of the ptyfwd client (client.c, exec.c) keep their frame reader and
+// writer per connection, but forwarding, tracing and echo prediction still keep their state in
+// the process, which is fine for one session per process.
+
+#define PTYFWD_TICKET_SIZE (16 + 8 + 32)
+
+// what libptyfwd.so exports. everything else in it is hidden.
+#define PTYFWD_API __attribute__((visibility("default")))
+
+// optional features to ask the server for
+#define PTYFWD_FEATURE_FORWARD (1 << 0)  // forwarding channels (forward.h)
+#define PTYFWD_FEATURE_TRACE (1 << 1)    // latency tracing stamps (trace.h)
+#define PTYFWD_FEATURE_EXEC (1 << 2)     // run the app on pipes instead of a PTY (exec.h)
+#define PTYFWD_FEATURE_CHAN_EOF (1 << 3) // forwarding channels can be half closed (forward.h)
+
+struct ptyfwd_client_config {
+  // the cookie, if the server requires authentication
+  const void *cookie;
+  size_t cookielen;
+  // a session ticket from an earlier connection to the same server (see PTYFWD_EV_TICKET), or
+  // NULL. with a ticket, the handshake is done in a single round trip.
+  const uint8_t *ticket;
+  // PTYFWD_FEATURE_*
+  uint32_t features;
+  // the backend to reach through a gateway, or NULL
+  const char *target;
+  // initial window size, 0 if there is none
+  uint16_t rows;
+  uint16_t cols;
+};
+
+enum ptyfwd_event_type {
+  PTYFWD_EV_READY,   // the handshake is done, and the server has launched the app
+  PTYFWD_EV_OUTPUT,  // `data`: output of the app (its stdout in exec sessions)
+  PTYFWD_EV_STDERR,  // `data`: stderr of the app in exec sessions
+  PTYFWD_EV_EXIT,    // `status`: exit status of the app in exec sessions
+  PTYFWD_EV_TICKET,  // `data`: a session ticket for the next connection. NULL if the one we
+                     // were given must be forgotten.
+  PTYFWD_EV_FRAME,   // `frame_type` and `data`: any other frame (e.g. forwarding channels)
+  PTYFWD_EV_WARNING, // `message`: worth telling the user, but the session goes on
+  PTYFWD_EV_CLOSED,  // the server ended the session
+  PTYFWD_EV_ERROR,   // `message`: the connection has failed
+};
+
+struct ptyfwd_event {
+  enum ptyfwd_event_type type;
+  int frame_type;
+  // valid until the next ptyfwd_feed
+  const uint8_t *data;
+  size_t len;
+  int32_t status;
+  const char *message;
+};
+
+struct ptyfwd_conn;
+
+// returns NULL if out of memory, or if the config is invalid (errno is EINVAL)
+PTYFWD_API struct ptyfwd_conn *ptyfwd_client_new(const struct ptyfwd_client_config *cfg);
+
+PTYFWD_API void ptyfwd_free(struct ptyfwd_conn *c);
+
+// bytes received from the server. returns false if out of memory.
+PTYFWD_API bool ptyfwd_feed(struct ptyfwd_conn *c, const void *data, size_t len);
+
+// the next event, if any. events come from what has been fed so far.
+PTYFWD_API bool ptyfwd_next_event(struct ptyfwd_conn *c, struct ptyfwd_event *ev);
+
+// how much to read to complete the next frame. reading no more than this, the handshake never
+// reads past its last frame, so the socket can be handed over to other code afterwards.
+// 0 if there is a complete frame already, i.e. ptyfwd_next_event has something.
+PTYFWD_API size_t ptyfwd_want(const struct ptyfwd_conn *c);
+
+// bytes for the server, and how many of them have been written
+PTYFWD_API size_t ptyfwd_output(const struct ptyfwd_conn *c, const uint8_t **data);
+
+PTYFWD_API void ptyfwd_output_consume(struct ptyfwd_conn *c, size_t len);
+
+// once PTYFWD_EV_READY has been returned
+PTYFWD_API bool ptyfwd_ready(const struct ptyfwd_conn *c);
+
+// features both sides support (PTYFWD_FEATURE_*)
+PTYFWD_API uint32_t ptyfwd_features(const struct ptyfwd_conn *c);
+
+// these queue frames for the server. they fail if the session is not ready, is over, or if we
+// are out of memory.
+PTYFWD_API bool ptyfwd_send_input(struct ptyfwd_conn *c, const void *data, size_t len);
+
+// exec sessions: no more input
+PTYFWD_API bool ptyfwd_send_eof(struct ptyfwd_conn *c);
+
+PTYFWD_API bool ptyfwd_resize(struct ptyfwd_conn *c, uint16_t rows, uint16_t cols);
+
+// a frame of any other type, e.g. for forwarding channels
+PTYFWD_API bool ptyfwd_send_frame(struct ptyfwd_conn *c, int type, const void *data, uint16_t len);
+
+// end the session
+PTYFWD_API bool ptyfwd_close(struct ptyfwd_conn *c);
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "caps.h"
+#include "libptyfwd.h"
+
+// for the ptyfwd client, not part of the library's API: all of the negotiated capabilities, and
+// whether the initial window size went out with the handshake
+
+void ptyfwd_caps(const struct ptyfwd_conn *c, struct caps *out);
+
+bool ptyfwd_winch_sent(const struct ptyfwd_conn *c);
@@ -0,0 +1,704 @@
+#include "loadgen.h"
+#include <err.h>
+#include <errno.h>
+
+#ifdef __linux__
+
+#include "caps.h"
+#include "client.h"
+#include "profile.h"
+#include "protocol.h"
+#include "socks.h"
+#include "utils.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+#define MAX_PROCS 256
+// echo latencies are kept in a log-linear histogram of microseconds: LAT_SUB buckets per
+// power of 2, so percentiles are within 1/LAT_SUB of the real value
+#define LAT_SUB 8
+#define LAT_BUCKETS 256
+// a keystroke whose echo does not arrive within this time is counted as lost
+#define ECHO_TIMEOUT_NS (5000 * 1000000ull)
+// interactive sessions kill the line after typing this many characters
+#define LINE_MAX_TYPED 32
+// sessions start typing once the app has said something (e.g. a shell prompt), since shells
+// throw away what was typed before they were ready. or after this long, if it does not.
+#define START_TIMEOUT_NS (1000 * 1000000ull)
+#define CTRL_U 0x15
+// with shards=, the most shard counts to sweep, and how long a server we start has to start
+// accepting connections
+#define MAX_SHARD_RUNS 16
+#define SERVER_START_MS 5000
+#define SERVER_START_RETRY_MS 50
+
+struct lg_config {
+  unsigned n;
+  unsigned step;
+  unsigned hold_s;
+  unsigned idle;
+  unsigned interactive;
+  unsigned bulk;
+  unsigned think_ms;
+  unsigned procs;
+  pid_t server;
+  unsigned shards[MAX_SHARD_RUNS];
+  unsigned nshards;
+};
+
+enum lg_kind { LK_IDLE, LK_INTERACTIVE, LK_BULK };
+
+struct lg_session {
+  int fd;
+  // in the worker's session array
+  unsigned idx;
+  enum lg_kind kind;
+  struct proto_reader reader;
+  // the app has said something, or START_TIMEOUT_NS has passed
+  bool started;
+  // interactive: the keystroke waiting for its echo (0 if none), and when it was sent
+  uint8_t key;
+  uint64_t key_ns;
+  uint64_t next_key_ns;
+  unsigned typed;
+};
+
+enum lg_cmd_type { LC_OPEN, LC_RUN };
+
+// parent -> worker
+struct lg_cmd {
+  uint32_t type;
+  // LC_OPEN: open sessions number `first`, `first` + procs, ... `count` of them
+  uint32_t first;
+  uint32_t count;
+  // LC_RUN: how long to run before reporting
+  uint32_t ms;
+};
+
+// worker -> parent, after each command
+struct lg_report {
+  uint32_t opened;
+  uint32_t failed;
+  uint32_t alive;
+  uint32_t dropped;
+  uint64_t bytes;
+  uint64_t keys;
+  uint64_t lost;
+  uint64_t hist[LAT_BUCKETS];
+};
+
+static struct lg_config cfg;
+static const char *target;
+// how to start a server on `target`, for shards=
+static const char *const *srvargs;
+
+// worker state
+static int epfd;
+static struct lg_session **sessions;
+static unsigned nsessions;
+static unsigned capsessions;
+static struct lg_report stats;
+static const char *bulkcmd;
+
+static bool parse_spec(const char *spec) {
+  cfg = (struct lg_config){.n = 100, .hold_s = 5, .idle = 80, .interactive = 15, .bulk = 5, .think_ms = 200};
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cfg.procs = ncpus > 0 ? ncpus : 1;
+  char *buff = strdup(spec);
+  if (!buff)
+    return false;
+  bool ok = true;
+  char *save;
+  for (char *tok = strtok_r(buff, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    int pid;
+    if (sscanf(tok, "n=%u", &cfg.n) == 1 || sscanf(tok, "step=%u", &cfg.step) == 1 ||
+        sscanf(tok, "hold=%u", &cfg.hold_s) == 1 || sscanf(tok, "idle=%u", &cfg.idle) == 1 ||
+        sscanf(tok, "interactive=%u", &cfg.interactive) == 1 || sscanf(tok, "bulk=%u", &cfg.bulk) == 1 ||
+        sscanf(tok, "think=%u", &cfg.think_ms) == 1 || sscanf(tok, "procs=%u", &cfg.procs) == 1)
+      continue;
+    if (sscanf(tok, "server=%d", &pid) == 1) {
+      cfg.server = pid;
+      continue;
+    }
+    if (!strncmp(tok, "shards=", 7)) {
+      // shard counts, separated by ':'
+      char *p = tok + 7, *end;
+      bool valid = false;
+      for (cfg.nshards = 0; cfg.nshards < MAX_SHARD_RUNS; p = end + 1) {
+        unsigned long n = strtoul(p, &end, 10);
+        if (end == p || !n || n > 1024 || (*end && *end != ':'))
+          break;
+        cfg.shards[cfg.nshards++] = n;
+        if (!*end) {
+          valid = true;
+          break;
+        }
+      }
+      if (valid)
+        continue;
+      cfg.nshards = 0;
+    }
+    warnx("Unknown load generator option '%s'", tok);
+    ok = false;
+  }
+  free(buff);
+  if (!ok)
+    return false;
+
+  if (!cfg.step || cfg.step > cfg.n)
+    cfg.step = cfg.n;
+  if (cfg.procs > cfg.n)
+    cfg.procs = cfg.n;
+  if (cfg.procs > MAX_PROCS)
+    cfg.procs = MAX_PROCS;
+  if (!cfg.n || !cfg.procs || !cfg.think_ms || cfg.idle + cfg.interactive + cfg.bulk != 100) {
+    warnx("Invalid load generator options. Session mix must add up to 100.");
+    return false;
+  }
+  // with shards=, we start the servers
+  if (cfg.nshards && cfg.server) {
+    warnx("Invalid load generator options. shards= and server= don't go together.");
+    return false;
+  }
+  return true;
+}
+
+// the session mix is spread over the session numbers, so that any step gets its share of
+// each kind. 61 is coprime to 100, so every 100 sessions still have the exact mix.
+static enum lg_kind kind_of(unsigned num) {
+  unsigned pct = num * 61 % 100;
+  return pct < cfg.idle ? LK_IDLE : pct < cfg.idle + cfg.interactive ? LK_INTERACTIVE : LK_BULK;
+}
+
+static int lat_bucket(uint64_t us) {
+  if (us < 2 * LAT_SUB)
+    return us;
+  // `us` >> e is in [LAT_SUB, 2 * LAT_SUB)
+  int e = 63 - __builtin_clzll(us) - 3;
+  int b = e * LAT_SUB + (us >> e);
+  return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+// the lowest latency in the bucket
+static uint64_t lat_bucket_us(int b) {
+  if (b < 2 * LAT_SUB)
+    return b;
+  return (uint64_t)(b % LAT_SUB + LAT_SUB) << (b / LAT_SUB - 1);
+}
+
+static uint64_t think_ns() {
+  // uniform between 0.5x and 1.5x the average
+  return (cfg.think_ms * 500000ull) + random() % (cfg.think_ms * 1000000ull);
+}
+
+static bool send_input(struct lg_session *s, const void *data, uint16_t len) {
+  uint8_t frame[PROTO_HDR_MAX + 256];
+  size_t flen = proto_encode(frame, len, DT_REGULAR, data);
+  return write(s->fd, frame, flen) == flen;
+}
+
+static void session_drop(struct lg_session *s) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+  close(s->fd);
+  bufpool_put(s->reader.buff, s->reader.cap);
+  sessions[s->idx] = sessions[--nsessions];
+  sessions[s->idx]->idx = s->idx;
+  free(s);
+  ++stats.dropped;
+}
+
+static bool session_open(unsigned num) {
+  int fd = create_spec_client(target);
+  if (fd < 0)
+    return false;
+  struct caps caps;
+  if (!client_negotiate(fd, &caps)) {
+    close(fd);
+    return false;
+  }
+  set_fd_flags(fd, true, O_NONBLOCK);
+
+  struct lg_session *s = calloc(1, sizeof(*s));
+  if (!s || (nsessions == capsessions && !(sessions = realloc(sessions, (capsessions += 1024) * sizeof(*sessions))))) {
+    warn("Error allocating session");
+    free(s);
+    close(fd);
+    return false;
+  }
+  s->fd = fd;
+  s->kind = kind_of(num);
+  proto_reader_init(&s->reader);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    warn("epoll_ctl error");
+    free(s);
+    close(fd);
+    return false;
+  }
+  s->idx = nsessions;
+  sessions[nsessions++] = s;
+  s->next_key_ns = mono_ns() + START_TIMEOUT_NS;
+  return true;
+}
+
+static void session_start(struct lg_session *s, uint64_t now) {
+  s->started = true;
+  if (s->kind == LK_BULK) {
+    char line[256];
+    int len = snprintf(line, sizeof(line), "%s\r", bulkcmd);
+    if (len >= sizeof(line) || !send_input(s, line, len))
+      warnx("Error sending bulk command");
+  }
+  s->next_key_ns = now + think_ns();
+}
+
+static void session_read(struct lg_session *s) {
+  if (!proto_reader_fill(&s->reader, s->fd)) {
+    session_drop(s);
+    return;
+  }
+  profile_rearm(s->fd);
+  uint64_t now = mono_ns();
+  uint16_t len;
+  enum data_type type;
+  const uint8_t *data;
+  while (proto_reader_next(&s->reader, &len, &type, &data)) {
+    switch (type) {
+    case DT_REGULAR:
+      stats.bytes += len;
+      if (!s->started && s->kind != LK_IDLE)
+        session_start(s, now);
+      if (s->key && memchr(data, s->key, len)) {
+        ++stats.hist[lat_bucket((now - s->key_ns) / 1000)];
+        ++stats.keys;
+        s->key = 0;
+        s->next_key_ns = now + think_ns();
+      }
+      break;
+    case DT_CLOSE:
+      session_drop(s);
+      return;
+    default:
+      break;
+    }
+  }
+  // only the bulk sessions are busy enough to be worth holding on to a buffer
+  if (s->kind != LK_BULK)
+    proto_reader_release(&s->reader);
+}
+
+// start the sessions whose app is quiet, and type on the interactive sessions that are due.
+// returns when the next one is due.
+static uint64_t sessions_type(uint64_t now) {
+  uint64_t next = now + 1000 * 1000000ull;
+  for (unsigned i = 0; i < nsessions; ++i) {
+    struct lg_session *s = sessions[i];
+    if (s->kind == LK_IDLE || (s->kind == LK_BULK && s->started))
+      continue;
+    if (!s->started) {
+      if (now >= s->next_key_ns)
+        session_start(s, now);
+      if (s->next_key_ns < next)
+        next = s->next_key_ns;
+      continue;
+    }
+    if (s->key && now - s->key_ns >= ECHO_TIMEOUT_NS) {
+      ++stats.lost;
+      s->key = 0;
+      s->next_key_ns = now + think_ns();
+    }
+    if (!s->key && now >= s->next_key_ns) {
+      if (s->typed >= LINE_MAX_TYPED) {
+        uint8_t kill = CTRL_U;
+        send_input(s, &kill, 1);
+        s->typed = 0;
+        s->next_key_ns = now + think_ns();
+      } else {
+        uint8_t key = 'a' + s->typed % 26;
+        if (send_input(s, &key, 1)) {
+          s->key = key;
+          s->key_ns = now;
+          ++s->typed;
+        } else {
+          // the socket is full. try again later.
+          s->next_key_ns = now + think_ns();
+        }
+      }
+    }
+    uint64_t due = s->key ? s->key_ns + ECHO_TIMEOUT_NS : s->next_key_ns;
+    if (due < next)
+      next = due;
+  }
+  return next;
+}
+
+// send what happened since the last report
+static void report(int ctlfd) {
+  stats.alive = nsessions;
+  if (!write_all(ctlfd, &stats, sizeof(stats)))
+    _exit(1);
+  memset(&stats, 0, sizeof(stats));
+}
+
+static void worker_main(int ctlfd) {
+  srandom(getpid() ^ mono_ns());
+  bulkcmd = getenv("PTYFWD_LOAD_BULK");
+  if (!bulkcmd || !*bulkcmd)
+    bulkcmd = "yes";
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, ctlfd, &ev) < 0)
+    err(1, "Error creating load generator event loop");
+
+  uint64_t run_end = 0;
+  uint64_t next_type = 0;
+  struct epoll_event events[MAX_EVENTS];
+  for (;;) {
+    uint64_t now = mono_ns();
+    if (now >= next_type)
+      next_type = sessions_type(now);
+    if (run_end && now >= run_end) {
+      report(ctlfd);
+      run_end = 0;
+    }
+    uint64_t wake = run_end && run_end < next_type ? run_end : next_type;
+    int n = epoll_wait(epfd, events, MAX_EVENTS, wake > now ? (wake - now + 999999) / 1000000 : 0);
+    if (n < 0 && errno != EINTR)
+      err(1, "epoll_wait error");
+
+    for (int i = 0; i < n; ++i) {
+      struct lg_session *s = events[i].data.ptr;
+      if (s) {
+        session_read(s);
+        continue;
+      }
+
+      struct lg_cmd cmd;
+      if (!read_all(ctlfd, &cmd, sizeof(cmd)))
+        _exit(0);
+      if (cmd.type == LC_OPEN) {
+        for (uint32_t j = 0; j < cmd.count; ++j) {
+          if (session_open(cmd.first + j * cfg.procs))
+            ++stats.opened;
+          else
+            ++stats.failed;
+        }
+        report(ctlfd);
+        next_type = 0;
+      } else {
+        // only what happens from now on is measured
+        uint32_t dropped = stats.dropped;
+        memset(&stats, 0, sizeof(stats));
+        stats.dropped = dropped;
+        run_end = mono_ns() + cmd.ms * 1000000ull;
+      }
+    }
+  }
+}
+
+struct server_sample {
+  // CPU time, in clock ticks
+  unsigned long long ticks;
+  unsigned long long pss_kb;
+};
+
+static pid_t workers[MAX_PROCS];
+
+// name, pgrp and CPU time of a process, from /proc/<pid>/stat
+static bool read_proc_stat(const char *pid, char *name, size_t namesize, pid_t *pgrp, unsigned long long *ticks) {
+  char path[64], buff[512];
+  snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  ssize_t len = read(fd, buff, sizeof(buff) - 1);
+  close(fd);
+  if (len <= 0)
+    return false;
+  buff[len] = 0;
+  // the name is in parentheses, and may itself have spaces and parentheses
+  char *start = strchr(buff, '(');
+  char *rest = strrchr(buff, ')');
+  if (!start || !rest || rest - start > namesize)
+    return false;
+  memcpy(name, start + 1, rest - start - 1);
+  name[rest - start - 1] = 0;
+  unsigned long long utime, stime;
+  if (sscanf(rest + 1, " %*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", pgrp, &utime, &stime) != 3)
+    return false;
+  *ticks = utime + stime;
+  return true;
+}
+
+static unsigned long long read_proc_pss(const char *pid) {
+  char path[64], line[256];
+  snprintf(path, sizeof(path), "/proc/%s/smaps_rollup", pid);
+  FILE *f = fopen(path, "re");
+  if (!f)
+    return 0;
+  unsigned long long kb = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "Pss: %llu kB", &kb) == 1)
+      break;
+  }
+  fclose(f);
+  return kb;
+}
+
+// the server, plus its session processes in fork mode
+static bool server_sample(struct server_sample *out) {
+  char pidstr[16], name[64], othername[64];
+  pid_t pgrp;
+  unsigned long long ticks;
+  snprintf(pidstr, sizeof(pidstr), "%d", cfg.server);
+  if (!read_proc_stat(pidstr, name, sizeof(name), &pgrp, &ticks))
+    return false;
+
+  memset(out, 0, sizeof(*out));
+  DIR *dir = opendir("/proc");
+  if (!dir)
+    return false;
+  struct dirent *de;
+  while ((de = readdir(dir))) {
+    pid_t pid = atoi(de->d_name);
+    pid_t p;
+    if (pid <= 0 || pid == getpid() || !read_proc_stat(de->d_name, othername, sizeof(othername), &p, &ticks) ||
+        p != pgrp || strcmp(name, othername))
+      continue;
+    // we're the same program, and may have been started in the same process group
+    bool ours = false;
+    for (unsigned i = 0; i < cfg.procs && !ours; ++i)
+      ours = workers[i] == pid;
+    if (ours)
+      continue;
+    out->ticks += ticks;
+    out->pss_kb += read_proc_pss(de->d_name);
+  }
+  closedir(dir);
+  return true;
+}
+
+static void print_percentiles(const struct lg_report *r) {
+  static const int pcts[] = {50, 90, 99, 100};
+  for (int i = 0; i < sizeof(pcts) / sizeof(*pcts); ++i) {
+    if (!r->keys) {
+      printf(" %8s", "-");
+      continue;
+    }
+    uint64_t rank = (r->keys - 1) * pcts[i] / 100, seen = 0;
+    int b = 0;
+    while (b < LAT_BUCKETS - 1 && (seen += r->hist[b]) <= rank)
+      ++b;
+    printf(" %8.2f", lat_bucket_us(b) / 1000.0);
+  }
+}
+
+// how the last step of a run went, for the shards= summary
+struct lg_result {
+  double mbps;
+  // the server's CPU, in percent of one CPU, or < 0 if not measured
+  double cpu;
+};
+
+// opens the sessions step by step with a fresh set of workers, and prints a line for each step
+static struct lg_result run_load() {
+  struct lg_result res = {.cpu = -1};
+  int ctlfds[MAX_PROCS];
+  for (unsigned w = 0; w < cfg.procs; ++w) {
+    int sp[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) < 0)
+      err(1, "Error creating load generator worker");
+    pid_t pid = fork();
+    if (pid < 0)
+      err(1, "Error creating load generator worker");
+    if (!pid) {
+      for (unsigned i = 0; i < w; ++i)
+        close(ctlfds[i]);
+      close(sp[0]);
+      worker_main(sp[1]);
+      _exit(0);
+    }
+    close(sp[1]);
+    ctlfds[w] = sp[0];
+    workers[w] = pid;
+  }
+
+  printf("%8s %8s %6s %7s %9s %8s %8s %8s %8s %6s %7s %8s\n", "sessions", "setup/s", "failed", "dropped",
+    "out(MB/s)", "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)", "lost", "srv_cpu", "srv_MB");
+  fflush(stdout);
+
+  unsigned failed = 0, dropped = 0;
+  for (unsigned started = 0; started < cfg.n;) {
+    unsigned k = cfg.n - started < cfg.step ? cfg.n - started : cfg.step;
+    uint64_t t0 = mono_ns();
+    unsigned opened = 0;
+    for (unsigned w = 0; w < cfg.procs; ++w) {
+      struct lg_cmd cmd = {.type = LC_OPEN, .first = started + w, .count = w < k ? (k - w + cfg.procs - 1) / cfg.procs : 0};
+      if (!write_all(ctlfds[w], &cmd, sizeof(cmd)))
+        err(1, "Error controlling load generator worker");
+    }
+    struct lg_report r, total = {0};
+    for (unsigned w = 0; w < cfg.procs; ++w) {
+      if (!read_all(ctlfds[w], &r, sizeof(r)))
+        errx(1, "Load generator worker died");
+      opened += r.opened;
+      failed += r.failed;
+      dropped += r.dropped;
+    }
+    double setup_s = (mono_ns() - t0) / 1e9;
+    started += k;
+
+    struct server_sample before, after;
+    bool measured = cfg.server && server_sample(&before);
+    t0 = mono_ns();
+    for (unsigned w = 0; w < cfg.procs; ++w) {
+      struct lg_cmd cmd = {.type = LC_RUN, .ms = cfg.hold_s * 1000};
+      if (!write_all(ctlfds[w], &cmd, sizeof(cmd)))
+        err(1, "Error controlling load generator worker");
+    }
+    for (unsigned w = 0; w < cfg.procs; ++w) {
+      if (!read_all(ctlfds[w], &r, sizeof(r)))
+        errx(1, "Load generator worker died");
+      total.alive += r.alive;
+      total.bytes += r.bytes;
+      total.keys += r.keys;
+      total.lost += r.lost;
+      dropped += r.dropped;
+      for (int b = 0; b < LAT_BUCKETS; ++b)
+        total.hist[b] += r.hist[b];
+    }
+    double run_s = (mono_ns() - t0) / 1e9;
+    measured = measured && server_sample(&after);
+
+    res.mbps = total.bytes / run_s / 1e6;
+    res.cpu = measured ? (after.ticks - before.ticks) * 100.0 / sysconf(_SC_CLK_TCK) / run_s : -1;
+    printf("%8u %8.0f %6u %7u %9.2f", total.alive, opened / setup_s, failed, dropped, res.mbps);
+    print_percentiles(&total);
+    printf(" %6llu", (unsigned long long)total.lost);
+    if (measured)
+      printf(" %6.1f%% %8.1f\n", res.cpu, after.pss_kb / 1024.0);
+    else
+      printf(" %7s %8s\n", "-", "-");
+    fflush(stdout);
+  }
+
+  for (unsigned w = 0; w < cfg.procs; ++w)
+    close(ctlfds[w]);
+  for (unsigned w = 0; w < cfg.procs; ++w)
+    waitpid(workers[w], NULL, 0);
+  return res;
+}
+
+// a threaded server with `nshards` shards on `target`, running /bin/sh. its output would get
+// mixed up with ours, so it goes to /dev/null. returns once it accepts connections.
+static pid_t server_start(unsigned nshards) {
+  char threads[16];
+  snprintf(threads, sizeof(threads), "%u", nshards);
+  const char *argv[32] = {"ptyfwd", "-s", "/bin/sh", "-j", threads};
+  int argc = 5;
+  for (int i = 0; srvargs[i] && argc < sizeof(argv) / sizeof(*argv) - 1; ++i)
+    argv[argc++] = srvargs[i];
+
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (!pid) {
+    int nullfd = open("/dev/null", O_RDWR);
+    if (nullfd >= 0) {
+      dup2(nullfd, 1);
+      dup2(nullfd, 2);
+    }
+    execv("/proc/self/exe", (char *const *)argv);
+    _exit(127);
+  }
+
+  for (int waited = 0; waited < SERVER_START_MS; waited += SERVER_START_RETRY_MS) {
+    int fd = create_spec_client(target);
+    if (fd >= 0) {
+      close(fd);
+      return pid;
+    }
+    if (waitpid(pid, NULL, WNOHANG) == pid)
+      return -1;
+    usleep(SERVER_START_RETRY_MS * 1000);
+  }
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  return -1;
+}
+
+int start_loadgen(const char *spec, const char *target_, const char *const *srvargs_) {
+  target = target_;
+  srvargs = srvargs_;
+  if (!parse_spec(spec))
+    return 1;
+
+  // one fd per session in the workers
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  if (cfg.n / cfg.procs + 16 > rl.rlim_cur)
+    warnx("Warning: %u sessions per process is more than the open file limit.", cfg.n / cfg.procs);
+  signal(SIGPIPE, SIG_IGN);
+  // nothing to share with in the workers, idle buffers go straight back to the OS
+  bufpool_init(0);
+
+  if (!cfg.nshards) {
+    // runs with different transports and profiles (-P) are told apart by this line
+    printf("# %s, %s profile\n", target, profile_name());
+    run_load();
+    return 0;
+  }
+
+  struct lg_result results[MAX_SHARD_RUNS];
+  for (unsigned i = 0; i < cfg.nshards; ++i) {
+    if ((cfg.server = server_start(cfg.shards[i])) < 0) {
+      warnx("Error starting a server with %u shards on %s", cfg.shards[i], target);
+      return 1;
+    }
+    printf("# %s, %s profile, %u shards\n", target, profile_name(), cfg.shards[i]);
+    results[i] = run_load();
+    kill(cfg.server, SIGTERM);
+    waitpid(cfg.server, NULL, 0);
+    // a server that is killed leaves its Unix socket behind, and the next one could not bind
+    if (!strncmp(target, "unix:", 5))
+      unlink(target + 5);
+    printf("\n");
+  }
+
+  // aggregate throughput of the last step of each run, and how it scales with the first run's
+  printf("# scaling, %u sessions\n", cfg.n);
+  printf("%8s %9s %8s %7s\n", "shards", "out(MB/s)", "speedup", "srv_cpu");
+  for (unsigned i = 0; i < cfg.nshards; ++i) {
+    printf("%8u %9.2f %7.2fx", cfg.shards[i], results[i].mbps, results[0].mbps ? results[i].mbps / results[0].mbps : 0);
+    if (results[i].cpu >= 0)
+      printf(" %6.1f%%\n", results[i].cpu);
+    else
+      printf(" %7s\n", "-");
+  }
+  return 0;
+}
+
+#else
+
+int start_loadgen(const char *spec, const char *target, const char *const *srvargs) {
+  errno = ENOTSUP;
+  warn("Load generator");
+  return 1;
+}
+
+#endif
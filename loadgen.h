@@ -0,0 +1,34 @@
+#pragma once
+
+// load generator (-l): many concurrent client sessions against one server, to see how the
+// server behaves as the number of sessions grows.
+// sessions are added in steps, through the same handshake as a normal client, by worker
+// processes that each run an event loop over their share of the sessions. after each step,
+// all sessions run for a while, and a line of statistics is printed:
+//  - the setup rate of the new sessions, and how many failed or were dropped by the server
+//  - aggregate output throughput
+//  - echo latency percentiles of the interactive sessions, over all their keystrokes
+//  - CPU and memory (PSS) of the server, if its pid is given. this includes the processes
+//    of the same program in the server's process group, i.e. its sessions in fork mode.
+//
+// `spec` is a comma separated list of:
+//  - n=<sessions>: total number of sessions (100)
+//  - step=<sessions>: sessions added per step (all of them)
+//  - hold=<seconds>: how long to measure after each step (5)
+//  - idle=, interactive=, bulk=<percent>: the mix of sessions (80, 15, 5)
+//  - think=<ms>: average time between keystrokes of an interactive session (200)
+//  - procs=<n>: worker processes (one per online CPU)
+//  - server=<pid>: the server to measure
+//  - shards=<n>[:<n>...]: start a threaded server (-j <n>) on `target` for each shard count in
+//    turn, running /bin/sh, and do all the steps against each of them. a table of the last
+//    step's aggregate throughput for each shard count follows, to show how the threaded
+//    server scales. not with server=, which is then the server we started.
+// idle sessions only read. interactive sessions type letters, time their echo, and kill the
+// line every now and then. bulk sessions send the command line in PTYFWD_LOAD_BULK ("yes" by
+// default) once, and read the output as fast as they can.
+//
+// `target` is where to connect to, in endpoint spec format (see socks.h). its sockets are tuned
+// with the transport profile (see profile.h), so that profiles can be compared. `srvargs` is
+// a NULL terminated list of the options that make a server listen on `target`, for shards=.
+// returns the exit code for the app. supported only on Linux.
+int start_loadgen(const char *spec, const char *target, const char *const *srvargs);
@@ -0,0 +1,456 @@
+#include "mux.h"
+#include <err.h>
+#include <errno.h>
+
+#ifdef __linux__
+
+#include "bufpool.h"
+#include "profile.h"
+#include "pump.h"
+#include "socks.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MUX_MAX_MAPS 256
+#define MAX_EVENTS 256
+
+// "%08x.%08x\n"
+#define PREAMBLE_LEN 18
+// streams must finish the preamble and backend connection within this time
+#define SETUP_TIMEOUT_MS 10000
+
+#define ANY UINT32_MAX
+
+struct mux_map {
+  uint32_t cid;
+  uint32_t port;
+  char *spec;
+};
+
+static struct mux_map maps[MUX_MAX_MAPS];
+static int nmaps;
+
+enum stream_state { ST_PREAMBLE, ST_CONNECTING, ST_RELAY };
+
+struct stream;
+
+// what an epoll event points to
+struct mux_end {
+  struct stream *st;
+  int fd;
+  // currently registered epoll events, 0 if not registered
+  uint32_t events;
+};
+
+struct stream {
+  enum stream_state state;
+  struct mux_end client;
+  struct mux_end backend;
+  // client to backend
+  struct pump up;
+  // backend to client
+  struct pump down;
+  char preamble[PREAMBLE_LEN];
+  size_t prelen;
+  uint64_t deadline;
+  struct stream *prev;
+  struct stream *next;
+};
+
+static int epfd;
+
+static struct stream *streams;
+
+static struct {
+  uint64_t accepted;
+  uint64_t routed;
+  uint64_t failed;
+  uint64_t active;
+  uint64_t bytes_up;
+  uint64_t bytes_down;
+} stats;
+
+static struct mux_end listener_end;
+static struct mux_end signal_end;
+
+static bool load_maps(const char *mapfile);
+
+static void accept_streams(int svrfd);
+
+static void handle_stream(struct mux_end *end, uint32_t events);
+
+static void stream_close(struct stream *st);
+
+static void expire_streams(uint64_t now);
+
+static void dump_stats();
+
+int start_vsock_mux(int svrfd, const char *mapfile) {
+  if (mapfile && !load_maps(mapfile))
+    return 1;
+
+  // every stream takes up to 6 fds
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  bufpool_init(0);
+
+  if (listen(svrfd, SOMAXCONN) < 0) {
+    warn("Listen error");
+    return 1;
+  }
+  set_fd_flags(svrfd, true, O_NONBLOCK);
+
+  int sigs[] = {SIGUSR1};
+  int sigfd = signal_fd(sigs, sizeof(sigs) / sizeof(*sigs));
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (sigfd < 0 || epfd < 0) {
+    warn("Error setting up event loop");
+    return 1;
+  }
+  listener_end.fd = svrfd;
+  signal_end.fd = sigfd;
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &listener_end};
+  struct epoll_event sigev = {.events = EPOLLIN, .data.ptr = &signal_end};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, svrfd, &ev) < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &sigev) < 0) {
+    warn("Error setting up event loop");
+    return 1;
+  }
+  warnx("VSOCK multiplexer started with %d mapping(s).", nmaps);
+  profile_pin();
+
+  struct epoll_event events[MAX_EVENTS];
+  uint64_t next_expire = mono_ns() + 1000000000ull;
+  for (;;) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+    if (n < 0) {
+      if (errno != EINTR)
+        warn("epoll_wait error");
+      continue;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      struct mux_end *end = events[i].data.ptr;
+      if (!end) {
+        // belongs to a stream closed earlier in this batch
+        continue;
+      } else if (end == &listener_end) {
+        accept_streams(svrfd);
+      } else if (end == &signal_end) {
+        int sig;
+        while ((sig = signal_fd_next(sigfd))) {
+          if (sig == SIGUSR1)
+            dump_stats();
+        }
+      } else {
+        struct stream *st = end->st;
+        handle_stream(end, events[i].events);
+        if (st->client.fd < 0) {
+          // closed. the other end may still be in this batch.
+          for (int j = i + 1; j < n; ++j) {
+            struct mux_end *other = events[j].data.ptr;
+            if (other == &st->client || other == &st->backend)
+              events[j].data.ptr = NULL;
+          }
+          free(st);
+        }
+      }
+    }
+
+    uint64_t now = mono_ns();
+    if (now >= next_expire) {
+      expire_streams(now);
+      next_expire = now + 1000000000ull;
+    }
+  }
+
+  return 0;
+}
+
+static uint32_t parse_map_field(const char *s, bool *ok) {
+  if (!strcmp(s, "*"))
+    return ANY;
+  char *endp;
+  unsigned long v = strtoul(s, &endp, 10);
+  *ok = *ok && *s && !*endp && v < ANY;
+  return v;
+}
+
+static bool load_maps(const char *mapfile) {
+  FILE *f = fopen(mapfile, "r");
+  if (!f) {
+    warn("Cannot open map file");
+    return false;
+  }
+
+  char line[512];
+  int lineno = 0;
+  bool success = false;
+  while (fgets(line, sizeof(line), f)) {
+    ++lineno;
+    line[strcspn(line, "\r\n")] = 0;
+    if (!*line || *line == '#')
+      continue;
+
+    char *port = strchr(line, ':');
+    char *spec = strchr(line, '=');
+    if (!port || !spec || spec < port) {
+      warnx("%s:%d: expected <cid>:<port>=<target spec>", mapfile, lineno);
+      goto end;
+    }
+    *port++ = 0;
+    *spec++ = 0;
+
+    if (nmaps == MUX_MAX_MAPS) {
+      warnx("%s:%d: too many mappings", mapfile, lineno);
+      goto end;
+    }
+    bool ok = true;
+    struct mux_map *m = maps + nmaps;
+    m->cid = parse_map_field(line, &ok);
+    m->port = parse_map_field(port, &ok);
+    if (!ok) {
+      warnx("%s:%d: invalid CID or port", mapfile, lineno);
+      goto end;
+    }
+    if (!(m->spec = strdup(spec))) {
+      warn("Error loading map file");
+      goto end;
+    }
+    ++nmaps;
+  }
+  success = true;
+
+end:
+  fclose(f);
+  return success;
+}
+
+// register, update or unregister `end` so that epoll only reports `events`.
+// fds without any events wanted are unregistered, since hangups are always reported.
+static bool end_watch(struct mux_end *end, uint32_t events) {
+  if (events == end->events)
+    return true;
+  struct epoll_event ev = {.events = events, .data.ptr = end};
+  int op = !events ? EPOLL_CTL_DEL : end->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(epfd, op, end->fd, &ev) < 0) {
+    warn("epoll_ctl error");
+    return false;
+  }
+  end->events = events;
+  return true;
+}
+
+static void accept_streams(int svrfd) {
+  for (;;) {
+    int fd = accept4(svrfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EINTR)
+        warn("Error accepting connection");
+      return;
+    }
+    profile_tune(fd);
+
+    struct stream *st = calloc(1, sizeof(*st));
+    if (!st) {
+      warn("Error allocating stream");
+      close(fd);
+      continue;
+    }
+    st->state = ST_PREAMBLE;
+    st->client.st = st->backend.st = st;
+    st->client.fd = fd;
+    st->backend.fd = -1;
+    pump_clear(&st->up);
+    pump_clear(&st->down);
+    st->deadline = mono_ns() + SETUP_TIMEOUT_MS * 1000000ull;
+    if (!end_watch(&st->client, EPOLLIN)) {
+      close(fd);
+      free(st);
+      continue;
+    }
+
+    st->next = streams;
+    if (streams)
+      streams->prev = st;
+    streams = st;
+    ++stats.accepted;
+    ++stats.active;
+  }
+}
+
+static bool parse_hex32(const char *s, uint32_t *out) {
+  *out = 0;
+  for (int i = 0; i < 8; ++i) {
+    char c = s[i];
+    int v;
+    if (c >= '0' && c <= '9')
+      v = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      v = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      v = c - 'A' + 10;
+    else
+      return false;
+    *out = (*out << 4) | v;
+  }
+  return true;
+}
+
+// returns false if the stream should be closed
+static bool stream_route(struct stream *st) {
+  uint32_t cid, port;
+  if (st->preamble[8] != '.' || st->preamble[17] != '\n' || !parse_hex32(st->preamble, &cid) ||
+      !parse_hex32(st->preamble + 9, &port)) {
+    warnx("Invalid multiplexer preamble");
+    return false;
+  }
+
+  const char *spec = NULL;
+  char vsockspec[32];
+  for (int i = 0; i < nmaps; ++i) {
+    if ((maps[i].cid == ANY || maps[i].cid == cid) && (maps[i].port == ANY || maps[i].port == port)) {
+      spec = maps[i].spec;
+      break;
+    }
+  }
+  if (!spec) {
+    snprintf(vsockspec, sizeof(vsockspec), "vsock:%u:%u", cid, port);
+    spec = vsockspec;
+  }
+
+  int fd = create_spec_client_async(spec);
+  if (fd < 0) {
+    warn("Error connecting to %s (CID %u port %u)", spec, cid, port);
+    return false;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  st->backend.fd = fd;
+  st->state = ST_CONNECTING;
+  // the client is not read from until the backend is connected
+  return end_watch(&st->client, 0) && end_watch(&st->backend, EPOLLOUT);
+}
+
+// sources are only read from once everything read before is written
+static bool stream_watch(struct stream *st) {
+  uint32_t cev = (!st->up.eof && !st->up.pending ? EPOLLIN : 0) | (st->down.pending ? EPOLLOUT : 0);
+  uint32_t bev = (!st->down.eof && !st->down.pending ? EPOLLIN : 0) | (st->up.pending ? EPOLLOUT : 0);
+  return end_watch(&st->client, cev) && end_watch(&st->backend, bev);
+}
+
+static void handle_stream(struct mux_end *end, uint32_t events) {
+  struct stream *st = end->st;
+  bool ok = true;
+  switch (st->state) {
+  case ST_PREAMBLE: {
+    // read exactly the preamble. whatever follows belongs to the backend.
+    ssize_t rd = read(st->client.fd, st->preamble + st->prelen, PREAMBLE_LEN - st->prelen);
+    if (rd <= 0) {
+      ok = rd < 0 && (errno == EAGAIN || errno == EINTR);
+      break;
+    }
+    st->prelen += rd;
+    if (st->prelen == PREAMBLE_LEN)
+      ok = stream_route(st);
+    break;
+  }
+  case ST_CONNECTING: {
+    int soerr = 0;
+    socklen_t soerrlen = sizeof(soerr);
+    getsockopt(st->backend.fd, SOL_SOCKET, SO_ERROR, &soerr, &soerrlen);
+    if (soerr) {
+      errno = soerr;
+      warn("Error connecting to backend");
+      ok = false;
+      break;
+    }
+    if (!(ok = pump_init(&st->up) && pump_init(&st->down)))
+      break;
+    st->state = ST_RELAY;
+    ++stats.routed;
+    ok = stream_watch(st);
+    break;
+  }
+  case ST_RELAY: {
+    uint64_t up = st->up.total, down = st->down.total;
+    ok = pump_run(&st->up, st->client.fd, st->backend.fd) && pump_run(&st->down, st->backend.fd, st->client.fd);
+    stats.bytes_up += st->up.total - up;
+    stats.bytes_down += st->down.total - down;
+    if (ok && st->up.done && st->down.done) {
+      stream_close(st);
+      return;
+    }
+    if (ok)
+      ok = stream_watch(st);
+    break;
+  }
+  }
+
+  if (!ok) {
+    if (st->state != ST_RELAY)
+      ++stats.failed;
+    stream_close(st);
+  }
+}
+
+// the stream itself is freed by the caller. `client.fd` is set to -1.
+static void stream_close(struct stream *st) {
+  end_watch(&st->client, 0);
+  close(st->client.fd);
+  st->client.fd = -1;
+  if (st->backend.fd >= 0) {
+    end_watch(&st->backend, 0);
+    close(st->backend.fd);
+  }
+  pump_free(&st->up);
+  pump_free(&st->down);
+
+  if (st->prev)
+    st->prev->next = st->next;
+  else
+    streams = st->next;
+  if (st->next)
+    st->next->prev = st->prev;
+  --stats.active;
+}
+
+static void expire_streams(uint64_t now) {
+  for (struct stream *st = streams, *next; st; st = next) {
+    next = st->next;
+    if (st->state == ST_RELAY || now < st->deadline)
+      continue;
+    warnx("Stream setup timed out");
+    ++stats.failed;
+    stream_close(st);
+    free(st);
+  }
+}
+
+static void dump_stats() {
+  fprintf(stderr, "accepted %llu, routed %llu, failed %llu, active %llu, bytes up %llu, down %llu\n",
+    (unsigned long long)stats.accepted, (unsigned long long)stats.routed, (unsigned long long)stats.failed,
+    (unsigned long long)stats.active, (unsigned long long)stats.bytes_up, (unsigned long long)stats.bytes_down);
+}
+
+#else
+
+int start_vsock_mux(int svrfd, const char *mapfile) {
+  errno = ENOTSUP;
+  warn("VSOCK multiplexer");
+  return 1;
+}
+
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+
+// VSOCK multiplexer: the server side of `create_vsock_mult_client`.
+// clients connect to a Unix socket and send a "%08x.%08x\n" (CID, port) preamble. the
+// stream is then routed to the matching backend and relayed as-is in both directions.
+//
+// backends are looked up in the map file first, with one entry per line in the format
+//   <cid>:<port>=<target spec>
+// where <cid> and <port> are decimal or `*`, and <target spec> is in the format of
+// `create_spec_client`. lines starting with '#' are ignored. streams that do not match any
+// entry go to VSOCK <cid>:<port> directly, if VSOCK is available.
+//
+// SIGUSR1 dumps statistics to stderr.
+
+// `svrfd` is a bound (but not listening) Unix socket. `mapfile` is optional. Linux only.
+int start_vsock_mux(int svrfd, const char *mapfile);
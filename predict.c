@@ -0,0 +1,230 @@
+#include "predict.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+
+// most keystrokes in flight that we keep track of
+#define PREDICT_MAX 64
+// predictions are shown only when the smoothed round trip time is at least this
+#define PREDICT_SHOW_RTT_NS (20 * 1000000ull)
+// a prediction is given up when its echo does not arrive within this many round trips...
+#define PREDICT_TIMEOUT_RTTS 3
+// ... but no sooner than this
+#define PREDICT_TIMEOUT_MIN_NS (250 * 1000000ull)
+
+#define UNDERLINE_ON "\x1b[4m"
+#define UNDERLINE_OFF "\x1b[24m"
+#define ERASE_EOL "\x1b[K"
+
+struct prediction {
+  // 0 for a sync point
+  uint8_t ch;
+  uint64_t sent_ns;
+};
+
+static bool (*write_out)(const uint8_t *data, size_t len);
+
+// keystrokes not yet echoed, oldest first. a sync point can only be the last one.
+static struct prediction queue[PREDICT_MAX];
+static int qlen;
+// whether the predictions in the queue are on the screen, right before the cursor
+static bool shown;
+// a keystroke since the last sync point has been echoed as predicted
+static bool confident;
+static uint64_t srtt_ns;
+
+// alternate screen tracking, from the "ESC [ ? <n> h/l" sequences in the output
+static bool altscreen;
+static enum { ESC_NONE, ESC_ESC, ESC_CSI, ESC_PRIV } esc_state;
+static unsigned esc_num;
+
+static struct {
+  unsigned long long predicted;
+  unsigned long long shown;
+  // times shown predictions had to be erased
+  unsigned long long wrong;
+} stats;
+
+void predict_init(bool (*write)(const uint8_t *data, size_t len)) { write_out = write; }
+
+static bool can_show() { return confident && !altscreen && srtt_ns >= PREDICT_SHOW_RTT_NS; }
+
+// number of predicted characters in the queue, excluding a sync point
+static int npredicted() { return qlen && !queue[qlen - 1].ch ? qlen - 1 : qlen; }
+
+// append the escape sequence that moves the cursor back over the shown predictions
+static size_t encode_rewind(char *out, size_t cap) {
+  int n = npredicted();
+  return shown && n ? snprintf(out, cap, "\x1b[%dD", n) : 0;
+}
+
+// append the predictions from `from` onwards, underlined
+static size_t encode_predictions(char *out, int from) {
+  size_t len = 0;
+  if (from >= npredicted())
+    return 0;
+  memcpy(out, UNDERLINE_ON, sizeof(UNDERLINE_ON) - 1);
+  len += sizeof(UNDERLINE_ON) - 1;
+  for (int i = from; i < npredicted(); ++i)
+    out[len++] = queue[i].ch;
+  memcpy(out + len, UNDERLINE_OFF, sizeof(UNDERLINE_OFF) - 1);
+  return len + sizeof(UNDERLINE_OFF) - 1;
+}
+
+static void track_altscreen(const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    uint8_t c = data[i];
+    switch (esc_state) {
+    case ESC_NONE: {
+      const uint8_t *esc = memchr(data + i, 0x1b, len - i);
+      if (!esc)
+        return;
+      i = esc - data;
+      esc_state = ESC_ESC;
+      break;
+    }
+    case ESC_ESC:
+      esc_state = c == '[' ? ESC_CSI : ESC_NONE;
+      break;
+    case ESC_CSI:
+      esc_state = c == '?' ? ESC_PRIV : ESC_NONE;
+      esc_num = 0;
+      break;
+    case ESC_PRIV:
+      if (c >= '0' && c <= '9') {
+        esc_num = esc_num * 10 + (c - '0');
+        break;
+      }
+      if ((c == 'h' || c == 'l') && (esc_num == 47 || esc_num == 1047 || esc_num == 1049))
+        altscreen = c == 'h';
+      esc_state = ESC_NONE;
+      break;
+    }
+  }
+}
+
+bool predict_input(const uint8_t *data, size_t len) {
+  char out[PREDICT_MAX + sizeof(UNDERLINE_ON UNDERLINE_OFF)];
+  int from = qlen;
+  uint64_t now = mono_ns();
+  for (size_t i = 0; i < len; ++i) {
+    // waiting for the response to a sync point
+    if (qlen && !queue[qlen - 1].ch)
+      break;
+    // anything but printable ASCII (including the last free slot) is a sync point
+    uint8_t c = data[i];
+    queue[qlen].ch = c >= 0x20 && c < 0x7f && qlen < PREDICT_MAX - 1 ? c : 0;
+    queue[qlen].sent_ns = now;
+    ++qlen;
+  }
+
+  if (!shown) {
+    // predictions can only appear right at the cursor
+    if (from || !can_show())
+      return true;
+    shown = true;
+  }
+  size_t outlen = encode_predictions(out, from);
+  stats.shown += npredicted() > from ? npredicted() - from : 0;
+  return !outlen || write_out((uint8_t *)out, outlen);
+}
+
+bool predict_output(const uint8_t *data, size_t len) {
+  if (!qlen || !len) {
+    track_altscreen(data, len);
+    return write_out(data, len);
+  }
+
+  // how much of the output echoes our predictions
+  uint64_t now = mono_ns();
+  int matched = 0;
+  size_t n = 0;
+  while (matched < qlen && queue[matched].ch && n < len && data[n] == queue[matched].ch) {
+    uint64_t rtt = now - queue[matched].sent_ns;
+    srtt_ns = srtt_ns ? (srtt_ns * 7 + rtt) / 8 : rtt;
+    ++matched;
+    ++n;
+  }
+  stats.predicted += matched;
+  if (matched)
+    confident = true;
+  bool wrong = matched < qlen && queue[matched].ch && n < len;
+  // whatever comes after a sync point is the server's response to it
+  bool synced = matched < qlen && !queue[matched].ch && n < len;
+
+  char head[sizeof(ERASE_EOL) + 16];
+  size_t headlen = encode_rewind(head, sizeof(head));
+  if (wrong && shown) {
+    memcpy(head + headlen, ERASE_EOL, sizeof(ERASE_EOL) - 1);
+    headlen += sizeof(ERASE_EOL) - 1;
+  }
+  bool wasshown = shown && npredicted() > matched;
+
+  if (wrong) {
+    stats.wrong += shown;
+    confident = false;
+    qlen = 0;
+  } else {
+    if (synced) {
+      confident = false;
+      ++matched;
+    }
+    qlen -= matched;
+    memmove(queue, queue + matched, qlen * sizeof(*queue));
+  }
+
+  track_altscreen(data, len);
+  char tail[PREDICT_MAX + sizeof(UNDERLINE_ON UNDERLINE_OFF ERASE_EOL)];
+  size_t taillen = 0;
+  shown = npredicted() && can_show();
+  if (shown) {
+    // the output ended with the echo of what came before them, so they go right after it
+    if (!wasshown)
+      stats.shown += npredicted();
+    taillen = encode_predictions(tail, 0);
+  } else if (wasshown) {
+    // the rest of our predictions are still on the screen
+    memcpy(tail, ERASE_EOL, sizeof(ERASE_EOL) - 1);
+    taillen = sizeof(ERASE_EOL) - 1;
+  }
+
+  return (!headlen || write_out((uint8_t *)head, headlen)) && write_out(data, len) &&
+         (!taillen || write_out((uint8_t *)tail, taillen));
+}
+
+static uint64_t expiry_ns() {
+  uint64_t timeout = srtt_ns * PREDICT_TIMEOUT_RTTS;
+  return queue[0].sent_ns + (timeout > PREDICT_TIMEOUT_MIN_NS ? timeout : PREDICT_TIMEOUT_MIN_NS);
+}
+
+int predict_timeout() {
+  if (!qlen)
+    return -1;
+  uint64_t now = mono_ns();
+  uint64_t expiry = expiry_ns();
+  return expiry > now ? (expiry - now + 999999) / 1000000 : 0;
+}
+
+bool predict_tick() {
+  if (!qlen || mono_ns() < expiry_ns())
+    return true;
+
+  // the server did not echo what we expected (e.g. a prompt with echo off), or did not
+  // respond to a sync point at all. start over.
+  char out[sizeof(ERASE_EOL) + 16];
+  size_t len = encode_rewind(out, sizeof(out));
+  if (len) {
+    memcpy(out + len, ERASE_EOL, sizeof(ERASE_EOL) - 1);
+    len += sizeof(ERASE_EOL) - 1;
+    ++stats.wrong;
+  }
+  qlen = 0;
+  shown = false;
+  confident = false;
+  return !len || write_out((uint8_t *)out, len);
+}
+
+void predict_dump_stats() {
+  fprintf(stderr, "Predictive echo: %llu keystrokes echoed as predicted, %llu shown early, %llu wrong. RTT %llu ms.\n",
+    stats.predicted, stats.shown, stats.wrong, (unsigned long long)(srtt_ns / 1000000));
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// client side predictive local echo (-e), for links where waiting for the server to echo
+// each keystroke is noticeably slow.
+//  - printable keystrokes are drawn (underlined) at the cursor right away, and replaced by
+//    the real echo once it arrives. any other key is a sync point: nothing is predicted
+//    until the server has responded to it.
+//  - predictions are only shown after a keystroke since the last sync point has been echoed
+//    as predicted, so nothing is drawn at a prompt that does not echo, like a password prompt.
+//  - nothing is shown while the app is on the alternate screen, or when the round trip is
+//    short enough not to matter.
+// a prediction that is contradicted by the server's output, or not echoed in time, is erased.
+
+// `write` writes to the terminal. must be called before the other functions.
+void predict_init(bool (*write)(const uint8_t *data, size_t len));
+
+// keystrokes that have just been sent to the server. returns false on terminal write error.
+bool predict_input(const uint8_t *data, size_t len);
+
+// write the server's output to the terminal, reconciling it with what we have predicted.
+// returns false on terminal write error.
+bool predict_output(const uint8_t *data, size_t len);
+
+// milliseconds until the oldest prediction expires, or -1 if there is none
+int predict_timeout();
+
+// erase expired predictions. returns false on terminal write error.
+bool predict_tick();
+
+// print the statistics to stderr
+void predict_dump_stats();
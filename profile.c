@@ -0,0 +1,169 @@
+#include "profile.h"
+#include <err.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <linux/vm_sockets.h>
+#endif
+
+enum profile_kind { PROF_DEFAULT, PROF_LATENCY, PROF_BULK };
+
+struct profile {
+  const char *name;
+  bool nodelay;
+  bool quickack;
+  // 0 leaves these alone
+  int notsent_lowat;
+  int busy_poll_us;
+  int uds_sndbuf;
+  int uds_rcvbuf;
+  uint64_t vsock_buff;
+};
+
+static const struct profile profiles[] = {
+  [PROF_DEFAULT] = {.name = "default", .nodelay = true},
+  [PROF_LATENCY] =
+    {
+      .name = "latency",
+      .nodelay = true,
+      .quickack = true,
+      .notsent_lowat = 16 * 1024,
+      .busy_poll_us = 50,
+      .uds_sndbuf = 64 * 1024,
+      .vsock_buff = 1024 * 1024,
+    },
+  [PROF_BULK] =
+    {
+      .name = "bulk",
+      .uds_sndbuf = 1024 * 1024,
+      .uds_rcvbuf = 1024 * 1024,
+      .vsock_buff = 4 * 1024 * 1024,
+    },
+};
+
+static const struct profile *prof = profiles + PROF_DEFAULT;
+static int pin_cpu = -1;
+
+// options that failed once are not reported again. sockets are tuned from multiple threads.
+static atomic_uint warned;
+
+enum { W_NODELAY, W_QUICKACK, W_LOWAT, W_BUSYPOLL, W_SNDBUF, W_RCVBUF, W_VSOCKBUF, W_PIN };
+
+static bool first_failure(int w) { return !(atomic_fetch_or(&warned, 1u << w) & (1u << w)); }
+
+static void set_opt(int fd, int level, int name, const void *val, socklen_t len, int w, const char *what) {
+  if (setsockopt(fd, level, name, val, len) < 0 && first_failure(w))
+    warn("Transport profile: error setting %s", what);
+}
+
+static void set_int(int fd, int level, int name, int val, int w, const char *what) {
+  set_opt(fd, level, name, &val, sizeof(val), w, what);
+}
+
+#ifdef __linux__
+
+// beyond the system limit if we are allowed to
+static void set_buff(int fd, int name, int forcename, int val, int w, const char *what) {
+  if (setsockopt(fd, SOL_SOCKET, forcename, &val, sizeof(val)) < 0)
+    set_int(fd, SOL_SOCKET, name, val, w, what);
+}
+
+#endif
+
+bool profile_init(const char *spec) {
+  char buff[64];
+  if (strlen(spec) >= sizeof(buff))
+    return false;
+  strcpy(buff, spec);
+
+  char *opt = strchr(buff, ',');
+  if (opt) {
+    *opt++ = 0;
+    char *endp;
+    if (strncmp(opt, "cpu=", 4) || !opt[4] || (pin_cpu = strtol(opt + 4, &endp, 10)) < 0 || *endp)
+      return false;
+#ifdef __linux__
+    if (pin_cpu >= CPU_SETSIZE)
+      return false;
+#endif
+  }
+  for (size_t i = 0; i < sizeof(profiles) / sizeof(*profiles); ++i) {
+    if (!strcmp(buff, profiles[i].name)) {
+      prof = profiles + i;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *profile_name() { return prof->name; }
+
+void profile_tune(int fd) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+    return;
+
+  switch (addr.ss_family) {
+  case AF_INET:
+  case AF_INET6:
+    set_int(fd, IPPROTO_TCP, TCP_NODELAY, prof->nodelay, W_NODELAY, "TCP_NODELAY");
+#ifdef __linux__
+    if (prof->quickack)
+      set_int(fd, IPPROTO_TCP, TCP_QUICKACK, 1, W_QUICKACK, "TCP_QUICKACK");
+    if (prof->notsent_lowat)
+      set_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, prof->notsent_lowat, W_LOWAT, "TCP_NOTSENT_LOWAT");
+    // raising it needs CAP_NET_ADMIN. without it, we get whatever net.core.busy_read says.
+    if (prof->busy_poll_us && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &prof->busy_poll_us, sizeof(int)) < 0 &&
+        errno != EPERM && first_failure(W_BUSYPOLL))
+      warn("Transport profile: error setting SO_BUSY_POLL");
+#endif
+    break;
+#ifdef __linux__
+  case AF_UNIX:
+    if (prof->uds_sndbuf)
+      set_buff(fd, SO_SNDBUF, SO_SNDBUFFORCE, prof->uds_sndbuf, W_SNDBUF, "SO_SNDBUF");
+    if (prof->uds_rcvbuf)
+      set_buff(fd, SO_RCVBUF, SO_RCVBUFFORCE, prof->uds_rcvbuf, W_RCVBUF, "SO_RCVBUF");
+    break;
+  case AF_VSOCK:
+    // the size can't go above the max, so that goes first
+    if (prof->vsock_buff) {
+      set_opt(fd, AF_VSOCK, SO_VM_SOCKETS_BUFFER_MAX_SIZE, &prof->vsock_buff, sizeof(prof->vsock_buff),
+        W_VSOCKBUF, "VSOCK buffer size");
+      set_opt(fd, AF_VSOCK, SO_VM_SOCKETS_BUFFER_SIZE, &prof->vsock_buff, sizeof(prof->vsock_buff), W_VSOCKBUF,
+        "VSOCK buffer size");
+    }
+    break;
+#endif
+  }
+}
+
+void profile_rearm(int fd) {
+#ifdef __linux__
+  int one = 1;
+  // other transports don't have the option
+  if (prof->quickack && setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one)) < 0 && errno != EOPNOTSUPP &&
+      errno != ENOPROTOOPT && first_failure(W_QUICKACK))
+    warn("Transport profile: error setting TCP_QUICKACK");
+#endif
+}
+
+void profile_pin() {
+#ifdef __linux__
+  if (pin_cpu < 0)
+    return;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(pin_cpu, &cpus);
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0 && first_failure(W_PIN))
+    warn("Transport profile: error pinning to CPU %d", pin_cpu);
+#endif
+}
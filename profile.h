@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+
+// transport profiles (-P): socket tuning for every session socket, applied as the socket is
+// created (socks.h) or accepted.
+//  - default: TCP_NODELAY, nothing else.
+//  - latency: for interactive sessions.
+//     - TCP: TCP_NODELAY and TCP_QUICKACK, which is set again after every read, as it wears
+//       off. TCP_NOTSENT_LOWAT (16 KiB) keeps the unsent part of the send queue short, so new
+//       output does not wait behind a backlog in the kernel.
+//       SO_BUSY_POLL (50 us) on NICs that support it, if we have CAP_NET_ADMIN.
+//     - Unix: a 64 KiB send buffer, for the same reason as TCP_NOTSENT_LOWAT.
+//     - VSOCK: 1 MiB buffers, so bursts do not stall waiting for credit from the peer.
+//     with cpu=<n> (e.g. "latency,cpu=2"), the relay is also pinned to CPU <n>: the client,
+//     each session process of the forking server, the gateway, or the VSOCK multiplexer.
+//  - bulk: for throughput.
+//     - TCP: Nagle's algorithm stays on, so small frames are coalesced into full segments.
+//     - Unix: 1 MiB buffers, so each wakeup moves more data.
+//     - VSOCK: 4 MiB buffers.
+// Unix socket buffers beyond net.core.[rw]mem_max are forced if we have CAP_NET_ADMIN.
+// options that can't be set are reported once and skipped. only TCP_NODELAY is set on other
+// systems than Linux.
+
+// `spec` is the profile name, optionally followed by ",cpu=<n>". returns false if invalid.
+bool profile_init(const char *spec);
+
+const char *profile_name();
+
+// tune a session socket of any transport
+void profile_tune(int fd);
+
+// after each read from a session socket. TCP_QUICKACK does not stick: the kernel goes back to
+// delayed ACKs by itself, so the latency profile sets it again. does nothing on other sockets.
+void profile_rearm(int fd);
+
+// pin the calling thread (and what it starts afterwards) to the profile's CPU, if any
+void profile_pin();
@@ -1,10 +1,17 @@
 #include "protocol.h"
 #include "utils.h"
+#include "common.h"
 #include <assert.h>
+#include <errno.h>
+#include <poll.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-bool proto_read(int fd, uint16_t *length, enum data_type *type, void *buff) {
+const uint8_t preamble[8] = {'p', 't', 'y', 'f', 'w', 'd', PROTOCOL_VERSION & 0xFF, (PROTOCOL_VERSION >> 8) & 0xFF};
+
+bool proto_read(int fd, uint16_t *length, enum data_type *type, void *buff, size_t buffsize) {
   unsigned char hbuff[2] = {0};
   // main header
   if (!read_all(fd, hbuff, 1))
@@ -16,13 +23,196 @@ bool proto_read(int fd, uint16_t *length, enum data_type *type, void *buff) {
   hbuff[1] = 0;
   if (!read_all(fd, hbuff, sizelen))
     return false;
-  *length = *((uint16_t *)hbuff);
+  memcpy(length, hbuff, sizeof(*length));
+
+  // never trust the peer with our buffer size
+  if (*length > buffsize) {
+    errno = EMSGSIZE;
+    return false;
+  }
 
   return *length ? read_all(fd, buff, *length) : true;
 }
 
-bool proto_write(int fd, uint16_t length, enum data_type type, const void *buff) {
+void proto_reader_init(struct proto_reader *r) {
+  r->start = r->end = r->cap = 0;
+  r->buff = NULL;
+  readsize_init(&r->rs);
+}
+
+void proto_reader_release(struct proto_reader *r) {
+  if (r->start != r->end)
+    return;
+  bufpool_put(r->buff, r->cap);
+  proto_reader_init(r);
+}
+
+// full length of the (possibly partial) frame at the front of the buffer
+static size_t reader_frame_len(const struct proto_reader *r) {
+  size_t avail = r->end - r->start;
+  const uint8_t *p = r->buff + r->start;
+  if (!avail)
+    return 0;
+  size_t hlen = (p[0] & 0x80) ? 3 : 2;
+  if (avail < hlen)
+    return PROTO_HDR_MAX;
+  uint16_t len = 0;
+  memcpy(&len, p + 1, hlen - 1);
+  return hlen + len;
+}
+
+bool proto_reader_fill(struct proto_reader *r, int fd) {
+  if (r->start == r->end)
+    r->start = r->end = 0;
+
+  // the buffer must fit the partial frame we have, and should be as big as the
+  // throughput asks for
+  size_t pending = r->end - r->start;
+  size_t need = reader_frame_len(r);
+  if (need < r->rs.size)
+    need = r->rs.size;
+  if (r->cap < need || (!pending && r->cap > need)) {
+    size_t newcap;
+    uint8_t *newbuff = bufpool_get(need, &newcap);
+    if (!newbuff)
+      return false;
+    // the first fill has no buffer yet
+    if (pending)
+      memcpy(newbuff, r->buff + r->start, pending);
+    bufpool_put(r->buff, r->cap);
+    r->buff = newbuff;
+    r->cap = newcap;
+    r->start = 0;
+    r->end = pending;
+  } else if (r->start && r->cap - r->start < need) {
+    memmove(r->buff, r->buff + r->start, pending);
+    r->end = pending;
+    r->start = 0;
+  }
+
+  size_t room = r->cap - r->end;
+  ssize_t rd;
+  do {
+    rd = read(fd, r->buff + r->end, room);
+  } while (rd < 0 && errno == EINTR);
+  if (rd < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  if (rd == 0) {
+    errno = EIO;
+    return false;
+  }
+  r->end += rd;
+  readsize_update(&r->rs, rd, room);
+  return true;
+}
+
+bool proto_reader_preload(struct proto_reader *r, const void *data, size_t len) {
+  if (!len)
+    return true;
+  size_t need = len < r->rs.size ? r->rs.size : len;
+  if (!(r->buff = bufpool_get(need, &r->cap)))
+    return false;
+  memcpy(r->buff, data, len);
+  r->start = 0;
+  r->end = len;
+  return true;
+}
+
+bool proto_reader_next(struct proto_reader *r, uint16_t *length, enum data_type *type, const uint8_t **data) {
+  size_t avail = r->end - r->start;
+  const uint8_t *p = r->buff + r->start;
+  if (avail < 2)
+    return false;
+  size_t hlen = (p[0] & 0x80) ? 3 : 2;
+  if (avail < hlen)
+    return false;
+  uint16_t len = 0;
+  memcpy(&len, p + 1, hlen - 1);
+  if (avail < hlen + len)
+    return false;
+
+  *type = p[0] & 0x7F;
+  *length = len;
+  *data = p + hlen;
+  r->start += hlen + len;
+  return true;
+}
+
+void proto_writer_init(struct proto_writer *w, int fd) { *w = (struct proto_writer){.fd = fd}; }
+
+void proto_writer_release(struct proto_writer *w) { bq_free(&w->q); }
+
+void proto_writer_trim(struct proto_writer *w) {
+  if (!w->q.len)
+    bq_free(&w->q);
+}
+
+bool proto_write(struct proto_writer *w, uint16_t length, enum data_type type, const void *buff) {
+  struct iovec iov = {.iov_base = (void *)buff, .iov_len = length};
+  return proto_writev(w, type, &iov, 1);
+}
+
+static bool queue_append(struct bytequeue *q, const struct iovec *iov, int iovcnt, size_t skip) {
+  for (int i = 0; i < iovcnt; ++i) {
+    size_t cp = iov[i].iov_len;
+    const uint8_t *src = iov[i].iov_base;
+    if (skip >= cp) {
+      skip -= cp;
+      continue;
+    }
+    if (!bq_append(q, src + skip, cp - skip))
+      return false;
+    skip = 0;
+  }
+  return true;
+}
+
+size_t proto_pending(const struct proto_writer *w) { return w->q.len; }
+
+bool proto_flush(struct proto_writer *w, bool wait) {
+  while (w->q.len) {
+    if (!bq_flush(&w->q, w->fd))
+      return false;
+    if (!w->q.len || !wait)
+      break;
+    struct pollfd pfds = {.fd = w->fd, .events = POLLOUT};
+    if (poll(&pfds, 1, -1) < 0 && errno != EINTR)
+      return false;
+  }
+  return true;
+}
+
+size_t proto_encode_header(uint8_t *out, uint16_t length, enum data_type type) {
+  size_t hlen = 2;
+  assert(!(type & 0x80));
+  out[0] = type;
+  if (length > 0xFF) {
+    ++hlen;
+    out[0] |= 0x80;
+  }
+  memcpy(out + 1, &length, hlen - 1);
+  return hlen;
+}
+
+size_t proto_encode(uint8_t *out, uint16_t length, enum data_type type, const void *buff) {
+  size_t hlen = proto_encode_header(out, length, type);
+  if (length)
+    memcpy(out + hlen, buff, length);
+  return hlen + length;
+}
+
+bool proto_writev(struct proto_writer *w, enum data_type type, const struct iovec *iov, int iovcnt) {
   unsigned char hbuff[3];
+  struct iovec wiov[8];
+  assert(iovcnt < 8);
+
+  size_t length = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    length += iov[i].iov_len;
+    wiov[i + 1] = iov[i];
+  }
+  assert(length <= 0xFFFF);
+
   int hlen = 2;
   assert(!(type & 0x80));
   hbuff[0] = type;
@@ -30,10 +220,31 @@ bool proto_write(int fd, uint16_t length, enum data_type type, const void *buff)
     ++hlen;
     hbuff[0] |= 0x80;
   }
-  *((uint16_t *)(hbuff + 1)) = length;
+  uint16_t length16 = length;
+  memcpy(hbuff + 1, &length16, hlen - 1);
+  wiov[0].iov_base = hbuff;
+  wiov[0].iov_len = hlen;
+  length += hlen;
 
-  if (!write_all(fd, hbuff, hlen))
+  // frames must not overtake what is already queued
+  if (!proto_flush(w, false))
     return false;
+  if (w->q.len)
+    return queue_append(&w->q, wiov, iovcnt + 1, 0) && (w->q.len < PROTO_OUTQ_MAX || proto_flush(w, true));
+
+  // header and data go out in a single syscall
+  ssize_t wr;
+  do {
+    wr = writev(w->fd, wiov, iovcnt + 1);
+  } while (wr < 0 && errno == EINTR);
+  if (wr < 0) {
+    if (errno != EAGAIN)
+      return false;
+    wr = 0;
+  }
+  if ((size_t)wr == length)
+    return true;
 
-  return length ? write_all(fd, buff, length) : true;
+  // keep the rest for later
+  return queue_append(&w->q, wiov, iovcnt + 1, wr);
 }
@@ -1,7 +1,12 @@
 #pragma once
 
+#include "bufpool.h"
+#include "common.h"
+#include "utils.h"
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 // the protocol of ptyfwd is in format:
 //  - 1 byte type
@@ -17,14 +22,99 @@ enum data_type {
   DT_NONE,      // move on to the next data
   DT_CLOSE,     // request to close/finish session
   DT_REGULAR,   // forward this data as-is to mPTY or stdio
-  DT_WINCH      // window size information
+  DT_WINCH,     // window size information
+  // forwarding channels (see forward.h)
+  DT_CHAN_LISTEN, // ask the server to listen: u32 listener id + listen spec
+  DT_CHAN_OPEN,   // open a channel: u32 channel id + u32 listener id + target spec
+  DT_CHAN_DATA,   // u32 channel id + data
+  DT_CHAN_CREDIT, // u32 channel id + u32 bytes consumed by the receiver
+  DT_CHAN_CLOSE,  // u32 channel id
+  DT_TICKET,      // v3 handshake: session ticket (see auth.h)
+  DT_TRACE,       // latency tracing (see trace.h)
+  // exec sessions (see exec.h)
+  DT_STDERR, // the app's stderr. its stdout is DT_REGULAR.
+  DT_EOF,    // client: no more stdin
+  DT_EXIT,   // server: i32 exit status of the app, right before DT_CLOSE
+  // half closed forwarding channels (CF_CHAN_EOF)
+  DT_CHAN_EOF // u32 channel id: no more data in this direction
 };
 
+// "ptyfwd" + the base protocol version. the handshake starts with it on both sides.
+extern const uint8_t preamble[8];
+
 struct winch_data {
   uint16_t rows;
   uint16_t cols;
 };
 
-bool proto_read(int fd, uint16_t *length, enum data_type *type, void *buff);
+#define PROTO_HDR_MAX 3
+
+// when `proto_pending` exceeds this, producers should stop reading new data
+#define PROTO_OUTQ_HIGH 65536
+// a write that grows the outgoing queue beyond this blocks until the queue is drained
+#define PROTO_OUTQ_MAX (1024 * 1024)
+
+// frames longer than `buffsize` are rejected with EMSGSIZE
+bool proto_read(int fd, uint16_t *length, enum data_type *type, void *buff, size_t buffsize);
+
+// frame writer of a connection. frame writes never block on a nonblocking fd: whatever cannot
+// be written immediately is queued, and later writes go out after it. event loops should poll
+// for POLLOUT while `proto_pending` is nonzero and call `proto_flush`.
+// each connection has its own, used by one thread at a time.
+struct proto_writer {
+  int fd;
+  struct bytequeue q;
+};
+
+void proto_writer_init(struct proto_writer *w, int fd);
+
+// free the queue, along with anything that is still in it
+void proto_writer_release(struct proto_writer *w);
+
+// free the queue's buffer if nothing is queued
+void proto_writer_trim(struct proto_writer *w);
+
+bool proto_write(struct proto_writer *w, uint16_t length, enum data_type type, const void *buff);
+
+// encode a frame into `out`, which must have room for PROTO_HDR_MAX + length bytes.
+// returns the number of bytes written to `out`. useful to batch multiple frames in one write.
+size_t proto_encode(uint8_t *out, uint16_t length, enum data_type type, const void *buff);
+
+// encode only the header of a frame with `length` bytes of data. returns the header length.
+size_t proto_encode_header(uint8_t *out, uint16_t length, enum data_type type);
+
+// write a single frame whose data is gathered from multiple buffers.
+// total length of the buffers must fit in 16 bit. max iovcnt is 7.
+bool proto_writev(struct proto_writer *w, enum data_type type, const struct iovec *iov, int iovcnt);
+
+// buffered frame reader for event loops: a single read() fetches as many frames as are
+// available, and frames are decoded in place without copying them out.
+// the buffer comes from the buffer pool (see bufpool.h) and grows with the throughput.
+struct proto_reader {
+  size_t start;
+  size_t end;
+  size_t cap;
+  uint8_t *buff;
+  struct readsize rs;
+};
+
+void proto_reader_init(struct proto_reader *r);
+
+// give the buffer back to the pool if there is no partial frame in it
+void proto_reader_release(struct proto_reader *r);
+
+// read whatever is available from `fd` without blocking.
+// returns false on read error or EOF (errno is set to EIO on EOF).
+bool proto_reader_fill(struct proto_reader *r, int fd);
+
+// put data received by another reader (e.g. a partial frame) in front of what is read next.
+// the reader must be empty.
+bool proto_reader_preload(struct proto_reader *r, const void *data, size_t len);
+
+// get the next complete frame, if any. `data` stays valid until the next `proto_reader_fill`.
+bool proto_reader_next(struct proto_reader *r, uint16_t *length, enum data_type *type, const uint8_t **data);
+
+size_t proto_pending(const struct proto_writer *w);
 
-bool proto_write(int fd, uint16_t length, enum data_type type, const void *buff);
+// write out queued frames. if `wait` is set, block until everything is written.
+bool proto_flush(struct proto_writer *w, bool wait);
@@ -0,0 +1,90 @@
+#include "pump.h"
+
+#ifdef __linux__
+
+#include "bufpool.h"
+#include "profile.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// relay this many rounds per call
+#define MAX_PUMP_ROUNDS 4
+// buffer size for sockets that cannot splice
+#define COPY_BUFF_SIZE (64 * 1024)
+
+void pump_clear(struct pump *p) {
+  memset(p, 0, sizeof(*p));
+  p->pipe[0] = p->pipe[1] = -1;
+}
+
+bool pump_init(struct pump *p) {
+  if (pipe2(p->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    warn("Error creating pipe");
+    return false;
+  }
+  int sz = fcntl(p->pipe[0], F_GETPIPE_SZ);
+  p->pipecap = sz > 0 ? sz : 65536;
+  return true;
+}
+
+bool pump_run(struct pump *p, int src, int dst) {
+  for (int round = 0; round < MAX_PUMP_ROUNDS && !p->eof; ++round) {
+    // whatever we have goes out first
+    while (p->pending) {
+      ssize_t wr = p->buff ? write(dst, p->buff + p->off, p->pending)
+                           : splice(p->pipe[0], NULL, dst, NULL, p->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (wr < 0) {
+        if (errno == EINTR)
+          continue;
+        return errno == EAGAIN;
+      }
+      p->pending -= wr;
+      p->off += wr;
+      p->total += wr;
+    }
+    p->off = 0;
+
+    ssize_t rd = p->buff ? read(src, p->buff, p->buffcap)
+                         : splice(src, NULL, p->pipe[1], NULL, p->pipecap, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rd < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        return true;
+      if (errno == EINVAL && !p->buff) {
+        // this socket can't splice. copy through user space instead.
+        if (!(p->buff = bufpool_get(COPY_BUFF_SIZE, &p->buffcap)))
+          return false;
+        continue;
+      }
+      return false;
+    }
+    if (!rd)
+      p->eof = true;
+    else
+      profile_rearm(src);
+    p->pending = rd;
+  }
+
+  // pass the EOF on once everything before it is written
+  if (p->eof && !p->pending && !p->done) {
+    shutdown(dst, SHUT_WR);
+    p->done = true;
+  }
+  return true;
+}
+
+void pump_free(struct pump *p) {
+  for (int i = 0; i < 2; ++i) {
+    if (p->pipe[i] >= 0)
+      close(p->pipe[i]);
+  }
+  bufpool_put(p->buff, p->buffcap);
+  pump_clear(p);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// one direction of a byte stream relayed between two sockets, without looking at the data.
+// data goes through a pipe with splice(), so it never gets copied to user space. sockets
+// that can't splice fall back to read()/write(). Linux only.
+struct pump {
+  int pipe[2];
+  size_t pipecap;
+  uint8_t *buff;
+  size_t buffcap;
+  // bytes read from the source but not written to the destination yet
+  size_t pending;
+  // write offset into `buff`
+  size_t off;
+  bool eof;
+  // the EOF has been passed on to the destination
+  bool done;
+  uint64_t total;
+};
+
+// a pump that has nothing to free yet
+void pump_clear(struct pump *p);
+
+bool pump_init(struct pump *p);
+
+// move data from `src` to `dst` until either would block, for a few rounds at most so one
+// busy stream can't starve the rest. the source's EOF is passed on with shutdown(SHUT_WR).
+// returns false on error.
+bool pump_run(struct pump *p, int src, int dst);
+
+void pump_free(struct pump *p);
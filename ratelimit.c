@@ -0,0 +1,275 @@
+#include "ratelimit.h"
+#include "utils.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// don't bother reading less than this, unless the session asks for less
+#define RL_MIN_GRANT 1024
+// buckets hold at most this fraction of a second worth of tokens
+#define RL_BURST_DIV 10
+#define RL_MIN_BURST 16384
+// sessions that can be contending at the same time. any more are not held to a share.
+#define RL_CONTENDERS_MAX 4096
+// how often the contenders of dead workers are looked for
+#define RL_RECLAIM_NS 1000000000ull
+
+// shared between all worker processes
+struct rl_global {
+  pthread_mutex_t lock;
+  double tokens;
+  uint64_t last_ns;
+  // total weight of the sessions that are limited by the global budget
+  uint32_t contending_weight;
+  uint32_t contending;
+  // statistics. atomic, so that sessions with no global rate never take the lock.
+  atomic_uint_fast64_t throttled_ns;
+  atomic_uint_fast64_t throttle_events;
+  atomic_uint_fast64_t bytes;
+  // who is contending, so that a worker that dies without rl_pause() can be taken off
+  struct {
+    pid_t pid;
+    uint32_t weight;
+  } contenders[RL_CONTENDERS_MAX];
+  int freeslots[RL_CONTENDERS_MAX];
+  int nfree;
+  uint64_t reclaim_ns;
+};
+
+static uint64_t session_rate;
+static double session_burst;
+static uint64_t global_rate;
+static double global_burst;
+static uint32_t interactive_weight = 1;
+static struct rl_global *global;
+
+static double burst_for(uint64_t rate) {
+  double burst = (double)rate / RL_BURST_DIV;
+  return burst < RL_MIN_BURST ? RL_MIN_BURST : burst;
+}
+
+static double refill(double tokens, double rate, double burst, double elapsed) {
+  tokens += rate * elapsed;
+  return tokens > burst ? burst : tokens;
+}
+
+bool rl_init(uint64_t srate, uint64_t grate, uint32_t iweight) {
+  interactive_weight = iweight ? iweight : 1;
+  session_rate = srate;
+  session_burst = burst_for(srate);
+  global_rate = grate;
+  global_burst = burst_for(grate);
+  if (!(srate || grate))
+    return true;
+
+  global = mmap(NULL, sizeof(*global), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (global == MAP_FAILED) {
+    global = NULL;
+    return false;
+  }
+  if (!shared_mutex_init(&global->lock)) {
+    munmap(global, sizeof(*global));
+    global = NULL;
+    return false;
+  }
+  global->tokens = global_burst;
+  global->last_ns = global->reclaim_ns = mono_ns();
+  for (int i = 0; i < RL_CONTENDERS_MAX; ++i)
+    global->freeslots[i] = RL_CONTENDERS_MAX - 1 - i;
+  global->nfree = RL_CONTENDERS_MAX;
+  return true;
+}
+
+static void reclaim() {
+  for (int i = 0; i < RL_CONTENDERS_MAX; ++i) {
+    pid_t pid = global->contenders[i].pid;
+    if (!pid || kill(pid, 0) == 0 || errno != ESRCH)
+      continue;
+    global->contending_weight -= global->contenders[i].weight;
+    --global->contending;
+    global->contenders[i].pid = 0;
+    global->freeslots[global->nfree++] = i;
+  }
+}
+
+// every access to the global state but the statistics goes through here
+static void lock_global(uint64_t now) {
+  // a worker that died in here may have left the accounting half done. its contenders are
+  // taken off, and the buckets refill anyway.
+  bool ownerdead = !shared_mutex_lock(&global->lock);
+  if (ownerdead || now - global->reclaim_ns >= RL_RECLAIM_NS) {
+    global->reclaim_ns = now;
+    reclaim();
+  }
+}
+
+bool rl_enabled() { return global; }
+
+void rl_session_init(struct rl_session *s, bool exec) {
+  memset(s, 0, sizeof(*s));
+  s->weight = exec ? 1 : interactive_weight;
+  s->tokens = session_burst;
+  s->share_tokens = global_burst;
+  s->last_ns = mono_ns();
+  s->slot = -1;
+}
+
+static void set_contending(struct rl_session *s, bool contending) {
+  if (s->contending == contending)
+    return;
+  s->contending = contending;
+  if (contending) {
+    if (!global->nfree)
+      return;
+    s->slot = global->freeslots[--global->nfree];
+    global->contenders[s->slot].pid = getpid();
+    global->contenders[s->slot].weight = s->weight;
+    global->contending_weight += s->weight;
+    ++global->contending;
+  } else if (s->slot >= 0) {
+    global->contenders[s->slot].pid = 0;
+    global->freeslots[global->nfree++] = s->slot;
+    s->slot = -1;
+    global->contending_weight -= s->weight;
+    --global->contending;
+  }
+}
+
+static void end_throttle(struct rl_session *s, uint64_t now) {
+  if (!s->throttle_start)
+    return;
+  uint64_t d = now - s->throttle_start;
+  s->throttled_ns += d;
+  s->throttle_start = 0;
+  atomic_fetch_add(&global->throttled_ns, d);
+}
+
+size_t rl_allow(struct rl_session *s, size_t want, int *wait_ms) {
+  if (!global)
+    return want;
+
+  uint64_t now = mono_ns();
+  double elapsed = (now - s->last_ns) / 1e9;
+  s->last_ns = now;
+  double avail = want;
+  double need = want < RL_MIN_GRANT ? want : RL_MIN_GRANT;
+  double wait = 0;
+
+  if (session_rate) {
+    s->tokens = refill(s->tokens, session_rate, session_burst, elapsed);
+    if (s->tokens < avail)
+      avail = s->tokens;
+    if (s->tokens < need)
+      wait = (need - s->tokens) / session_rate;
+  }
+
+  if (global_rate) {
+    lock_global(now);
+    global->tokens = refill(global->tokens, global_rate, global_burst, (now - global->last_ns) / 1e9);
+    global->last_ns = now;
+
+    // our weighted share of the global rate, counting ourselves as contending
+    uint32_t totalweight = global->contending_weight + (s->slot >= 0 ? 0 : s->weight);
+    double share_rate = (double)global_rate * s->weight / totalweight;
+    double share_burst = global_burst * s->weight / totalweight;
+    s->share_tokens = refill(s->share_tokens, share_rate, share_burst, elapsed);
+
+    double gavail = global->tokens < s->share_tokens ? global->tokens : s->share_tokens;
+    set_contending(s, gavail < avail);
+    if (gavail < avail)
+      avail = gavail;
+    if (global->tokens < need && (need - global->tokens) / global_rate > wait)
+      wait = (need - global->tokens) / global_rate;
+    if (s->share_tokens < need && (need - s->share_tokens) / share_rate > wait)
+      wait = (need - s->share_tokens) / share_rate;
+    pthread_mutex_unlock(&global->lock);
+  }
+
+  if (avail < need) {
+    if (!s->throttle_start) {
+      s->throttle_start = now;
+      atomic_fetch_add(&global->throttle_events, 1);
+    }
+    int ms = wait * 1000 + 1;
+    *wait_ms = ms > 1000 ? 1000 : ms;
+    return 0;
+  }
+
+  end_throttle(s, now);
+  return avail;
+}
+
+void rl_consume(struct rl_session *s, size_t used) {
+  if (!global)
+    return;
+  s->tokens -= used;
+  s->share_tokens -= used;
+  atomic_fetch_add(&global->bytes, used);
+  if (global_rate) {
+    lock_global(mono_ns());
+    global->tokens -= used;
+    pthread_mutex_unlock(&global->lock);
+  }
+}
+
+void rl_pause(struct rl_session *s) {
+  if (!global)
+    return;
+  uint64_t now = mono_ns();
+  end_throttle(s, now);
+  // only the global rate makes sessions contend
+  if (s->contending) {
+    lock_global(now);
+    set_contending(s, false);
+    pthread_mutex_unlock(&global->lock);
+  }
+}
+
+void rl_get_stats(struct rl_stats *st) {
+  memset(st, 0, sizeof(*st));
+  if (!global)
+    return;
+  st->throttled_ns = atomic_load(&global->throttled_ns);
+  st->throttle_events = atomic_load(&global->throttle_events);
+  st->bytes = atomic_load(&global->bytes);
+  lock_global(mono_ns());
+  st->contending = global->contending;
+  pthread_mutex_unlock(&global->lock);
+}
+
+void rl_dump_stats() {
+  struct rl_stats st;
+  rl_get_stats(&st);
+  fprintf(stderr, "rate limit: %llu bytes sent, throttled %llu times for %llu ms in total, %u session(s) contending\n",
+    (unsigned long long)st.bytes, (unsigned long long)st.throttle_events,
+    (unsigned long long)(st.throttled_ns / 1000000), st.contending);
+}
+
+uint64_t rl_parse_rate(const char *s) {
+  char *end;
+  unsigned long long v = strtoull(s, &end, 10);
+  switch (*end) {
+  case 'k':
+  case 'K':
+    v <<= 10;
+    ++end;
+    break;
+  case 'm':
+  case 'M':
+    v <<= 20;
+    ++end;
+    break;
+  case 'g':
+  case 'G':
+    v <<= 30;
+    ++end;
+    break;
+  }
+  return *end ? 0 : v;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// output rate limiting for server sessions (-b, -B). rates are in bytes per second.
+//  - each session has its own token bucket, refilled at the per-session rate.
+//  - all sessions also draw from a global bucket, shared between worker processes.
+//    while sessions are contending for it, each of them is also held to its weighted
+//    share of the global rate, so that one busy session can't starve the others.
+// a session that is out of tokens stops reading its mPTY until it has some again,
+// which backpressures the launched app.
+
+struct rl_session {
+  uint32_t weight;
+  // true while the global budget is what limits this session
+  bool contending;
+  // in the shared list of contenders, -1 if not there
+  int slot;
+  double tokens;
+  double share_tokens;
+  uint64_t last_ns;
+  // 0 if not throttled right now
+  uint64_t throttle_start;
+  uint64_t throttled_ns;
+};
+
+struct rl_stats {
+  uint64_t throttled_ns;
+  uint64_t throttle_events;
+  uint64_t bytes;
+  uint32_t contending;
+};
+
+// 0 means unlimited. `interactive_weight` is the weight of PTY sessions in their share of the
+// global rate, against exec sessions (-E), which have weight 1. must be called before there are
+// multiple workers.
+bool rl_init(uint64_t session_rate, uint64_t global_rate, uint32_t interactive_weight);
+
+bool rl_enabled();
+
+// `exec` for sessions without a PTY
+void rl_session_init(struct rl_session *s, bool exec);
+
+// returns how many bytes (at most `want`) the session may read now. if it returns 0, the
+// session is throttled and `*wait_ms` is set to how long it should wait before asking again.
+size_t rl_allow(struct rl_session *s, size_t want, int *wait_ms);
+
+// account for `used` bytes, which must not be more than what `rl_allow` returned
+void rl_consume(struct rl_session *s, size_t used);
+
+// the session stopped reading its mPTY for another reason, or ended
+void rl_pause(struct rl_session *s);
+
+void rl_get_stats(struct rl_stats *st);
+
+// print the statistics to stderr
+void rl_dump_stats();
+
+// parse a rate like "500K" or "10M". returns 0 if invalid.
+uint64_t rl_parse_rate(const char *s);
@@ -1,13 +1,30 @@
+#include "auth.h"
+#include "bufpool.h"
+#include "caps.h"
+#include "cgroup.h"
 #include "common.h"
+#include "exec.h"
+#include "forward.h"
 #include "global.h"
+#include "handoff.h"
+#include "history.h"
+#include "profile.h"
 #include "protocol.h"
+#include "ratelimit.h"
+#include "server.h"
+#include "shard.h"
 #include "socks.h"
+#include "launch.h"
+#include "tls.h"
+#include "trace.h"
+#include "trigger.h"
 #include "utils.h"
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -18,27 +35,65 @@
 #include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
-#include <openssl/sha.h>
 
 #define LISTEN_BACKLOG 8
 
-static void server_worker_loop(int commfd, char *launchreq);
+static void server_worker_loop(int commfd, const char *launchreq, const struct session_setup *setup);
 
-static void set_winsize(int fd, const struct winch_data *data);
+static bool authenticate(int fd, const uint8_t *nonce, uint8_t *hsbuff);
 
-static char rbuff[BUFF_SIZE];
+static bool authenticate_v3(int fd, const uint8_t *nonce, uint8_t *hsbuff, struct session_setup *setup);
 
-static bool negotiate(int fd);
+int start_server(int svrfd, const char *launchreq, int nthreads) {
+  if (listen(svrfd, nthreads >= 0 ? SOMAXCONN : LISTEN_BACKLOG) < 0) {
+    warn("Listen error");
+    return 1;
+  }
 
-static bool authenticate(int fd);
+  if (cookie.size && !auth_ticket_init())
+    warn("Error setting up session tickets");
 
-int start_server(int svrfd, const char *launchreq) {
-  if (listen(svrfd, LISTEN_BACKLOG) < 0) {
-    warn("Listen error");
+  if (nthreads >= 0)
+    return start_threaded_server(svrfd, launchreq, nthreads);
+
+  // sessions are processes of their own, so there are none to take over
+  if (!handoff_start(NULL))
     return 1;
+
+  // session processes are reaped by the kernel, instead of forking twice so that init does it
+  signal(SIGCHLD, SIG_IGN);
+
+  // with rate limits or accounting, SIGUSR1 dumps their statistics
+  int sigfd = -1;
+  if (rl_enabled() || cg_enabled()) {
+    int sigs[] = {SIGUSR1};
+    if ((sigfd = signal_fd(sigs, sizeof(sigs) / sizeof(*sigs))) < 0)
+      warn("Error setting up signal fd");
   }
 
   for (;;) {
+    if (sigfd >= 0 || handoff_fd() >= 0 || cg_enabled()) {
+      struct pollfd pfds[3] = {
+        {.fd = svrfd, .events = POLLIN}, {.fd = sigfd, .events = POLLIN}, {.fd = handoff_fd(), .events = POLLIN}};
+      if (poll(pfds, 3, cg_tick()) < 0)
+        continue;
+      if (pfds[1].revents & POLLIN) {
+        while (signal_fd_next(sigfd)) {
+          if (rl_enabled())
+            rl_dump_stats();
+          cg_dump_stats();
+        }
+      }
+      // running sessions go on in their own processes
+      bool adopt;
+      if ((pfds[2].revents & POLLIN) && handoff_accept(svrfd, &adopt)) {
+        handoff_finish();
+        return 0;
+      }
+      if (!(pfds[0].revents & POLLIN))
+        continue;
+    }
+
     int commfd = accept(svrfd, NULL, NULL);
     if (commfd < 0) {
       if (errno != EINTR)
@@ -46,6 +101,7 @@ int start_server(int svrfd, const char *launchreq) {
       continue;
     }
     set_fd_flags(commfd, true, O_NONBLOCK);
+    profile_tune(commfd);
     pid_t pid = fork();
     if (pid < 0) {
       warn("Fork failed");
@@ -53,143 +109,268 @@ int start_server(int svrfd, const char *launchreq) {
     } else if (pid) {
       // parent. we don't need the commfd here.
       close(commfd);
-      // worker is @ grandchild. child will be killed immediately.
-      waitpid(pid, NULL, 0);
     } else {
-      // child. fork again! we don't want to deal with zombies.
-      pid_t pid2 = fork();
-      if (pid2 < 0)
-        err(1, "Double fork error");
-      if (pid2)
-        exit(0);
-      // from this point on is the grandchild, which will do all the job.
-      // no return
-      char *launchreq_c = alloca(strlen(launchreq) + 1);
-      strcpy(launchreq_c, launchreq);
+      // child, which will do all the job. it waits for its own children.
+      signal(SIGCHLD, SIG_DFL);
+      if (sigfd >= 0)
+        close(sigfd);
       // never return
-      if (!negotiate(commfd)) {
+      struct session_setup setup;
+      if (tls_enabled() && (commfd = tls_wrap(commfd, NULL, false)) < 0)
+        errx(1, "Client negotiation failed.");
+      if (!server_negotiate(commfd, CF_FORWARD | CF_TRACE | CF_EXEC | CF_CHAN_EOF, &setup)) {
         errx(1, "Client negotiation failed.");
       }
       warnx("New client successfully connected.");
-      server_worker_loop(commfd, launchreq_c);
+      if (setup.caps.features & CF_EXEC)
+        exec_worker_loop(commfd, launchreq, &setup);
+      server_worker_loop(commfd, launchreq, &setup);
     }
   }
 
   return 0;
 }
 
-static void server_worker_loop(int commfd, char *launchreq) {
+pid_t spawn_pty_child(const char *launchreq, const struct session_setup *setup, int closefd, int *ptymout) {
   // controlling (m) pty
-  int ptym = open("/dev/ptmx", O_RDWR);
-  if (ptym < 0)
-    err(1, "Error opening ptmx");
+  int ptym = open("/dev/ptmx", O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (ptym < 0) {
+    warn("Error opening ptmx");
+    return -1;
+  }
   set_fd_flags(ptym, true, O_NONBLOCK);
 
-  if (grantpt(ptym) < 0)
-    err(1, "grantpt error");
-  if (unlockpt(ptym) < 0)
-    err(1, "unlockpt error");
+  int ptys = -1;
+  if (grantpt(ptym) < 0) {
+    warn("grantpt error");
+    goto error;
+  }
+  if (unlockpt(ptym) < 0) {
+    warn("unlockpt error");
+    goto error;
+  }
 
   // controlled (s) pty
-  char pts_name[32];
+  char pts_name[64];
+#ifdef __linux__
+  if (ptsname_r(ptym, pts_name, sizeof(pts_name))) {
+#else
   char *ptsnameres = ptsname(ptym);
-  if (!ptsnameres)
-    err(1, "Error getting name for sPTY");
-  strcpy(pts_name, ptsnameres);
-
-  int ptys = open(pts_name, O_RDWR);
-  if (ptys < 0)
-    err(1, "Error opening sPTY");
-
-  pid_t childpid = fork();
-  if (childpid < 0)
-    err(1, "Error spawning process");
-  if (!childpid) {
-    // child.
-
-    // we're done with mPTY
-    close(ptym);
-    // child also no need to deal with commsock
-    close(commfd);
-
-    // this must be done in this exact order to make this process
-    // as both session leader and controlling terminal
-    if (setsid() < 0)
-      err(1, "Error setting session leader");
-    if (ioctl(ptys, TIOCSCTTY, 0) < 0)
-      err(1, "Error setting controlling terminal");
-    if (tcsetpgrp(ptys, getpid()) < 0)
-      err(1, "Error setting foreground process group");
-
-    // make sPTY our stdio!
-    for (int i = 0; i <= 2; ++i) {
-      if (dup2(ptys, i) != i)
-        err(1, "Error dup2 sPTY to stdio");
-    }
+  if (ptsnameres)
+    snprintf(pts_name, sizeof(pts_name), "%s", ptsnameres);
+  else {
+#endif
+    warn("Error getting name for sPTY");
+    goto error;
+  }
 
-    char *args[2] = {launchreq, NULL};
-    if (execvp(launchreq, args) < 0)
-      err(1, "exec error");
+  ptys = open(pts_name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (ptys < 0) {
+    warn("Error opening sPTY");
+    goto error;
+  }
+
+  if (setup->has_winch)
+    set_winsize(ptym, &setup->winch);
+
+  // ours stays open until the app has opened it too, so that mPTY never sees it closed
+  struct launch_io io = {.pts = pts_name, .closefd = closefd, .cgroup = true};
+  pid_t childpid = launch_app(launchreq, &io);
+  if (childpid < 0) {
+    warn("Error launching %s", launchreq);
+    goto error;
   }
 
   close(ptys);
+  *ptymout = ptym;
+  return childpid;
+
+error:
+  if (ptys >= 0)
+    close(ptys);
+  close(ptym);
+  return -1;
+}
+
+// `reply` triggers type into the app like the client does
+static void trigger_reply(void *ctx, const uint8_t *data, size_t len) {
+  if (!write_all(*(int *)ctx, data, len))
+    warn("mPTY write error");
+}
+
+static void server_worker_loop(int commfd, const char *launchreq, const struct session_setup *setup) {
+  struct proto_writer comm;
+  proto_writer_init(&comm, commfd);
+  int ptym;
+  pid_t pid = spawn_pty_child(launchreq, setup, commfd, &ptym);
+  if (pid < 0) {
+    // where the app would have said it
+    char msg[256];
+    int len = snprintf(msg, sizeof(msg), "ptyfwd: Error launching %s: %s\r\n", launchreq, strerror(errno));
+    proto_write(&comm, len, DT_REGULAR, msg);
+    proto_write(&comm, 0, DT_CLOSE, NULL);
+    proto_flush(&comm, true);
+    exit(1);
+  }
+  // the app keeps the affinity it was started with
+  profile_pin();
+  const struct caps *caps = &setup->caps;
 
   // parent
   // this loop basically:
   // - read remote, write to PTM
   // - read PTM, write to remote
 
-  struct pollfd pfds[2];
+  fwd_init(true);
+  fwd_half_close(caps->features & CF_CHAN_EOF);
+  // nothing to share with in this process. idle buffers go straight back to the OS.
+  bufpool_init(0);
+  // relay buffers. both are given back when the session goes idle.
+  struct relaybuf rbuff;
+  relaybuf_init(&rbuff);
+  struct proto_reader reader;
+  proto_reader_init(&reader);
+  struct rl_session rls;
+  rl_session_init(&rls, false);
+  struct trace_session trace;
+  trace_session_init(&trace, caps->features & CF_TRACE);
+  struct trigger_session trig;
+  trigger_session_init(&trig, pid, trigger_reply, &ptym);
+  struct history_session *hist = history_open(pid);
+
+  struct pollfd pfds[2 + FWD_MAX_POLLFDS];
   pfds[0].fd = commfd;
-  pfds[1].fd = ptym;
-  pfds[0].events = pfds[1].events = POLLIN;
   const char *errmsg = NULL;
   bool stop = false;
   while (!(errmsg || stop)) {
-    if (poll(pfds, 2, -1) < 0) {
+    // stop reading new data while the peer is not keeping up with us, or while we
+    // are over our rate limit
+    bool congested = proto_pending(&comm) >= PROTO_OUTQ_HIGH;
+    size_t allowed = 0;
+    int throttle_ms = -1;
+    if (congested)
+      rl_pause(&rls);
+    else
+      allowed = rl_allow(&rls, caps_read_size(caps), &throttle_ms);
+    pfds[0].events = POLLIN | (proto_pending(&comm) ? POLLOUT : 0);
+    // a hung up fd would be reported even without any events
+    pfds[1].fd = allowed ? ptym : -1;
+    pfds[1].events = allowed ? POLLIN : 0;
+    int nfwd = fwd_fill_pollfds(pfds + 2, !congested);
+    bool holding = rbuff.buff || reader.buff || proto_pending(&comm);
+    int timeout = holding ? BUFPOOL_IDLE_MS : -1;
+    if (throttle_ms >= 0 && (timeout < 0 || throttle_ms < timeout))
+      timeout = throttle_ms;
+    int npoll = poll(pfds, 2 + nfwd, timeout);
+    if (npoll < 0) {
       if (errno == EINTR)
         continue;
+    } else if (!npoll && timeout != throttle_ms) {
+      relaybuf_release(&rbuff);
+      proto_reader_release(&reader);
+      proto_writer_trim(&comm);
+      continue;
     }
 
     for (int i = 0; i < 2; ++i) {
+      if (!pfds[i].events)
+        continue;
+      if ((pfds[i].revents & POLLOUT) && !proto_flush(&comm, false)) {
+        errmsg = "Socket write error";
+        break;
+      }
       if (!(pfds[i].revents & (POLLIN | POLLERR | POLLHUP)))
         continue;
       int srcfd = pfds[i].fd;
       if (srcfd == commfd) {
-        uint16_t rdlen;
-        enum data_type pdatatype;
-        if (!proto_read(commfd, &rdlen, &pdatatype, rbuff)) {
+        if (!proto_reader_fill(&reader, commfd)) {
           errmsg = "Socket read error";
           break;
         }
+        profile_rearm(commfd);
 
-        switch (pdatatype) {
-        case DT_WINCH:
-          set_winsize(ptym, (struct winch_data *)rbuff);
-          break;
-        case DT_REGULAR:
-          if (!write_all(ptym, rbuff, rdlen))
-            errmsg = "mPTY write error";
-          break;
-        case DT_CLOSE:
-          stop = true;
-          break;
-        case DT_NONE:
-          break;
-        default:
-          warnx("Unrecognized data type %d", pdatatype);
-          continue;
+        // only the newest window size in this batch is applied
+        struct winch_data wd;
+        bool has_winch = false;
+
+        uint16_t rdlen;
+        enum data_type pdatatype;
+        const uint8_t *data;
+        while (!(errmsg || stop) && proto_reader_next(&reader, &rdlen, &pdatatype, &data)) {
+          switch (pdatatype) {
+          case DT_WINCH:
+            if (rdlen != sizeof(wd)) {
+              warnx("Invalid window size data");
+              break;
+            }
+            memcpy(&wd, data, sizeof(wd));
+            has_winch = true;
+            break;
+          case DT_REGULAR:
+            if (!write_all(ptym, data, rdlen))
+              errmsg = "mPTY write error";
+            trace_pty_write(&trace);
+            break;
+          case DT_TRACE: {
+            uint8_t reply[TRACE_PAYLOAD_MAX];
+            size_t replylen = trace_handle(&trace, data, rdlen, reply);
+            if (replylen && !proto_write(&comm, replylen, DT_TRACE, reply))
+              errmsg = "Socket write error";
+            break;
+          }
+          case DT_CLOSE:
+            stop = true;
+            break;
+          case DT_NONE:
+            break;
+          case DT_CHAN_LISTEN:
+          case DT_CHAN_OPEN:
+          case DT_CHAN_DATA:
+          case DT_CHAN_CREDIT:
+          case DT_CHAN_CLOSE:
+          case DT_CHAN_EOF:
+            if (!fwd_handle_frame(&comm, pdatatype, data, rdlen))
+              errmsg = "Socket write error";
+            break;
+          default:
+            warnx("Unrecognized data type %d", pdatatype);
+            break;
+          }
         }
+
+        if (has_winch)
+          set_winsize(ptym, &wd);
       } else if (srcfd == ptym) {
-        int rd = read(ptym, rbuff, BUFF_SIZE);
+        uint8_t *buff = relaybuf_acquire(&rbuff);
+        if (!buff) {
+          errmsg = "Error allocating buffer";
+          break;
+        }
+        size_t room = allowed;
+        if (room > rbuff.cap)
+          room = rbuff.cap;
+        int rd = read(ptym, buff, room);
         if (rd <= 0) {
           if (rd < 0)
             errmsg = "mPTY read error";
           stop = true;
           break;
         }
-
-        if (!proto_write(commfd, rd, DT_REGULAR, rbuff)) {
+        uint64_t readns = trace.enabled ? mono_ns() : 0;
+        readsize_update(&rbuff.rs, rd, room);
+        rl_consume(&rls, rd);
+        trigger_scan(&trig, buff, rd);
+        history_append(hist, buff, rd);
+
+        if (trace.enabled) {
+          uint8_t stamp[TRACE_PAYLOAD_MAX];
+          size_t stamplen = trace_stamp(&trace, stamp, readns, rd);
+          if (!proto_write(&comm, stamplen, DT_TRACE, stamp)) {
+            errmsg = "Socket write error";
+            break;
+          }
+        }
+        if (!proto_write(&comm, rd, DT_REGULAR, buff)) {
           errmsg = "Socket write error";
           break;
         }
@@ -198,96 +379,284 @@ static void server_worker_loop(int commfd, char *launchreq) {
         errmsg = "unknown src fd";
       }
     }
+
+    if (!(errmsg || stop) && !fwd_handle_pollfds(&comm, pfds + 2, nfwd))
+      errmsg = "Socket write error";
   }
 
   if (errmsg)
     warn("%s", errmsg);
 
   // don't forget to let client know if we're stopping
-  proto_write(commfd, 0, DT_CLOSE, NULL);
+  proto_write(&comm, 0, DT_CLOSE, NULL);
+  proto_flush(&comm, true);
+  proto_writer_release(&comm);
 
+  fwd_close_all();
+  trigger_session_free(&trig);
   close(commfd);
   close(ptym);
-
-  warnx("Client disconnected.");
+  // the rest of the history, before the process is gone
+  history_close(hist);
+  history_finish();
+
+  rl_pause(&rls);
+  if (rls.throttled_ns)
+    warnx("Client disconnected. Output was throttled for %llu ms.", (unsigned long long)(rls.throttled_ns / 1000000));
+  else
+    warnx("Client disconnected.");
   exit(errmsg ? 1 : 0);
 }
 
-static void set_winsize(int fd, const struct winch_data *data) {
+void set_winsize(int fd, const struct winch_data *data) {
   struct winsize ws = {.ws_row = data->rows, .ws_col = data->cols};
   if (ioctl(fd, TIOCSWINSZ, &ws) < 0)
     warn("Set window size error");
 }
 
-static bool negotiate(int fd) {
-  // preamble: server send a 8 byte preamble data
-  // client should either disconnect the connection if it doesn't agree,
-  // or reply with the same preamble string.
+bool server_negotiate(int fd, uint32_t features, struct session_setup *setup) {
+  // preamble: server send a 8 byte preamble data, followed by the highest handshake
+  // version it supports. client should either disconnect the connection if it doesn't agree,
+  // or reply with the same preamble string. legacy (v2) clients reply with the 8 byte
+  // preamble only, while newer clients append the handshake version they picked.
+  // the authentication challenge (or DT_NONE if we don't need one) goes out in the same
+  // write as the preamble. legacy clients read it after echoing the preamble, so for them
+  // nothing changes, while v3 clients can send their answer together with the preamble.
   enum data_type recv_type;
   uint16_t recv_len;
 
-  proto_write(fd, sizeof(preamble), DT_PREAMBLE, preamble);
+  // v3 preambles carry our capabilities after the handshake version (see caps.h).
+  struct caps local_caps;
+  caps_local(&local_caps);
+  local_caps.features &= features;
+  setup->has_winch = false;
+  uint8_t hsbuff[HANDSHAKE_BUFF_SIZE];
+
+  uint8_t svr_preamble[sizeof(preamble) + sizeof(uint16_t) + CAPS_MAX_ENCODED];
+  uint16_t version = HANDSHAKE_VERSION;
+  memcpy(svr_preamble, preamble, sizeof(preamble));
+  memcpy(svr_preamble + sizeof(preamble), &version, sizeof(version));
+  size_t preamblelen = sizeof(preamble) + sizeof(version);
+  preamblelen += caps_encode(&local_caps, svr_preamble + preamblelen, sizeof(svr_preamble) - preamblelen);
 
-  if (!proto_read(fd, &recv_len, &recv_type, rbuff)) {
+  uint8_t nonce[NONCE_SIZE];
+  uint8_t flight[2 * PROTO_HDR_MAX + sizeof(svr_preamble) + NONCE_SIZE];
+  size_t flightlen = proto_encode(flight, preamblelen, DT_PREAMBLE, svr_preamble);
+  if (cookie.size) {
+    random_fill(nonce, sizeof(nonce));
+    flightlen += proto_encode(flight + flightlen, NONCE_SIZE, DT_AUTH, nonce);
+  } else {
+    flightlen += proto_encode(flight + flightlen, 0, DT_NONE, NULL);
+  }
+  if (!write_all(fd, flight, flightlen)) {
+    warn("Error sending preamble");
+    return false;
+  }
+
+  if (!proto_read(fd, &recv_len, &recv_type, hsbuff, sizeof(hsbuff))) {
     warn("%s", "Error receiving preamble message back");
     return false;
   }
-  if (recv_len != sizeof(preamble) && recv_type != DT_PREAMBLE) {
-    warn("Got unknown response from client");
+  if (recv_len < sizeof(preamble) || recv_type != DT_PREAMBLE) {
+    warnx("Got unknown response from client");
     return false;
   }
 
-  if (memcmp(rbuff, preamble, sizeof(preamble))) {
+  if (memcmp(hsbuff, preamble, sizeof(preamble))) {
     warnx("Reply back preamble mismatch!");
     return false;
   }
 
-  if (cookie.size) {
-    return authenticate(fd);
-  } else {
-    return proto_write(fd, 0, DT_NONE, NULL);
+  if (recv_len == sizeof(preamble)) {
+    // legacy client
+    caps_legacy(&setup->caps);
+    return cookie.size ? authenticate(fd, nonce, hsbuff) : true;
+  }
+
+  if (recv_len < sizeof(preamble) + sizeof(version)) {
+    warnx("Got unknown response from client");
+    return false;
+  }
+  memcpy(&version, hsbuff + sizeof(preamble), sizeof(version));
+  if (version != HANDSHAKE_VERSION) {
+    warnx("Client picked unsupported handshake version %u", version);
+    return false;
+  }
+
+  struct caps client_caps;
+  size_t capsoff = sizeof(preamble) + sizeof(version);
+  if (!caps_decode((uint8_t *)hsbuff + capsoff, recv_len - capsoff, &client_caps)) {
+    warnx("Got malformed capabilities from client");
+    return false;
   }
+  caps_merge(&local_caps, &client_caps, &setup->caps);
+
+  return cookie.size ? authenticate_v3(fd, nonce, hsbuff, setup) : true;
 }
 
-static bool authenticate(int fd) {
-  uint8_t nonce[NONCE_SIZE];
-  random_fill(nonce, sizeof(nonce));
+static struct {
+  int fd;
+  // a duplicate of `fd` to shut the socket down with. tls_wrap() closes `fd` when it fails, and
+  // the number may already belong to someone else by the time the slot is given back.
+  int dupfd;
+  // 0 if the slot is free, UINT64_MAX once the handshake has been shut down
+  uint64_t deadline;
+} hs_slots[HANDSHAKE_MAX];
+static pthread_mutex_t hs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int handshake_begin(int fd) {
+  int slot = -1;
+  pthread_mutex_lock(&hs_lock);
+  for (int i = 0; i < HANDSHAKE_MAX && slot < 0; ++i) {
+    if (hs_slots[i].deadline)
+      continue;
+    if ((hs_slots[i].dupfd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+      warn("Error duplicating connection");
+      break;
+    }
+    hs_slots[i].fd = fd;
+    hs_slots[i].deadline = mono_ns() + HANDSHAKE_TIMEOUT_S * 1000000000ull;
+    slot = i;
+  }
+  pthread_mutex_unlock(&hs_lock);
+  return slot;
+}
 
+int handshake_fd(int slot) {
+  pthread_mutex_lock(&hs_lock);
+  int fd = hs_slots[slot].fd;
+  pthread_mutex_unlock(&hs_lock);
+  return fd;
+}
+
+void handshake_end(int slot) {
+  pthread_mutex_lock(&hs_lock);
+  close(hs_slots[slot].dupfd);
+  hs_slots[slot].deadline = 0;
+  pthread_mutex_unlock(&hs_lock);
+}
+
+int handshake_sweep() {
+  uint64_t now = mono_ns(), next = UINT64_MAX;
+  pthread_mutex_lock(&hs_lock);
+  for (int i = 0; i < HANDSHAKE_MAX; ++i) {
+    if (!hs_slots[i].deadline || hs_slots[i].deadline == UINT64_MAX)
+      continue;
+    if (now >= hs_slots[i].deadline) {
+      shutdown(hs_slots[i].dupfd, SHUT_RDWR);
+      hs_slots[i].deadline = UINT64_MAX;
+    } else if (hs_slots[i].deadline < next) {
+      next = hs_slots[i].deadline;
+    }
+  }
+  pthread_mutex_unlock(&hs_lock);
+  return next == UINT64_MAX ? -1 : (next - now + 999999) / 1000000;
+}
+
+// an empty frame for the client during the handshake. the handshake has no frame writer: it
+// runs on a blocking socket, and writes each of its flights in one go.
+static bool send_empty(int fd, enum data_type type) {
+  uint8_t frame[PROTO_HDR_MAX];
+  return write_all(fd, frame, proto_encode(frame, 0, type, NULL));
+}
+
+static bool authenticate(int fd, const uint8_t *nonce, uint8_t *hsbuff) {
   // we generate the correct answer ourselves first
   // answer is SHA1(nonce + cookie)
   uint8_t refanswer[ANSWER_SIZE];
-  SHA_CTX shactx;
-  int sharesult = 1;
-  sharesult &= SHA1_Init(&shactx);
-  sharesult &= SHA1_Update(&shactx, nonce, NONCE_SIZE);
-  sharesult &= SHA1_Update(&shactx, cookie.data, cookie.size);
-  sharesult &= SHA1_Final(refanswer, &shactx);
-  if (!sharesult) {
+  if (!auth_answer_v2(&cookie, nonce, refanswer)) {
     errx(1, "BUG! Failed to compute reference answer!");
   }
 
-  // send nonce only
-  proto_write(fd, NONCE_SIZE, DT_AUTH, nonce);
   // expect SHA1 answer from client
   uint16_t recv_len;
   enum data_type recv_type;
-  if (!proto_read(fd, &recv_len, &recv_type, rbuff)) {
+  if (!proto_read(fd, &recv_len, &recv_type, hsbuff, HANDSHAKE_BUFF_SIZE)) {
     warn("Error reading authentication response.");
     return false;
   }
-  if (recv_len != ANSWER_SIZE && recv_type != DT_AUTH) {
-    warn("Got unknown authentication from client");
+  if (recv_len != ANSWER_SIZE || recv_type != DT_AUTH) {
+    warnx("Got unknown authentication from client");
     return false;
   }
 
-  if (memcmp(refanswer, rbuff, ANSWER_SIZE)) {
+  if (!auth_equal(refanswer, hsbuff, ANSWER_SIZE)) {
     warnx("Client authentication request rejected!");
     // send CLOSE message to let client know we reject this request
-    proto_write(fd, 0, DT_CLOSE, NULL);
+    send_empty(fd, DT_CLOSE);
     return false;
   }
 
   // send a NONE to let client know auth was successful
-  proto_write(fd, 0, DT_NONE, NULL);
-  return true;
-}
\ No newline at end of file
+  return send_empty(fd, DT_NONE);
+}
+
+// v3: client follows its preamble with either a DT_TICKET carrying a session ticket from an
+// earlier connection, or a DT_AUTH answering the nonce we sent along with our preamble.
+// a rejected ticket is answered with an empty DT_AUTH, asking the client to answer the nonce.
+// on success, a fresh ticket and the final DT_NONE are sent in a single write.
+static bool authenticate_v3(int fd, const uint8_t *nonce, uint8_t *hsbuff, struct session_setup *setup) {
+  uint8_t refanswer[ANSWER_V3_SIZE];
+  if (!auth_answer_v3(&cookie, nonce, refanswer)) {
+    errx(1, "BUG! Failed to compute reference answer!");
+  }
+
+  // a client gets one go with a ticket, and sends its window size at most once. anything more
+  // would keep the server busy for nothing.
+  bool granted = false, got_ticket = false, got_winch = false;
+  while (!granted) {
+    uint16_t recv_len;
+    enum data_type recv_type;
+    if (!proto_read(fd, &recv_len, &recv_type, hsbuff, HANDSHAKE_BUFF_SIZE)) {
+      warn("Error reading authentication response.");
+      return false;
+    }
+    if ((recv_type == DT_TICKET && got_ticket) || (recv_type == DT_WINCH && got_winch)) {
+      warnx("Got unexpected authentication from client");
+      return false;
+    }
+
+    switch (recv_type) {
+    case DT_TICKET:
+      got_ticket = true;
+      if (auth_ticket_check(&cookie, (uint8_t *)hsbuff, recv_len)) {
+        granted = true;
+      } else {
+        warnx("Client session ticket rejected, falling back to challenge.");
+        send_empty(fd, DT_AUTH);
+      }
+      break;
+    case DT_AUTH:
+      if (recv_len != ANSWER_V3_SIZE) {
+        warnx("Got unknown authentication from client");
+        return false;
+      }
+      if (!auth_equal(refanswer, hsbuff, ANSWER_V3_SIZE)) {
+        warnx("Client authentication request rejected!");
+        send_empty(fd, DT_CLOSE);
+        return false;
+      }
+      granted = true;
+      break;
+    case DT_WINCH:
+      // speculatively sent by the client together with its ticket. keep it for later.
+      got_winch = true;
+      if (recv_len == sizeof(setup->winch)) {
+        memcpy(&setup->winch, hsbuff, sizeof(setup->winch));
+        setup->has_winch = true;
+      }
+      break;
+    default:
+      warnx("Got unknown authentication from client");
+      return false;
+    }
+  }
+
+  uint8_t flight[2 * PROTO_HDR_MAX + TICKET_SIZE];
+  size_t flightlen = 0;
+  uint8_t ticket[TICKET_SIZE];
+  if (auth_ticket_issue(ticket))
+    flightlen += proto_encode(flight, sizeof(ticket), DT_TICKET, ticket);
+  flightlen += proto_encode(flight + flightlen, 0, DT_NONE, NULL);
+  return write_all(fd, flight, flightlen);
+}
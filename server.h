@@ -0,0 +1,46 @@
+#pragma once
+
+#include "caps.h"
+#include "protocol.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// what the client told us during the handshake
+struct session_setup {
+  struct caps caps;
+  // window size the client sent along with its handshake, before the PTY exists
+  bool has_winch;
+  struct winch_data winch;
+};
+
+// `nthreads` >= 0 runs the threaded server (see shard.h) instead of forking per session
+int start_server(int svrfd, const char *launchreq, int nthreads);
+
+// thread safe. `features` is the set of CF_* we offer to the client.
+bool server_negotiate(int fd, uint32_t features, struct session_setup *setup);
+
+// the threaded servers (-j, -G) negotiate on threads of their own, with blocking sockets. at
+// most HANDSHAKE_MAX of them at a time, and each gets HANDSHAKE_TIMEOUT_S in total, after
+// which its socket is shut down, which fails the negotiation.
+#define HANDSHAKE_MAX 256
+#define HANDSHAKE_TIMEOUT_S 10
+
+// thread safe. returns the handshake's slot, or -1 if there are too many handshakes already.
+int handshake_begin(int fd);
+
+// thread safe. the socket that `slot` was started with.
+int handshake_fd(int slot);
+
+// thread safe. before the socket is closed or handed over.
+void handshake_end(int slot);
+
+// shuts down the sockets of the handshakes that ran out of time. returns the milliseconds until
+// the next one does, or -1 if there are none, for the caller's poll timeout.
+int handshake_sweep();
+
+// open a PTY and launch `launchreq` on it (see launch.h). `closefd` (if >= 0) is closed in the child.
+// returns the child's pid and the (nonblocking, close-on-exec) PTY master, or -1 on error (errno set).
+pid_t spawn_pty_child(const char *launchreq, const struct session_setup *setup, int closefd, int *ptym);
+
+void set_winsize(int fd, const struct winch_data *data);
@@ -0,0 +1,822 @@
+#include "shard.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef __linux__
+
+#include "bufpool.h"
+#include "caps.h"
+#include "cgroup.h"
+#include "common.h"
+#include "handoff.h"
+#include "history.h"
+#include "profile.h"
+#include "protocol.h"
+#include "ratelimit.h"
+#include "server.h"
+#include "tls.h"
+#include "trace.h"
+#include "trigger.h"
+#include "utils.h"
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_SHARDS 256
+#define MAX_EVENTS 64
+
+// how often shards update their throughput estimate
+#define RATE_INTERVAL_MS 1000
+// a session counts as this much throughput (bytes/s) when balancing, so that idle
+// sessions are spread evenly too
+#define SESSION_COST 1024
+// bytes of released relay buffers kept per size class
+#define SHARD_POOL_CACHED (256 * 1024)
+
+struct session;
+
+// what an epoll event points to
+struct sess_fd {
+  struct session *s;
+  int fd;
+  // currently registered epoll events, 0 if not registered
+  uint32_t events;
+};
+
+struct session {
+  struct sess_fd comm;
+  struct sess_fd pty;
+  pid_t pid;
+  struct caps caps;
+  struct proto_reader reader;
+  struct relaybuf rbuff;
+  // frames not yet written to the client
+  struct bytequeue toclient;
+  // client data not yet written to mPTY
+  struct bytequeue topty;
+  uint64_t last_active;
+  struct rl_session rl;
+  struct trace_session trace;
+  struct trigger_session trig;
+  struct history_session *hist;
+  // bytes we may read from mPTY now
+  size_t allowed;
+  // when a throttled session may read again, 0 if not throttled
+  uint64_t resume_ns;
+  struct session *prev;
+  struct session *next;
+  struct session *next_throttled;
+  // the comm socket is the client's connection itself (no TLS relay), so it can be handed off
+  bool movable;
+};
+
+struct shard {
+  int id;
+  pthread_t thread;
+  int epfd;
+  // wakes up the shard when a new session is handed over
+  int evfd;
+
+  pthread_mutex_t lock;
+  struct session *incoming;
+  // sessions owned by this shard
+  struct session *sessions;
+  // sessions waiting for their rate limit
+  struct session *throttled;
+
+  // counted by the handshake threads as they pick the shard
+  atomic_int nsessions;
+  // everything below is written by the shard thread only
+  // bytes/s, exponentially weighted
+  atomic_uint_fast64_t rate;
+  atomic_uint_fast64_t total;
+  uint64_t interval_bytes;
+  uint64_t interval_start;
+  bool handed_off;
+};
+
+static struct shard *shards;
+static int nshards;
+
+static const char *launchreq;
+
+// epoll data of the shards' eventfd
+static struct sess_fd wakeup_marker;
+
+// handshakes in progress
+static atomic_int handshakes;
+
+// set when a successor takes our sessions. the shards meet at the barrier once theirs are sent.
+static atomic_bool handoff_requested;
+static pthread_barrier_t handoff_barrier;
+
+static void *shard_main(void *arg);
+
+static void *handshake_main(void *arg);
+
+static void dump_stats();
+
+static void trigger_reply(void *ctx, const uint8_t *data, size_t len);
+
+static void adopt_session(const struct handoff_session *hs);
+
+static void start_handoff();
+
+int start_threaded_server(int svrfd, const char *launchreq_, int nthreads) {
+  launchreq = launchreq_;
+  int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpus < 1)
+    ncpus = 1;
+  nshards = nthreads ? nthreads : ncpus;
+  if (nshards > MAX_SHARDS)
+    nshards = MAX_SHARDS;
+
+  // two fds per session. the soft limit is usually far below what a busy server needs.
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  // launched apps are not ours to wait for
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  // the listening socket must not leak into launched apps
+  set_fd_flags(svrfd, true, O_NONBLOCK);
+  fcntl(svrfd, F_SETFD, FD_CLOEXEC);
+
+  // relay buffers released by idle sessions are reused by the busy ones
+  bufpool_init(SHARD_POOL_CACHED);
+
+  // make sure random_fill is set up before there are multiple threads
+  uint8_t dummy;
+  random_fill(&dummy, sizeof(dummy));
+
+  // signals are only received through the fd. block them before creating threads
+  // so that every thread inherits the mask.
+  int sigs[] = {SIGUSR1};
+  int sigfd = signal_fd(sigs, sizeof(sigs) / sizeof(*sigs));
+  if (sigfd < 0) {
+    warn("Error setting up signal fd");
+    return 1;
+  }
+
+  shards = calloc(nshards, sizeof(*shards));
+  if (!shards) {
+    warn("Error allocating shards");
+    return 1;
+  }
+  for (int i = 0; i < nshards; ++i) {
+    struct shard *sh = shards + i;
+    sh->id = i;
+    pthread_mutex_init(&sh->lock, NULL);
+    sh->epfd = epoll_create1(EPOLL_CLOEXEC);
+    sh->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sh->epfd < 0 || sh->evfd < 0) {
+      warn("Error creating shard event loop");
+      return 1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &wakeup_marker};
+    if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->evfd, &ev) < 0) {
+      warn("Error creating shard event loop");
+      return 1;
+    }
+    if ((errno = pthread_create(&sh->thread, NULL, shard_main, sh))) {
+      warn("Error starting shard thread");
+      return 1;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(i % ncpus, &cpus);
+    pthread_setaffinity_np(sh->thread, sizeof(cpus), &cpus);
+  }
+  warnx("Threaded server started with %d shards.", nshards);
+  if (!handoff_start(adopt_session))
+    return 1;
+
+  pthread_attr_t hsattr;
+  pthread_attr_init(&hsattr);
+  pthread_attr_setdetachstate(&hsattr, PTHREAD_CREATE_DETACHED);
+
+  struct pollfd pfds[3] = {
+    {.fd = svrfd, .events = POLLIN}, {.fd = sigfd, .events = POLLIN}, {.fd = handoff_fd(), .events = POLLIN}};
+  // after a handoff, we only wait for the sessions that stayed with us
+  bool draining = false;
+  for (;;) {
+    if (draining) {
+      int left = atomic_load(&handshakes);
+      for (int i = 0; i < nshards; ++i)
+        left += atomic_load(&shards[i].nsessions);
+      if (!left)
+        break;
+    }
+    int timeout = cg_tick(), hstimeout = handshake_sweep();
+    if (hstimeout >= 0 && (timeout < 0 || hstimeout < timeout))
+      timeout = hstimeout;
+    if (draining && (timeout < 0 || timeout > 1000))
+      timeout = 1000;
+    if (poll(pfds, 3, timeout) < 0) {
+      if (errno != EINTR)
+        warn("poll error");
+      continue;
+    }
+    if (pfds[1].revents & POLLIN) {
+      int sig;
+      while ((sig = signal_fd_next(sigfd))) {
+        if (sig == SIGUSR1)
+          dump_stats();
+      }
+    }
+    bool adopt;
+    if ((pfds[2].revents & POLLIN) && handoff_accept(svrfd, &adopt)) {
+      pfds[0].fd = pfds[2].fd = -1;
+      if (adopt)
+        start_handoff();
+      handoff_finish();
+      draining = true;
+      continue;
+    }
+    if (!(pfds[0].revents & POLLIN))
+      continue;
+
+    for (;;) {
+      // handshakes run on blocking sockets. shards switch them to nonblocking.
+      int commfd = accept4(svrfd, NULL, NULL, SOCK_CLOEXEC);
+      if (commfd < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+          warn("Error accepting connection");
+        break;
+      }
+      profile_tune(commfd);
+      int slot = handshake_begin(commfd);
+      if (slot < 0) {
+        warnx("Too many handshakes in progress. Dropping connection.");
+        close(commfd);
+        continue;
+      }
+      pthread_t hsthread;
+      atomic_fetch_add(&handshakes, 1);
+      if ((errno = pthread_create(&hsthread, &hsattr, handshake_main, (void *)(intptr_t)slot))) {
+        warn("Error starting handshake thread");
+        atomic_fetch_sub(&handshakes, 1);
+        handshake_end(slot);
+        close(commfd);
+      }
+    }
+  }
+
+  history_finish();
+  warnx("All sessions are over. Exiting.");
+  return 0;
+}
+
+// ask every shard to hand its sessions over, and wait until they have
+static void start_handoff() {
+  pthread_barrier_init(&handoff_barrier, NULL, nshards + 1);
+  atomic_store(&handoff_requested, true);
+  uint64_t one = 1;
+  for (int i = 0; i < nshards; ++i)
+    write(shards[i].evfd, &one, sizeof(one));
+  pthread_barrier_wait(&handoff_barrier);
+}
+
+static struct shard *least_loaded_shard() {
+  struct shard *best = NULL;
+  uint64_t bestscore = UINT64_MAX;
+  for (int i = 0; i < nshards; ++i) {
+    uint64_t score = atomic_load(&shards[i].rate) + (uint64_t)atomic_load(&shards[i].nsessions) * SESSION_COST;
+    if (score < bestscore) {
+      bestscore = score;
+      best = shards + i;
+    }
+  }
+  return best;
+}
+
+// everything but the fds and the pid
+static void session_init(struct session *s, const struct caps *caps) {
+  set_fd_flags(s->comm.fd, true, O_NONBLOCK);
+  s->comm.s = s->pty.s = s;
+  s->caps = *caps;
+  proto_reader_init(&s->reader);
+  relaybuf_init(&s->rbuff);
+  rl_session_init(&s->rl, false);
+  trace_session_init(&s->trace, caps->features & CF_TRACE);
+  trigger_session_init(&s->trig, s->pid, trigger_reply, s);
+  s->hist = history_open(s->pid);
+}
+
+// what session_init() and the relay have allocated. the reader's buffer goes even with a partial
+// frame in it.
+static void session_free_buffers(struct session *s) {
+  bq_free(&s->toclient);
+  bq_free(&s->topty);
+  trigger_session_free(&s->trig);
+  history_close(s->hist);
+  bufpool_put(s->reader.buff, s->reader.cap);
+  proto_reader_init(&s->reader);
+  relaybuf_release(&s->rbuff);
+}
+
+// hand a new session to the least loaded shard
+static void session_assign(struct session *s) {
+  struct shard *sh = least_loaded_shard();
+  atomic_fetch_add(&sh->nsessions, 1);
+  pthread_mutex_lock(&sh->lock);
+  s->next = sh->incoming;
+  sh->incoming = s;
+  pthread_mutex_unlock(&sh->lock);
+  uint64_t one = 1;
+  write(sh->evfd, &one, sizeof(one));
+}
+
+static void handshake(int slot) {
+  struct session_setup setup;
+  int commfd = handshake_fd(slot), sockfd = commfd;
+  // if it runs out of time, the main thread shuts the socket down, which fails it
+  bool ok = !tls_enabled() || (commfd = tls_wrap(commfd, NULL, true)) >= 0;
+  // forwarding relies on per-process state, so it is not offered here
+  ok = ok && server_negotiate(commfd, CF_TRACE, &setup);
+  handshake_end(slot);
+  if (!ok) {
+    warnx("Client negotiation failed.");
+    if (commfd >= 0)
+      close(commfd);
+    return;
+  }
+
+  struct session *s = calloc(1, sizeof(*s));
+  if (!s) {
+    warn("Error allocating session");
+    goto error;
+  }
+  s->pid = spawn_pty_child(launchreq, &setup, -1, &s->pty.fd);
+  if (s->pid < 0)
+    goto error;
+  warnx("New client successfully connected.");
+
+  s->comm.fd = commfd;
+  s->movable = commfd == sockfd;
+  session_init(s, &setup.caps);
+  session_assign(s);
+  return;
+
+error:
+  free(s);
+  close(commfd);
+}
+
+static void *handshake_main(void *arg) {
+  handshake((intptr_t)arg);
+  atomic_fetch_sub(&handshakes, 1);
+  return NULL;
+}
+
+// a session from the server we took over from
+static void adopt_session(const struct handoff_session *hs) {
+  struct session *s = calloc(1, sizeof(*s));
+  if (!s) {
+    warn("Error allocating session");
+    goto error;
+  }
+  s->comm.fd = hs->commfd;
+  s->pty.fd = hs->ptyfd;
+  s->pid = hs->pid;
+  s->movable = true;
+  session_init(s, &hs->caps);
+  if (!bq_append(&s->toclient, hs->toclient, hs->toclientlen) || !bq_append(&s->topty, hs->topty, hs->toptylen) ||
+      !proto_reader_preload(&s->reader, hs->partial, hs->partiallen)) {
+    warn("Error allocating session");
+    session_free_buffers(s);
+    goto error;
+  }
+  session_assign(s);
+  return;
+
+error:
+  free(s);
+  close(hs->commfd);
+  close(hs->ptyfd);
+}
+
+// register, update or unregister `sfd` so that epoll only reports `events`.
+// fds without any events wanted are unregistered, since hangups are always reported.
+static bool sess_fd_watch(struct shard *sh, struct sess_fd *sfd, uint32_t events) {
+  if (events == sfd->events)
+    return true;
+  struct epoll_event ev = {.events = events, .data.ptr = sfd};
+  int op = !events ? EPOLL_CTL_DEL : sfd->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(sh->epfd, op, sfd->fd, &ev) < 0) {
+    warn("epoll_ctl error");
+    return false;
+  }
+  sfd->events = events;
+  return true;
+}
+
+static bool session_watch(struct shard *sh, struct session *s) {
+  // stop reading from one side while the other side is not keeping up.
+  // mPTY is not read either while the session is over its rate limit.
+  s->allowed = 0;
+  if (s->toclient.len >= PROTO_OUTQ_HIGH) {
+    rl_pause(&s->rl);
+  } else {
+    int wait_ms;
+    s->allowed = rl_allow(&s->rl, caps_read_size(&s->caps), &wait_ms);
+    if (!s->allowed) {
+      if (!s->resume_ns) {
+        s->next_throttled = sh->throttled;
+        sh->throttled = s;
+      }
+      s->resume_ns = mono_ns() + wait_ms * 1000000ull;
+    }
+  }
+  uint32_t commev = (s->topty.len < PROTO_OUTQ_HIGH ? EPOLLIN : 0) | (s->toclient.len ? EPOLLOUT : 0);
+  uint32_t ptyev = (s->allowed ? EPOLLIN : 0) | (s->topty.len ? EPOLLOUT : 0);
+  return sess_fd_watch(sh, &s->comm, commev) && sess_fd_watch(sh, &s->pty, ptyev);
+}
+
+// write to `fd` after whatever is queued in `q`, queueing what cannot be written now
+static bool queued_write(struct bytequeue *q, int fd, const void *data, size_t len) {
+  if (!q->len) {
+    ssize_t wr = write(fd, data, len);
+    if (wr < 0) {
+      if (errno != EAGAIN && errno != EINTR)
+        return false;
+      wr = 0;
+    }
+    data = (const uint8_t *)data + wr;
+    len -= wr;
+  }
+  return !len || bq_append(q, data, len);
+}
+
+// `reply` triggers go after whatever the client typed
+static void trigger_reply(void *ctx, const uint8_t *data, size_t len) {
+  struct session *s = ctx;
+  if (!queued_write(&s->topty, s->pty.fd, data, len))
+    warn("mPTY write error");
+}
+
+// forget about `s`, without a word to anyone
+static void session_drop(struct shard *sh, struct session *s) {
+  sess_fd_watch(sh, &s->comm, 0);
+  sess_fd_watch(sh, &s->pty, 0);
+  close(s->comm.fd);
+  // the launched app gets SIGHUP from this, unless mPTY has been handed off
+  close(s->pty.fd);
+  session_free_buffers(s);
+  rl_pause(&s->rl);
+  if (s->resume_ns) {
+    for (struct session **p = &sh->throttled; *p; p = &(*p)->next_throttled) {
+      if (*p == s) {
+        *p = s->next_throttled;
+        break;
+      }
+    }
+  }
+
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    sh->sessions = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+  free(s);
+  atomic_fetch_sub(&sh->nsessions, 1);
+}
+
+static void session_close(struct shard *sh, struct session *s) {
+  // let the client know we're stopping. best effort, as the shard must not block.
+  uint8_t closeframe[PROTO_HDR_MAX];
+  size_t closelen = proto_encode(closeframe, 0, DT_CLOSE, NULL);
+  if (bq_append(&s->toclient, closeframe, closelen))
+    bq_flush(&s->toclient, s->comm.fd);
+
+  rl_pause(&s->rl);
+  if (s->rl.throttled_ns)
+    warnx("Client disconnected. Output was throttled for %llu ms.", (unsigned long long)(s->rl.throttled_ns / 1000000));
+  else
+    warnx("Client disconnected.");
+  session_drop(sh, s);
+}
+
+// send our sessions to the successor. those that can't move stay.
+static void shard_handoff(struct shard *sh) {
+  int moved = 0, kept = 0;
+  struct session *next;
+  for (struct session *s = sh->sessions; s; s = next) {
+    next = s->next;
+    if (!s->movable) {
+      ++kept;
+      continue;
+    }
+    struct handoff_session hs = {
+      .commfd = s->comm.fd,
+      .ptyfd = s->pty.fd,
+      .pid = s->pid,
+      .caps = s->caps,
+      .toclient = s->toclient.buff + s->toclient.off,
+      .toclientlen = s->toclient.len,
+      .topty = s->topty.buff + s->topty.off,
+      .toptylen = s->topty.len,
+      .partial = s->reader.buff + s->reader.start,
+      .partiallen = s->reader.end - s->reader.start,
+    };
+    if (!handoff_send_session(&hs)) {
+      warn("Shard %d: error handing off a session", sh->id);
+      ++kept;
+      continue;
+    }
+    session_drop(sh, s);
+    ++moved;
+  }
+  warnx("Shard %d handed off %d sessions, kept %d.", sh->id, moved, kept);
+}
+
+// returns false if the session is over
+static bool handle_comm(struct shard *sh, struct session *s, uint32_t events) {
+  if ((events & EPOLLOUT) && !bq_flush(&s->toclient, s->comm.fd)) {
+    warn("Socket write error");
+    return false;
+  }
+  if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+    return true;
+
+  if (!proto_reader_fill(&s->reader, s->comm.fd)) {
+    if (errno != EIO)
+      warn("Socket read error");
+    return false;
+  }
+  profile_rearm(s->comm.fd);
+
+  // only the newest window size in this batch is applied
+  struct winch_data wd;
+  bool has_winch = false;
+
+  uint16_t rdlen;
+  enum data_type pdatatype;
+  const uint8_t *data;
+  bool ok = true;
+  while (ok && proto_reader_next(&s->reader, &rdlen, &pdatatype, &data)) {
+    switch (pdatatype) {
+    case DT_WINCH:
+      if (rdlen != sizeof(wd)) {
+        warnx("Invalid window size data");
+        break;
+      }
+      memcpy(&wd, data, sizeof(wd));
+      has_winch = true;
+      break;
+    case DT_REGULAR:
+      if (!queued_write(&s->topty, s->pty.fd, data, rdlen)) {
+        warn("mPTY write error");
+        ok = false;
+      }
+      trace_pty_write(&s->trace);
+      sh->interval_bytes += rdlen;
+      break;
+    case DT_TRACE: {
+      uint8_t reply[TRACE_PAYLOAD_MAX];
+      uint8_t frame[PROTO_HDR_MAX + TRACE_PAYLOAD_MAX];
+      size_t replylen = trace_handle(&s->trace, data, rdlen, reply);
+      if (replylen) {
+        size_t framelen = proto_encode(frame, replylen, DT_TRACE, reply);
+        if (!queued_write(&s->toclient, s->comm.fd, frame, framelen)) {
+          warn("Socket write error");
+          ok = false;
+        }
+      }
+      break;
+    }
+    case DT_CLOSE:
+      ok = false;
+      break;
+    case DT_NONE:
+      break;
+    default:
+      warnx("Unrecognized data type %d", pdatatype);
+      break;
+    }
+  }
+
+  if (has_winch)
+    set_winsize(s->pty.fd, &wd);
+  return ok;
+}
+
+static bool handle_pty(struct shard *sh, struct session *s, uint32_t events) {
+  if ((events & EPOLLOUT) && !bq_flush(&s->topty, s->pty.fd)) {
+    warn("mPTY write error");
+    return false;
+  }
+  if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+    return true;
+
+  uint8_t *buff = relaybuf_acquire(&s->rbuff);
+  if (!buff) {
+    warn("Error allocating buffer");
+    return false;
+  }
+  // read right after the room for the frame header (and the trace stamp before it), so the
+  // frame goes out in one write
+  size_t lead = PROTO_HDR_MAX + (s->trace.enabled ? PROTO_HDR_MAX + TRACE_PAYLOAD_MAX : 0);
+  uint8_t *data = buff + lead;
+  size_t room = s->allowed;
+  if (room > s->rbuff.cap - lead)
+    room = s->rbuff.cap - lead;
+  ssize_t rd = read(s->pty.fd, data, room);
+  if (rd <= 0) {
+    if (rd < 0 && (errno == EAGAIN || errno == EINTR))
+      return true;
+    // EIO is how Linux reports that the launched app is gone
+    if (rd < 0 && errno != EIO)
+      warn("mPTY read error");
+    return false;
+  }
+  uint64_t readns = s->trace.enabled ? mono_ns() : 0;
+  sh->interval_bytes += rd;
+  readsize_update(&s->rbuff.rs, rd, room);
+  rl_consume(&s->rl, rd);
+  trigger_scan(&s->trig, data, rd);
+  history_append(s->hist, data, rd);
+
+  uint8_t hdr[PROTO_HDR_MAX];
+  size_t hlen = proto_encode_header(hdr, rd, DT_REGULAR);
+  uint8_t *start = data - hlen;
+  memcpy(start, hdr, hlen);
+  if (s->trace.enabled) {
+    uint8_t stamp[TRACE_PAYLOAD_MAX];
+    uint8_t frame[PROTO_HDR_MAX + TRACE_PAYLOAD_MAX];
+    size_t framelen = proto_encode(frame, trace_stamp(&s->trace, stamp, readns, rd), DT_TRACE, stamp);
+    start -= framelen;
+    memcpy(start, frame, framelen);
+  }
+  if (!queued_write(&s->toclient, s->comm.fd, start, data + rd - start)) {
+    warn("Socket write error");
+    return false;
+  }
+  return true;
+}
+
+// give the relay buffers of quiet sessions back to the pool
+static void shard_release_idle(struct shard *sh, uint64_t now) {
+  for (struct session *s = sh->sessions; s; s = s->next) {
+    if (now - s->last_active < BUFPOOL_IDLE_MS * 1000000ull)
+      continue;
+    relaybuf_release(&s->rbuff);
+    proto_reader_release(&s->reader);
+    if (!s->toclient.len)
+      bq_free(&s->toclient);
+    if (!s->topty.len)
+      bq_free(&s->topty);
+  }
+}
+
+static void shard_tick(struct shard *sh) {
+  uint64_t now = mono_ns();
+  uint64_t elapsed = now - sh->interval_start;
+  if (elapsed < RATE_INTERVAL_MS * 1000000ull)
+    return;
+  shard_release_idle(sh, now);
+  uint64_t currrate = sh->interval_bytes * 1000000000ull / elapsed;
+  atomic_store(&sh->rate, (atomic_load(&sh->rate) * 3 + currrate) / 4);
+  atomic_fetch_add(&sh->total, sh->interval_bytes);
+  sh->interval_bytes = 0;
+  sh->interval_start = now;
+}
+
+// let throttled sessions whose time has come read again.
+// returns how long until the next one is due, capped at RATE_INTERVAL_MS.
+static int shard_resume_throttled(struct shard *sh) {
+  uint64_t now = mono_ns();
+  struct session *s = sh->throttled;
+  sh->throttled = NULL;
+  while (s) {
+    struct session *next = s->next_throttled;
+    if (s->resume_ns <= now) {
+      s->resume_ns = 0;
+      // may put the session back on the list
+      if (!session_watch(sh, s))
+        session_close(sh, s);
+    } else {
+      s->next_throttled = sh->throttled;
+      sh->throttled = s;
+    }
+    s = next;
+  }
+
+  uint64_t timeout = RATE_INTERVAL_MS * 1000000ull;
+  for (s = sh->throttled; s; s = s->next_throttled) {
+    if (s->resume_ns - now < timeout)
+      timeout = s->resume_ns - now;
+  }
+  return (timeout + 999999) / 1000000;
+}
+
+static void *shard_main(void *arg) {
+  struct shard *sh = arg;
+  sh->interval_start = mono_ns();
+  struct epoll_event events[MAX_EVENTS];
+  for (;;) {
+    int n = epoll_wait(sh->epfd, events, MAX_EVENTS, shard_resume_throttled(sh));
+    if (n < 0) {
+      if (errno != EINTR)
+        warn("epoll_wait error");
+      continue;
+    }
+
+    // the batch may still have events of the sessions that are handed off
+    bool handoff_now = false;
+    for (int i = 0; i < n; ++i) {
+      struct sess_fd *sfd = events[i].data.ptr;
+      if (!sfd) {
+        // belongs to a session closed earlier in this batch
+        continue;
+      }
+      if (sfd == &wakeup_marker) {
+        // new sessions
+        uint64_t cnt;
+        read(sh->evfd, &cnt, sizeof(cnt));
+        pthread_mutex_lock(&sh->lock);
+        struct session *s = sh->incoming;
+        sh->incoming = NULL;
+        pthread_mutex_unlock(&sh->lock);
+        handoff_now = atomic_load(&handoff_requested) && !sh->handed_off;
+        while (s) {
+          struct session *next = s->next;
+          s->prev = NULL;
+          s->next = sh->sessions;
+          if (sh->sessions)
+            sh->sessions->prev = s;
+          sh->sessions = s;
+          s->last_active = mono_ns();
+          if (!session_watch(sh, s))
+            session_close(sh, s);
+          s = next;
+        }
+        continue;
+      }
+
+      struct session *s = sfd->s;
+      s->last_active = mono_ns();
+      bool ok = sfd == &s->comm ? handle_comm(sh, s, events[i].events) : handle_pty(sh, s, events[i].events);
+      if (ok)
+        ok = session_watch(sh, s);
+      if (!ok) {
+        // the other fd of this session may still be in this batch
+        for (int j = i + 1; j < n; ++j) {
+          struct sess_fd *other = events[j].data.ptr;
+          if (other && other != &wakeup_marker && other->s == s)
+            events[j].data.ptr = NULL;
+        }
+        session_close(sh, s);
+      }
+    }
+
+    if (handoff_now) {
+      sh->handed_off = true;
+      shard_handoff(sh);
+      pthread_barrier_wait(&handoff_barrier);
+    }
+    shard_tick(sh);
+  }
+  return NULL;
+}
+
+static void dump_stats() {
+  fprintf(stderr, "shard  sessions  rate(B/s)  total(B)\n");
+  for (int i = 0; i < nshards; ++i) {
+    fprintf(stderr, "%5d  %8d  %9llu  %8llu\n", i, atomic_load(&shards[i].nsessions),
+      (unsigned long long)atomic_load(&shards[i].rate), (unsigned long long)atomic_load(&shards[i].total));
+  }
+  struct bufpool_stats st;
+  bufpool_get_stats(&st);
+  fprintf(stderr, "relay buffers: %zu bytes in use, %zu bytes cached\n", st.inuse, st.cached);
+  if (rl_enabled())
+    rl_dump_stats();
+  cg_dump_stats();
+}
+
+#else
+
+int start_threaded_server(int svrfd, const char *launchreq, int nthreads) {
+  errno = ENOTSUP;
+  warn("Threaded server");
+  return 1;
+}
+
+#endif
@@ -0,0 +1,13 @@
+#pragma once
+
+// threaded server: instead of a process per session, sessions are spread over a fixed
+// number of threads (shards), each pinned to a core and running its own epoll loop.
+//  - the main thread only accepts connections.
+//  - handshakes run on short-lived threads, so a slow client never stalls a shard.
+//  - a new session goes to the shard with the lowest load, which is its recent throughput
+//    plus a fixed cost per session.
+// SIGUSR1 dumps per-shard statistics to stderr.
+// forwarding (-L/-R) is not offered to clients in this mode.
+
+// `nthreads` of 0 means one shard per online CPU. Linux only.
+int start_threaded_server(int svrfd, const char *launchreq, int nthreads);
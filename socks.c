@@ -1,16 +1,18 @@
 #include "socks.h"
+#include "profile.h"
+#include "udp.h"
 #include "utils.h"
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <netinet/in.h>
-#include <netinet/tcp.h>
 #include <unistd.h>
 #ifdef __linux__
 #include <linux/vm_sockets.h>
@@ -58,9 +60,8 @@ int create_tcp_server(bool ipv6, const char *host, const char *port) {
     if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) < 0) {
       warn("Error setting REUSEADDR on TCP socket");
     }
-    if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)) < 0) {
-      warn("Error setting TCP_NODELAY");
-    }
+    // accepted sockets inherit this
+    profile_tune(s);
 
     if (bind(s, res->ai_addr, res->ai_addrlen) < 0) {
       warn("Error binding socket");
@@ -78,7 +79,8 @@ int create_tcp_server(bool ipv6, const char *host, const char *port) {
   return -1;
 }
 
-int create_tcp_client(bool ipv6, const char *host, const char *port) {
+// `async` clients return as soon as the connection is in progress
+static int tcp_client(bool ipv6, const char *host, const char *port, bool async) {
   int st;
 
   struct addrinfo addrhints;
@@ -100,16 +102,13 @@ int create_tcp_client(bool ipv6, const char *host, const char *port) {
 
   int s = -1;
   for (struct addrinfo *res = addrres; res; res = res->ai_next) {
-    s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    s = socket(res->ai_family, res->ai_socktype | (async ? SOCK_NONBLOCK : 0), res->ai_protocol);
     if (s < 0)
       continue;
 
-    int val = 1;
-    if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)) < 0) {
-      warn("Error setting TCP_NODELAY");
-    }
+    profile_tune(s);
 
-    if (connect(s, res->ai_addr, res->ai_addrlen) < 0) {
+    if (connect(s, res->ai_addr, res->ai_addrlen) < 0 && !(async && errno == EINPROGRESS)) {
       close(s);
       s = -1;
       continue;
@@ -121,6 +120,91 @@ int create_tcp_client(bool ipv6, const char *host, const char *port) {
   return s;
 }
 
+int create_tcp_client(bool ipv6, const char *host, const char *port) { return tcp_client(ipv6, host, port, false); }
+
+// resolve the UDP endpoint and create a nonblocking socket for it, bound to it if `server`
+static int udp_socket(bool ipv6, const char *host, const char *port, bool server, struct sockaddr_storage *addr,
+  socklen_t *addrlen) {
+  if (!(host && port)) {
+    warnx("Please specify address and port!");
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct addrinfo addrhints;
+  struct addrinfo *addrres;
+  memset(&addrhints, 0, sizeof(addrhints));
+  addrhints.ai_family = ipv6 ? AF_INET6 : AF_INET;
+  addrhints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, port, &addrhints, &addrres))
+    return -1;
+
+  int s = -1;
+  for (struct addrinfo *res = addrres; res; res = res->ai_next) {
+    s = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+    if (s < 0)
+      continue;
+    if (server && bind(s, res->ai_addr, res->ai_addrlen) < 0) {
+      warn("Error binding socket");
+      close(s);
+      s = -1;
+      continue;
+    }
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *addrlen = res->ai_addrlen;
+    break;
+  }
+  freeaddrinfo(addrres);
+  return s;
+}
+
+#ifdef __linux__
+
+int create_udp_server(bool ipv6, const char *host, const char *port) {
+  struct sockaddr_storage udpaddr;
+  socklen_t udpaddrlen;
+  int u = udp_socket(ipv6, host, port, true, &udpaddr, &udpaddrlen);
+  if (u < 0)
+    return -1;
+
+  // the relay hands the sessions to the server through a private (abstract) Unix socket
+  int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s < 0) {
+    warn("Error creating Unix socket");
+    close(u);
+    return -1;
+  }
+  uint32_t id;
+  random_fill(&id, sizeof(id));
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  int namelen = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "ptyfwd-udp-%d-%08x", getpid(), id);
+  socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + namelen;
+  // the relay may connect as soon as it has started
+  if (bind(s, (struct sockaddr *)&addr, addrlen) < 0 || listen(s, SOMAXCONN) < 0) {
+    warn("Error binding socket");
+    goto error;
+  }
+  if (!udp_start_server_relay(u, (struct sockaddr *)&addr, addrlen))
+    goto error;
+  return s;
+
+error:
+  close(s);
+  close(u);
+  return -1;
+}
+
+#endif
+
+int create_udp_client(bool ipv6, const char *host, const char *port) {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int u = udp_socket(ipv6, host, port, false, &addr, &addrlen);
+  if (u < 0)
+    return -1;
+  return udp_start_client_relay(u, (struct sockaddr *)&addr, addrlen);
+}
+
 int create_uds_server(const char *path) {
   if (!path) {
     warnx("Please specify socket path!");
@@ -146,22 +230,23 @@ int create_uds_server(const char *path) {
   return s;
 }
 
-int create_uds_client(const char *path) {
+static int uds_client(const char *path, bool async) {
   if (!path) {
     warnx("Please specify socket path!");
     errno = EINVAL;
     return -1;
   }
 
-  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  int s = socket(AF_UNIX, SOCK_STREAM | (async ? SOCK_NONBLOCK : 0), 0);
   if (s < 0)
     return -1;
+  profile_tune(s);
 
   struct sockaddr_un addr;
   addr.sun_family = AF_UNIX;
   strncpy(addr.sun_path, path, sizeof(addr.sun_path));
 
-  if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+  if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 && !(async && errno == EINPROGRESS)) {
     close(s);
     return -1;
   }
@@ -169,6 +254,8 @@ int create_uds_client(const char *path) {
   return s;
 }
 
+int create_uds_client(const char *path) { return uds_client(path, false); }
+
 #ifdef __linux
 
 int create_vsock_server(const char *s_cid, const char *s_port) {
@@ -191,6 +278,8 @@ int create_vsock_server(const char *s_cid, const char *s_port) {
     warn("Error creating VSOCK");
     return -1;
   }
+  // accepted sockets inherit this
+  profile_tune(s);
 
   struct sockaddr_vm addr = {0};
   addr.svm_family = AF_VSOCK;
@@ -205,7 +294,7 @@ int create_vsock_server(const char *s_cid, const char *s_port) {
   return s;
 }
 
-int create_vsock_client(const char *s_cid, const char *s_port) {
+static int vsock_client(const char *s_cid, const char *s_port, bool async) {
   if (!(s_cid && s_port)) {
     warnx("Please specify CID and port number!");
     errno = EINVAL;
@@ -219,16 +308,17 @@ int create_vsock_client(const char *s_cid, const char *s_port) {
     return -1;
   }
 
-  int s = socket(AF_VSOCK, SOCK_STREAM, 0);
+  int s = socket(AF_VSOCK, SOCK_STREAM | (async ? SOCK_NONBLOCK : 0), 0);
   if (s < 0)
     return -1;
+  profile_tune(s);
 
   struct sockaddr_vm addr = {0};
   addr.svm_family = AF_VSOCK;
   addr.svm_cid = cid;
   addr.svm_port = port;
 
-  if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+  if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 && !(async && errno == EINPROGRESS)) {
     close(s);
     return -1;
   }
@@ -236,6 +326,8 @@ int create_vsock_client(const char *s_cid, const char *s_port) {
   return s;
 }
 
+int create_vsock_client(const char *s_cid, const char *s_port) { return vsock_client(s_cid, s_port, false); }
+
 #endif
 
 int create_vsock_mult_client(const char *path, const char *s_cid, const char *s_port) {
@@ -268,3 +360,62 @@ err_inval:
   errno = EINVAL;
   return -1;
 }
+
+static int create_spec_socket(bool server, bool async, const char *spec) {
+  if (!spec) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  char buff[256];
+  if (strlen(spec) >= sizeof(buff)) {
+    warnx("Endpoint spec too long: %s", spec);
+    errno = EINVAL;
+    return -1;
+  }
+  strcpy(buff, spec);
+
+  char *proto = buff;
+  char *addr = strchr(buff, ':');
+  if (!addr)
+    goto inval;
+  *addr++ = 0;
+
+  if (!strcmp(proto, "unix"))
+    return server ? create_uds_server(addr) : uds_client(addr, async);
+
+  // the rest is in <addr>:<port> format. IPv6 addresses have colons, so split at the last one.
+  char *port = strrchr(addr, ':');
+  if (!port)
+    goto inval;
+  *port++ = 0;
+
+  if (!strcmp(proto, "tcp") || !strcmp(proto, "tcp6")) {
+    bool ipv6 = proto[3] == '6';
+    return server ? create_tcp_server(ipv6, addr, port) : tcp_client(ipv6, addr, port, async);
+  }
+#ifdef __linux__
+  if (!strcmp(proto, "vsock"))
+    return server ? create_vsock_server(addr, port) : vsock_client(addr, port, async);
+#endif
+
+inval:
+  warnx("Invalid endpoint spec: %s", spec);
+  errno = EINVAL;
+  return -1;
+}
+
+int create_spec_server(const char *spec) {
+  int s = create_spec_socket(true, false, spec);
+  if (s < 0)
+    return -1;
+  if (listen(s, SOMAXCONN) < 0) {
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+int create_spec_client(const char *spec) { return create_spec_socket(false, false, spec); }
+
+int create_spec_client_async(const char *spec) { return create_spec_socket(false, true, spec); }
@@ -7,6 +7,17 @@ int create_tcp_server(bool ipv6, const char *host, const char *port);
 
 int create_tcp_client(bool ipv6, const char *host, const char *port);
 
+#ifdef __linux__
+
+// sessions over the UDP transport (see udp.h). the returned socket is a stream socket that
+// the server accepts the sessions from, as it does from a TCP server socket.
+int create_udp_server(bool ipv6, const char *host, const char *port);
+
+#endif
+
+// a stream socket connected to the server through the UDP transport
+int create_udp_client(bool ipv6, const char *host, const char *port);
+
 int create_uds_server(const char *path);
 
 int create_uds_client(const char *path);
@@ -20,3 +31,17 @@ int create_vsock_client(const char *cid, const char *port);
 #endif
 
 int create_vsock_mult_client(const char *path, const char *cid, const char *port);
+
+// endpoint spec, one of:
+//  - tcp:<host>:<port>
+//  - tcp6:<host>:<port>
+//  - unix:<path>
+//  - vsock:<cid>:<port> (Linux only)
+// the returned server socket is already listening.
+int create_spec_server(const char *spec);
+
+int create_spec_client(const char *spec);
+
+// nonblocking client socket whose connection may still be in progress. the caller
+// should wait for it to become writable and check SO_ERROR.
+int create_spec_client_async(const char *spec);
@@ -0,0 +1,324 @@
+#include "tls.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// older OpenSSL: no kTLS, and EOF without close_notify is reported as an error
+#ifndef SSL_OP_ENABLE_KTLS
+#define SSL_OP_ENABLE_KTLS 0
+#endif
+#ifndef SSL_OP_IGNORE_UNEXPECTED_EOF
+#define SSL_OP_IGNORE_UNEXPECTED_EOF 0
+#endif
+#ifndef BIO_get_ktls_send
+#define BIO_get_ktls_send(b) 0
+#define BIO_get_ktls_recv(b) 0
+#endif
+
+// the handshake must not take longer than this
+#define TLS_HANDSHAKE_TIMEOUT_S 10
+// largest TLS record payload
+#define TLS_RELAY_BUFF 16384
+// stop decrypting while this much is waiting for the app
+#define TLS_RELAY_HIGH 262144
+
+struct tls_relay {
+  SSL *ssl;
+  // the TLS connection
+  int fd;
+  // our end of the app's socket pair
+  int appfd;
+};
+
+static SSL_CTX *ctx;
+static bool server;
+
+static void warn_ssl(const char *msg) {
+  char buff[256];
+  unsigned long e = ERR_get_error();
+  if (e)
+    ERR_error_string_n(e, buff, sizeof(buff));
+  warnx("%s: %s", msg, e ? buff : "unknown error");
+  ERR_clear_error();
+}
+
+bool tls_init(bool server_, const char *pemfile) {
+  server = server_;
+  ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+  if (!ctx) {
+    warn_ssl("Error creating TLS context");
+    return false;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+  // the app has its own way of ending a session (DT_CLOSE), so a missing close_notify is just EOF
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+  if (server) {
+    // tickets would come after the handshake, in records that the app can't read with kTLS.
+    // sessions are resumed with the app's own tickets instead.
+    SSL_CTX_set_num_tickets(ctx, 0);
+    if (SSL_CTX_use_certificate_chain_file(ctx, pemfile) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, pemfile, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+      warn_ssl("Error loading TLS certificate and key");
+      goto error;
+    }
+  } else {
+    if (SSL_CTX_load_verify_locations(ctx, pemfile, NULL) != 1) {
+      warn_ssl("Error loading TLS certificates");
+      goto error;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  }
+  return true;
+
+error:
+  SSL_CTX_free(ctx);
+  ctx = NULL;
+  return false;
+}
+
+bool tls_enabled() { return ctx; }
+
+// returns 1 if the operation should be retried once `*events` are ready, 0 on EOF, -1 on error
+static int ssl_retry(SSL *ssl, int ret, short *events) {
+  switch (SSL_get_error(ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+    *events = POLLIN;
+    return 1;
+  case SSL_ERROR_WANT_WRITE:
+    *events = POLLOUT;
+    return 1;
+  case SSL_ERROR_ZERO_RETURN:
+    return 0;
+  case SSL_ERROR_SYSCALL:
+    if (!ret && !ERR_peek_error())
+      return 0;
+    // fallthrough
+  default:
+    return -1;
+  }
+}
+
+static void relay_loop(struct tls_relay *r) {
+  set_fd_flags(r->fd, true, O_NONBLOCK);
+  set_fd_flags(r->appfd, true, O_NONBLOCK);
+
+  uint8_t buff[TLS_RELAY_BUFF];
+  // from the app, not yet taken by SSL_write
+  uint8_t out[TLS_RELAY_BUFF];
+  size_t outoff = 0;
+  size_t outlen = 0;
+  struct bytequeue toapp = {0};
+  bool peer_eof = false, app_eof = false;
+  bool peer_shut = false, app_shut = false;
+  short readev = POLLIN, writeev = POLLOUT;
+
+  for (;;) {
+    bool progress = false;
+
+    // peer to app
+    if (!peer_eof && toapp.len < TLS_RELAY_HIGH) {
+      int n = SSL_read(r->ssl, buff, sizeof(buff));
+      if (n > 0) {
+        if (!bq_append(&toapp, buff, n))
+          break;
+        progress = true;
+      } else {
+        int st = ssl_retry(r->ssl, n, &readev);
+        if (st < 0)
+          break;
+        if (!st)
+          peer_eof = progress = true;
+      }
+    }
+    if (toapp.len && !bq_flush(&toapp, r->appfd))
+      break;
+    if (peer_eof && !toapp.len && !app_shut) {
+      shutdown(r->appfd, SHUT_WR);
+      app_shut = true;
+    }
+
+    // app to peer
+    if (!outlen && !app_eof) {
+      ssize_t rd = read(r->appfd, out, sizeof(out));
+      if (rd > 0) {
+        outoff = 0;
+        outlen = rd;
+        progress = true;
+      } else if (!rd) {
+        app_eof = progress = true;
+      } else if (errno != EAGAIN && errno != EINTR) {
+        break;
+      }
+    }
+    if (outlen) {
+      int n = SSL_write(r->ssl, out + outoff, outlen);
+      if (n > 0) {
+        outoff += n;
+        outlen -= n;
+        progress = true;
+      } else if (ssl_retry(r->ssl, n, &writeev) <= 0) {
+        break;
+      }
+    }
+    if (app_eof && !outlen && !peer_shut) {
+      shutdown(r->fd, SHUT_WR);
+      peer_shut = true;
+    }
+
+    if (peer_eof && app_shut && peer_shut)
+      break;
+    if (progress)
+      continue;
+
+    struct pollfd pfds[2] = {{.fd = r->fd}, {.fd = r->appfd}};
+    if (!peer_eof && toapp.len < TLS_RELAY_HIGH)
+      pfds[0].events |= readev;
+    if (outlen)
+      pfds[0].events |= writeev;
+    if (!outlen && !app_eof)
+      pfds[1].events |= POLLIN;
+    if (toapp.len)
+      pfds[1].events |= POLLOUT;
+    if (poll(pfds, 2, -1) < 0 && errno != EINTR)
+      break;
+  }
+
+  bq_free(&toapp);
+  SSL_free(r->ssl);
+  close(r->fd);
+  close(r->appfd);
+}
+
+static void *relay_main(void *arg) {
+  struct tls_relay *r = arg;
+  relay_loop(r);
+  free(r);
+  return NULL;
+}
+
+static bool start_relay(struct tls_relay *r, bool thread, int otherfd) {
+  if (thread) {
+    // signals are for the app's threads
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int st = pthread_create(&t, &attr, relay_main, r);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (st) {
+      errno = st;
+      warn("Error starting TLS relay thread");
+      return false;
+    }
+    return true;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    warn("Error starting TLS relay");
+    return false;
+  }
+  if (!pid) {
+    // relay process. it goes away once the connection is over, so the terminal's signals
+    // are none of its business.
+    signal(SIGINT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    close(otherfd);
+    relay_loop(r);
+    _exit(0);
+  }
+  // the relay process has its own copy of everything
+  SSL_free(r->ssl);
+  close(r->fd);
+  close(r->appfd);
+  free(r);
+  return true;
+}
+
+int tls_wrap(int fd, const char *host, bool thread) {
+  int flags = fcntl(fd, F_GETFL);
+  set_fd_flags(fd, false, O_NONBLOCK);
+  struct timeval tv = {.tv_sec = TLS_HANDSHAKE_TIMEOUT_S};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  SSL *ssl = SSL_new(ctx);
+  if (!ssl || !SSL_set_fd(ssl, fd)) {
+    warn_ssl("Error setting up TLS");
+    goto error;
+  }
+  if (!server && host) {
+    X509_VERIFY_PARAM *param = SSL_get0_param(ssl);
+    uint8_t ip[16];
+    if (inet_pton(AF_INET, host, ip) == 1 || inet_pton(AF_INET6, host, ip) == 1) {
+      X509_VERIFY_PARAM_set1_ip_asc(param, host);
+    } else {
+      SSL_set_tlsext_host_name(ssl, host);
+      X509_VERIFY_PARAM_set1_host(param, host, 0);
+    }
+  }
+  if ((server ? SSL_accept(ssl) : SSL_connect(ssl)) != 1) {
+    warn_ssl("TLS handshake failed");
+    goto error;
+  }
+  tv.tv_sec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) && !SSL_has_pending(ssl)) {
+    // the kernel does the record layer from now on. this does not close `fd`.
+    SSL_free(ssl);
+    if (flags & O_NONBLOCK)
+      set_fd_flags(fd, true, O_NONBLOCK);
+    return fd;
+  }
+
+  int sp[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) < 0) {
+    warn("Error creating TLS relay socket pair");
+    goto error;
+  }
+  struct tls_relay *r = malloc(sizeof(*r));
+  if (!r) {
+    close(sp[0]);
+    close(sp[1]);
+    goto error;
+  }
+  r->ssl = ssl;
+  r->fd = fd;
+  r->appfd = sp[1];
+  if (!start_relay(r, thread, sp[0])) {
+    free(r);
+    close(sp[0]);
+    close(sp[1]);
+    goto error;
+  }
+  if (flags & O_NONBLOCK)
+    set_fd_flags(sp[0], true, O_NONBLOCK);
+  return sp[0];
+
+error:
+  SSL_free(ssl);
+  close(fd);
+  return -1;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+
+// TLS 1.3 for the TCP transport (-t).
+// after the handshake, the record layer is handed to the kernel (kTLS) when both directions
+// can be offloaded, and the app keeps using the socket as is. otherwise, the app gets one end
+// of a socket pair, and a relay encrypts and decrypts between it and the socket.
+
+// server: `pemfile` has the certificate chain and the private key.
+// client: `pemfile` has the certificates to verify the server against.
+bool tls_init(bool server, const char *pemfile);
+
+bool tls_enabled();
+
+// run the handshake on the connected `fd`. clients verify the server's certificate against
+// `host`. the relay, if needed, runs in a thread if `thread` is set, otherwise in a process
+// that outlives the caller until everything written has been delivered.
+// returns the fd to use from now on (with the same O_NONBLOCK setting as `fd`), which may be
+// `fd` itself. returns -1 on error, in which case `fd` is closed.
+int tls_wrap(int fd, const char *host, bool thread);
@@ -0,0 +1,331 @@
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// USDT probes, for bpftrace/perf/systemtap. without <sys/sdt.h>, they compile to nothing.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define PROBE1(name, a) DTRACE_PROBE1(ptyfwd, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(ptyfwd, name, a, b)
+#define PROBE6(name, a, b, c, d, e, f) DTRACE_PROBE6(ptyfwd, name, a, b, c, d, e, f)
+#else
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE6(name, a, b, c, d, e, f) ((void)(a), (void)(b), (void)(c), (void)(d), (void)(e), (void)(f))
+#endif
+
+#define TRACE_PING_INTERVAL_NS (1000 * 1000000ull)
+// the clock offset is taken from the best of this many latest pings, so that it follows drift
+#define TRACE_CLOCK_SAMPLES 8
+// latest frames kept for the percentiles
+#define TRACE_RING 1024
+// log2 buckets of microseconds
+#define TRACE_BUCKETS 32
+// in the ring: stage not known for this frame
+#define UNKNOWN UINT32_MAX
+
+void trace_session_init(struct trace_session *t, bool enabled) {
+  memset(t, 0, sizeof(*t));
+  t->enabled = enabled;
+}
+
+size_t trace_handle(struct trace_session *t, const uint8_t *data, size_t len, uint8_t *reply) {
+  uint64_t ns;
+  if (len != 1 + sizeof(ns))
+    return 0;
+  memcpy(&ns, data + 1, sizeof(ns));
+  switch (data[0]) {
+  case TRACE_INPUT:
+    t->next_input_ns = ns;
+    return 0;
+  case TRACE_PING: {
+    uint64_t now = mono_ns();
+    reply[0] = TRACE_PONG;
+    memcpy(reply + 1, &ns, sizeof(ns));
+    memcpy(reply + 1 + sizeof(ns), &now, sizeof(now));
+    return 1 + 2 * sizeof(ns);
+  }
+  default:
+    return 0;
+  }
+}
+
+void trace_pty_write(struct trace_session *t) {
+  if (!t->enabled)
+    return;
+  uint64_t now = mono_ns();
+  PROBE1(pty_write, now);
+  // the output that follows is the response to the first keystrokes since the last read
+  if (!t->pty_write_ns) {
+    t->pty_write_ns = now;
+    t->input_ns = t->next_input_ns;
+  }
+  t->next_input_ns = 0;
+}
+
+size_t trace_stamp(struct trace_session *t, uint8_t *out, uint64_t pty_read_ns, size_t len) {
+  struct trace_stamp st = {
+      .input_ns = t->input_ns, .pty_write_ns = t->pty_write_ns, .pty_read_ns = pty_read_ns, .sock_write_ns = mono_ns()};
+  t->input_ns = t->pty_write_ns = 0;
+  PROBE2(pty_read, pty_read_ns, len);
+  PROBE2(sock_write, st.sock_write_ns, len);
+  out[0] = TRACE_STAMP;
+  memcpy(out + 1, &st, sizeof(st));
+  return 1 + sizeof(st);
+}
+
+// client side
+
+enum { ST_UP, ST_APP, ST_RELAY, ST_NET, ST_TERM, ST_TOTAL, ST_MAX };
+
+static const char *stage_names[ST_MAX] = {"up", "app", "relay", "net", "term", "total"};
+
+struct clock_sample {
+  uint64_t rtt_ns;
+  // server clock - client clock
+  int64_t offset_ns;
+};
+
+static struct clock_sample clock_samples[TRACE_CLOCK_SAMPLES];
+static unsigned nclock;
+static uint64_t last_ping_ns;
+
+// stamp of the next DT_REGULAR
+static struct trace_stamp next_stamp;
+static bool has_next;
+
+// traced output still waiting for the terminal
+static struct {
+  bool active;
+  struct trace_stamp stamp;
+  uint64_t read_ns;
+} pending;
+
+static uint32_t ring[TRACE_RING][ST_MAX];
+static unsigned long long nframes;
+static unsigned long long hist[ST_MAX][TRACE_BUCKETS];
+static uint32_t maxus[ST_MAX];
+// output that went to the terminal behind traced output still waiting for it
+static unsigned long long skipped;
+
+void trace_init() {
+  last_ping_ns = 0;
+  nclock = 0;
+}
+
+int trace_timeout() {
+  uint64_t now = mono_ns();
+  uint64_t due = last_ping_ns + TRACE_PING_INTERVAL_NS;
+  return due > now ? (due - now + 999999) / 1000000 : 0;
+}
+
+size_t trace_ping(uint8_t *out) {
+  uint64_t now = mono_ns();
+  if (now < last_ping_ns + TRACE_PING_INTERVAL_NS)
+    return 0;
+  last_ping_ns = now;
+  out[0] = TRACE_PING;
+  memcpy(out + 1, &now, sizeof(now));
+  return 1 + sizeof(now);
+}
+
+size_t trace_input(uint8_t *out) {
+  uint64_t now = mono_ns();
+  out[0] = TRACE_INPUT;
+  memcpy(out + 1, &now, sizeof(now));
+  return 1 + sizeof(now);
+}
+
+static bool clock_offset(int64_t *offset, uint64_t *rtt) {
+  unsigned n = nclock < TRACE_CLOCK_SAMPLES ? nclock : TRACE_CLOCK_SAMPLES;
+  if (!n)
+    return false;
+  const struct clock_sample *best = clock_samples;
+  for (unsigned i = 1; i < n; ++i) {
+    if (clock_samples[i].rtt_ns < best->rtt_ns)
+      best = clock_samples + i;
+  }
+  *offset = best->offset_ns;
+  if (rtt)
+    *rtt = best->rtt_ns;
+  return true;
+}
+
+void trace_frame(const uint8_t *data, size_t len, uint64_t read_ns) {
+  if (len == 1 + sizeof(next_stamp) && data[0] == TRACE_STAMP) {
+    memcpy(&next_stamp, data + 1, sizeof(next_stamp));
+    has_next = true;
+  } else if (len == 1 + 2 * sizeof(uint64_t) && data[0] == TRACE_PONG) {
+    uint64_t sent, server;
+    memcpy(&sent, data + 1, sizeof(sent));
+    memcpy(&server, data + 1 + sizeof(sent), sizeof(server));
+    if (sent > read_ns)
+      return;
+    // the server read the clock halfway through the round trip, give or take
+    struct clock_sample *cs = clock_samples + nclock++ % TRACE_CLOCK_SAMPLES;
+    cs->rtt_ns = read_ns - sent;
+    cs->offset_ns = (int64_t)(server - sent) - (int64_t)(cs->rtt_ns / 2);
+  }
+}
+
+// microseconds from `from` to `to`, or UNKNOWN if either is. clock errors can make a short
+// stage look negative, which is counted as 0.
+static uint32_t span_us(int64_t from, int64_t to, bool known) {
+  if (!known)
+    return UNKNOWN;
+  if (to <= from)
+    return 0;
+  uint64_t us = (to - from + 500) / 1000;
+  return us < UNKNOWN ? us : UNKNOWN - 1;
+}
+
+static void record(const struct trace_stamp *st, uint64_t read_ns, uint64_t done_ns) {
+  int64_t off = 0;
+  bool synced = clock_offset(&off, NULL);
+  bool input = st->input_ns && st->pty_write_ns;
+  uint32_t *rec = ring[nframes++ % TRACE_RING];
+  rec[ST_UP] = span_us(st->input_ns, st->pty_write_ns - off, input && synced);
+  rec[ST_APP] = span_us(st->pty_write_ns, st->pty_read_ns, st->pty_write_ns);
+  rec[ST_RELAY] = span_us(st->pty_read_ns, st->sock_write_ns, true);
+  rec[ST_NET] = span_us(st->sock_write_ns - off, read_ns, synced);
+  rec[ST_TERM] = span_us(read_ns, done_ns, true);
+  rec[ST_TOTAL] = span_us(st->input_ns, done_ns, input);
+
+  for (int i = 0; i < ST_MAX; ++i) {
+    if (rec[i] == UNKNOWN)
+      continue;
+    int b = rec[i] <= 1 ? 0 : 32 - __builtin_clz(rec[i] - 1);
+    ++hist[i][b < TRACE_BUCKETS ? b : TRACE_BUCKETS - 1];
+    if (rec[i] > maxus[i])
+      maxus[i] = rec[i];
+  }
+  PROBE6(frame, (int)rec[ST_UP], (int)rec[ST_APP], (int)rec[ST_RELAY], (int)rec[ST_NET], (int)rec[ST_TERM],
+    (int)rec[ST_TOTAL]);
+}
+
+void trace_output(uint64_t read_ns, size_t len, bool queued) {
+  PROBE2(sock_read, read_ns, len);
+  if (!has_next)
+    return;
+  has_next = false;
+  if (pending.active) {
+    ++skipped;
+    return;
+  }
+  if (queued) {
+    pending.active = true;
+    pending.stamp = next_stamp;
+    pending.read_ns = read_ns;
+    return;
+  }
+  uint64_t now = mono_ns();
+  PROBE2(stdout_write, now, len);
+  record(&next_stamp, read_ns, now);
+}
+
+void trace_output_drained() {
+  if (!pending.active)
+    return;
+  uint64_t now = mono_ns();
+  PROBE2(stdout_write, now, 0);
+  record(&pending.stamp, pending.read_ns, now);
+  pending.active = false;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// percentile `p` of the stage over the frames in the ring, or UNKNOWN
+static uint32_t percentile(int stage, int p) {
+  static uint32_t vals[TRACE_RING];
+  size_t n = 0;
+  size_t inring = nframes < TRACE_RING ? nframes : TRACE_RING;
+  for (size_t i = 0; i < inring; ++i) {
+    if (ring[i][stage] != UNKNOWN)
+      vals[n++] = ring[i][stage];
+  }
+  if (!n)
+    return UNKNOWN;
+  qsort(vals, n, sizeof(*vals), cmp_u32);
+  return vals[(n - 1) * p / 100];
+}
+
+static void print_row(const char *label, const uint32_t *vals) {
+  fprintf(stderr, "%10s", label);
+  for (int i = 0; i < ST_MAX; ++i) {
+    if (vals[i] == UNKNOWN)
+      fprintf(stderr, " %8s", "-");
+    else
+      fprintf(stderr, " %8u", vals[i]);
+  }
+  fputc('\n', stderr);
+}
+
+void trace_dump() {
+  if (!nframes) {
+    fprintf(stderr, "Latency trace: no frames traced.\n");
+    return;
+  }
+  int64_t off;
+  uint64_t rtt;
+  if (clock_offset(&off, &rtt))
+    fprintf(stderr, "Latency breakdown of %llu frames (us). Clock offset %lld us, best ping RTT %llu us.\n", nframes,
+      (long long)(off / 1000), (unsigned long long)(rtt / 1000));
+  else
+    fprintf(stderr, "Latency breakdown of %llu frames (us). Clock offset unknown.\n", nframes);
+  if (skipped)
+    fprintf(stderr, "%llu frames not traced while the terminal was behind.\n", skipped);
+
+  fprintf(stderr, "%10s", "<= us");
+  for (int i = 0; i < ST_MAX; ++i)
+    fprintf(stderr, " %8s", stage_names[i]);
+  fputc('\n', stderr);
+
+  int lo = TRACE_BUCKETS, hi = -1;
+  for (int i = 0; i < ST_MAX; ++i) {
+    for (int b = 0; b < TRACE_BUCKETS; ++b) {
+      if (!hist[i][b])
+        continue;
+      lo = b < lo ? b : lo;
+      hi = b > hi ? b : hi;
+    }
+  }
+  for (int b = lo; b <= hi; ++b) {
+    bool empty = true;
+    for (int i = 0; i < ST_MAX; ++i)
+      empty = empty && !hist[i][b];
+    if (empty)
+      continue;
+    char label[24];
+    snprintf(label, sizeof(label), "%llu", 1ull << b);
+    fprintf(stderr, "%10s", label);
+    for (int i = 0; i < ST_MAX; ++i) {
+      if (hist[i][b])
+        fprintf(stderr, " %8llu", hist[i][b]);
+      else
+        fprintf(stderr, " %8s", ".");
+    }
+    fputc('\n', stderr);
+  }
+
+  uint32_t row[ST_MAX];
+  for (int i = 0; i < ST_MAX; ++i)
+    row[i] = percentile(i, 50);
+  print_row("p50", row);
+  for (int i = 0; i < ST_MAX; ++i)
+    row[i] = percentile(i, 99);
+  print_row("p99", row);
+  for (int i = 0; i < ST_MAX; ++i)
+    row[i] = hist[i][0] || maxus[i] ? maxus[i] : UNKNOWN;
+  print_row("max", row);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// end-to-end latency tracing (-x), to tell where the time goes when a session feels slow.
+// when the client asks for it (CF_TRACE), the server sends a DT_TRACE stamp right before each
+// DT_REGULAR frame of pty output, and the client sends one right before each keystroke frame.
+// for every frame of output, the client ends up with:
+//  - up:    keystroke sent by the client -> written to mPTY (only for output after input)
+//  - app:   written to mPTY -> its response read from mPTY
+//  - relay: read from mPTY -> written to the socket by the server
+//  - net:   written to the socket -> read by the client. this includes anything queued ahead
+//           of the frame on the server.
+//  - term:  read by the client -> written to the terminal
+//  - total: keystroke sent -> response written to the terminal
+// stamps are in the sender's monotonic clock. the client pings the server every second and
+// converts with the offset from the ping with the shortest round trip.
+// the stages of all frames go into log2 histograms, and those of the latest frames into a ring
+// buffer for the percentiles. both sides also fire USDT probes (provider "ptyfwd") if built
+// with <sys/sdt.h>.
+
+// DT_TRACE payload: 1 byte kind + struct
+enum trace_kind {
+  TRACE_STAMP, // server -> client: struct trace_stamp, describes the DT_REGULAR that follows
+  TRACE_INPUT, // client -> server: u64 send time, describes the DT_REGULAR that follows
+  TRACE_PING,  // client -> server: u64 send time
+  TRACE_PONG,  // server -> client: u64 client send time + u64 server time
+};
+
+struct trace_stamp {
+  // client clock. 0 if no keystroke led to this output.
+  uint64_t input_ns;
+  // server clock. 0 if no keystroke led to this output.
+  uint64_t pty_write_ns;
+  uint64_t pty_read_ns;
+  uint64_t sock_write_ns;
+};
+
+// largest DT_TRACE payload
+#define TRACE_PAYLOAD_MAX (1 + sizeof(struct trace_stamp))
+
+// server side, per session
+struct trace_session {
+  bool enabled;
+  // from the last TRACE_INPUT, for the next keystrokes written to mPTY
+  uint64_t next_input_ns;
+  // the first keystrokes written to mPTY since the last read from it
+  uint64_t input_ns;
+  uint64_t pty_write_ns;
+};
+
+void trace_session_init(struct trace_session *t, bool enabled);
+
+// a DT_TRACE from the client. returns the length of the payload to send back in `reply`,
+// which must have room for TRACE_PAYLOAD_MAX bytes, or 0 if there is nothing to send.
+size_t trace_handle(struct trace_session *t, const uint8_t *data, size_t len, uint8_t *reply);
+
+// keystrokes have just been written to mPTY
+void trace_pty_write(struct trace_session *t);
+
+// encode the stamp for `len` bytes read from mPTY at `pty_read_ns`, to be written right now.
+// `out` must have room for TRACE_PAYLOAD_MAX bytes. returns the payload length.
+size_t trace_stamp(struct trace_session *t, uint8_t *out, uint64_t pty_read_ns, size_t len);
+
+// client side
+
+void trace_init();
+
+// milliseconds until the next ping is due
+int trace_timeout();
+
+// encode a ping into `out` (TRACE_PAYLOAD_MAX bytes) if one is due. returns the payload length.
+size_t trace_ping(uint8_t *out);
+
+// encode the stamp for keystrokes about to be sent. returns the payload length.
+size_t trace_input(uint8_t *out);
+
+// a DT_TRACE from the server, read at `read_ns`
+void trace_frame(const uint8_t *data, size_t len, uint64_t read_ns);
+
+// `len` bytes of output read at `read_ns` have been given to the terminal.
+// `queued` if some of it is still waiting for the terminal.
+void trace_output(uint64_t read_ns, size_t len, bool queued);
+
+// the terminal has taken everything that was queued
+void trace_output_drained();
+
+// print the latency breakdown to stderr
+void trace_dump();
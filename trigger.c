@@ -0,0 +1,392 @@
+#include "trigger.h"
+#include "utils.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRIGGER_X86
+#endif
+
+// patterns are spread over this many buckets, one bit each in the nibble tables
+#define BUCKETS 8
+#define EXEC_MIN_INTERVAL_NS 1000000000ull
+
+enum trigger_action { TA_LOG, TA_REPLY, TA_EXEC };
+
+struct trigger {
+  uint8_t pat[TRIGGER_MAX_LEN];
+  size_t len;
+  // as written in the trigger file
+  char *name;
+  enum trigger_action action;
+  uint8_t *arg;
+  size_t arglen;
+};
+
+static struct trigger triggers[TRIGGER_MAX];
+static int ntriggers;
+static size_t maxlen;
+
+static uint8_t bucket_pats[BUCKETS][TRIGGER_MAX];
+static int bucket_n[BUCKETS];
+
+// bit b of masks[k][n] is set if some pattern in bucket b has n as the low (k = 0, 2) or high
+// (k = 1, 3) nibble of its first (k = 0, 1) or second (k = 2, 3) byte.
+// a position is a candidate if all four lookups agree on a bucket.
+static uint8_t masks[4][16] __attribute__((aligned(16)));
+
+// scans whole blocks of `data` for candidates. returns where the scalar scan takes over.
+static size_t (*scan_simd)(struct trigger_session *t, const uint8_t *data, size_t len);
+
+static size_t unescape(const char *s, uint8_t *out, size_t outsize) {
+  size_t n = 0;
+  while (*s) {
+    if (n == outsize)
+      return 0;
+    char c = *s++;
+    if (c == '\\') {
+      switch ((c = *s++)) {
+      case 's':
+        c = ' ';
+        break;
+      case 't':
+        c = '\t';
+        break;
+      case 'r':
+        c = '\r';
+        break;
+      case 'n':
+        c = '\n';
+        break;
+      case 'e':
+        c = 0x1b;
+        break;
+      case '\\':
+        break;
+      case 'x': {
+        char hex[3] = {s[0], s[0] ? s[1] : 0, 0};
+        char *endp;
+        c = strtol(hex, &endp, 16);
+        if (endp != hex + 2)
+          return 0;
+        s += 2;
+        break;
+      }
+      default:
+        return 0;
+      }
+    }
+    out[n++] = c;
+  }
+  return n;
+}
+
+static bool parse_line(char *line, struct trigger *t) {
+  char *action = line + strcspn(line, " \t");
+  if (!*action)
+    return false;
+  *action++ = 0;
+  action += strspn(action, " \t");
+  char *arg = strchr(action, ' ');
+  if (arg)
+    *arg++ = 0;
+
+  if (!(t->len = unescape(line, t->pat, sizeof(t->pat))) || t->len < 2)
+    return false;
+  if (!strcmp(action, "log") && !arg) {
+    t->action = TA_LOG;
+  } else if (!strcmp(action, "reply") && arg) {
+    t->action = TA_REPLY;
+    uint8_t text[256];
+    if (!(t->arglen = unescape(arg, text, sizeof(text))) || !(t->arg = malloc(t->arglen)))
+      return false;
+    memcpy(t->arg, text, t->arglen);
+  } else if (!strcmp(action, "exec") && arg) {
+    t->action = TA_EXEC;
+    if (!(t->arg = (uint8_t *)strdup(arg)))
+      return false;
+    t->arglen = strlen(arg);
+  } else {
+    return false;
+  }
+  return (t->name = strdup(line));
+}
+
+#ifdef TRIGGER_X86
+
+static void verify(struct trigger_session *t, const uint8_t *data, size_t len, size_t pos, uint8_t buckets,
+  size_t minend);
+
+__attribute__((target("ssse3"))) static size_t scan_ssse3(struct trigger_session *t, const uint8_t *data,
+  size_t len) {
+  const __m128i lo0 = _mm_load_si128((const __m128i *)masks[0]);
+  const __m128i hi0 = _mm_load_si128((const __m128i *)masks[1]);
+  const __m128i lo1 = _mm_load_si128((const __m128i *)masks[2]);
+  const __m128i hi1 = _mm_load_si128((const __m128i *)masks[3]);
+  const __m128i nib = _mm_set1_epi8(0x0F);
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  // the second byte of the last position must be in the buffer too
+  for (; i + 17 <= len; i += 16) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *)(data + i));
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+    __m128i c = _mm_and_si128(
+      _mm_and_si128(_mm_shuffle_epi8(lo0, _mm_and_si128(v0, nib)),
+        _mm_shuffle_epi8(hi0, _mm_and_si128(_mm_srli_epi16(v0, 4), nib))),
+      _mm_and_si128(_mm_shuffle_epi8(lo1, _mm_and_si128(v1, nib)),
+        _mm_shuffle_epi8(hi1, _mm_and_si128(_mm_srli_epi16(v1, 4), nib))));
+    uint32_t m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(c, zero)) & 0xFFFF;
+    if (!m)
+      continue;
+    uint8_t cb[16];
+    _mm_storeu_si128((__m128i *)cb, c);
+    for (; m; m &= m - 1) {
+      int b = __builtin_ctz(m);
+      verify(t, data, len, i + b, cb[b], 0);
+    }
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(struct trigger_session *t, const uint8_t *data, size_t len) {
+  // the shuffles look up within each 128 bit lane, so both lanes get the same tables
+  const __m256i lo0 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)masks[0]));
+  const __m256i hi0 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)masks[1]));
+  const __m256i lo1 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)masks[2]));
+  const __m256i hi1 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)masks[3]));
+  const __m256i nib = _mm256_set1_epi8(0x0F);
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 33 <= len; i += 32) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)(data + i));
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)(data + i + 1));
+    __m256i c = _mm256_and_si256(
+      _mm256_and_si256(_mm256_shuffle_epi8(lo0, _mm256_and_si256(v0, nib)),
+        _mm256_shuffle_epi8(hi0, _mm256_and_si256(_mm256_srli_epi16(v0, 4), nib))),
+      _mm256_and_si256(_mm256_shuffle_epi8(lo1, _mm256_and_si256(v1, nib)),
+        _mm256_shuffle_epi8(hi1, _mm256_and_si256(_mm256_srli_epi16(v1, 4), nib))));
+    uint32_t m = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, zero));
+    if (!m)
+      continue;
+    uint8_t cb[32];
+    _mm256_storeu_si256((__m256i *)cb, c);
+    for (; m; m &= m - 1) {
+      int b = __builtin_ctz(m);
+      verify(t, data, len, i + b, cb[b], 0);
+    }
+  }
+  return i;
+}
+
+#endif
+
+bool trigger_load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    warn("Cannot open trigger file");
+    return false;
+  }
+
+  char line[512];
+  int lineno = 0;
+  bool success = false;
+  while (fgets(line, sizeof(line), f)) {
+    ++lineno;
+    line[strcspn(line, "\r\n")] = 0;
+    if (!*line || *line == '#')
+      continue;
+    if (ntriggers == TRIGGER_MAX) {
+      warnx("%s:%d: too many triggers", path, lineno);
+      goto end;
+    }
+    struct trigger *t = triggers + ntriggers;
+    if (!parse_line(line, t)) {
+      warnx("%s:%d: expected <pattern> log|reply <text>|exec <command>", path, lineno);
+      goto end;
+    }
+
+    int b = ntriggers % BUCKETS;
+    bucket_pats[b][bucket_n[b]++] = ntriggers;
+    masks[0][t->pat[0] & 0xF] |= 1 << b;
+    masks[1][t->pat[0] >> 4] |= 1 << b;
+    masks[2][t->pat[1] & 0xF] |= 1 << b;
+    masks[3][t->pat[1] >> 4] |= 1 << b;
+    if (t->len > maxlen)
+      maxlen = t->len;
+    ++ntriggers;
+  }
+  success = true;
+
+  if (!trigger_use_scan("avx2"))
+    trigger_use_scan("ssse3");
+
+end:
+  fclose(f);
+  return success;
+}
+
+bool trigger_use_scan(const char *name) {
+  if (!strcmp(name, "scalar")) {
+    scan_simd = NULL;
+    return true;
+  }
+#ifdef TRIGGER_X86
+  __builtin_cpu_init();
+  if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+    scan_simd = scan_avx2;
+    return true;
+  }
+  if (!strcmp(name, "ssse3") && __builtin_cpu_supports("ssse3")) {
+    scan_simd = scan_ssse3;
+    return true;
+  }
+#endif
+  return false;
+}
+
+bool trigger_enabled() { return ntriggers; }
+
+void trigger_session_init(struct trigger_session *t, pid_t pid, trigger_reply_fn reply, void *ctx) {
+  t->pid = pid;
+  t->reply = reply;
+  t->ctx = ctx;
+  t->taillen = 0;
+  t->last_exec = ntriggers ? calloc(ntriggers, sizeof(*t->last_exec)) : NULL;
+}
+
+void trigger_session_free(struct trigger_session *t) {
+  free(t->last_exec);
+  t->last_exec = NULL;
+}
+
+// run the command in a grandchild, so nobody has to wait for it
+static void run_exec(struct trigger_session *t, const struct trigger *tr) {
+  // everything is prepared before forking, as sessions may share the process with other threads
+  extern char **environ;
+  size_t nenv = 0;
+  while (environ[nenv])
+    ++nenv;
+  char **envp = malloc((nenv + 3) * sizeof(*envp));
+  char trigger_env[32 + TRIGGER_MAX_LEN * 4], session_env[32];
+  if (!envp) {
+    warn("Error running trigger command");
+    return;
+  }
+  snprintf(trigger_env, sizeof(trigger_env), "PTYFWD_TRIGGER=%s", tr->name);
+  snprintf(session_env, sizeof(session_env), "PTYFWD_SESSION=%d", (int)t->pid);
+  memcpy(envp, environ, nenv * sizeof(*envp));
+  envp[nenv] = trigger_env;
+  envp[nenv + 1] = session_env;
+  envp[nenv + 2] = NULL;
+  char *argv[] = {"sh", "-c", (char *)tr->arg, NULL};
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    warn("Error running trigger command");
+  } else if (!pid) {
+    setsid();
+    if (fork())
+      _exit(0);
+    // none of the server's fds are the command's business
+    int devnull = open("/dev/null", O_RDWR);
+    dup2(devnull, 0);
+    dup2(devnull, 1);
+#ifdef SYS_close_range
+    syscall(SYS_close_range, 3, ~0U, 0);
+#else
+    for (int fd = 3; fd < 1024; ++fd)
+      close(fd);
+#endif
+    execve("/bin/sh", argv, envp);
+    _exit(127);
+  } else {
+    waitpid(pid, NULL, 0);
+  }
+  free(envp);
+}
+
+static void fire(struct trigger_session *t, int idx) {
+  const struct trigger *tr = triggers + idx;
+  switch (tr->action) {
+  case TA_LOG:
+    warnx("Trigger '%s' matched in session %d.", tr->name, (int)t->pid);
+    break;
+  case TA_REPLY:
+    t->reply(t->ctx, tr->arg, tr->arglen);
+    break;
+  case TA_EXEC: {
+    uint64_t now = mono_ns();
+    if (t->last_exec[idx] && now - t->last_exec[idx] < EXEC_MIN_INTERVAL_NS)
+      break;
+    t->last_exec[idx] = now;
+    run_exec(t, tr);
+    break;
+  }
+  }
+}
+
+// check the patterns of `buckets` at `pos`. only matches that end after `minend` count.
+static void verify(struct trigger_session *t, const uint8_t *data, size_t len, size_t pos, uint8_t buckets,
+  size_t minend) {
+  for (; buckets; buckets &= buckets - 1) {
+    int b = __builtin_ctz(buckets);
+    for (int k = 0; k < bucket_n[b]; ++k) {
+      const struct trigger *tr = triggers + bucket_pats[b][k];
+      if (pos + tr->len <= len && pos + tr->len > minend && !memcmp(data + pos, tr->pat, tr->len))
+        fire(t, bucket_pats[b][k]);
+    }
+  }
+}
+
+static inline uint8_t candidates(const uint8_t *p) {
+  return masks[0][p[0] & 0xF] & masks[1][p[0] >> 4] & masks[2][p[1] & 0xF] & masks[3][p[1] >> 4];
+}
+
+// candidates in [from, to), which must leave room for the second byte
+static void scan_scalar(struct trigger_session *t, const uint8_t *data, size_t len, size_t from, size_t to,
+  size_t minend) {
+  for (size_t i = from; i < to; ++i) {
+    uint8_t c = candidates(data + i);
+    if (c)
+      verify(t, data, len, i, c, minend);
+  }
+}
+
+void trigger_scan(struct trigger_session *t, const uint8_t *data, size_t len) {
+  if (!ntriggers || !len)
+    return;
+
+  // matches that started in earlier reads and end in this one
+  size_t keep = maxlen - 1;
+  if (t->taillen) {
+    uint8_t joint[2 * (TRIGGER_MAX_LEN - 1)];
+    size_t head = len < keep ? len : keep;
+    memcpy(joint, t->tail, t->taillen);
+    memcpy(joint + t->taillen, data, head);
+    scan_scalar(t, joint, t->taillen + head, 0, t->taillen, t->taillen);
+  }
+
+  // matches that start in this read and end in it. the rest are found next time.
+  size_t i = scan_simd ? scan_simd(t, data, len) : 0;
+  if (len > 1)
+    scan_scalar(t, data, len, i, len - 1, 0);
+
+  if (len >= keep) {
+    memcpy(t->tail, data + len - keep, keep);
+    t->taillen = keep;
+  } else {
+    size_t old = t->taillen + len > keep ? keep - len : t->taillen;
+    memmove(t->tail, t->tail + t->taillen - old, old);
+    memcpy(t->tail + old, data, len);
+    t->taillen = old + len;
+  }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// output triggers (-w): the server scans everything the app prints for a set of byte strings
+// (e.g. "panic:", "Out of memory" or a prompt), and acts the moment one shows up, including
+// matches that span multiple reads from mPTY.
+//
+// the trigger file has one trigger per line: a pattern, whitespace, then the action.
+//  - <pattern> log: note the match in the server's log.
+//  - <pattern> reply <text>: type <text> into the session, as if the client did.
+//  - <pattern> exec <command>: run <command> with `/bin/sh -c`, detached from the session, with
+//    PTYFWD_TRIGGER set to the pattern and PTYFWD_SESSION to the app's pid. at most once per
+//    second per trigger and session.
+// patterns and reply texts can use \s (space), \t, \r, \n, \e, \\ and \xHH. patterns are
+// 2 to TRIGGER_MAX_LEN bytes long. lines starting with '#' are ignored.
+//
+// candidates are found with a nibble-table filter on the first two bytes of every pattern,
+// 16 or 32 bytes at a time with SSSE3 or AVX2 where the CPU has them, and only candidates are
+// compared in full. output that can't start any pattern costs about one table lookup per byte.
+
+#define TRIGGER_MAX 64
+#define TRIGGER_MAX_LEN 64
+
+// server side. returns false if the file is invalid.
+bool trigger_load(const char *path);
+
+bool trigger_enabled();
+
+// what `reply` triggers type. the session decides how to get it to mPTY.
+typedef void (*trigger_reply_fn)(void *ctx, const uint8_t *data, size_t len);
+
+struct trigger_session {
+  pid_t pid;
+  trigger_reply_fn reply;
+  void *ctx;
+  // the end of the output so far, for matches that continue in the next read
+  uint8_t tail[TRIGGER_MAX_LEN - 1];
+  size_t taillen;
+  // for `exec` triggers, by trigger. NULL if there are no triggers.
+  uint64_t *last_exec;
+};
+
+// `pid` is the launched app
+void trigger_session_init(struct trigger_session *t, pid_t pid, trigger_reply_fn reply, void *ctx);
+
+void trigger_session_free(struct trigger_session *t);
+
+// `data` has just been read from mPTY
+void trigger_scan(struct trigger_session *t, const uint8_t *data, size_t len);
+
+// use the candidate scan `name` ("avx2", "ssse3" or "scalar") instead of the best one the CPU
+// has, e.g. to compare them. returns false if the CPU does not have it.
+bool trigger_use_scan(const char *name);
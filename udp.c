@@ -0,0 +1,979 @@
+#include "udp.h"
+#include "auth.h"
+#include "global.h"
+#include "utils.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+struct udp_hdr {
+  uint64_t connid;
+  // bit i set: packet ack + 1 + i has been received
+  uint64_t sack;
+  // sequence number of this packet, if it has UF_DATA or UF_FIN
+  uint32_t seq;
+  // next sequence number expected from the peer
+  uint32_t ack;
+  // sender's clock in us, and the latest `ts` received from the peer, for RTT measurement
+  uint32_t ts;
+  uint32_t tsecr;
+  uint8_t flags;
+  uint8_t reserved[3];
+};
+
+enum udp_flags {
+  // client packets until the server has answered. opens the connection on the server.
+  UF_SYN = 1,
+  UF_DATA = 2,
+  // end of stream. sequenced, like data.
+  UF_FIN = 4,
+  // the connection does not exist (anymore)
+  UF_RST = 8,
+  // server: the address validation token for a SYN, in the payload. client: a SYN with it.
+  UF_RETRY = 16,
+  // server: its public key, before the payload, until the client has proven it has the keys
+  UF_KEY = 32,
+  // path validation of a peer's new address: a random value, and its echo
+  UF_CHALLENGE = 64,
+  UF_RESPONSE = 128,
+};
+
+// datagrams stay well below the minimum IPv6 MTU, with room for tunnels
+#define UDP_DGRAM_MAX 1200
+// X25519 public keys, and the keys derived from them
+#define UDP_KEY_LEN 32
+#define UDP_TOKEN_LEN 16
+#define UDP_MAC_LEN 16
+#define UDP_PAYLOAD_MAX (UDP_DGRAM_MAX - sizeof(struct udp_hdr) - UDP_MAC_LEN)
+// the client pads its SYNs to this, so that the server's answers to them are no bigger
+#define UDP_SYN_LEN 256
+// address validation tokens are good for one to two of these
+#define UDP_TOKEN_PERIOD_NS (30 * 1000000000ull)
+// connections whose client has not proven that it has the keys yet, and how long they get to
+#define UDP_HALF_OPEN_MAX 64
+#define UDP_HANDSHAKE_TIMEOUT_NS (10 * 1000000000ull)
+// until a peer that moved has echoed our challenge, it gets at most this many times what it sent
+#define UDP_AMPLIFICATION 3
+// the challenge is sent this often until it is echoed
+#define UDP_CHALLENGE_NS (100 * 1000000ull)
+#define UDP_HASH_SIZE 1024
+// packets in flight per direction
+#define UDP_WINDOW 256
+#define UDP_CWND_INIT 10
+#define UDP_CWND_MIN 2
+// retransmit a packet once this many packets sent after it have been acknowledged
+#define UDP_FAST_RETRANSMIT 3
+// packets that may go out back to back before pacing kicks in
+#define UDP_PACING_BURST 4
+#define UDP_RTO_INIT_NS (500 * 1000000ull)
+#define UDP_RTO_MIN_NS (50 * 1000000ull)
+#define UDP_RTO_MAX_NS (2000 * 1000000ull)
+// an idle connection still sends something this often, so that the server learns about a
+// new client address quickly and NAT mappings stay alive
+#define UDP_KEEPALIVE_NS (1000 * 1000000ull)
+// drop the connection after not hearing from the peer for this long
+#define UDP_IDLE_TIMEOUT_NS (120 * 1000000000ull)
+// how long a connection whose stream has ended keeps trying to deliver the rest
+#define UDP_LINGER_NS (10 * 1000000000ull)
+// stop taking data from the peer while this much is waiting to be written to the stream
+#define UDP_STREAM_HIGH 262144
+
+struct udp_slot {
+  uint64_t sent_ns;
+  uint16_t len;
+  uint8_t flags;
+  // send: in flight. receive: arrived out of order.
+  bool used;
+  bool sacked;
+  uint8_t data[UDP_PAYLOAD_MAX];
+};
+
+struct udp_conn {
+  uint64_t connid;
+  // -1 on the server until the client has proven it has the keys
+  int streamfd;
+  struct sockaddr_storage peer;
+  socklen_t peerlen;
+  // client: the server has answered with its key. server: the client has proven it has the keys.
+  bool established;
+  uint64_t start_ns;
+
+  // X25519 key pair, and the keys that authenticate each direction
+  EVP_PKEY *kp;
+  uint8_t pub[UDP_KEY_LEN];
+  bool keyed;
+  uint8_t tx_key[UDP_KEY_LEN];
+  uint8_t rx_key[UDP_KEY_LEN];
+  // client: the server's address validation token
+  uint8_t token[UDP_TOKEN_LEN];
+  bool has_token;
+  // server: the peer's address is known to reach it, from its token or a path validation
+  bool validated;
+  uint64_t challenge;
+  uint64_t challenge_ns;
+  // bytes from and to the peer's address while it is not validated
+  uint64_t unval_rx;
+  uint64_t unval_tx;
+
+  uint32_t snd_una;
+  uint32_t snd_nxt;
+  struct udp_slot snd[UDP_WINDOW];
+  uint32_t rcv_nxt;
+  struct udp_slot rcv[UDP_WINDOW];
+  // delivered data not yet taken by the stream
+  struct bytequeue tostream;
+
+  double cwnd;
+  double ssthresh;
+  // no further congestion response until this packet has been acknowledged
+  uint32_t recover;
+  uint64_t srtt_ns;
+  uint64_t rttvar_ns;
+  uint64_t rto_ns;
+  uint64_t next_send_ns;
+  uint64_t last_send_ns;
+  uint64_t last_recv_ns;
+  uint64_t eof_ns;
+  uint32_t ts_recent;
+  bool ack_pending;
+  // our stream ended, FIN queued
+  bool stream_eof;
+  // the peer's FIN has been delivered
+  bool fin_rcvd;
+  bool stream_shut;
+  // abort the connection
+  bool reset;
+  // the peer has aborted it
+  bool peer_reset;
+
+  // for the event loop
+  short events;
+  uint64_t deadline;
+  struct udp_conn *next;
+  // in `conn_hash`
+  struct udp_conn *hnext;
+};
+
+struct udp_delayed {
+  uint64_t due_ns;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  uint16_t len;
+  uint8_t data[UDP_DGRAM_MAX];
+  struct udp_delayed *next;
+};
+
+// the relay runs on a single thread, in a process of its own (client) or alongside the
+// server, so its state is kept here.
+static int udpfd = -1;
+static bool server;
+static struct sockaddr_storage listenaddr;
+static socklen_t listenaddrlen;
+static struct udp_conn *conns;
+static struct udp_conn *conn_hash[UDP_HASH_SIZE];
+static int half_open;
+static uint8_t token_key[32];
+
+static struct {
+  bool enabled;
+  int loss;
+  uint64_t delay_ns;
+  uint64_t jitter_ns;
+  uint64_t rebind_ns;
+} impair;
+static struct udp_delayed *delayed;
+static uint64_t next_rebind_ns;
+
+static struct {
+  unsigned long long sent;
+  unsigned long long retransmitted;
+  unsigned long long received;
+  unsigned long long dropped;
+  unsigned long long roamed;
+} stats;
+
+static uint32_t now_us() {
+  // 0 means "no timestamp"
+  return (uint32_t)(mono_ns() / 1000) | 1;
+}
+
+static void parse_impairment() {
+  const char *env = getenv("PTYFWD_UDP_IMPAIR");
+  if (!env || !*env)
+    return;
+  char *spec = strdup(env);
+  char *save;
+  for (char *tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    unsigned long v;
+    if (sscanf(tok, "loss=%lu", &v) == 1)
+      impair.loss = v;
+    else if (sscanf(tok, "delay=%lu", &v) == 1)
+      impair.delay_ns = v * 1000000ull;
+    else if (sscanf(tok, "jitter=%lu", &v) == 1)
+      impair.jitter_ns = v * 1000000ull;
+    else if (sscanf(tok, "rebind=%lu", &v) == 1)
+      impair.rebind_ns = v * 1000000ull;
+    else
+      warnx("Unknown UDP impairment '%s'", tok);
+  }
+  free(spec);
+  impair.enabled = true;
+  srandom(mono_ns());
+}
+
+static void send_dgram(const void *buff, size_t len, const struct sockaddr_storage *addr, socklen_t addrlen) {
+  ++stats.sent;
+  if (impair.enabled) {
+    if (impair.loss && random() % 100 < impair.loss)
+      return;
+    if (impair.delay_ns || impair.jitter_ns) {
+      struct udp_delayed *d = malloc(sizeof(*d));
+      if (!d)
+        return;
+      d->due_ns = mono_ns() + impair.delay_ns + (impair.jitter_ns ? random() % impair.jitter_ns : 0);
+      memcpy(&d->addr, addr, addrlen);
+      d->addrlen = addrlen;
+      d->len = len;
+      memcpy(d->data, buff, len);
+      // jitter reorders the datagrams
+      struct udp_delayed **p = &delayed;
+      while (*p && (*p)->due_ns <= d->due_ns)
+        p = &(*p)->next;
+      d->next = *p;
+      *p = d;
+      return;
+    }
+  }
+  // errors are just like lost datagrams
+  sendto(udpfd, buff, len, 0, (const struct sockaddr *)addr, addrlen);
+}
+
+static void send_delayed(uint64_t now) {
+  while (delayed && delayed->due_ns <= now) {
+    struct udp_delayed *d = delayed;
+    delayed = d->next;
+    sendto(udpfd, d->data, d->len, 0, (const struct sockaddr *)&d->addr, d->addrlen);
+    free(d);
+  }
+}
+
+static void dgram_mac(const uint8_t *key, const uint8_t *buff, size_t len, uint8_t *mac) {
+  uint8_t full[32];
+  unsigned int outlen;
+  HMAC(EVP_sha256(), key, UDP_KEY_LEN, buff, len, full, &outlen);
+  memcpy(mac, full, UDP_MAC_LEN);
+}
+
+// `buff` ends with its MAC
+static bool dgram_mac_ok(const uint8_t *key, const uint8_t *buff, size_t len) {
+  uint8_t mac[UDP_MAC_LEN];
+  dgram_mac(key, buff, len - UDP_MAC_LEN, mac);
+  return auth_equal(mac, buff + len - UDP_MAC_LEN, UDP_MAC_LEN);
+}
+
+// the keys of both directions, from the X25519 secret, both public keys and the cookie, so
+// that only peers that have the cookie (if there is one) end up with the same keys
+static bool derive_keys(struct udp_conn *c, const uint8_t *peerpub) {
+  EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peerpub, UDP_KEY_LEN);
+  EVP_PKEY_CTX *ctx = peer ? EVP_PKEY_CTX_new(c->kp, NULL) : NULL;
+  uint8_t msg[3 * UDP_KEY_LEN];
+  size_t len = UDP_KEY_LEN;
+  bool ok = ctx && EVP_PKEY_derive_init(ctx) > 0 && EVP_PKEY_derive_set_peer(ctx, peer) > 0 &&
+            EVP_PKEY_derive(ctx, msg, &len) > 0 && len == UDP_KEY_LEN;
+  EVP_PKEY_CTX_free(ctx);
+  EVP_PKEY_free(peer);
+  memcpy(msg + UDP_KEY_LEN, server ? peerpub : c->pub, UDP_KEY_LEN);
+  memcpy(msg + 2 * UDP_KEY_LEN, server ? c->pub : peerpub, UDP_KEY_LEN);
+
+  uint8_t prk[32];
+  unsigned int outlen;
+  ok = ok && HMAC(EVP_sha256(), cookie.data, cookie.size, msg, sizeof(msg), prk, &outlen);
+  // one key per direction, so that datagrams can't be reflected back to their sender
+  uint8_t label[] = {'c', '2', 's', 0, 0, 0, 0, 0, 0, 0, 0};
+  memcpy(label + 3, &c->connid, sizeof(c->connid));
+  ok = ok && HMAC(EVP_sha256(), prk, sizeof(prk), label, sizeof(label), server ? c->rx_key : c->tx_key, &outlen);
+  label[0] = 's';
+  label[2] = 'c';
+  ok = ok && HMAC(EVP_sha256(), prk, sizeof(prk), label, sizeof(label), server ? c->tx_key : c->rx_key, &outlen);
+  OPENSSL_cleanse(msg, sizeof(msg));
+  OPENSSL_cleanse(prk, sizeof(prk));
+  c->keyed = ok;
+  return ok;
+}
+
+// stateless: whoever echoes it receives at `addr`. `period` counts UDP_TOKEN_PERIOD_NS.
+static void make_token(uint64_t period, uint64_t connid, const uint8_t *pub, const struct sockaddr_storage *addr,
+  socklen_t addrlen, uint8_t *token) {
+  uint8_t msg[16 + UDP_KEY_LEN + sizeof(*addr)], full[32];
+  memcpy(msg, &period, 8);
+  memcpy(msg + 8, &connid, 8);
+  memcpy(msg + 16, pub, UDP_KEY_LEN);
+  memcpy(msg + 16 + UDP_KEY_LEN, addr, addrlen);
+  unsigned int outlen;
+  HMAC(EVP_sha256(), token_key, sizeof(token_key), msg, 16 + UDP_KEY_LEN + addrlen, full, &outlen);
+  memcpy(token, full, UDP_TOKEN_LEN);
+}
+
+static bool same_addr(const struct udp_conn *c, const struct sockaddr_storage *addr, socklen_t addrlen) {
+  return addrlen == c->peerlen && !memcmp(addr, &c->peer, addrlen);
+}
+
+static void send_packet(struct udp_conn *c, uint8_t flags, uint32_t seq, const void *data, size_t len) {
+  uint8_t buff[UDP_DGRAM_MAX];
+  struct udp_hdr h = {
+      .connid = c->connid,
+      .seq = seq,
+      .ack = c->rcv_nxt,
+      .ts = now_us(),
+      .tsecr = c->ts_recent,
+      .flags = flags,
+  };
+  for (int i = 0; i < 64; ++i) {
+    if (c->rcv[(c->rcv_nxt + 1 + i) % UDP_WINDOW].used)
+      h.sack |= 1ull << i;
+  }
+  size_t off = sizeof(h);
+  if (!server && !c->established) {
+    // our public key, and the server's token once we have it. the rest waits for its key.
+    h.flags |= UF_SYN | (c->has_token ? UF_RETRY : 0);
+    memcpy(buff + off, c->pub, UDP_KEY_LEN);
+    memcpy(buff + off + UDP_KEY_LEN, c->token, UDP_TOKEN_LEN);
+    memset(buff + off + UDP_KEY_LEN + UDP_TOKEN_LEN, 0, UDP_SYN_LEN - off - UDP_KEY_LEN - UDP_TOKEN_LEN);
+    off = UDP_SYN_LEN;
+  } else if (server && !c->established) {
+    h.flags |= UF_KEY;
+    memcpy(buff + off, c->pub, UDP_KEY_LEN);
+    off += UDP_KEY_LEN;
+  }
+  memcpy(buff, &h, sizeof(h));
+  if (len)
+    memcpy(buff + off, data, len);
+  off += len;
+  if (c->keyed) {
+    dgram_mac(c->tx_key, buff, off, buff + off);
+    off += UDP_MAC_LEN;
+  }
+  c->last_send_ns = mono_ns();
+  c->ack_pending = false;
+  // anything over the limit is as good as lost
+  if (server && !c->validated) {
+    if (c->unval_tx + off > UDP_AMPLIFICATION * c->unval_rx)
+      return;
+    c->unval_tx += off;
+  }
+  send_dgram(buff, off, &c->peer, c->peerlen);
+}
+
+static void send_slot(struct udp_conn *c, uint32_t seq, uint64_t now) {
+  struct udp_slot *s = &c->snd[seq % UDP_WINDOW];
+  send_packet(c, s->flags, seq, s->data, s->len);
+  s->sent_ns = now;
+  // pacing: spread a window over a round trip
+  if (c->srtt_ns) {
+    uint64_t interval = c->srtt_ns / c->cwnd;
+    uint64_t earliest = now - UDP_PACING_BURST * interval;
+    c->next_send_ns = (c->next_send_ns > earliest ? c->next_send_ns : earliest) + interval;
+  }
+}
+
+static struct udp_conn **hash_slot(uint64_t connid) {
+  return &conn_hash[connid % UDP_HASH_SIZE];
+}
+
+static struct udp_conn *conn_find(uint64_t connid) {
+  struct udp_conn *c = *hash_slot(connid);
+  while (c && c->connid != connid)
+    c = c->hnext;
+  return c;
+}
+
+static struct udp_conn *conn_new(uint64_t connid, int streamfd, const void *peer, socklen_t peerlen) {
+  struct udp_conn *c = calloc(1, sizeof(*c));
+  if (!c)
+    return NULL;
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+  size_t publen = UDP_KEY_LEN;
+  if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_keygen(ctx, &c->kp) <= 0 ||
+      EVP_PKEY_get_raw_public_key(c->kp, c->pub, &publen) <= 0) {
+    warnx("Error generating UDP connection key");
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(c->kp);
+    free(c);
+    return NULL;
+  }
+  EVP_PKEY_CTX_free(ctx);
+  c->connid = connid;
+  c->streamfd = streamfd;
+  memcpy(&c->peer, peer, peerlen);
+  c->peerlen = peerlen;
+  c->cwnd = UDP_CWND_INIT;
+  c->ssthresh = UDP_WINDOW;
+  c->rto_ns = UDP_RTO_INIT_NS;
+  c->start_ns = c->last_recv_ns = mono_ns();
+  c->next = conns;
+  conns = c;
+  c->hnext = *hash_slot(connid);
+  *hash_slot(connid) = c;
+  return c;
+}
+
+static void conn_free(struct udp_conn *c) {
+  for (struct udp_conn **p = &conns; *p; p = &(*p)->next) {
+    if (*p == c) {
+      *p = c->next;
+      break;
+    }
+  }
+  for (struct udp_conn **p = hash_slot(c->connid); *p; p = &(*p)->hnext) {
+    if (*p == c) {
+      *p = c->hnext;
+      break;
+    }
+  }
+  if (!c->peer_reset && (c->reset || !c->stream_shut))
+    send_packet(c, UF_RST, 0, NULL, 0);
+  if (server && !c->established)
+    --half_open;
+  if (c->streamfd >= 0)
+    close(c->streamfd);
+  bq_free(&c->tostream);
+  EVP_PKEY_free(c->kp);
+  OPENSSL_cleanse(c->tx_key, sizeof(c->tx_key));
+  OPENSSL_cleanse(c->rx_key, sizeof(c->rx_key));
+  free(c);
+}
+
+static void rtt_sample(struct udp_conn *c, uint64_t rtt) {
+  // RFC 6298
+  if (!c->srtt_ns) {
+    c->srtt_ns = rtt;
+    c->rttvar_ns = rtt / 2;
+  } else {
+    uint64_t dev = rtt > c->srtt_ns ? rtt - c->srtt_ns : c->srtt_ns - rtt;
+    c->rttvar_ns = (c->rttvar_ns * 3 + dev) / 4;
+    c->srtt_ns = (c->srtt_ns * 7 + rtt) / 8;
+  }
+  c->rto_ns = c->srtt_ns + 4 * c->rttvar_ns;
+  if (c->rto_ns < UDP_RTO_MIN_NS)
+    c->rto_ns = UDP_RTO_MIN_NS;
+  if (c->rto_ns > UDP_RTO_MAX_NS)
+    c->rto_ns = UDP_RTO_MAX_NS;
+}
+
+static void conn_input(struct udp_conn *c, const struct udp_hdr *h, const uint8_t *payload, size_t len,
+  const struct sockaddr_storage *from, socklen_t fromlen, uint64_t now) {
+  if (h->flags & UF_RST) {
+    c->reset = c->peer_reset = true;
+    return;
+  }
+  // must not acknowledge anything we have not sent. an older ACK is just a reordered packet.
+  bool oldack = (int32_t)(h->ack - c->snd_una) < 0;
+  if (!oldack && h->ack - c->snd_una > c->snd_nxt - c->snd_una)
+    return;
+
+  // roaming: the client is wherever its newest authenticated packet came from. a replay of one
+  // is no newer. the new address is only trusted with more than a few times what it sent once
+  // it has echoed a challenge, as the packet could have been redirected by someone on the path.
+  int32_t age = c->ts_recent ? (int32_t)(h->ts - c->ts_recent) : 1;
+  if (age >= 0) {
+    if (server && age > 0 && !same_addr(c, from, fromlen)) {
+      memcpy(&c->peer, from, fromlen);
+      c->peerlen = fromlen;
+      c->validated = false;
+      c->unval_rx = c->unval_tx = 0;
+      random_fill(&c->challenge, sizeof(c->challenge));
+      c->challenge_ns = 0;
+      ++stats.roamed;
+    }
+    c->ts_recent = h->ts;
+  }
+  c->last_recv_ns = now;
+
+  bool progress = false;
+  while (!oldack && c->snd_una != h->ack) {
+    struct udp_slot *s = &c->snd[c->snd_una % UDP_WINDOW];
+    s->used = false;
+    ++c->snd_una;
+    progress = true;
+    c->cwnd += c->cwnd < c->ssthresh ? 1 : 1 / c->cwnd;
+    if (c->cwnd > UDP_WINDOW)
+      c->cwnd = UDP_WINDOW;
+  }
+  for (int i = 0; i < 64; ++i) {
+    uint32_t seq = h->ack + 1 + i;
+    if (oldack || !(h->sack & (1ull << i)) || seq - c->snd_una >= c->snd_nxt - c->snd_una)
+      continue;
+    struct udp_slot *s = &c->snd[seq % UDP_WINDOW];
+    progress |= !s->sacked;
+    s->sacked = true;
+  }
+  // the peer acks right away, so its echo of our clock is a fair RTT sample
+  if (progress && h->tsecr)
+    rtt_sample(c, (uint64_t)(uint32_t)(now_us() - h->tsecr) * 1000);
+
+  if ((h->flags & UF_CHALLENGE) && !server && len == sizeof(c->challenge))
+    send_packet(c, UF_RESPONSE, 0, payload, len);
+  if ((h->flags & UF_RESPONSE) && server && len == sizeof(c->challenge) && same_addr(c, from, fromlen) &&
+      !memcmp(payload, &c->challenge, len))
+    c->validated = true;
+
+  if (!(h->flags & (UF_DATA | UF_FIN)))
+    return;
+  c->ack_pending = true;
+  // past the window, already delivered, or the stream is not keeping up: the peer will resend
+  if (h->seq - c->rcv_nxt >= UDP_WINDOW || c->tostream.len >= UDP_STREAM_HIGH)
+    return;
+  struct udp_slot *s = &c->rcv[h->seq % UDP_WINDOW];
+  if (s->used)
+    return;
+  s->used = true;
+  s->flags = h->flags;
+  s->len = len;
+  memcpy(s->data, payload, len);
+  while ((s = &c->rcv[c->rcv_nxt % UDP_WINDOW])->used) {
+    s->used = false;
+    ++c->rcv_nxt;
+    if (s->flags & UF_FIN)
+      c->fin_rcvd = true;
+    else if (!bq_append(&c->tostream, s->data, s->len))
+      c->reset = true;
+  }
+}
+
+static void on_loss(struct udp_conn *c, uint32_t seq, bool timeout) {
+  if (timeout) {
+    c->rto_ns *= 2;
+    if (c->rto_ns > UDP_RTO_MAX_NS)
+      c->rto_ns = UDP_RTO_MAX_NS;
+  }
+  // once per window
+  if (seq - c->recover < 0x80000000u) {
+    c->ssthresh = c->cwnd / 2 < UDP_CWND_MIN ? UDP_CWND_MIN : c->cwnd / 2;
+    c->cwnd = c->ssthresh;
+    c->recover = c->snd_nxt;
+  }
+}
+
+static void set_deadline(struct udp_conn *c, uint64_t t) {
+  if (t < c->deadline)
+    c->deadline = t;
+}
+
+// (re)send what is due, take new data from the stream, and work out what to wait for.
+// returns false when the connection is over.
+static bool conn_pump(struct udp_conn *c, uint64_t now) {
+  c->events = 0;
+  c->deadline = UINT64_MAX;
+  if (c->reset)
+    return false;
+  if (now - c->last_recv_ns >= UDP_IDLE_TIMEOUT_NS) {
+    warnx("UDP peer timed out.");
+    return false;
+  }
+  if (c->stream_eof && now - c->eof_ns >= UDP_LINGER_NS)
+    return false;
+  if (!c->established && now - c->start_ns >= UDP_HANDSHAKE_TIMEOUT_NS) {
+    if (!server)
+      warnx("UDP handshake timed out. Is the cookie the same as the server's?");
+    return false;
+  }
+  // a peer that moved gets nothing but the challenge and ACKs until it has echoed it
+  bool hold = server && !c->validated;
+  if (hold) {
+    if (now - c->challenge_ns >= UDP_CHALLENGE_NS) {
+      send_packet(c, UF_CHALLENGE, 0, &c->challenge, sizeof(c->challenge));
+      c->challenge_ns = now;
+    }
+    set_deadline(c, c->challenge_ns + UDP_CHALLENGE_NS);
+  }
+
+  // stream side
+  if (c->tostream.len && !bq_flush(&c->tostream, c->streamfd))
+    return false;
+  if (c->tostream.len)
+    c->events |= POLLOUT;
+  else if (c->fin_rcvd && !c->stream_shut) {
+    shutdown(c->streamfd, SHUT_WR);
+    c->stream_shut = true;
+  }
+
+  // retransmissions, oldest first
+  uint32_t sacked = 0;
+  for (uint32_t seq = c->snd_una; seq != c->snd_nxt; ++seq)
+    sacked += c->snd[seq % UDP_WINDOW].sacked;
+  uint32_t inflight = c->snd_nxt - c->snd_una - sacked;
+  for (uint32_t seq = c->snd_una; seq != c->snd_nxt && !hold; ++seq) {
+    struct udp_slot *s = &c->snd[seq % UDP_WINDOW];
+    if (s->sacked) {
+      --sacked;
+      continue;
+    }
+    bool timeout = now >= s->sent_ns + c->rto_ns;
+    bool fast = sacked >= UDP_FAST_RETRANSMIT && now >= s->sent_ns + (c->srtt_ns ? c->srtt_ns : c->rto_ns);
+    if (timeout || fast) {
+      if (now < c->next_send_ns) {
+        set_deadline(c, c->next_send_ns);
+        break;
+      }
+      on_loss(c, seq, timeout);
+      send_slot(c, seq, now);
+      ++stats.retransmitted;
+    }
+    set_deadline(c, s->sent_ns + c->rto_ns);
+  }
+
+  // new data, once the handshake is done
+  while (c->established && !hold && !c->stream_eof && c->snd_nxt - c->snd_una < UDP_WINDOW && inflight < c->cwnd) {
+    if (now < c->next_send_ns) {
+      set_deadline(c, c->next_send_ns);
+      break;
+    }
+    struct udp_slot *s = &c->snd[c->snd_nxt % UDP_WINDOW];
+    ssize_t rd = read(c->streamfd, s->data, UDP_PAYLOAD_MAX);
+    if (rd < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        c->reset = true;
+        return false;
+      }
+      c->events |= POLLIN;
+      break;
+    }
+    s->len = rd;
+    s->flags = rd ? UF_DATA : UF_FIN;
+    s->used = true;
+    s->sacked = false;
+    if (!rd) {
+      c->stream_eof = true;
+      c->eof_ns = now;
+    }
+    send_slot(c, c->snd_nxt++, now);
+    set_deadline(c, now + c->rto_ns);
+    ++inflight;
+  }
+
+  if (c->stream_eof && c->snd_una == c->snd_nxt && c->stream_shut) {
+    // all done. the peer gets our last ACK, and can tell from the RST if it misses it.
+    send_packet(c, 0, 0, NULL, 0);
+    return false;
+  }
+
+  // until the server answers, keep knocking
+  uint64_t keepalive = c->established ? UDP_KEEPALIVE_NS : c->rto_ns;
+  if (c->ack_pending || now - c->last_send_ns >= keepalive)
+    send_packet(c, 0, 0, NULL, 0);
+  set_deadline(c, c->last_send_ns + keepalive);
+  set_deadline(c, c->last_recv_ns + UDP_IDLE_TIMEOUT_NS);
+  if (c->stream_eof)
+    set_deadline(c, c->eof_ns + UDP_LINGER_NS);
+  return true;
+}
+
+static void send_reset(const struct udp_hdr *h, const struct sockaddr_storage *from, socklen_t fromlen) {
+  struct udp_hdr rst = {.connid = h->connid, .ack = h->seq, .ts = now_us(), .flags = UF_RST};
+  send_dgram(&rst, sizeof(rst), from, fromlen);
+}
+
+static void send_retry(const struct udp_hdr *h, const uint8_t *pub, const struct sockaddr_storage *from,
+  socklen_t fromlen, uint64_t now) {
+  uint8_t buff[sizeof(*h) + UDP_TOKEN_LEN];
+  struct udp_hdr retry = {.connid = h->connid, .ts = now_us(), .tsecr = h->ts, .flags = UF_RETRY};
+  memcpy(buff, &retry, sizeof(retry));
+  make_token(now / UDP_TOKEN_PERIOD_NS, h->connid, pub, from, fromlen, buff + sizeof(retry));
+  send_dgram(buff, sizeof(buff), from, fromlen);
+}
+
+// a SYN for a connection we don't have. the first one only gets a token for the address it
+// came from, without any state kept. echoed, it gets a half-open connection, with our key.
+// only when the client proves that it has the keys too does the session get a stream.
+static void accept_syn(const struct udp_hdr *h, const uint8_t *payload, size_t len,
+  const struct sockaddr_storage *from, socklen_t fromlen, uint64_t now) {
+  if (len < UDP_SYN_LEN - sizeof(*h)) {
+    ++stats.dropped;
+    return;
+  }
+  const uint8_t *pub = payload, *token = payload + UDP_KEY_LEN;
+  uint64_t period = now / UDP_TOKEN_PERIOD_NS;
+  uint8_t expected[UDP_TOKEN_LEN];
+  bool valid = false;
+  for (int i = 0; i < 2 && !valid && (h->flags & UF_RETRY); ++i) {
+    make_token(period - i, h->connid, pub, from, fromlen, expected);
+    valid = auth_equal(expected, token, UDP_TOKEN_LEN);
+  }
+  if (!valid) {
+    send_retry(h, pub, from, fromlen, now);
+    return;
+  }
+  // the client knocks again
+  if (half_open >= UDP_HALF_OPEN_MAX) {
+    ++stats.dropped;
+    return;
+  }
+  struct udp_conn *c = conn_new(h->connid, -1, from, fromlen);
+  if (!c)
+    return;
+  ++half_open;
+  c->validated = true;
+  c->ts_recent = h->ts;
+  if (!derive_keys(c, pub))
+    c->reset = true;
+  c->ack_pending = true;
+}
+
+static bool connect_stream(struct udp_conn *c) {
+  int s = socket(listenaddr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (s < 0) {
+    warn("Error creating UDP relay socket");
+    return false;
+  }
+  // the listener is local, so this completes right away unless its backlog is full
+  if (connect(s, (struct sockaddr *)&listenaddr, listenaddrlen) < 0) {
+    close(s);
+    return false;
+  }
+  c->streamfd = s;
+  c->established = true;
+  --half_open;
+  return true;
+}
+
+static void recv_dgrams(uint64_t now) {
+  uint8_t buff[UDP_DGRAM_MAX];
+  struct sockaddr_storage from;
+  for (;;) {
+    socklen_t fromlen = sizeof(from);
+    ssize_t rd = recvfrom(udpfd, buff, sizeof(buff), 0, (struct sockaddr *)&from, &fromlen);
+    if (rd < 0)
+      return;
+    ++stats.received;
+    struct udp_hdr h;
+    if (rd < sizeof(h)) {
+      ++stats.dropped;
+      continue;
+    }
+    memcpy(&h, buff, sizeof(h));
+    const uint8_t *payload = buff + sizeof(h);
+    size_t len = rd - sizeof(h);
+
+    struct udp_conn *c = conn_find(h.connid);
+    if (!c) {
+      if (server && (h.flags & UF_SYN)) {
+        accept_syn(&h, payload, len, &from, fromlen, now);
+        continue;
+      }
+      ++stats.dropped;
+      if (server && !(h.flags & UF_RST))
+        send_reset(&h, &from, fromlen);
+      continue;
+    }
+
+    if (!server && !c->established) {
+      // until we have the server's key, all it can send is a token or a reset
+      if (!same_addr(c, &from, fromlen)) {
+        ++stats.dropped;
+        continue;
+      }
+      if (h.flags & UF_RST) {
+        c->reset = c->peer_reset = true;
+        continue;
+      }
+      if ((h.flags & UF_RETRY) && len >= UDP_TOKEN_LEN) {
+        memcpy(c->token, payload, UDP_TOKEN_LEN);
+        c->has_token = true;
+        c->ack_pending = true;
+        continue;
+      }
+      if (!(h.flags & UF_KEY) || len < UDP_KEY_LEN + UDP_MAC_LEN || !derive_keys(c, payload) ||
+          !dgram_mac_ok(c->rx_key, buff, rd)) {
+        c->keyed = false;
+        ++stats.dropped;
+        continue;
+      }
+      // the first packet with our keys tells the server we have them
+      c->established = true;
+      c->ack_pending = true;
+    } else if (h.flags & UF_SYN) {
+      // the client has not got our key yet
+      if (server && !c->established && same_addr(c, &from, fromlen))
+        c->ack_pending = true;
+      continue;
+    } else if (len < UDP_MAC_LEN || !dgram_mac_ok(c->rx_key, buff, rd)) {
+      ++stats.dropped;
+      continue;
+    }
+    len -= UDP_MAC_LEN;
+    if (h.flags & UF_KEY) {
+      if (len < UDP_KEY_LEN) {
+        ++stats.dropped;
+        continue;
+      }
+      payload += UDP_KEY_LEN;
+      len -= UDP_KEY_LEN;
+    }
+    if (server && !c->established && !connect_stream(c)) {
+      c->reset = true;
+      continue;
+    }
+    conn_input(c, &h, payload, len, &from, fromlen, now);
+    if (server && !c->validated && same_addr(c, &from, fromlen))
+      c->unval_rx += rd;
+  }
+}
+
+// testing only: the client moves to a new local port, as if its address had changed
+static void rebind(uint64_t now) {
+  int s = socket(conns ? conns->peer.ss_family : AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (s >= 0) {
+    close(udpfd);
+    udpfd = s;
+  }
+  next_rebind_ns = now + impair.rebind_ns;
+}
+
+static void dump_stats() {
+  fprintf(stderr, "udp: %llu datagrams sent, %llu retransmitted, %llu received, %llu dropped, peer moved %llu times\n",
+    stats.sent, stats.retransmitted, stats.received, stats.dropped, stats.roamed);
+}
+
+static void relay_loop() {
+  struct pollfd *pfds = NULL;
+  size_t npfds = 0;
+  for (;;) {
+    uint64_t now = mono_ns();
+    if (!server && impair.rebind_ns && now >= next_rebind_ns)
+      rebind(now);
+    send_delayed(now);
+
+    size_t n = 1;
+    uint64_t deadline = UINT64_MAX;
+    for (struct udp_conn *c = conns, *next; c; c = next) {
+      next = c->next;
+      if (!conn_pump(c, now)) {
+        conn_free(c);
+        if (impair.enabled)
+          dump_stats();
+        continue;
+      }
+      if (c->deadline < deadline)
+        deadline = c->deadline;
+      ++n;
+    }
+    if (!server && !conns)
+      break;
+    if (delayed && delayed->due_ns < deadline)
+      deadline = delayed->due_ns;
+    if (!server && impair.rebind_ns && next_rebind_ns < deadline)
+      deadline = next_rebind_ns;
+
+    if (n > npfds) {
+      struct pollfd *p = realloc(pfds, n * sizeof(*pfds));
+      if (!p) {
+        warn("Error allocating UDP relay pollfds");
+        continue;
+      }
+      pfds = p;
+      npfds = n;
+    }
+    pfds[0].fd = udpfd;
+    pfds[0].events = POLLIN;
+    n = 1;
+    for (struct udp_conn *c = conns; c; c = c->next) {
+      pfds[n].fd = c->events ? c->streamfd : -1;
+      pfds[n++].events = c->events;
+    }
+
+    int timeout = -1;
+    if (deadline != UINT64_MAX) {
+      now = mono_ns();
+      timeout = deadline > now ? (deadline - now + 999999) / 1000000 : 0;
+    }
+    if (poll(pfds, n, timeout) < 0 && errno != EINTR) {
+      warn("UDP relay wait error");
+      break;
+    }
+    if (pfds[0].revents & POLLIN)
+      recv_dgrams(mono_ns());
+  }
+  free(pfds);
+}
+
+static void *server_relay_main(void *arg) {
+  relay_loop();
+  return NULL;
+}
+
+bool udp_start_server_relay(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  udpfd = fd;
+  server = true;
+  memcpy(&listenaddr, addr, addrlen);
+  listenaddrlen = addrlen;
+  random_fill(token_key, sizeof(token_key));
+  set_fd_flags(udpfd, true, O_NONBLOCK);
+  parse_impairment();
+
+  // signals are for the server's main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int st = pthread_create(&thread, &attr, server_relay_main, NULL);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (st) {
+    errno = st;
+    warn("Error starting UDP relay thread");
+    return false;
+  }
+  return true;
+}
+
+int udp_start_client_relay(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  int sp[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) < 0) {
+    warn("Error creating UDP relay socket pair");
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    warn("Error starting UDP relay");
+    close(sp[0]);
+    close(sp[1]);
+    return -1;
+  }
+  if (pid) {
+    close(sp[1]);
+    close(fd);
+    return sp[0];
+  }
+
+  // relay process. it goes away once the connection is over, so the terminal's signals
+  // are none of its business.
+  close(sp[0]);
+  signal(SIGINT, SIG_IGN);
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  udpfd = fd;
+  set_fd_flags(udpfd, true, O_NONBLOCK);
+  set_fd_flags(sp[1], true, O_NONBLOCK);
+  parse_impairment();
+  next_rebind_ns = mono_ns() + impair.rebind_ns;
+  uint64_t connid;
+  random_fill(&connid, sizeof(connid));
+  if (!conn_new(connid, sp[1], addr, addrlen))
+    _exit(1);
+  relay_loop();
+  _exit(0);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+// reliable stream transport over UDP, for lossy links where TCP stalls on every lost segment.
+// the rest of the app still talks to a stream socket: a relay moves the stream to and from
+// datagrams with sequence numbers, selective ACKs, congestion control and pacing. the peer is
+// identified by a random connection ID rather than by its address, so a client whose address
+// changes (roaming, NAT rebinding) keeps its session.
+//
+// the connection ID is no secret, so it is not what the peer is trusted for:
+//  - a new connection takes a round trip to validate the client's address first (a stateless
+//    token, as in QUIC's Retry), before the server keeps any state for it. the server never
+//    answers a datagram with a bigger one until then, and half-open connections are capped.
+//  - both sides exchange X25519 keys in the handshake. every datagram after it carries a MAC
+//    with keys derived from the shared secret and the cookie, and only those are acted upon.
+//  - the server follows the client to a new address only on a newer authenticated datagram,
+//    and sends at most a few times what it received there until the client has echoed a
+//    challenge from it.
+//
+// for testing, PTYFWD_UDP_IMPAIR="loss=<percent>,delay=<ms>,jitter=<ms>,rebind=<ms>" makes the
+// relay drop, delay and reorder the datagrams it sends. on the client, `rebind` also moves the
+// relay to a new local port at that interval.
+
+// relay the datagrams arriving at the bound `udpfd` to new connections to the listening stream
+// socket at `addr`, from a background thread. returns false on error.
+bool udp_start_server_relay(int udpfd, const struct sockaddr *addr, socklen_t addrlen);
+
+// relay a new connection to the server at `addr` through `udpfd`, from a background process
+// that outlives the caller until everything written has been delivered. returns the stream
+// socket of the connection, or -1 on error.
+int udp_start_client_relay(int udpfd, const struct sockaddr *addr, socklen_t addrlen);
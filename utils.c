@@ -8,8 +8,13 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
 
 bool rw_all(bool iswrite, int fd, const void *buff, UINT len);
 
@@ -26,6 +31,43 @@ bool write_all(int fd, const void *buff, UINT len) { return rw_all(true, fd, buf
 
 bool read_all(int fd, const void *buff, UINT len) { return rw_all(false, fd, buff, len); }
 
+bool writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt) {
+    // skip over fully written (or empty) buffers
+    if (!iov->iov_len) {
+      ++iov;
+      --iovcnt;
+      continue;
+    }
+    ssize_t currdone = writev(fd, iov, iovcnt);
+    if (currdone < 0) {
+      if (errno == EINTR)
+        continue;
+      else if (errno == EAGAIN) {
+        struct pollfd pfds = {.fd = fd, .events = POLLOUT};
+        if (poll(&pfds, 1, -1) < 0 && errno != EINTR)
+          return false;
+        continue;
+      }
+      return false;
+    } else if (currdone == 0) {
+      errno = EIO;
+      return false;
+    }
+    while (currdone) {
+      size_t adv = (size_t)currdone < iov->iov_len ? (size_t)currdone : iov->iov_len;
+      iov->iov_base = (void *)((uintptr_t)iov->iov_base + adv);
+      iov->iov_len -= adv;
+      currdone -= adv;
+      if (!iov->iov_len) {
+        ++iov;
+        --iovcnt;
+      }
+    }
+  }
+  return true;
+}
+
 bool rw_all(bool iswrite, int fd, const void *buff, UINT len) {
   // caller should not attempt to do this with len == 0
   // if they did so, they must have forgotten to do EOF checks or things like that
@@ -100,6 +142,172 @@ void random_fill(void *buff, size_t size) {
 }
 #endif
 
+bool bq_append(struct bytequeue *q, const void *data, size_t len) {
+  if (q->off && q->off + q->len + len > q->cap) {
+    memmove(q->buff, q->buff + q->off, q->len);
+    q->off = 0;
+  }
+  if (q->len + len > q->cap) {
+    size_t newcap = q->cap ? q->cap : 65536;
+    while (newcap < q->len + len)
+      newcap *= 2;
+    uint8_t *newbuff = realloc(q->buff, newcap);
+    if (!newbuff)
+      return false;
+    q->buff = newbuff;
+    q->cap = newcap;
+  }
+  memcpy(q->buff + q->off + q->len, data, len);
+  q->len += len;
+  return true;
+}
+
+bool bq_flush(struct bytequeue *q, int fd) {
+  while (q->len) {
+    ssize_t wr = write(fd, q->buff + q->off, q->len);
+    if (wr < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    q->off += wr;
+    q->len -= wr;
+  }
+  q->off = 0;
+  return true;
+}
+
+void bq_free(struct bytequeue *q) {
+  free(q->buff);
+  memset(q, 0, sizeof(*q));
+}
+
+#ifdef __linux__
+int signal_fd(const int *sigs, int nsigs) {
+  sigset_t set;
+  sigemptyset(&set);
+  for (int i = 0; i < nsigs; ++i)
+    sigaddset(&set, sigs[i]);
+  if (sigprocmask(SIG_BLOCK, &set, NULL) < 0)
+    return -1;
+  return signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+int signal_fd_next(int fd) {
+  struct signalfd_siginfo si;
+  if (read(fd, &si, sizeof(si)) != sizeof(si))
+    return 0;
+  return si.ssi_signo;
+}
+#else
+// self-pipe trick
+static int sigpipe_wr = -1;
+
+static void sigpipe_handler(int sig) {
+  int saved_errno = errno;
+  uint8_t b = sig;
+  write(sigpipe_wr, &b, 1);
+  errno = saved_errno;
+}
+
+int signal_fd(const int *sigs, int nsigs) {
+  int p[2];
+  if (pipe(p) < 0)
+    return -1;
+  set_fd_flags(p[0], true, O_NONBLOCK);
+  set_fd_flags(p[1], true, O_NONBLOCK);
+  sigpipe_wr = p[1];
+
+  struct sigaction act = {0};
+  sigfillset(&act.sa_mask);
+  act.sa_handler = sigpipe_handler;
+  for (int i = 0; i < nsigs; ++i) {
+    if (sigaction(sigs[i], &act, NULL) < 0)
+      return -1;
+  }
+  return p[0];
+}
+
+int signal_fd_next(int fd) {
+  uint8_t b;
+  if (read(fd, &b, 1) != 1)
+    return 0;
+  return b;
+}
+#endif
+
+bool shared_mutex_init(pthread_mutex_t *m) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+  int ret = pthread_mutex_init(m, &attr);
+  pthread_mutexattr_destroy(&attr);
+  return !ret;
+}
+
+bool shared_mutex_lock(pthread_mutex_t *m) {
+#ifdef __linux__
+  if (pthread_mutex_lock(m) == EOWNERDEAD) {
+    pthread_mutex_consistent(m);
+    return false;
+  }
+#else
+  pthread_mutex_lock(m);
+#endif
+  return true;
+}
+
+size_t format_uint(char *buff, uint64_t v) {
+  char digits[20];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  for (size_t i = 0; i < n; ++i)
+    buff[i] = digits[n - 1 - i];
+  return n;
+}
+
+void warn_raw(const char *msg) {
+  int saved = errno;
+  char buff[256];
+  size_t len = 0;
+  const char *parts[] = {"ptyfwd: ", msg, ": "};
+  for (int i = 0; i < 3; ++i) {
+    size_t plen = strlen(parts[i]);
+    if (plen > sizeof(buff) - len - 32)
+      plen = sizeof(buff) - len - 32;
+    memcpy(buff + len, parts[i], plen);
+    len += plen;
+  }
+  const char *desc = NULL;
+#ifdef __GLIBC__
+  // untranslated, so that no locale is looked at
+  desc = strerrordesc_np(saved);
+#endif
+  if (desc && strlen(desc) < sizeof(buff) - len - 1) {
+    memcpy(buff + len, desc, strlen(desc));
+    len += strlen(desc);
+  } else {
+    memcpy(buff + len, "errno ", 6);
+    len += 6;
+    len += format_uint(buff + len, saved);
+  }
+  buff[len++] = '\n';
+  write(2, buff, len);
+  errno = saved;
+}
+
+uint64_t mono_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 void wait_debugger() {
   printf("Please attach debugger to PID %d\n", getpid());
   bool stop = false;
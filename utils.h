@@ -1,8 +1,11 @@
 #pragma once
 
 #include "common.h"
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 int set_fd_flags(int fd, bool set, int flags);
 
@@ -11,6 +14,49 @@ bool write_all(int fd, const void *buff, UINT len);
 
 bool read_all(int fd, const void *buff, UINT len);
 
+// same as write_all, but gathers the data from multiple buffers.
+// the iov array is modified in the process.
+bool writev_all(int fd, struct iovec *iov, int iovcnt);
+
 void random_fill(void *buff, size_t size);
 
+// growable FIFO of bytes, for data that cannot be written without blocking
+struct bytequeue {
+  uint8_t *buff;
+  size_t off;
+  size_t len;
+  size_t cap;
+};
+
+bool bq_append(struct bytequeue *q, const void *data, size_t len);
+
+// write as much as possible to `fd` without blocking. returns false on write error.
+bool bq_flush(struct bytequeue *q, int fd);
+
+void bq_free(struct bytequeue *q);
+
+// deliver `sigs` through a nonblocking fd instead of signal handlers, so that the event loop
+// can poll for them. only one such fd can exist per process.
+int signal_fd(const int *sigs, int nsigs);
+
+// returns the next pending signal from `signal_fd`, or 0 if there is none
+int signal_fd_next(int fd);
+
+// a mutex for memory shared between processes. on Linux it is robust: if a process dies while
+// holding it, the next one to lock it takes it over, and shared_mutex_lock returns false to tell
+// that whatever it protects may be half updated.
+bool shared_mutex_init(pthread_mutex_t *m);
+
+bool shared_mutex_lock(pthread_mutex_t *m);
+
+// the decimal digits of `v`, without a terminator. returns how many. async-signal-safe.
+size_t format_uint(char *buff, uint64_t v);
+
+// warn() with raw syscalls only, for the child of a fork from a threaded process: another
+// thread may have held a stdio or malloc lock at the time of the fork.
+void warn_raw(const char *msg);
+
+// monotonic clock in nanoseconds
+uint64_t mono_ns();
+
 void wait_debugger();